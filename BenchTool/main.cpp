@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2020 Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures the cost of HAX_VCPU_IOCTL_RUN as the number of VCPUs in a VM
+// grows. Each VCPU runs a two-instruction real mode loop that exits to user
+// space on every iteration, so the time per RUN is dominated by the ioctl
+// path, VM entry and VM exit. With --cpuid, each iteration also executes CPUID
+// a given number of times, which HAXM handles without returning to user space,
+// so that the cost of such in-kernel exits can be told apart.
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace haxm {
+namespace bench_util {
+
+#define APP_VERSION    "1.0.0"
+
+#define PACKED __attribute__ ((packed))
+
+// Copies of the definitions in include/hax_interface.h and
+// include/{linux,darwin}/hax_interface_*.h, which cannot be included by user
+// space programs
+struct hax_tunnel_info {
+    uint64_t va;
+    uint64_t io_va;
+    uint16_t size;
+    uint16_t io_size;
+    uint16_t pad[2];
+} PACKED;
+
+struct hax_ramblock_info {
+    uint64_t start_va;
+    uint64_t size;
+    uint64_t reserved;
+} PACKED;
+
+struct hax_set_ram_info {
+    uint64_t pa_start;
+    uint32_t size;
+    uint8_t flags;
+    uint8_t pad[3];
+    uint64_t va;
+} PACKED;
+
+struct hax_tunnel {
+    uint32_t exit_reason;
+    uint32_t pad0;
+    uint32_t exit_status;
+    // The rest of the structure is not used here
+} PACKED;
+
+#define HAX_IOCTL_CREATE_VM _IOWR(0, 0x21, uint32_t)
+#define HAX_VM_IOCTL_VCPU_CREATE _IOWR(0, 0x80, uint32_t)
+#define HAX_VM_IOCTL_SET_RAM _IOWR(0, 0x82, struct hax_set_ram_info)
+#define HAX_VM_IOCTL_ADD_RAMBLOCK _IOW(0, 0x85, struct hax_ramblock_info)
+#define HAX_VCPU_IOCTL_RUN _IO(0, 0xc0)
+#define HAX_VCPU_IOCTL_SETUP_TUNNEL _IOWR(0, 0xc5, struct hax_tunnel_info)
+
+enum {
+    kExitIo = 1,
+    kExitRealMode = 3
+};
+
+static const int kPageSize = 4096;
+// The page holding the reset vector (CS base 0xffff0000, IP 0xfff0)
+static const uint64_t kCodeGpa = 0xfffff000;
+// out 0x10, al; jmp $-2
+static const uint8_t kGuestCode[] = { 0xe6, 0x10, 0xeb, 0xfc };
+// start: mov si, <count>; l: xor eax, eax; cpuid; dec si; jnz l;
+// out 0x10, al; jmp start
+static const uint8_t kGuestCpuidCode[] = {
+    0xbe, 0x00, 0x00, 0x66, 0x31, 0xc0, 0x0f, 0xa2, 0x4e, 0x75, 0xf8, 0xe6,
+    0x10, 0xeb, 0xf1
+};
+// Offset of the CPUID count in kGuestCpuidCode
+static const int kCpuidCountOffset = 1;
+
+struct Vcpu {
+    int fd;
+    volatile hax_tunnel *tunnel;
+    uint64_t runs;
+    bool failed;
+};
+
+struct Vm {
+    int fd;
+    void *ram;
+    std::vector<Vcpu> vcpus;
+};
+
+static void CloseVm(Vm *vm) {
+    for (const Vcpu &vcpu : vm->vcpus) {
+        close(vcpu.fd);
+    }
+    vm->vcpus.clear();
+    if (vm->fd >= 0) {
+        close(vm->fd);
+    }
+    vm->fd = -1;
+    free(vm->ram);
+    vm->ram = nullptr;
+}
+
+static bool CreateVm(int hax_fd, int nr_vcpus, uint16_t cpuids, Vm *vm) {
+    uint32_t vm_id;
+    char path[64];
+
+    vm->fd = -1;
+    vm->ram = nullptr;
+    if (ioctl(hax_fd, HAX_IOCTL_CREATE_VM, &vm_id) < 0) {
+        perror("HAX_IOCTL_CREATE_VM");
+        return false;
+    }
+    snprintf(path, sizeof(path), "/dev/hax_vm/vm%02u", vm_id);
+    vm->fd = open(path, O_RDWR);
+    if (vm->fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    if (posix_memalign(&vm->ram, kPageSize, kPageSize)) {
+        std::cerr << "Failed to allocate guest RAM" << std::endl;
+        return false;
+    }
+    memset(vm->ram, 0xf4, kPageSize);  // hlt
+    uint8_t *code = static_cast<uint8_t *>(vm->ram) + 0xff0;
+    if (cpuids) {
+        memcpy(code, kGuestCpuidCode, sizeof(kGuestCpuidCode));
+        code[kCpuidCountOffset] = static_cast<uint8_t>(cpuids);
+        code[kCpuidCountOffset + 1] = static_cast<uint8_t>(cpuids >> 8);
+    } else {
+        memcpy(code, kGuestCode, sizeof(kGuestCode));
+    }
+
+    hax_ramblock_info block = {};
+    block.start_va = reinterpret_cast<uintptr_t>(vm->ram);
+    block.size = kPageSize;
+    if (ioctl(vm->fd, HAX_VM_IOCTL_ADD_RAMBLOCK, &block) < 0) {
+        perror("HAX_VM_IOCTL_ADD_RAMBLOCK");
+        return false;
+    }
+    hax_set_ram_info ram = {};
+    ram.pa_start = kCodeGpa;
+    ram.size = kPageSize;
+    ram.va = block.start_va;
+    if (ioctl(vm->fd, HAX_VM_IOCTL_SET_RAM, &ram) < 0) {
+        perror("HAX_VM_IOCTL_SET_RAM");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < static_cast<uint32_t>(nr_vcpus); ++i) {
+        uint32_t vcpu_id = i;
+        if (ioctl(vm->fd, HAX_VM_IOCTL_VCPU_CREATE, &vcpu_id) < 0) {
+            perror("HAX_VM_IOCTL_VCPU_CREATE");
+            return false;
+        }
+        snprintf(path, sizeof(path), "/dev/hax_vm%02u/vcpu%02u", vm_id, i);
+        Vcpu vcpu = {};
+        vcpu.fd = open(path, O_RDWR);
+        if (vcpu.fd < 0) {
+            perror(path);
+            return false;
+        }
+        vm->vcpus.push_back(vcpu);
+
+        hax_tunnel_info info = {};
+        if (ioctl(vcpu.fd, HAX_VCPU_IOCTL_SETUP_TUNNEL, &info) < 0) {
+            perror("HAX_VCPU_IOCTL_SETUP_TUNNEL");
+            return false;
+        }
+        vm->vcpus.back().tunnel = reinterpret_cast<volatile hax_tunnel *>(
+                static_cast<uintptr_t>(info.va));
+    }
+    return true;
+}
+
+static void RunVcpu(Vcpu *vcpu, uint64_t runs, std::atomic<int> *ready,
+                    const std::atomic<bool> *go) {
+    ready->fetch_add(1);
+    while (!go->load()) {
+        std::this_thread::yield();
+    }
+    for (vcpu->runs = 0; vcpu->runs < runs; ++vcpu->runs) {
+        if (ioctl(vcpu->fd, HAX_VCPU_IOCTL_RUN, nullptr) < 0 ||
+            vcpu->tunnel->exit_status != kExitIo) {
+            vcpu->failed = true;
+            return;
+        }
+    }
+}
+
+static bool Measure(int hax_fd, int nr_vcpus, uint64_t runs, uint16_t cpuids) {
+    Vm vm;
+    if (!CreateVm(hax_fd, nr_vcpus, cpuids, &vm)) {
+        CloseVm(&vm);
+        return false;
+    }
+
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (Vcpu &vcpu : vm.vcpus) {
+        threads.emplace_back(RunVcpu, &vcpu, runs, &ready, &go);
+    }
+    while (ready.load() < nr_vcpus) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t total_runs = 0;
+    bool ok = true;
+    for (const Vcpu &vcpu : vm.vcpus) {
+        total_runs += vcpu.runs;
+        if (vcpu.failed) {
+            std::cerr << "VCPU run failed with exit status "
+                      << vcpu.tunnel->exit_status;
+            if (vcpu.tunnel->exit_status == kExitRealMode) {
+                std::cerr << " (unrestricted guest is required)";
+            }
+            std::cerr << std::endl;
+            ok = false;
+            break;
+        }
+    }
+    CloseVm(&vm);
+    if (!ok) {
+        return false;
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    // Each VCPU thread issues its RUNs back to back, so the time per RUN seen
+    // by one VCPU is the wall time divided by the RUNs of one VCPU
+    printf("%6d %14" PRIu64 " %12.1f %14.0f", nr_vcpus, total_runs,
+           ns / runs, total_runs * 1e9 / ns);
+    if (cpuids) {
+        // Every RUN covers |cpuids| in-kernel exits and one exit to user space
+        printf(" %12.1f", ns / runs / (cpuids + 1));
+    }
+    printf("\n");
+    return true;
+}
+
+static void Usage() {
+    std::cerr << "HAXM Bench Tool " << APP_VERSION << std::endl
+              << "Usage: benchtool [--runs <count>] [--cpuid <count>] "
+                 "[<vcpus> ...]" << std::endl << std::endl
+              << "Runs a trivial guest on each number of VCPUs given "
+                 "(default: 1 2 4 8 16 32 64)" << std::endl
+              << "and reports the time per HAX_VCPU_IOCTL_RUN." << std::endl
+              << "  --runs   RUNs per VCPU (default: 100000)" << std::endl
+              << "  --cpuid  CPUIDs executed by the guest per RUN, up to "
+                 "65535 (default: 0)" << std::endl;
+}
+
+static int Run(int argc, char *argv[]) {
+    uint64_t runs = 100000;
+    uint16_t cpuids = 0;
+    std::vector<int> counts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--runs" && i + 1 < argc) {
+            runs = strtoull(argv[++i], nullptr, 0);
+            if (runs == 0) {
+                Usage();
+                return 1;
+            }
+        } else if (arg == "--cpuid" && i + 1 < argc) {
+            unsigned long count = strtoul(argv[++i], nullptr, 0);
+            if (count > 0xffff) {
+                Usage();
+                return 1;
+            }
+            cpuids = static_cast<uint16_t>(count);
+        } else if (arg == "-h" || arg == "--help") {
+            Usage();
+            return 0;
+        } else if (arg[0] == '-' || atoi(arg.c_str()) <= 0) {
+            Usage();
+            return 1;
+        } else {
+            counts.push_back(atoi(arg.c_str()));
+        }
+    }
+    if (counts.empty()) {
+        counts = { 1, 2, 4, 8, 16, 32, 64 };
+    }
+
+    int hax_fd = open("/dev/HAX", O_RDWR);
+    if (hax_fd < 0) {
+        perror("/dev/HAX");
+        return 1;
+    }
+    printf("%6s %14s %12s %14s", "vcpus", "runs", "ns/run", "runs/s");
+    if (cpuids) {
+        printf(" %12s", "ns/exit");
+    }
+    printf("\n");
+    int ret = 0;
+    for (int count : counts) {
+        if (!Measure(hax_fd, count, runs, cpuids)) {
+            ret = 1;
+            break;
+        }
+    }
+    close(hax_fd);
+    return ret;
+}
+
+}  // namespace bench_util
+}  // namespace haxm
+
+int main(int argc, char *argv[]) {
+    return haxm::bench_util::Run(argc, argv);
+}
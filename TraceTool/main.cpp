@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2020 Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Converts HAXM VCPU trace rings (q.v. HAX_VCPU_IOCTL_SETUP_TRACE in
+// docs/api.md) into the Chrome trace event format (JSON), which can be viewed
+// with chrome://tracing or https://ui.perfetto.dev.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace haxm {
+namespace trace_util {
+
+#define APP_VERSION    "1.0.0"
+
+// Copies of the definitions in include/hax_interface.h, which cannot be
+// included by user space programs
+enum TraceEventType {
+    kVmEntry   = 1,
+    kVmExit    = 2,
+    kInject    = 3,
+    kUserExit  = 4,
+    kUserEntry = 5
+};
+
+#pragma pack(push, 1)
+struct TraceEvent {
+    uint64_t tsc;
+    uint16_t type;
+    uint16_t pad;
+    uint32_t info;
+    uint64_t qualification;
+    uint64_t address;
+};
+
+struct TraceRing {
+    uint32_t vcpu_id;
+    uint32_t nr_events;
+    uint64_t head;
+    uint64_t pad[6];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TraceEvent) == 32, "Unexpected size of TraceEvent");
+static_assert(sizeof(TraceRing) == 64, "Unexpected size of TraceRing");
+
+struct Trace {
+    std::string file;
+    uint32_t vcpu_id;
+    std::vector<TraceEvent> events;
+};
+
+static const char *kExitReasons[] = {
+    "EXCEPTION_NMI", "EXT_INTERRUPT", "TRIPLE_FAULT", "INIT", "SIPI",
+    "SMI_IO", "SMI_OTHER", "INTERRUPT_WINDOW", "NMI_WINDOW", "TASK_SWITCH",
+    "CPUID", "GETSEC", "HLT", "INVD", "INVLPG", "RDPMC", "RDTSC", "RSM",
+    "VMCALL", "VMCLEAR", "VMLAUNCH", "VMPTRLD", "VMPTRST", "VMREAD",
+    "VMRESUME", "VMWRITE", "VMXOFF", "VMXON", "CR_ACCESS", "DR_ACCESS", "IO",
+    "MSR_READ", "MSR_WRITE", "FAILED_VMENTER_GS", "FAILED_VMENTER_MSR",
+    nullptr, "MWAIT", "MTF", nullptr, "MONITOR", "PAUSE", "MACHINE_CHECK",
+    nullptr, "TPR_BELOW_THRESHOLD", "APIC_ACCESS", nullptr, "GDT_IDT_ACCESS",
+    "LDT_TR_ACCESS", "EPT_VIOLATION", "EPT_MISCONFIG", "INVEPT", "RDTSCP",
+    "PREEMPTION_TIMER", "INVVPID", "WBINVD", "XSETBV", "APIC_WRITE", "RDRAND",
+    "INVPCID", "VMFUNC", "ENCLS", "RDSEED", nullptr, "XSAVES", "XRSTORS"
+};
+
+static const char *kExitStatuses[] = {
+    nullptr, "IO", "MMIO", "REALMODE", "INTERRUPT", "UNKNOWN", "HLT",
+    "STATECHANGE", "PAUSED", "FAST_MMIO", "PAGEFAULT", "DEBUG", "TIMER"
+};
+
+static std::string Name(const char *const *names, size_t count,
+                        uint32_t index) {
+    if (index < count && names[index]) {
+        return names[index];
+    }
+    return std::to_string(index);
+}
+
+static std::string ExitReasonName(uint32_t reason) {
+    return Name(kExitReasons, sizeof(kExitReasons) / sizeof(kExitReasons[0]),
+                reason);
+}
+
+static std::string ExitStatusName(uint32_t status) {
+    return Name(kExitStatuses,
+                sizeof(kExitStatuses) / sizeof(kExitStatuses[0]), status);
+}
+
+// Reads a copy of a trace ring, and returns the events that are still valid
+// in chronological order.
+static bool ReadTrace(const std::string &file, Trace *trace) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        std::cerr << file << ": cannot open file" << std::endl;
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+
+    TraceRing ring;
+    if (data.size() < sizeof(ring)) {
+        std::cerr << file << ": file too small" << std::endl;
+        return false;
+    }
+    memcpy(&ring, data.data(), sizeof(ring));
+    if (!ring.nr_events || (ring.nr_events & (ring.nr_events - 1)) ||
+        data.size() < sizeof(ring) + ring.nr_events * sizeof(TraceEvent)) {
+        std::cerr << file << ": invalid trace ring" << std::endl;
+        return false;
+    }
+
+    trace->file = file;
+    trace->vcpu_id = ring.vcpu_id;
+    trace->events.clear();
+    // Once the ring has wrapped around, the oldest event is the one that is
+    // going to be overwritten next
+    uint64_t first = ring.head > ring.nr_events ? ring.head - ring.nr_events
+                                                : 0;
+    for (uint64_t n = first; n < ring.head; ++n) {
+        TraceEvent event;
+        memcpy(&event, data.data() + sizeof(ring) +
+               (n & (ring.nr_events - 1)) * sizeof(TraceEvent),
+               sizeof(event));
+        trace->events.push_back(event);
+    }
+    return true;
+}
+
+class JsonWriter {
+public:
+    JsonWriter(uint64_t base_tsc, double tsc_mhz)
+        : base_tsc_(base_tsc), tsc_mhz_(tsc_mhz), first_(true) {}
+
+    void Begin() {
+        printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    }
+
+    void End() {
+        printf("\n]}\n");
+    }
+
+    void ThreadName(uint32_t tid, const std::string &name) {
+        Separator();
+        printf("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,"
+               "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", tid, name.c_str());
+    }
+
+    // A complete event, from |begin| to |end| (in TSC cycles). |args| is a
+    // JSON object, or empty.
+    void Slice(uint32_t tid, const std::string &category,
+               const std::string &name, uint64_t begin, uint64_t end,
+               const std::string &args) {
+        if (end < begin)
+            return;
+        Separator();
+        printf("{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":0,"
+               "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", category.c_str(),
+               name.c_str(), tid, Time(begin), (end - begin) / tsc_mhz_);
+        if (!args.empty()) {
+            printf(",\"args\":%s", args.c_str());
+        }
+        printf("}");
+    }
+
+    void Instant(uint32_t tid, const std::string &category,
+                 const std::string &name, uint64_t tsc,
+                 const std::string &args) {
+        Separator();
+        printf("{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"%s\",\"name\":\"%s\","
+               "\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":%s}",
+               category.c_str(), name.c_str(), tid, Time(tsc), args.c_str());
+    }
+
+private:
+    // Microseconds since the first event of all the traces
+    double Time(uint64_t tsc) const {
+        return (tsc - base_tsc_) / tsc_mhz_;
+    }
+
+    void Separator() {
+        if (!first_) {
+            printf(",\n");
+        }
+        first_ = false;
+    }
+
+    uint64_t base_tsc_;
+    double tsc_mhz_;
+    bool first_;
+};
+
+static std::string Hex(uint64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\"0x%" PRIx64 "\"", value);
+    return buf;
+}
+
+static void WriteExit(uint32_t tid, const TraceEvent &exit, uint64_t end,
+                      JsonWriter *writer) {
+    writer->Slice(tid, "haxm", ExitReasonName(exit.info), exit.tsc, end,
+                  "{\"qualification\":" + Hex(exit.qualification) +
+                  ",\"address\":" + Hex(exit.address) + "}");
+}
+
+// Turns the events of a VCPU into slices: the guest runs from VM entry to VM
+// exit, HAXM handles the VM exit until the next VM entry or the return to user
+// space, and user space handles the exit status until the VCPU is run again.
+static void WriteTrace(const Trace &trace, JsonWriter *writer) {
+    uint32_t tid = trace.vcpu_id;
+    const TraceEvent *entry = nullptr, *exit = nullptr, *user_exit = nullptr;
+
+    writer->ThreadName(tid, "VCPU " + std::to_string(tid));
+    for (const TraceEvent &event : trace.events) {
+        switch (event.type) {
+            case kVmEntry: {
+                if (exit) {
+                    WriteExit(tid, *exit, event.tsc, writer);
+                }
+                entry = &event;
+                exit = nullptr;
+                break;
+            }
+            case kVmExit: {
+                if (entry) {
+                    writer->Slice(tid, "guest", "guest", entry->tsc,
+                                  event.tsc, "");
+                }
+                entry = nullptr;
+                exit = &event;
+                break;
+            }
+            case kInject: {
+                writer->Instant(tid, "haxm", "inject", event.tsc,
+                                "{\"vector\":" +
+                                std::to_string(event.info & 0xff) +
+                                ",\"type\":" +
+                                std::to_string((event.info >> 8) & 0x7) +
+                                "}");
+                break;
+            }
+            case kUserExit: {
+                if (exit) {
+                    WriteExit(tid, *exit, event.tsc, writer);
+                }
+                entry = exit = nullptr;
+                user_exit = &event;
+                break;
+            }
+            case kUserEntry: {
+                if (user_exit) {
+                    writer->Slice(tid, "user",
+                                  ExitStatusName(user_exit->info),
+                                  user_exit->tsc, event.tsc, "");
+                }
+                user_exit = nullptr;
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+}
+
+static void Usage() {
+    std::cerr << "HAXM Trace Tool " << APP_VERSION << std::endl
+              << "Usage: tracetool [--tsc-mhz <MHz>] <ring> [<ring> ...]"
+              << std::endl << std::endl
+              << "Converts copies of HAXM VCPU trace rings into Chrome trace "
+                 "JSON on stdout." << std::endl
+              << "  --tsc-mhz  TSC frequency of the host (default: 1000)"
+              << std::endl;
+}
+
+static int Run(int argc, char *argv[]) {
+    double tsc_mhz = 1000;
+    std::vector<Trace> traces;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--tsc-mhz" && i + 1 < argc) {
+            tsc_mhz = atof(argv[++i]);
+            if (tsc_mhz <= 0) {
+                Usage();
+                return 1;
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            Usage();
+            return 0;
+        } else if (arg[0] == '-') {
+            Usage();
+            return 1;
+        } else {
+            Trace trace;
+            if (!ReadTrace(arg, &trace)) {
+                return 1;
+            }
+            traces.push_back(trace);
+        }
+    }
+    if (traces.empty()) {
+        Usage();
+        return 1;
+    }
+
+    // The TSC is synchronized across host CPUs, so all the VCPUs share a time
+    // base
+    uint64_t base_tsc = UINT64_MAX;
+    for (const Trace &trace : traces) {
+        if (!trace.events.empty() && trace.events[0].tsc < base_tsc) {
+            base_tsc = trace.events[0].tsc;
+        }
+    }
+
+    JsonWriter writer(base_tsc, tsc_mhz);
+    writer.Begin();
+    for (const Trace &trace : traces) {
+        WriteTrace(trace, &writer);
+    }
+    writer.End();
+    return 0;
+}
+
+}  // namespace trace_util
+}  // namespace haxm
+
+int main(int argc, char *argv[]) {
+    return haxm::trace_util::Run(argc, argv);
+}
@@ -65,6 +65,9 @@ int chunk_alloc(uint64_t base_uva, uint64_t size, hax_chunk **chunk)
 
     chk->base_uva = base_uva;
     chk->size = size;
+    chk->idle = 0;
+    chk->accessed = false;
+    chk->unpin = false;
     ret = hax_pin_user_pages(base_uva, size, &chk->memdesc);
     if (ret) {
         hax_log(HAX_LOGE, "hax_chunk: pin user pages failed,"
@@ -37,6 +37,7 @@
 #include "dump.h"
 #include "fpu.h"
 #include "ia32_defs.h"
+#include "interface.h"
 #include "intr.h"
 #include "name.h"
 #include "vcpu.h"
@@ -214,6 +215,72 @@ static void vmread_cr(struct vcpu_t *vcpu)
     state->_cr4 = (cr4 & ~cr4_mask) | (state->_cr4 & cr4_mask);
 }
 
+/*
+ * Reads the groups of VMCS fields in |fields| (a combination of VMCS_CACHE_*
+ * flags) that have not been read since the last VM entry, loading the VMCS
+ * once for all of them if it is not loaded already.
+ */
+void vcpu_vmcs_cache_fetch(struct vcpu_t *vcpu, uint32_t fields)
+{
+    struct vcpu_state_t *state = vcpu->state;
+    preempt_flag flags;
+    uint32_t vmcs_err = 0;
+    uint8_t loaded;
+
+    fields &= ~vmx(vcpu, vmcs_cache_valid);
+    if (!fields)
+        return;
+
+    loaded = is_vmcs_loaded(vcpu);
+    if (!loaded && (vmcs_err = load_vmcs(vcpu, &flags))) {
+        vcpu_set_panic(vcpu);
+        hax_log(HAX_LOGPANIC, "load_vmcs failed while "
+                "vcpu_vmcs_cache_fetch: %x\n", vmcs_err);
+        hax_panic_log(vcpu);
+        return;
+    }
+
+    if (fields & VMCS_CACHE_EXIT_QUALIFICATION) {
+        vmx(vcpu, exit_qualification).raw = vmread(
+                vcpu, VM_EXIT_INFO_QUALIFICATION);
+    }
+    if (fields & VMCS_CACHE_EXIT_INTR_INFO) {
+        vmx(vcpu, exit_intr_info).raw = vmread(
+                vcpu, VM_EXIT_INFO_INTERRUPT_INFO);
+    }
+    if (fields & VMCS_CACHE_EXIT_ERROR_CODE) {
+        vmx(vcpu, exit_exception_error_code) = vmread(
+                vcpu, VM_EXIT_INFO_EXCEPTION_ERROR_CODE);
+    }
+    if (fields & VMCS_CACHE_EXIT_INSTR_LENGTH) {
+        vmx(vcpu, exit_instr_length) = vmread(
+                vcpu, VM_EXIT_INFO_INSTRUCTION_LENGTH);
+    }
+    if (fields & VMCS_CACHE_EXIT_GPA) {
+        vmx(vcpu, exit_gpa) = vmread(
+                vcpu, VM_EXIT_INFO_GUEST_PHYSICAL_ADDRESS);
+    }
+    if (fields & VMCS_CACHE_RSP) {
+        state->_rsp = vmread(vcpu, GUEST_RSP);
+    }
+    if (fields & VMCS_CACHE_SEGS) {
+        VMREAD_SEG(vcpu, CS, state->_cs);
+        VMREAD_SEG(vcpu, DS, state->_ds);
+        VMREAD_SEG(vcpu, ES, state->_es);
+    }
+    if (fields & VMCS_CACHE_CRS) {
+        vmread_cr(vcpu);
+    }
+    vmx(vcpu, vmcs_cache_valid) |= fields;
+
+    if (!loaded && (vmcs_err = put_vmcs(vcpu, &flags))) {
+        vcpu_set_panic(vcpu);
+        hax_log(HAX_LOGPANIC, "put_vmcs failed while "
+                "vcpu_vmcs_cache_fetch: %x\n", vmcs_err);
+        hax_panic_log(vcpu);
+    }
+}
+
 vmx_result_t cpu_vmx_vmptrld(struct per_cpu_data *cpu_data, hax_paddr_t vmcs,
                              struct vcpu_t *vcpu)
 {
@@ -290,6 +357,7 @@ vmx_result_t cpu_vmx_run(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     host_rip = vmx_get_rip();
     vmwrite(vcpu, HOST_RIP, (mword)host_rip);
     vcpu->is_running = 1;
+    vcpu->in_guest = 1;
 #ifdef  DEBUG_HOST_STATE
     vcpu_get_host_state(vcpu, 1);
 #endif
@@ -298,9 +366,12 @@ vmx_result_t cpu_vmx_run(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 
     vcpu_load_guest_state(vcpu);
 
+    // Whatever was read from the VMCS is about to become stale
+    vmx(vcpu, vmcs_cache_valid) = 0;
     result = asm_vmxrun(vcpu->state, vcpu->launched);
 
     vcpu->is_running = 0;
+    vcpu->in_guest = 0;
     vcpu_save_guest_state(vcpu);
     vcpu_load_host_state(vcpu);
 
@@ -309,7 +380,10 @@ vmx_result_t cpu_vmx_run(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     compare_host_state(vcpu);
 #endif
 
-    if (result != VMX_SUCCEED) {
+    if (result == VMX_SUCCEED) {
+        // Until the next VMCLEAR, the VMCS can be entered with VMRESUME
+        vcpu->launched = 1;
+    } else {
         cpu_vmentry_failed(vcpu, result);
         htun->_exit_reason = 0;
         htun->_exit_status = HAX_EXIT_UNKNOWN;
@@ -342,17 +416,72 @@ void vcpu_handle_vmcs_pending(struct vcpu_t *vcpu)
     vcpu->vmcs_pending = 0;
 }
 
-/* Return the value same as ioctl value */
-int cpu_vmx_execute(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+/*
+ * Reads the exit information every exit handler needs right after VM exit.
+ */
+static exit_reason_t cpu_vmx_read_exit_info(struct vcpu_t *vcpu)
+{
+    struct vcpu_state_t *state = vcpu->state;
+    exit_reason_t exit_reason;
+
+    exit_reason.raw = vmread(vcpu, VM_EXIT_INFO_REASON);
+    hax_log(HAX_LOGD, "....exit_reason.raw %x, vcpu %d, cpu %d\n",
+            exit_reason.raw, vcpu->cpu_id, hax_cpu_id());
+
+    /* XXX Currently we take active save/restore for MSR and FPU, the main
+     * reason is, we have no schedule hook to get notified of preemption
+     * This should be changed later after get better idea
+     */
+    state->_rip = vmread(vcpu, GUEST_RIP);
+
+    vmx(vcpu, exit_idt_vectoring) = vmread(vcpu, VM_EXIT_INFO_IDT_VECTORING);
+    hax_handle_idt_vectoring(vcpu);
+
+    vmx(vcpu, interruptibility_state).raw = vmread(
+            vcpu, GUEST_INTERRUPTIBILITY);
+    state->_rflags = vmread(vcpu, GUEST_RFLAGS);
+    // The rest of the exit information is read on demand, where it is used
+    // (see vcpu_vmcs_cache_fetch()). Most exit handlers need the
+    // qualification or the instruction length, which are cheaper to read now
+    // that the VMCS is still loaded.
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_QUALIFICATION |
+                          VMCS_CACHE_EXIT_INSTR_LENGTH);
+    return exit_reason;
+}
+
+/*
+ * Tries to handle the VM exit that just occurred right away, with the VMCS
+ * still loaded and interrupts disabled (see vcpu_fast_vmexit_handler()).
+ * Returns true if it has been handled, in which case the guest can be
+ * re-entered without going through the entry preparation code again.
+ */
+static bool cpu_vmexit_fast_path(struct vcpu_t *vcpu, exit_reason_t exit_reason,
+                                 struct hax_tunnel *htun)
+{
+    // Pending events must be processed before the next VM entry
+    if (vcpu->paused || vcpu->panicked || vcpu->nr_pending_intrs > 0 ||
+        vcpu->vmcs_pending)
+        return false;
+
+    if (!vcpu_fast_vmexit_handler(vcpu, exit_reason, htun))
+        return false;
+
+    vcpu->cur_state = GS_STALE;
+    return true;
+}
+
+static int cpu_vmx_execute_loop(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 {
     vmx_result_t res = 0;
     int ret;
     preempt_flag flags;
-    struct vcpu_state_t *state = vcpu->state;
     uint32_t vmcs_err = 0;
+    struct vcpu_exit_stats *stats, *resumed = NULL;
+    uint64_t entry_tsc, exit_tsc = 0, handler_tsc;
 
     while (1) {
         exit_reason_t exit_reason;
+        uint64_t nr_vmreads;
 
         if (vcpu->paused) {
             htun->_exit_status = HAX_EXIT_PAUSED;
@@ -361,6 +490,8 @@ int cpu_vmx_execute(struct vcpu_t *vcpu, struct hax_tunnel *htun)
         if (vcpu_is_panic(vcpu))
             return 0;
 
+        // Charge all the VMREADs of this round trip to its exit reason
+        nr_vmreads = vcpu->nr_vmreads;
         if ((vmcs_err = load_vmcs(vcpu, &flags))) {
             vcpu_set_panic(vcpu);
             hax_log(HAX_LOGPANIC, "load_vmcs fail: %x\n", vmcs_err);
@@ -368,82 +499,56 @@ int cpu_vmx_execute(struct vcpu_t *vcpu, struct hax_tunnel *htun)
             return 0;
         }
         vcpu_handle_vmcs_pending(vcpu);
+        vcpu_vpid_update(vcpu);
         vcpu_inject_intr(vcpu, htun);
 
-        /* sometimes, the code segment type from qemu can be 10 (code segment),
-         * this will cause invalid guest state, since 11 (accessed code segment),
-         * not 10 is required by vmx hardware. Note: 11 is one of the allowed
-         * values by vmx hardware.
-         */
-        {
-            uint32_t temp= vmread(vcpu, GUEST_CS_AR);
-
-            if( (temp & 0xf) == 0xa) {
-                temp = temp +1;
-                vmwrite(vcpu, GUEST_CS_AR, temp);
+        // Exits handled on the fast path go straight back to the guest
+        for (;;) {
+            vcpu_arm_preemption_timer(vcpu, htun);
+            entry_tsc = ia32_rdtsc();
+            if (resumed) {
+                resumed->resume_cycles += entry_tsc - exit_tsc;
+                resumed = NULL;
+            }
+            vcpu_trace(vcpu, HAX_TRACE_VM_ENTRY, 0, entry_tsc);
+            res = cpu_vmx_run(vcpu, htun);
+            if (res) {
+                vcpu_release_fpu(vcpu);
+                hax_log(HAX_LOGE, "cpu_vmx_run error, code:%x\n", res);
+                if ((vmcs_err = put_vmcs(vcpu, &flags))) {
+                    vcpu_set_panic(vcpu);
+                    hax_log(HAX_LOGPANIC, "put_vmcs fail: %x\n", vmcs_err);
+                    hax_panic_log(vcpu);
+                }
+                return -EINVAL;
             }
-        }
-        /* sometimes, the TSS segment type from qemu is not right.
-         * let's hard-code it for now
-         */
-        {
-            uint32_t temp = vmread(vcpu, GUEST_TR_AR);
-
-            temp = (temp & ~0xf) | 0xb;
-            vmwrite(vcpu, GUEST_TR_AR, temp);
-        }
 
-        res = cpu_vmx_run(vcpu, htun);
-        if (res) {
-            hax_log(HAX_LOGE, "cpu_vmx_run error, code:%x\n", res);
-            if ((vmcs_err = put_vmcs(vcpu, &flags))) {
-                vcpu_set_panic(vcpu);
-                hax_log(HAX_LOGPANIC, "put_vmcs fail: %x\n", vmcs_err);
-                hax_panic_log(vcpu);
+            exit_tsc = ia32_rdtsc();
+            vcpu_stats_hist(vcpu->stats.guest_hist, exit_tsc - entry_tsc);
+            exit_reason = cpu_vmx_read_exit_info(vcpu);
+            if (vcpu->trace) {
+                vcpu_trace_vmexit(vcpu, exit_reason.basic_reason, exit_tsc);
             }
-            return -EINVAL;
+            if (!cpu_vmexit_fast_path(vcpu, exit_reason, htun))
+                break;
+
+            stats = &vcpu->exit_stats[exit_reason.basic_reason];
+            stats->count++;
+            stats->vmreads += vcpu->nr_vmreads - nr_vmreads;
+            stats->resumes++;
+            stats->fast++;
+            resumed = stats;
+            nr_vmreads = vcpu->nr_vmreads;
         }
 
-        exit_reason.raw = vmread(vcpu, VM_EXIT_INFO_REASON);
-        hax_log(HAX_LOGD, "....exit_reason.raw %x, vcpu %d, cpu %d\n",
-                exit_reason.raw, vcpu->cpu_id, hax_cpu_id());
-
-        /* XXX Currently we take active save/restore for MSR and FPU, the main
-         * reason is, we have no schedule hook to get notified of preemption
-         * This should be changed later after get better idea
-         */
-        vcpu->state->_rip = vmread(vcpu, GUEST_RIP);
-
-        hax_handle_idt_vectoring(vcpu);
-
-        vmx(vcpu, exit_qualification).raw = vmread(
-                vcpu, VM_EXIT_INFO_QUALIFICATION);
-        vmx(vcpu, exit_intr_info).raw = vmread(
-                vcpu, VM_EXIT_INFO_INTERRUPT_INFO);
-        vmx(vcpu, exit_exception_error_code) = vmread(
-                vcpu, VM_EXIT_INFO_EXCEPTION_ERROR_CODE);
-        vmx(vcpu, exit_idt_vectoring) = vmread(
-                vcpu, VM_EXIT_INFO_IDT_VECTORING);
-        vmx(vcpu, exit_instr_length) = vmread(
-                vcpu, VM_EXIT_INFO_INSTRUCTION_LENGTH);
-        vmx(vcpu, exit_gpa) = vmread(
-                vcpu, VM_EXIT_INFO_GUEST_PHYSICAL_ADDRESS);
-        vmx(vcpu, interruptibility_state).raw = vmread(
-                vcpu, GUEST_INTERRUPTIBILITY);
-
-        state->_rflags = vmread(vcpu, GUEST_RFLAGS);
-        state->_rsp = vmread(vcpu, GUEST_RSP);
-        VMREAD_SEG(vcpu, CS, state->_cs);
-        VMREAD_SEG(vcpu, DS, state->_ds);
-        VMREAD_SEG(vcpu, ES, state->_es);
-        vmread_cr(vcpu);
-
         if (vcpu->nr_pending_intrs > 0 || hax_intr_is_blocked(vcpu))
             htun->ready_for_interrupt_injection = 0;
         else
             htun->ready_for_interrupt_injection = 1;
 
         vcpu->cur_state = GS_STALE;
+        // The host may use the FPU as soon as interrupts are enabled
+        vcpu_release_fpu(vcpu);
         vmcs_err = put_vmcs(vcpu, &flags);
         if (vmcs_err) {
             vcpu_set_panic(vcpu);
@@ -453,12 +558,55 @@ int cpu_vmx_execute(struct vcpu_t *vcpu, struct hax_tunnel *htun)
         }
         hax_enable_irq();
 
+        handler_tsc = ia32_rdtsc();
         ret = cpu_vmexit_handler(vcpu, exit_reason, htun);
+        handler_tsc = ia32_rdtsc() - handler_tsc;
+        vcpu_stats_hist(vcpu->stats.handler_hist, handler_tsc);
+        if (exit_reason.basic_reason < VCPU_NR_EXIT_REASONS) {
+            stats = &vcpu->exit_stats[exit_reason.basic_reason];
+            stats->count++;
+            stats->vmreads += vcpu->nr_vmreads - nr_vmreads;
+            stats->handler_cycles += handler_tsc;
+            if (ret > 0) {
+                stats->resumes++;
+                resumed = stats;
+            }
+        }
         if (ret <= 0)
             return ret;
     }
 }
 
+/* Return the value same as ioctl value */
+int cpu_vmx_execute(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    preempt_flag flags;
+    bool notified = false;
+    int ret;
+
+    // The VMCS and the guest MSRs may only stay in the host processor while
+    // preemption can be tracked, so that they are put away before the thread
+    // moves to another host processor, or another thread runs on this one
+    if (config.persistent_vmcs || config.lazy_host_msrs) {
+        notified = !hax_vcpu_preempt_notify_begin(vcpu, vcpu->vcpu_host);
+    }
+    vcpu->vmcs_keep = notified && config.persistent_vmcs;
+    vcpu->lazy_host_msrs = notified && config.lazy_host_msrs;
+
+    ret = cpu_vmx_execute_loop(vcpu, htun);
+
+    if (notified) {
+        vcpu->vmcs_keep = 0;
+        vcpu->lazy_host_msrs = 0;
+        // The thread is about to return to user space
+        hax_disable_preemption(&flags);
+        vcpu_sched_out(vcpu);
+        hax_enable_preemption(&flags);
+        hax_vcpu_preempt_notify_end(vcpu, vcpu->vcpu_host);
+    }
+    return ret;
+}
+
 uint8_t is_vmcs_loaded(struct vcpu_t *vcpu)
 {
     return (vcpu && vcpu->is_vmcs_loaded);
@@ -512,6 +660,34 @@ void hax_panic_log(struct vcpu_t *vcpu)
     hax_log(HAX_LOGE, "log_vmxoff_res %x\n", log_vmxoff_res);
 }
 
+/*
+ * Clears the VMCS kept current on this host processor (see put_vmcs()), and
+ * leaves VMX operation. Must be called with preemption disabled.
+ */
+static void cpu_evict_vmcs(struct per_cpu_data *cpu_data)
+{
+    struct vcpu_t *vcpu = cpu_data->resident_vcpu;
+    hax_paddr_t vmcs_phy = vcpu_vmcs_pa(vcpu);
+
+    if (asm_vmclear(&vmcs_phy) != VMX_SUCCEED) {
+        log_vmclear_err = 1;
+    }
+    vcpu->launched = 0;
+    cpu_data->resident_vcpu = NULL;
+    cpu_vmxroot_leave();
+    cpu_data->other_vmcs = VMCS_NONE;
+}
+
+void vcpu_sched_out(struct vcpu_t *vcpu)
+{
+    struct per_cpu_data *cpu_data = current_cpu_data();
+
+    if (cpu_data->resident_vcpu == vcpu) {
+        cpu_evict_vmcs(cpu_data);
+    }
+    vcpu_put_guest_msrs(vcpu);
+}
+
 uint32_t load_vmcs(struct vcpu_t *vcpu, preempt_flag *flags)
 {
     struct per_cpu_data *cpu_data;
@@ -532,6 +708,17 @@ uint32_t load_vmcs(struct vcpu_t *vcpu, preempt_flag *flags)
         return 0;
     }
 
+    if (cpu_data->resident_vcpu) {
+        if (cpu_data->resident_vcpu == vcpu) {
+            // Still current since the last put_vmcs() on this processor
+            vcpu->is_vmcs_loaded = 1;
+            cpu_data->current_vcpu = vcpu;
+            vcpu->prev_cpu_id = vcpu->cpu_id;
+            return VMXON_SUCCESS;
+        }
+        cpu_evict_vmcs(cpu_data);
+    }
+
     if (cpu_vmxroot_enter() != VMX_SUCCEED) {
         hax_enable_preemption(flags);
         return VMXON_FAIL;
@@ -560,6 +747,14 @@ uint32_t load_vmcs(struct vcpu_t *vcpu, preempt_flag *flags)
         cpu_data->current_vcpu = vcpu;
         vcpu->prev_cpu_id = vcpu->cpu_id;
         vcpu->cpu_id = hax_cpu_id();
+        // This CPU may cache translations from the VM's EPT from now on (see
+        // invept_eptp_cpus())
+        hax_test_and_set_bit((int)vcpu->cpu_id, vcpu->vm->ept_tree.cpus);
+        vcpu->stats.vmcs_loads++;
+        if (vcpu->prev_cpu_id != (uint32_t)(~0ULL) &&
+            vcpu->prev_cpu_id != vcpu->cpu_id) {
+            vcpu->stats.migrations++;
+        }
     }
 
     cpu_data->other_vmcs = curr_vmcs;
@@ -590,6 +785,15 @@ uint32_t put_vmcs(struct vcpu_t *vcpu, preempt_flag *flags)
         goto out;
     }
 
+    if (vcpu && vcpu->vmcs_keep) {
+        // Skip VMCLEAR and VMXOFF, until the thread gets scheduled out (see
+        // vcpu_sched_out()), or the vCPU leaves its run loop
+        cpu_data->resident_vcpu = vcpu;
+        cpu_data->current_vcpu = NULL;
+        vcpu->is_vmcs_loaded = 0;
+        goto out;
+    }
+
     if (vcpu)
         vmcs_phy = vcpu_vmcs_pa(vcpu);
     else
@@ -599,6 +803,8 @@ uint32_t put_vmcs(struct vcpu_t *vcpu, preempt_flag *flags)
         hax_log(HAX_LOGE, "vmclear failed (%llx)\n", vmcs_phy);
         log_vmclear_err = 1;
     }
+    if (vcpu)
+        vcpu->launched = 0;
 
     cpu_data->current_vcpu = NULL;
 
@@ -639,6 +845,9 @@ void load_vmcs_common(struct vcpu_t *vcpu)
     if (vmx(vcpu, pcpu_ctls) & USE_TSC_OFFSETTING)
         vmwrite(vcpu, VMX_TSC_OFFSET, vcpu->tsc_offset);
 
+    if (vmx(vcpu, scpu_ctls) & USE_TSC_SCALING)
+        vmwrite(vcpu, VMX_TSC_MULTIPLIER, vcpu->tsc_ratio);
+
     vmwrite(vcpu, GUEST_ACTIVITY_STATE, vcpu->state->_activity_state);
     vcpu_vmwrite_all(vcpu);
 }
@@ -32,6 +32,7 @@
 #include "cpuid.h"
 
 #include "cpu.h"
+#include "cpuid_index.h"
 #include "driver.h"
 #include "fpu.h"
 #include "ia32.h"
@@ -84,6 +85,9 @@ typedef struct cpuid_controller_t {
 } cpuid_controller_t;
 
 static cpuid_cache_t cache = {0};
+// Locates the leaves of kCpuidManager[], which is also the layout of every
+// hax_cpuid_t.features[]
+static cpuid_index_t guest_index = {0};
 
 static inline uint32_t feature_leaf(uint32_t feature_key);
 static inline uint32_t feature_subleaf(uint32_t feature_key);
@@ -96,6 +100,8 @@ static void update_feature(hax_cpuid_entry *entry, uint32_t feature_key,
 static hax_cpuid_entry * find_cpuid_entry(hax_cpuid_entry *features,
                                           uint32_t size, uint32_t function,
                                           uint32_t index);
+static hax_cpuid_entry * find_guest_entry(hax_cpuid_t *cpuid,
+                                          uint32_t function, uint32_t index);
 static void dump_features(hax_cpuid_entry *features, uint32_t size);
 static uint32_t calc_xstate_required_size(uint64_t xstate_bv,
                                           bool is_compacted);
@@ -215,6 +221,7 @@ void cpuid_host_init(void)
 {
     cpuid_args_t res;
     uint32_t *data = cache.data;
+    int i;
 
     cpuid_query_leaf(&res, 0x00000001);
     data[0] = res.ecx;
@@ -232,6 +239,13 @@ void cpuid_host_init(void)
     data[6] = res.edx;
 
     cache.initialized = true;
+
+    for (i = 0; i < CPUID_TOTAL_LEAVES; ++i) {
+        if (!cpuid_index_add(&guest_index, kCpuidManager[i].leaf, i)) {
+            hax_log(HAX_LOGE, "%s: Cannot index CPUID leaf 0x%x\n", __func__,
+                    kCpuidManager[i].leaf);
+        }
+    }
 }
 
 bool cpuid_host_has_feature(uint32_t feature_key)
@@ -426,8 +440,7 @@ bool cpuid_guest_has_feature(hax_cpuid_t *cpuid, uint32_t feature_key)
     if (cpuid == NULL)
         return false;
 
-    entry = find_cpuid_entry(cpuid->features, CPUID_TOTAL_LEAVES,
-                             feature_leaf(feature_key),
+    entry = find_guest_entry(cpuid, feature_leaf(feature_key),
                              feature_subleaf(feature_key));
 
     if (entry == NULL)
@@ -439,8 +452,9 @@ bool cpuid_guest_has_feature(hax_cpuid_t *cpuid, uint32_t feature_key)
 void cpuid_execute(hax_cpuid_t *cpuid, cpuid_args_t *args)
 {
     uint32_t leaf, subleaf;
-    int i, index, supported = 0;
-    hax_cpuid_entry *e, *entry = NULL;
+    int i, supported;
+    hax_cpuid_entry *entry = NULL;
+    cpuid_index_slot_t slot;
 
     if (cpuid == NULL || args == NULL)
         return;
@@ -455,27 +469,14 @@ void cpuid_execute(hax_cpuid_t *cpuid, cpuid_args_t *args)
     // * If multiple entries are found and the subleaf matches exactly, the
     //   cached values will be used (supported = 1); otherwise the instruction
     //   is regarded as uncached and needs to be re-executed (supported > 1).
-    for (i = 0; i < CPUID_TOTAL_LEAVES; ++i) {
-        e = &cpuid->features[i];
-
-        if (e->function != leaf) {
-            if (supported == 0)
-                continue;
-            else
-                break;
-        }
-
-        if (e->index == subleaf) {
+    slot = cpuid_index_find(&guest_index, leaf);
+    supported = slot.count;
+    entry = &cpuid->features[slot.first];
+    for (i = 0; i < slot.count && supported > 1; ++i) {
+        if (cpuid->features[slot.first + i].index == subleaf) {
             supported = 1;
-            entry = e;
-            break;
+            entry = &cpuid->features[slot.first + i];
         }
-
-        if (supported++ != 0)
-            continue;
-
-        index = i;
-        entry = e;
     }
 
     switch (supported) {
@@ -498,7 +499,7 @@ void cpuid_execute(hax_cpuid_t *cpuid, cpuid_args_t *args)
         default: {  // uncached
             // Call the primary execute() corresponding to the leaf for the
             // CPUID instruction.
-            const cpuid_manager_t *cpuid_manager = &kCpuidManager[index];
+            const cpuid_manager_t *cpuid_manager = &kCpuidManager[slot.first];
 
             if (cpuid_manager->execute != NULL) {
                 cpuid_manager->execute(args);
@@ -516,19 +517,20 @@ void cpuid_update(hax_cpuid_t *cpuid, struct vcpu_t *vcpu)
     vcpu_state_t *state = vcpu->state;
     hax_cpuid_entry *entry;
 
-    entry = find_cpuid_entry(cpuid->features, CPUID_TOTAL_LEAVES, 0x01, 0);
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
+    entry = find_guest_entry(cpuid, 0x01, 0);
     if (entry != NULL && cpu_has_feature(X86_FEATURE_XSAVE)) {
         // Update OSXSAVE bit
         update_feature(entry, X86_FEATURE_OSXSAVE,
                        !!(state->_cr4 & CR4_OSXSAVE));
     }
 
-    entry = find_cpuid_entry(cpuid->features, CPUID_TOTAL_LEAVES, 0x0d, 0);
+    entry = find_guest_entry(cpuid, 0x0d, 0);
     if (entry != NULL) {
         entry->ebx = calc_xstate_required_size(vcpu->xcr0, false);
     }
 
-    entry = find_cpuid_entry(cpuid->features, CPUID_TOTAL_LEAVES, 0x0d, 1);
+    entry = find_guest_entry(cpuid, 0x0d, 1);
     if (entry != NULL && is_feature_set(entry, X86_FEATURE_XSAVEC)) {
         entry->ebx = calc_xstate_required_size(vcpu->xcr0, true);
     }
@@ -594,7 +596,7 @@ void cpuid_post_set_features(hax_cpuid_t *cpuid, struct vm_t *vm)
 {
     hax_cpuid_entry *entry;
 
-    entry = find_cpuid_entry(cpuid->features, CPUID_TOTAL_LEAVES, 0x0d, 0);
+    entry = find_guest_entry(cpuid, 0x0d, 0);
 
     vm->valid_xcr0 = (entry == NULL) ? 0 : (entry->eax |
             ((uint64_t)entry->edx << 32)) & hax->supported_xcr0;
@@ -722,6 +724,20 @@ static hax_cpuid_entry * find_cpuid_entry(hax_cpuid_entry *features,
     return NULL;
 }
 
+static hax_cpuid_entry * find_guest_entry(hax_cpuid_t *cpuid,
+                                          uint32_t function, uint32_t index)
+{
+    cpuid_index_slot_t slot = cpuid_index_find(&guest_index, function);
+    int i;
+
+    for (i = slot.first; i < slot.first + slot.count; ++i) {
+        if (cpuid->features[i].index == index)
+            return &cpuid->features[i];
+    }
+
+    return NULL;
+}
+
 static void dump_features(hax_cpuid_entry *features, uint32_t size)
 {
     int i;
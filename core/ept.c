@@ -78,8 +78,14 @@ static bool ept_has_cap(uint64_t cap)
 struct invept_bundle {
     uint type;
     struct invept_desc *desc;
+    const uint64_t *cpus;
 };
 
+static bool invept_cpu_selected(const uint64_t *cpus, uint32_t cpu_id)
+{
+    return !cpus || (cpus[cpu_id / 64] & ((uint64_t)1 << (cpu_id % 64)));
+}
+
 static void invept_smpfunc(struct invept_bundle *bundle)
 {
     struct per_cpu_data *cpu_data;
@@ -88,8 +94,17 @@ static void invept_smpfunc(struct invept_bundle *bundle)
     cpu_data = current_cpu_data();
     cpu_data->invept_res = VMX_SUCCEED;
 
+    if (!invept_cpu_selected(bundle->cpus, cpu_data->cpu_id))
+        return;
+
     hax_log(HAX_LOGD, "[#%d] invept_smpfunc\n", cpu_data->cpu_id);
 
+    if (cpu_data->resident_vcpu) {
+        // Already in VMX operation, with a VMCS kept current (see put_vmcs())
+        cpu_data->invept_res = asm_invept(bundle->type, bundle->desc);
+        return;
+    }
+
     cpu_vmxroot_enter();
 
     if (cpu_data->vmxon_res == VMX_SUCCEED) {
@@ -100,7 +115,16 @@ static void invept_smpfunc(struct invept_bundle *bundle)
 
 void invept(hax_vm_t *hax_vm, uint type)
 {
-    uint64_t eptp_value = vm_get_eptp(hax_vm);
+    invept_eptp(vm_get_eptp(hax_vm), type);
+}
+
+void invept_eptp(uint64_t eptp_value, uint type)
+{
+    invept_eptp_cpus(eptp_value, type, NULL);
+}
+
+void invept_eptp_cpus(uint64_t eptp_value, uint type, const uint64_t *cpus)
+{
     struct invept_desc desc = { eptp_value, 0 };
     struct invept_bundle bundle;
     uint32_t cpu_id, res;
@@ -130,6 +154,7 @@ void invept(hax_vm_t *hax_vm, uint type)
 
     bundle.type = type;
     bundle.desc = &desc;
+    bundle.cpus = cpus;
     hax_smp_call_function(&cpu_online_map, (void (*)(void *))invept_smpfunc,
                       &bundle);
 
@@ -141,7 +166,8 @@ void invept(hax_vm_t *hax_vm, uint type)
     for (cpu_id = 0; cpu_id < cpu_online_map.cpu_num; cpu_id++) {
         struct per_cpu_data *cpu_data;
 
-        if (!cpu_is_online(&cpu_online_map, cpu_id)) {
+        if (!cpu_is_online(&cpu_online_map, cpu_id) ||
+            !invept_cpu_selected(cpus, cpu_id)) {
             continue;
         }
         cpu_data = hax_cpu_data[cpu_id];
@@ -169,3 +195,25 @@ void invept(hax_vm_t *hax_vm, uint type)
         }
     }
 }
+
+bool invvpid_has_all_context(void)
+{
+    return ept_has_cap(ept_cap_invvpid) && ept_has_cap(ept_cap_invvpid_ac);
+}
+
+bool ept_has_ad_bits(void)
+{
+    // Unlike ept_has_cap(), safe to call if EPT is not usable
+    return (ept_capabilities & ept_cap_AD) != 0;
+}
+
+/*
+ * Invalidates the TLB entries of all VPIDs on the current processor, which
+ * must be in VMX operation (i.e. with a VMCS loaded).
+ */
+vmx_result_t invvpid_all_context(void)
+{
+    struct invvpid_desc desc = { 0, 0 };
+
+    return asm_invvpid(VMX_INVVPID_ALL_CONTEXT, &desc);
+}
@@ -33,6 +33,7 @@
 #include "hax.h"
 #include "hax_host_mem.h"
 
+#include "ept.h"
 #include "paging.h"
 
 void ept_handle_mapping_removed(hax_gpa_space_listener *listener,
@@ -72,65 +73,148 @@ void ept_handle_mapping_changed(hax_gpa_space_listener *listener,
     hax_log(HAX_LOGI, "%s: Invalidated %d PTEs\n", __func__, ret);
 }
 
-int ept_handle_access_violation(hax_gpa_space *gpa_space, hax_ept_tree *tree,
-                                exit_qualification_t qual, uint64_t gpa,
-                                uint64_t *fault_gfn)
+void ept_handle_pages_unshared(hax_gpa_space_listener *listener,
+                               uint64_t start_gfn, uint64_t npages)
 {
-    uint combined_perm;
-    uint64_t gfn;
-    hax_memslot *slot;
-    bool is_rom;
-    hax_ramblock *block;
-    hax_chunk *chunk;
-    uint64_t offset_within_slot, offset_within_block, offset_within_chunk;
-    uint64_t chunk_offset_low, chunk_offset_high, slot_offset_high;
-    uint64_t start_gpa, size;
-    int ret;
+    hax_ept_tree *tree;
 
-    gfn = gpa >> PG_ORDER_4K;
-    hax_assert(gpa_space != NULL);
-    slot = memslot_find(gpa_space, gfn);
-    if (!slot) {
-        // The faulting GPA is reserved for MMIO
-        hax_log(HAX_LOGD, "%s: gpa=0x%llx is reserved for MMIO\n",
-                __func__, gpa);
-        return 0;
+    hax_assert(listener != NULL);
+    tree = (hax_ept_tree *) listener->opaque;
+    if (ept_tree_invalidate_entries(tree, start_gfn, npages) <= 0)
+        return;
+    // Other host CPUs may still cache the read-only mappings to the template's
+    // page frames, and would keep reading stale data from them after the guest
+    // writes to its own copies. Only the host CPUs that have run this VM can.
+    if (!hax_test_and_clear_bit(0, (uint64_t *)&tree->invept_pending)) {
+        invept_eptp_cpus(tree->eptp.value, EPT_INVEPT_SINGLE_CONTEXT,
+                         tree->cpus);
     }
+}
 
-    // Extract bits 5..3 from Exit Qualification
-    combined_perm = (uint) ((qual.raw >> 3) & 7);
-    if (combined_perm != HAX_EPT_PERM_NONE) {
-        if ((qual.raw & HAX_EPT_ACC_W) && !(combined_perm & HAX_EPT_PERM_W) &&
-            (slot->flags == HAX_MEMSLOT_READONLY)) {
-            // Handle a write to ROM/ROM device as MMIO
-            hax_log(HAX_LOGD, "%s: write to a read-only gpa=0x%llx\n",
-                    __func__, gpa);
-            return 0;
+// Creates the PTEs for the given GFN range, which must be covered by the given
+// |hax_memslot|, using the given mapping properties. The range may span more
+// than one chunk. Chunks that are not pinned yet are pinned if |alloc| is true.
+// Returns 0 on success, or one of the following error codes:
+// -ENOMEM: Memory allocation/mapping error, or |alloc| is false and a chunk is
+//          not pinned.
+static int ept_map_slot_range(hax_ept_tree *tree, hax_memslot *slot,
+                              uint64_t gfn, uint64_t npages, uint8_t flags,
+                              bool alloc)
+{
+    hax_ramblock *block = slot->block;
+
+    while (npages) {
+        hax_chunk *chunk;
+        uint64_t offset_within_block, offset_within_chunk, n;
+        int ret;
+
+        offset_within_block = slot->offset_within_block +
+                              ((gfn - slot->base_gfn) << PG_ORDER_4K);
+        chunk = ramblock_get_chunk(block, offset_within_block, alloc);
+        if (!chunk) {
+            hax_log(HAX_LOGE, "%s: Failed to grab the RAM chunk for gfn=0x%llx:"
+                    " block.base_uva=0x%llx, offset_within_block=0x%llx, "
+                    "alloc=%d\n", __func__, gfn, block->base_uva,
+                    offset_within_block, alloc);
+            return -ENOMEM;
         }
-        // See IA SDM Vol. 3C 27.2.1 Table 27-7, especially note 2
-        hax_log(HAX_LOGE, "%s: Cannot handle the case where the PTE "
-                "corresponding to the faulting GPA is present: qual=0x%llx, "
-                "gpa=0x%llx\n", __func__, qual.raw, gpa);
-        return -EACCES;
+        offset_within_chunk = offset_within_block -
+                              (chunk->base_uva - block->base_uva);
+        n = (chunk->size - offset_within_chunk) >> PG_ORDER_4K;
+        if (n > npages) {
+            n = npages;
+        }
+        ret = ept_tree_create_entries(tree, gfn, n, chunk, offset_within_chunk,
+                                      flags);
+        if (ret < 0) {
+            hax_log(HAX_LOGE, "%s: Failed to create PTEs for GFN range: "
+                    "ret=%d, start_gfn=0x%llx, npages=%llu\n", __func__, ret,
+                    gfn, n);
+            return ret;
+        }
+        gfn += n;
+        npages -= n;
     }
+    return 0;
+}
 
-    // Ideally we should call gpa_space_is_page_protected() and ask user space
-    // to unprotect just the host virtual page that |gfn| maps to. But since we
-    // pin host RAM one chunk (rather than one page) at a time, if the chunk
-    // that |gfn| maps to contains any other host virtual page that is protected
-    // (by means of a VirtualProtect() or mprotect() call from user space), we
-    // will not be able to pin the chunk when we handle the next EPT violation
-    // caused by the same |gfn|.
-    // For now, we ask user space to unprotect all host virtual pages in the
-    // chunk, so our next hax_pin_user_pages() call will not fail. This is a
-    // dirty hack.
-    // TODO: Make chunks more flexible, so we can pin host RAM in finer
-    // granularity (as small as one page) and hide chunks from user space.
-    if (gpa_space_is_chunk_protected(gpa_space, gfn, fault_gfn))
-        return -EFAULT;
+// The counterpart of ept_map_chunk() for RAM in a clone. Covers the same GFN
+// range, but only pins the chunk of the clone's own RAM if any page in that
+// range is not shared with the template.
+static int ept_map_clone_chunk(hax_gpa_space *gpa_space, hax_ept_tree *tree,
+                               hax_memslot *slot, uint64_t gfn)
+{
+    hax_memslot *template_slot;
+    uint64_t offset_within_block, low, high, start_gfn, end_gfn, n;
+    int ret = 0;
 
-    // The faulting GPA maps to RAM/ROM
+    offset_within_block = slot->offset_within_block +
+                          ((gfn - slot->base_gfn) << PG_ORDER_4K);
+    // Intersect the UVA ranges covered by |slot| and the chunk containing |gfn|
+    low = offset_within_block & ~((uint64_t)HAX_CHUNK_SIZE - 1);
+    if (low < slot->offset_within_block) {
+        low = slot->offset_within_block;
+    }
+    high = (offset_within_block | (HAX_CHUNK_SIZE - 1)) + 1;
+    if (high > slot->offset_within_block + (slot->npages << PG_ORDER_4K)) {
+        high = slot->offset_within_block + (slot->npages << PG_ORDER_4K);
+    }
+    start_gfn = gfn - ((offset_within_block - low) >> PG_ORDER_4K);
+    end_gfn = gfn + ((high - offset_within_block) >> PG_ORDER_4K);
+
+    // Keep pages from being unshared in the meantime, which would leave them
+    // mapped to the template
+    hax_mutex_lock(gpa_space->cow.lock);
+    for (gfn = start_gfn; gfn < end_gfn; gfn += n) {
+        n = gpa_space_get_shared_run(gpa_space, gfn, end_gfn - gfn,
+                                     &template_slot);
+        if (template_slot) {
+            ret = ept_map_slot_range(tree, template_slot, gfn, n,
+                                     HAX_MEMSLOT_READONLY, false);
+        } else {
+            ret = ept_map_slot_range(tree, slot, gfn, n, slot->flags, true);
+        }
+        if (ret < 0)
+            break;
+    }
+    hax_mutex_unlock(gpa_space->cow.lock);
+    return ret < 0 ? ret : 1;
+}
+
+// Handles a write to a page of a clone that is mapped read-only to the
+// template's page frame, by giving the clone its own copy of the page.
+static int ept_handle_cow_violation(hax_gpa_space *gpa_space,
+                                    hax_ept_tree *tree, hax_memslot *slot,
+                                    uint64_t gfn)
+{
+    int ret;
+
+    // Also invalidates the PTE, unless another vCPU has unshared the page
+    // first
+    ret = gpa_space_unshare_range(gpa_space, gfn, 1);
+    if (ret < 0)
+        return ret;
+    // Map the copy right away rather than on the next EPT violation
+    ret = ept_map_slot_range(tree, slot, gfn, 1, slot->flags, true);
+    return ret < 0 ? ret : 1;
+}
+
+int ept_map_chunk(hax_gpa_space *gpa_space, hax_ept_tree *tree,
+                  hax_memslot *slot, uint64_t gfn)
+{
+    bool is_rom;
+    hax_ramblock *block;
+    hax_chunk *chunk;
+    uint64_t offset_within_slot, offset_within_block, offset_within_chunk;
+    uint64_t chunk_offset_low, chunk_offset_high, slot_offset_high;
+    uint64_t gpa, start_gpa, size;
+    int ret;
+
+    hax_assert(slot != NULL);
+    gpa = gfn << PG_ORDER_4K;
     is_rom = slot->flags & HAX_MEMSLOT_READONLY;
+    if (gpa_space->cow.template && !is_rom)
+        return ept_map_clone_chunk(gpa_space, tree, slot, gfn);
     offset_within_slot = gpa - (slot->base_gfn << PG_ORDER_4K);
     hax_assert(offset_within_slot < (slot->npages << PG_ORDER_4K));
     block = slot->block;
@@ -179,6 +263,65 @@ int ept_handle_access_violation(hax_gpa_space *gpa_space, hax_ept_tree *tree,
     return 1;
 }
 
+int ept_handle_access_violation(hax_gpa_space *gpa_space, hax_ept_tree *tree,
+                                exit_qualification_t qual, uint64_t gpa,
+                                uint64_t *fault_gfn)
+{
+    uint combined_perm;
+    uint64_t gfn;
+    hax_memslot *slot;
+
+    gfn = gpa >> PG_ORDER_4K;
+    hax_assert(gpa_space != NULL);
+    slot = memslot_find(gpa_space, gfn);
+    if (!slot) {
+        // The faulting GPA is reserved for MMIO
+        hax_log(HAX_LOGD, "%s: gpa=0x%llx is reserved for MMIO\n",
+                __func__, gpa);
+        return 0;
+    }
+
+    // Extract bits 5..3 from Exit Qualification
+    combined_perm = (uint) ((qual.raw >> 3) & 7);
+    if (combined_perm != HAX_EPT_PERM_NONE) {
+        if ((qual.raw & HAX_EPT_ACC_W) && !(combined_perm & HAX_EPT_PERM_W) &&
+            (slot->flags == HAX_MEMSLOT_READONLY)) {
+            // Handle a write to ROM/ROM device as MMIO
+            hax_log(HAX_LOGD, "%s: write to a read-only gpa=0x%llx\n",
+                    __func__, gpa);
+            return 0;
+        }
+        if ((qual.raw & HAX_EPT_ACC_W) && !(combined_perm & HAX_EPT_PERM_W) &&
+            gpa_space->cow.template) {
+            // Copy on write to RAM shared with the template
+            return ept_handle_cow_violation(gpa_space, tree, slot, gfn);
+        }
+        // See IA SDM Vol. 3C 27.2.1 Table 27-7, especially note 2
+        hax_log(HAX_LOGE, "%s: Cannot handle the case where the PTE "
+                "corresponding to the faulting GPA is present: qual=0x%llx, "
+                "gpa=0x%llx\n", __func__, qual.raw, gpa);
+        return -EACCES;
+    }
+
+    // Ideally we should call gpa_space_is_page_protected() and ask user space
+    // to unprotect just the host virtual page that |gfn| maps to. But since we
+    // pin host RAM one chunk (rather than one page) at a time, if the chunk
+    // that |gfn| maps to contains any other host virtual page that is protected
+    // (by means of a VirtualProtect() or mprotect() call from user space), we
+    // will not be able to pin the chunk when we handle the next EPT violation
+    // caused by the same |gfn|.
+    // For now, we ask user space to unprotect all host virtual pages in the
+    // chunk, so our next hax_pin_user_pages() call will not fail. This is a
+    // dirty hack.
+    // TODO: Make chunks more flexible, so we can pin host RAM in finer
+    // granularity (as small as one page) and hide chunks from user space.
+    if (gpa_space_is_chunk_protected(gpa_space, gfn, fault_gfn))
+        return -EFAULT;
+
+    // The faulting GPA maps to RAM/ROM
+    return ept_map_chunk(gpa_space, tree, slot, gfn);
+}
+
 typedef struct epte_fixer_bundle {
     hax_memslot *slot;
     int misconfigured_count;
@@ -239,6 +382,8 @@ static void fix_epte(hax_ept_tree *tree, uint64_t gfn, int level, hax_epte *epte
         if (level == HAX_EPT_LEVEL_PT) {
             // Preserve bits 5..3 (EPT MT)
             preserved_bits |= 0x7 << 3;
+            // Preserve bit 9 (Dirty)
+            preserved_bits |= 1 << 9;
         }
 
         // Clear all reserved bits
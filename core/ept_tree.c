@@ -33,6 +33,7 @@
 #include "hax.h"
 #include "hax_host_mem.h"
 
+#include "ept.h"
 #include "paging.h"
 
 static hax_epte INVALID_EPTE = {
@@ -144,6 +145,11 @@ static inline hax_ept_page_kmap * ept_tree_get_freq_page(hax_ept_tree *tree,
     return freq_page;
 }
 
+static uint32_t ept_tree_cpus_size(void)
+{
+    return (cpu_online_map.cpu_num + 63) / 64 * sizeof(uint64_t);
+}
+
 int ept_tree_init(hax_ept_tree *tree)
 {
     hax_ept_page *root_page;
@@ -160,9 +166,18 @@ int ept_tree_init(hax_ept_tree *tree)
     memset(tree->freq_pages, 0, sizeof(tree->freq_pages));
     tree->invept_pending = false;
 
+    // Also accessed from invept_smpfunc(), which runs in interrupt context
+    tree->cpus = hax_vmalloc(ept_tree_cpus_size(), HAX_MEM_NONPAGE);
+    if (!tree->cpus) {
+        hax_log(HAX_LOGE, "%s: Failed to allocate CPU bitmap\n", __func__);
+        return -ENOMEM;
+    }
+    memset(tree->cpus, 0, ept_tree_cpus_size());
+
     tree->lock = hax_spinlock_alloc_init();
     if (!tree->lock) {
         hax_log(HAX_LOGE, "%s: Failed to allocate EPT tree lock\n", __func__);
+        hax_vfree(tree->cpus, ept_tree_cpus_size());
         return -ENOMEM;
     }
 
@@ -170,6 +185,7 @@ int ept_tree_init(hax_ept_tree *tree)
     if (!root_page) {
         hax_log(HAX_LOGE, "%s: Failed to allocate EPT root page\n", __func__);
         hax_spinlock_free(tree->lock);
+        hax_vfree(tree->cpus, ept_tree_cpus_size());
         return -ENOMEM;
     }
     kva = hax_get_kva_phys(&root_page->memdesc);
@@ -185,6 +201,9 @@ int ept_tree_init(hax_ept_tree *tree)
     tree->eptp.ept_mt = HAX_EPT_MEMTYPE_WB;
     tree->eptp.max_level = HAX_EPT_LEVEL_MAX;
     tree->eptp.pfn = pfn;
+    // Accessed and dirty flags are only turned on once working set estimation
+    // or RAM reclaim needs them (see ws_enable_tracking())
+    tree->eptp.track_access = 0;
     hax_log(HAX_LOGI, "%s: eptp=0x%llx\n", __func__, tree->eptp.value);
     return 0;
 }
@@ -226,6 +245,7 @@ int ept_tree_free(hax_ept_tree *tree)
     hax_log(HAX_LOGI, "%s: Total %d EPT page(s) freed\n", __func__, i);
 
     hax_spinlock_free(tree->lock);
+    hax_vfree(tree->cpus, ept_tree_cpus_size());
     return 0;
 }
 
@@ -445,7 +465,7 @@ int ept_tree_create_entry(hax_ept_tree *tree, uint64_t gfn, hax_epte value)
     pte = &table[pt_index];
     if (!hax_cmpxchg64(0, value.value, &pte->value)) {
         // pte->value != 0, implying pte->perm != HAX_EPT_PERM_NONE
-        if (pte->value != value.value) {
+        if ((pte->value & ~HAX_EPT_AD_MASK) != value.value) {
             hax_log(HAX_LOGE, "%s: A different PTE corresponding to gfn=0x%llx"
                     " already exists: old_value=0x%llx, new_value=0x%llx\n",
                     __func__, gfn, pte->value, value.value);
@@ -544,7 +564,7 @@ next_pt:
         hax_assert(new_pte.pfn != INVALID_PFN);
         if (!hax_cmpxchg64(0, new_pte.value, &pte->value)) {
             // pte->value != 0, implying pte->perm != HAX_EPT_PERM_NONE
-            if (pte->value != new_pte.value) {
+            if ((pte->value & ~HAX_EPT_AD_MASK) != new_pte.value) {
                 hax_log(HAX_LOGE, "%s: A different PTE corresponding to %s "
                         "gfn=0x%llx already exists: old_value=0x%llx, "
                         "new_value=0x%llx\n", __func__, is_rom ? "ROM" : "RAM",
@@ -669,6 +689,97 @@ void ept_tree_walk(hax_ept_tree *tree, uint64_t gfn, epte_visitor visit_epte,
     hax_assert(ret == 0);
 }
 
+typedef struct epte_harvester_bundle {
+    bool clear;
+    bool pde_accessed;
+    // Whether any accessed flag was cleared
+    bool modified;
+} epte_harvester_bundle;
+
+// Returns the old value of the accessed flag of the given present |hax_epte|,
+// which is cleared if |clear| is true
+static bool epte_harvest_accessed(hax_epte *epte, bool clear, bool *modified)
+{
+    if (!epte->accessed)
+        return false;
+    if (clear) {
+        // Atomically, since the CPU may set the dirty flag at the same time
+        if (!hax_test_and_clear_bit(8, &epte->value)) {
+            *modified = true;
+        }
+    }
+    return true;
+}
+
+static void harvest_pde(hax_ept_tree *tree, uint64_t gfn, int level,
+                        hax_epte *epte, void *opaque)
+{
+    epte_harvester_bundle *bundle;
+
+    hax_assert(epte != NULL);
+    hax_assert(opaque != NULL);
+    bundle = (epte_harvester_bundle *) opaque;
+    if (level == HAX_EPT_LEVEL_PD && epte->perm != HAX_EPT_PERM_NONE) {
+        bundle->pde_accessed = epte_harvest_accessed(epte, bundle->clear,
+                                                     &bundle->modified);
+    }
+}
+
+int ept_tree_harvest_accessed(hax_ept_tree *tree, uint64_t gfn, bool clear,
+                              uint64_t *bitmap)
+{
+    epte_harvester_bundle bundle = { 0 };
+    hax_kmap_phys kmap = { 0 }, prev_kmap = { 0 };
+    hax_epte *table;
+    int level, ret;
+    uint i;
+    int count = 0;
+
+    if (!tree) {
+        hax_log(HAX_LOGE, "%s: tree == NULL\n", __func__);
+        return -EINVAL;
+    }
+    if (bitmap) {
+        memset(bitmap, 0, HAX_EPT_TABLE_SIZE / 8);
+    }
+    if (!tree->eptp.track_access)
+        return 0;
+
+    bundle.clear = clear;
+    table = ept_tree_get_root_table(tree);
+    hax_assert(table != NULL);
+    for (level = HAX_EPT_LEVEL_PML4; level >= HAX_EPT_LEVEL_PD; level--) {
+        table = ept_tree_get_next_table(tree, gfn, level, table, &kmap, false,
+                                        harvest_pde, &bundle);
+        ret = hax_unmap_page_frame(&prev_kmap);
+        hax_assert(ret == 0);
+        if (!table)
+            goto out;
+        kmap_swap(&prev_kmap, &kmap);
+    }
+    // The CPU sets the accessed flag of every EPT entry it uses to translate a
+    // GPA, so if that of the PDE is clear, no page of the PT has been accessed
+    // since both were last cleared, and the PT need not be scanned
+    if (bundle.pde_accessed) {
+        for (i = 0; i < HAX_EPT_TABLE_SIZE; i++) {
+            if (table[i].perm == HAX_EPT_PERM_NONE ||
+                !epte_harvest_accessed(&table[i], clear, &bundle.modified))
+                continue;
+            count++;
+            if (bitmap) {
+                bitmap[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+    }
+    ret = hax_unmap_page_frame(&prev_kmap);
+    hax_assert(ret == 0);
+out:
+    if (bundle.modified) {
+        hax_test_and_set_bit(0, (uint64_t *) &tree->invept_pending);
+    }
+    return count;
+}
+
 void invalidate_pte(hax_ept_tree *tree, uint64_t gfn, int level, hax_epte *epte,
                     void *opaque)
 {
@@ -57,6 +57,12 @@ int gpa_space_init(hax_gpa_space *gpa_space)
     // Initialize listener list
     hax_init_list_head(&gpa_space->listener_list);
 
+    gpa_space->lock = hax_mutex_alloc_init();
+    if (!gpa_space->lock) {
+        hax_log(HAX_LOGE, "%s: Failed to allocate lock\n", __func__);
+        return -ENOMEM;
+    }
+
     return ret;
 }
 
@@ -86,6 +92,10 @@ void gpa_space_free(hax_gpa_space *gpa_space)
 
     memslot_free_list(gpa_space);
     ramblock_free_list(&gpa_space->ramblock_list);
+    if (gpa_space->lock) {
+        hax_mutex_free(gpa_space->lock);
+        gpa_space->lock = NULL;
+    }
 
     // Clear listener_list.
     hax_list_entry_for_each_safe(listener, tmp, &gpa_space->listener_list,
@@ -95,6 +105,210 @@ void gpa_space_free(hax_gpa_space *gpa_space)
     if (gpa_space->prot.bitmap)
         hax_vfree(gpa_space->prot.bitmap,
                   gpa_space_prot_bitmap_size(gpa_space->prot.end_gfn));
+    if (gpa_space->cow.bitmap)
+        hax_vfree(gpa_space->cow.bitmap,
+                  gpa_space_prot_bitmap_size(gpa_space->cow.end_gfn));
+    if (gpa_space->cow.lock)
+        hax_mutex_free(gpa_space->cow.lock);
+}
+
+int gpa_space_set_template(hax_gpa_space *gpa_space, hax_gpa_space *template)
+{
+    hax_gpa_cow *cow;
+    hax_memslot *slot;
+    uint64_t end_gfn = 0;
+    uint bitmap_size;
+
+    if (!gpa_space || !template || gpa_space->cow.template) {
+        hax_log(HAX_LOGE, "%s: Invalid GPA space or template\n", __func__);
+        return -EINVAL;
+    }
+
+    // The memslot list is sorted by GFN
+    hax_list_entry_for_each(slot, &template->memslot_list, hax_memslot,
+                            entry) {
+        if (!(slot->flags & HAX_MEMSLOT_READONLY)) {
+            end_gfn = slot->base_gfn + slot->npages;
+        }
+    }
+    bitmap_size = gpa_space_prot_bitmap_size(end_gfn);
+    if (!bitmap_size) {
+        hax_log(HAX_LOGE, "%s: end_gfn=0x%llx is too big\n", __func__, end_gfn);
+        return -EINVAL;
+    }
+
+    cow = &gpa_space->cow;
+    cow->bitmap = hax_vmalloc(bitmap_size, HAX_MEM_NONPAGE);
+    if (!cow->bitmap) {
+        hax_log(HAX_LOGE, "%s: Not enough memory for sharing bitmap\n",
+                __func__);
+        return -ENOMEM;
+    }
+    memset(cow->bitmap, 0, bitmap_size);
+    cow->lock = hax_mutex_alloc_init();
+    if (!cow->lock) {
+        hax_vfree(cow->bitmap, bitmap_size);
+        cow->bitmap = NULL;
+        return -ENOMEM;
+    }
+    cow->end_gfn = end_gfn;
+    cow->template = template;
+    hax_log(HAX_LOGI, "%s: Sharing RAM below gfn=0x%llx with the template\n",
+            __func__, end_gfn);
+    return 0;
+}
+
+// Returns the template's |hax_memslot| backing the given GFN of a clone, if the
+// guest page frame is shared with the template, or NULL otherwise.
+static hax_memslot * gpa_space_find_shared(hax_gpa_space *gpa_space,
+                                           uint64_t gfn)
+{
+    hax_gpa_cow *cow = &gpa_space->cow;
+    hax_memslot *slot;
+
+    if (!cow->template || gfn >= cow->end_gfn)
+        return NULL;
+    // Since gfn < cow->end_gfn < 2^31 (cf. gpa_space_prot_bitmap_size()), it's
+    // safe to convert it to int.
+    if (hax_test_bit((int)gfn, (uint64_t *)cow->bitmap))
+        return NULL;
+    // Only RAM is shared. ROM contents are provided by user space.
+    slot = memslot_find(gpa_space, gfn);
+    if (!slot || (slot->flags & HAX_MEMSLOT_READONLY))
+        return NULL;
+    slot = memslot_find(cow->template, gfn);
+    if (!slot || (slot->flags & HAX_MEMSLOT_READONLY))
+        return NULL;
+    return slot;
+}
+
+uint64_t gpa_space_get_shared_run(hax_gpa_space *gpa_space, uint64_t gfn,
+                                  uint64_t npages,
+                                  hax_memslot **template_slot)
+{
+    hax_memslot *slot;
+    uint64_t n;
+
+    hax_assert(npages != 0);
+    hax_assert(template_slot != NULL);
+    if (!gpa_space->cow.template) {
+        *template_slot = NULL;
+        return npages;
+    }
+
+    slot = gpa_space_find_shared(gpa_space, gfn);
+    if (slot && slot->base_gfn + slot->npages - gfn < npages) {
+        npages = slot->base_gfn + slot->npages - gfn;
+    }
+    for (n = 1; n < npages; n++) {
+        if (gpa_space_find_shared(gpa_space, gfn + n) != slot)
+            break;
+    }
+    *template_slot = slot;
+    return n;
+}
+
+// Maps the given guest page frame, which must be covered by the given
+// |hax_memslot|, into KVA space. If |alloc| is true, pins the chunk backing it
+// in host RAM if necessary. Returns NULL on error.
+static void * gpa_space_map_slot_page(hax_memslot *slot, uint64_t gfn,
+                                      bool alloc, hax_kmap_user *kmap)
+{
+    hax_ramblock *block = slot->block;
+    hax_chunk *chunk;
+    uint64_t offset_within_block, offset_within_chunk;
+
+    offset_within_block = slot->offset_within_block +
+                          ((gfn - slot->base_gfn) << PG_ORDER_4K);
+    chunk = ramblock_get_chunk(block, offset_within_block, alloc);
+    if (!chunk)
+        return NULL;
+    offset_within_chunk = offset_within_block -
+                          (chunk->base_uva - block->base_uva);
+    return hax_map_user_pages(&chunk->memdesc, offset_within_chunk,
+                              PAGE_SIZE_4K, kmap);
+}
+
+// Copies a shared page of a clone to the clone's own RAM. Must be called with
+// |cow->lock| held.
+// Returns 1 if the page has been unshared, 0 if it was not shared, or -ENOMEM.
+static int gpa_space_unshare_page(hax_gpa_space *gpa_space, uint64_t gfn)
+{
+    hax_gpa_cow *cow = &gpa_space->cow;
+    hax_memslot *template_slot;
+    hax_kmap_user src_kmap, dst_kmap;
+    void *src, *dst;
+
+    template_slot = gpa_space_find_shared(gpa_space, gfn);
+    if (!template_slot) {
+        // Not shared, or already unshared by another thread
+        return 0;
+    }
+
+    // The template's RAM was pinned when it was frozen, and cannot be pinned
+    // from this process anyway
+    src = gpa_space_map_slot_page(template_slot, gfn, false, &src_kmap);
+    if (!src) {
+        hax_log(HAX_LOGE, "%s: Failed to map template page: gfn=0x%llx\n",
+                __func__, gfn);
+        return -ENOMEM;
+    }
+    dst = gpa_space_map_slot_page(memslot_find(gpa_space, gfn), gfn, true,
+                                  &dst_kmap);
+    if (!dst) {
+        hax_log(HAX_LOGE, "%s: Failed to map clone page: gfn=0x%llx\n",
+                __func__, gfn);
+        hax_unmap_user_pages(&src_kmap);
+        return -ENOMEM;
+    }
+    memcpy(dst, src, PAGE_SIZE_4K);
+    hax_unmap_user_pages(&dst_kmap);
+    hax_unmap_user_pages(&src_kmap);
+    hax_test_and_set_bit((int)gfn, (uint64_t *)cow->bitmap);
+    return 1;
+}
+
+int gpa_space_unshare_range(hax_gpa_space *gpa_space, uint64_t start_gfn,
+                            uint64_t npages)
+{
+    hax_gpa_cow *cow = &gpa_space->cow;
+    hax_gpa_space_listener *listener;
+    uint64_t gfn, first_gfn = ~0ULL, last_gfn = 0;
+    int ret = 0;
+
+    if (!cow->template)
+        return 0;
+
+    hax_mutex_lock(cow->lock);
+    for (gfn = start_gfn; gfn < start_gfn + npages; gfn++) {
+        ret = gpa_space_unshare_page(gpa_space, gfn);
+        if (ret < 0)
+            break;
+        if (ret) {
+            if (first_gfn == ~0ULL) {
+                first_gfn = gfn;
+            }
+            last_gfn = gfn;
+        }
+    }
+    if (first_gfn == ~0ULL)
+        goto out;
+
+    // Notifying the listeners once lets them batch their work, e.g. flush
+    // cached EPT translations with a single INVEPT
+    hax_list_entry_for_each(listener, &gpa_space->listener_list,
+                            hax_gpa_space_listener, entry) {
+        if (listener->pages_unshared) {
+            listener->pages_unshared(listener, first_gfn,
+                                     last_gfn - first_gfn + 1);
+        }
+    }
+    if (ret >= 0) {
+        ret = 1;
+    }
+out:
+    hax_mutex_unlock(cow->lock);
+    return ret;
 }
 
 void gpa_space_add_listener(hax_gpa_space *gpa_space,
@@ -127,13 +341,15 @@ void gpa_space_remove_listener(hax_gpa_space *gpa_space,
 // (or write to it if |*writable| is true), with a size equal to the return
 // value. When it is done with the buffer, it must destroy |kmap| by calling
 // hax_unmap_user_pages().
+// In a clone, pages shared with the template are unshared first if |for_write|
+// is true, or else read from the template's RAM.
 static int gpa_space_map_range(hax_gpa_space *gpa_space, uint64_t start_gpa,
                                int len, uint8_t **buf, hax_kmap_user *kmap,
-                               bool *writable)
+                               bool *writable, bool for_write)
 {
     uint64_t gfn;
     uint delta, size, npages;
-    hax_memslot *slot;
+    hax_memslot *slot, *template_slot = NULL;
     hax_ramblock *block;
     uint64_t offset_within_block, offset_within_chunk;
     hax_chunk *chunk;
@@ -171,10 +387,28 @@ static int gpa_space_map_range(hax_gpa_space *gpa_space, uint64_t start_gpa,
         size = npages << PG_ORDER_4K;
     }
 
+    if (gpa_space->cow.template && for_write) {
+        int ret = gpa_space_unshare_range(gpa_space, gfn, npages);
+        if (ret < 0)
+            return ret;
+    } else if (gpa_space->cow.template) {
+        uint64_t run;
+
+        run = gpa_space_get_shared_run(gpa_space, gfn, npages, &template_slot);
+        if (run < npages) {
+            npages = (uint) run;
+            size = npages << PG_ORDER_4K;
+        }
+        if (template_slot) {
+            // Already pinned by the template, in another process
+            slot = template_slot;
+        }
+    }
+
     block = slot->block;
     offset_within_block = ((gfn - slot->base_gfn) << PG_ORDER_4K) +
                           slot->offset_within_block;
-    chunk = ramblock_get_chunk(block, offset_within_block, true);
+    chunk = ramblock_get_chunk(block, offset_within_block, !template_slot);
     if (!chunk) {
         hax_log(HAX_LOGE, "%s: ramblock_get_chunk() failed: start_gpa=0x%llx\n",
                 __func__, start_gpa);
@@ -183,10 +417,11 @@ static int gpa_space_map_range(hax_gpa_space *gpa_space, uint64_t start_gpa,
     offset_within_chunk = offset_within_block - (chunk->base_uva -
                           block->base_uva);
     if (offset_within_chunk + size > chunk->size) {
-        hax_log(HAX_LOGW, "%s: GPA range spans more than one chunk: "
-                "start_gpa=0x%llx, len=%d, offset_within_chunk=0x%llx, "
-                "size=0x%x, chunk_size=0x%llx\n", __func__, start_gpa, len,
-                offset_within_chunk, size, chunk->size);
+        hax_log_ratelimited(HAX_LOGW, "%s: GPA range spans more than one "
+                            "chunk: start_gpa=0x%llx, len=%d, "
+                            "offset_within_chunk=0x%llx, size=0x%x, "
+                            "chunk_size=0x%llx\n", __func__, start_gpa, len,
+                            offset_within_chunk, size, chunk->size);
         size = (uint) (chunk->size - offset_within_chunk);
     }
 
@@ -214,7 +449,8 @@ int gpa_space_read_data(hax_gpa_space *gpa_space, uint64_t start_gpa, int len,
         return -EINVAL;
     }
 
-    ret = gpa_space_map_range(gpa_space, start_gpa, len, &buf, &kmap, NULL);
+    ret = gpa_space_map_range(gpa_space, start_gpa, len, &buf, &kmap, NULL,
+                              false);
     if (ret < 0) {
         hax_log(HAX_LOGE, "%s: gpa_space_map_range() failed: start_gpa=0x%llx,"
                 " len=%d\n", __func__, start_gpa, len);
@@ -254,7 +490,7 @@ int gpa_space_write_data(hax_gpa_space *gpa_space, uint64_t start_gpa, int len,
     }
 
     ret = gpa_space_map_range(gpa_space, start_gpa, len, &buf, &kmap,
-                              &writable);
+                              &writable, true);
     if (ret < 0) {
         hax_log(HAX_LOGE, "%s: gpa_space_map_range() failed: start_gpa=0x%llx,"
                 " len=%d\n", __func__, start_gpa, len);
@@ -286,7 +522,7 @@ int gpa_space_write_data(hax_gpa_space *gpa_space, uint64_t start_gpa, int len,
 }
 
 void * gpa_space_map_page(hax_gpa_space *gpa_space, uint64_t gfn,
-                          hax_kmap_user *kmap, bool *writable)
+                          hax_kmap_user *kmap, bool *writable, bool for_write)
 {
     uint8_t *buf;
     int ret;
@@ -295,7 +531,7 @@ void * gpa_space_map_page(hax_gpa_space *gpa_space, uint64_t gfn,
     hax_assert(gpa_space != NULL);
     hax_assert(kmap != NULL);
     ret = gpa_space_map_range(gpa_space, gfn << PG_ORDER_4K, PAGE_SIZE_4K, &buf,
-                              kmap, writable);
+                              kmap, writable, for_write);
     if (ret < PAGE_SIZE_4K) {
         hax_log(HAX_LOGE, "%s: gpa_space_map_range() returned %d\n",
                 __func__, ret);
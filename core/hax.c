@@ -34,7 +34,10 @@
 
 #include "cpu.h"
 #include "driver.h"
+#include "ept.h"
+#include "ia32.h"
 #include "ia32_defs.h"
+#include "paging.h"
 
 /* deal with module parameter */
 struct config_t config = {
@@ -46,9 +49,115 @@ struct config_t config = {
     .no_cpuid_pass_through       = 1,
     .cpuid_pass_through          = 0,
     .cpuid_no_mwait              = 0,
-    .no_msr_pass_through         = 0
+    .no_msr_pass_through         = 0,
+    .halt_poll_max_cycles        = 200000,
+    .halt_poll_start_cycles      = 10000,
+    .halt_poll_grow              = 2,
+    .halt_poll_shrink            = 2,
+    .ple_gap                     = 128,
+    .ple_window                  = 4096,
+    .persistent_vmcs             = 0,
+    .lazy_host_msrs              = 1
 };
 
+int hax_log_level = HAX_LOG_DEFAULT;
+char hax_log_sites[256];
+// Starts at 1 so that the zero-initialized state of every site is stale
+uint32_t hax_log_generation = 1;
+
+static const char *hax_log_basename(const char *file)
+{
+    const char *base = file;
+
+    for (; *file; file++) {
+        if (*file == '/' || *file == '\\') {
+            base = file + 1;
+        }
+    }
+    return base;
+}
+
+static bool hax_log_site_match(struct hax_log_site *site)
+{
+    const char *base = hax_log_basename(site->file);
+    const char *entry = hax_log_sites;
+
+    while (*entry) {
+        const char *p = entry, *b = base;
+        bool match;
+
+        while (*p && *p != ',' && *p != ':' && *p == *b) {
+            p++;
+            b++;
+        }
+        match = !*b && (!*p || *p == ',' || *p == ':');
+        if (match && *p == ':') {
+            uint32_t line = 0;
+
+            for (p++; *p >= '0' && *p <= '9'; p++) {
+                line = line * 10 + (*p - '0');
+            }
+            match = line == site->line;
+        }
+        if (match)
+            return true;
+        while (*p && *p != ',') {
+            p++;
+        }
+        entry = *p ? p + 1 : p;
+    }
+    return false;
+}
+
+/*
+ * Racing updates of the same site (or of the same rate limit below) are
+ * harmless: each of them stores a consistent result, and at worst a message is
+ * printed or dropped once too often.
+ */
+bool hax_log_site_update(struct hax_log_site *site, int level)
+{
+    uint32_t generation = hax_log_generation;
+    bool enabled;
+
+    enabled = level >= hax_log_level || (hax_log_sites[0] &&
+              hax_log_site_match(site));
+    site->state = (generation << 1) | enabled;
+    return enabled;
+}
+
+bool hax_log_ratelimit_pass(struct hax_log_ratelimit *rl,
+                            struct hax_log_site *site)
+{
+    uint64_t window = ia32_rdtsc() >> HAX_LOG_RATELIMIT_ORDER;
+
+    if (window != rl->window) {
+        if (rl->suppressed) {
+            hax_log_write(HAX_LOGW, "%s:%u: %u messages suppressed\n",
+                          hax_log_basename(site->file), site->line,
+                          rl->suppressed);
+        }
+        rl->window = window;
+        rl->count = 0;
+        rl->suppressed = 0;
+    }
+    if (rl->count < HAX_LOG_RATELIMIT_BURST) {
+        rl->count++;
+        return true;
+    }
+    rl->suppressed++;
+    return false;
+}
+
+void hax_log_settings_changed(void)
+{
+    // |state| only has room for 31 bits of the generation
+    uint32_t generation = (hax_log_generation + 1) & 0x7fffffff;
+
+    hax_log_sites[sizeof(hax_log_sites) - 1] = '\0';
+    hax_log_generation = generation ? generation : 1;
+    hax_smp_mb();
+}
+
 struct hax_page *io_bitmap_page_a;
 struct hax_page *io_bitmap_page_b;
 struct hax_page *msr_bitmap_page;
@@ -273,7 +382,7 @@ static int hax_vmx_enable_check(void)
  * |read| and |write| determine if each MSR can be read or written freely by the
  * guest, respectively.
  */
-static void set_msr_access(uint32_t start, uint32_t count, bool read, bool write)
+void set_msr_access(uint32_t start, uint32_t count, bool read, bool write)
 {
     uint32_t end = start + count - 1;
     uint32_t read_base, write_base, bit;
@@ -335,12 +444,7 @@ static int hax_vmx_init(void)
 
     // Set MSRs loaded on VM entries/exits to pass-through
     // See Intel SDM Vol. 3C 24.6.9 (MSR-Bitmap Address)
-
-    // 4 consecutive MSRs starting from IA32_STAR:
-    // IA32_STAR, IA32_LSTAR, IA32_CSTAR and IA32_SF_MASK
-    set_msr_access(IA32_STAR, 4, true, true);
-    set_msr_access(IA32_KERNEL_GS_BASE, 1, true, true);
-    set_msr_access(IA32_TSC_AUX, 1, true, true);
+    vcpu_msr_init_bitmap();
 
     return 0;
 out_5:
@@ -389,6 +493,17 @@ int hax_set_memlimit(void *buf, int bufLeng, int *outLength)
     return 0;
 }
 
+int hax_set_pin_limit(struct hax_pin_limit *info)
+{
+    hax_mutex_lock(hax->hax_lock);
+    hax->pin_high_water = info->high_water;
+    hax_mutex_unlock(hax->hax_lock);
+    info->pinned = (uint64_t)hax->pinned_pages << PG_ORDER_4K;
+    hax_log(HAX_LOGI, "%s: high_water=0x%llx, pinned=0x%llx\n", __func__,
+            info->high_water, info->pinned);
+    return 0;
+}
+
 int hax_get_capability(void *buf, int bufLeng, int *outLength)
 {
     struct hax_capabilityinfo *cap;
@@ -410,6 +525,22 @@ int hax_get_capability(void *buf, int bufLeng, int *outLength)
         struct per_cpu_data *cpu_data = current_cpu_data();
 
         cap->wstatus = HAX_CAP_STATUS_WORKING;
+        cap->wstatus |= HAX_CAP_REGS_PAGE;
+        cap->wstatus |= HAX_CAP_SNAPSHOT;
+        cap->wstatus |= HAX_CAP_VM_CLONE;
+        // A guest TSC frequency other than the host's can only be emulated
+        // with TSC scaling, and only if the host frequency is known
+        if ((cpu_data->vmx_info.pcpu_ctls_1 & SECONDARY_CONTROLS) &&
+            (cpu_data->vmx_info.scpu_ctls_1 & USE_TSC_SCALING) &&
+            hax->tsc_khz) {
+            cap->wstatus |= HAX_CAP_TSC_SCALING;
+        }
+        // Working set estimation relies on EPT accessed flags
+        if (ept_has_ad_bits()) {
+            cap->wstatus |= HAX_CAP_WORKING_SET;
+            // So does finding cold chunks to unpin
+            cap->wstatus |= HAX_CAP_RAM_RECLAIM;
+        }
         // Fast MMIO supported since API version 2
         cap->winfo = HAX_CAP_FASTMMIO;
         cap->winfo |= HAX_CAP_64BIT_RAMBLOCK;
@@ -419,6 +550,15 @@ int hax_get_capability(void *buf, int bufLeng, int *outLength)
         cap->winfo |= HAX_CAP_RAM_PROTECTION;
         cap->winfo |= HAX_CAP_DEBUG;
         cap->winfo |= HAX_CAP_CPUID;
+        cap->winfo |= HAX_CAP_IOBUF_SIZE;
+        cap->winfo |= HAX_CAP_HALT_POLL;
+        cap->winfo |= HAX_CAP_PLE;
+        // Timer deadlines are enforced with the VMX-preemption timer
+        if (cpu_data->vmx_info.pin_ctls_1 & VMX_TIMER_EXITING) {
+            cap->winfo |= HAX_CAP_TIMER_DEADLINE;
+        }
+        cap->winfo |= HAX_CAP_VCPU_STATS;
+        cap->winfo |= HAX_CAP_VCPU_STATE;
         if (cpu_data->vmx_info._ept_cap) {
             cap->winfo |= HAX_CAP_EPT;
         }
@@ -540,6 +680,44 @@ static void hax_pmu_init(void)
     }
 }
 
+/*
+ * Determines the TSC frequency of the host from CPUID leaf 0x15 (TSC/crystal
+ * clock ratio and crystal frequency), or failing that, from the processor base
+ * frequency in CPUID leaf 0x16. The frequency is left unknown, and TSC scaling
+ * unsupported, on processors that enumerate neither.
+ */
+static void hax_tsc_init(void)
+{
+    cpuid_args_t args;
+    uint32_t max_leaf;
+
+    hax->tsc_khz = 0;
+    cpuid_query_leaf(&args, 0x00);
+    max_leaf = args.eax;
+
+    if (max_leaf >= 0x15) {
+        cpuid_query_leaf(&args, 0x15);
+        // EBX/EAX is the TSC/crystal ratio, ECX is the crystal frequency in Hz
+        if (args.eax && args.ebx && args.ecx) {
+            hax->tsc_khz = (uint32_t)((uint64_t)args.ecx * args.ebx / args.eax
+                                      / 1000);
+        }
+    }
+    // Some processors (e.g. Skylake client) enumerate the TSC/crystal ratio,
+    // but not the crystal frequency. The invariant TSC of these runs at the
+    // processor base frequency, which leaf 0x16 reports in MHz.
+    if (!hax->tsc_khz && max_leaf >= 0x16) {
+        cpuid_query_leaf(&args, 0x16);
+        hax->tsc_khz = (args.eax & 0xffff) * 1000;
+    }
+
+    if (hax->tsc_khz) {
+        hax_log(HAX_LOGI, "TSC: %u kHz\n", hax->tsc_khz);
+    } else {
+        hax_log(HAX_LOGW, "TSC: frequency unknown\n");
+    }
+}
+
 int hax_module_init(void)
 {
     uint32_t cpu_id;
@@ -549,6 +727,8 @@ int hax_module_init(void)
         return -ENOMEM;
 
     hax->mem_quota = hax->mem_limit = hax_get_memory_threshold();
+    hax->pinned_pages = 0;
+    hax->pin_high_water = 0;
     hax->hax_lock = hax_mutex_alloc_init();
     if (!hax->hax_lock)
         goto out_0;
@@ -581,8 +761,11 @@ int hax_module_init(void)
         goto out_2;
 
     hax_pmu_init();
+    hax_tsc_init();
 
     hax_init_list_head(&hax->hax_vmlist);
+    hax->vm_table = NULL;
+    hax->vm_table_size = 0;
     hax_log(HAX_LOGW, "-------- HAXM v%s Start --------\n",
             HAXM_RELEASE_VERSION_STR);
 
@@ -630,6 +813,9 @@ int hax_module_exit(void)
     }
     hax_vfree(hax_cpu_data, cpu_online_map.cpu_num * sizeof(void *));
     cpu_info_exit();
+    if (hax->vm_table) {
+        hax_vfree(hax->vm_table, hax->vm_table_size * sizeof(void *));
+    }
     hax_mutex_free(hax->hax_lock);
     hax_vfree(hax, sizeof(struct hax_t));
     hax_log(HAX_LOGW, "-------- HAXM v%s End --------\n",
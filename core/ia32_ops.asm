@@ -166,6 +166,10 @@ function asm_fls, 1
     bsr reg_ret_32, reg_arg1_32
     ret
 
+function asm_pause, 0
+    pause
+    ret
+
 function asm_cpuid, 1
 %ifidn __BITS__, 64
     push rbx
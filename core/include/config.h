@@ -62,16 +62,68 @@ struct config_t {
      * no_msr_pass_through forces all MSRs to be virtualized.
      */
     int no_msr_pass_through;
+
+    /*
+     * After the guest executes HLT, HAXM may busy-wait for the timer deadline
+     * published by user space in the tunnel to expire, and return
+     * HAX_EXIT_TIMER right away, which is much cheaper than putting the vCPU
+     * thread to sleep and waking it up again if the guest is only idle for a
+     * short while. The poll window of each vCPU, in host TSC cycles, starts at
+     * halt_poll_start_cycles, is multiplied by halt_poll_grow whenever polling
+     * succeeds and divided by halt_poll_shrink whenever it fails, and never
+     * exceeds halt_poll_max_cycles.
+     * halt_poll_max_cycles = 0 disables halt polling.
+     */
+    int halt_poll_max_cycles;
+    int halt_poll_start_cycles;
+    int halt_poll_grow;
+    int halt_poll_shrink;
+
+    /*
+     * PAUSE-loop exiting (PLE) parameters, in TSC cycles (cf. IA SDM Vol. 3C
+     * 25.1.3): a VM exit occurs if the guest executes PAUSE in a loop, with at
+     * most ple_gap cycles between two PAUSEs, for longer than ple_window
+     * cycles. ple_gap = 0 disables PLE.
+     */
+    int ple_gap;
+    int ple_window;
+
+    /*
+     * While a vCPU is in its run loop, keep the host processor in VMX
+     * operation and the VMCS current between VM exits, instead of running
+     * VMCLEAR/VMXOFF after every exit and VMXON/VMPTRLD before every entry.
+     * The VMCS is only cleared when the vCPU thread gets scheduled out, so
+     * this requires host support for preemption notifiers, and has no effect
+     * otherwise. Off by default.
+     */
+    int persistent_vmcs;
+
+    /*
+     * After VM exit, leave the guest values of the SYSCALL MSRs and of
+     * IA32_TSC_AUX in the host processor, which the host kernel does not use,
+     * and only restore the host values when the vCPU thread returns to user
+     * space or gets scheduled out. This also requires host support for
+     * preemption notifiers.
+     */
+    int lazy_host_msrs;
 };
 
-#define HAX_MAX_VCPUS 16
+extern struct config_t config;
 
+/*
+ * Upper bounds for VM and vCPU IDs. The tables indexed by them (see
+ * hax_create_vm() and vcpu_create()) grow on demand, so these only need to
+ * fit the device numbering of each host.
+ */
 #ifdef HAX_PLATFORM_NETBSD
-// TODO: Handle 64 VMs
+// Unit numbers have 3 bits for the VM ID and 4 for the vCPU ID (see
+// vmvcpu2unit())
+#define HAX_MAX_VCPUS 16
 #define HAX_MAX_VMS 8
 #else
-// Matches the number of bits in vm_mid_bits (see vm.c)
-#define HAX_MAX_VMS 64
+// macOS minor numbers have 12 bits for each ID (see hax_get_vcpu_mid())
+#define HAX_MAX_VCPUS 1024
+#define HAX_MAX_VMS 1024
 #endif
 
 #endif  // HAX_CORE_CONFIG_H_
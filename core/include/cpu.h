@@ -103,11 +103,23 @@ struct per_cpu_data {
     struct hax_page    *vmxon_page;
     struct hax_page    *vmcs_page;
     struct vcpu_t      *current_vcpu;
+    // vCPU whose VMCS is kept current between exits (see put_vmcs())
+    struct vcpu_t      *resident_vcpu;
+    // vCPU whose guest MSR values are left in this processor after VM exit
+    // (see load_host_msr())
+    struct vcpu_t      *msr_owner;
+    // vCPU whose FPU state is loaded in this processor (see
+    // vcpu_release_fpu())
+    struct vcpu_t      *fpu_owner;
     hax_paddr_t        other_vmcs;
     uint32_t           cpu_id;
     uint16_t           vmm_flag;
     uint16_t           nested;
     mword              host_cr4_vmxe;
+    // Next VPID to hand out on this processor, and the generation of the
+    // VPIDs handed out since the last flush (see vcpu_vpid_update())
+    uint32_t           vpid_next;
+    uint64_t           vpid_generation;
 
     /*
      * These fields are used to record the result of certain VMX instructions
@@ -198,5 +210,6 @@ extern struct hax_page *io_bitmap_page_a;
 extern struct hax_page *io_bitmap_page_b;
 extern struct hax_page *msr_bitmap_page;
 
-extern struct config_t config;
+void set_msr_access(uint32_t start, uint32_t count, bool read, bool write);
+
 #endif  // HAX_CORE_CPU_H_
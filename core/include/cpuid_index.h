@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2020 Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HAX_CORE_CPUID_INDEX_H_
+#define HAX_CORE_CPUID_INDEX_H_
+
+#include "types.h"
+
+/*
+ * Maps a CPUID leaf to the entries of hax_cpuid_t.features[] that cache it, in
+ * constant time: basic (0000_00xxh) and extended (8000_00xxh) leaves are
+ * direct-mapped, and the few others (e.g. 4000_0000h) are kept in a small
+ * open-addressing hash table.
+ * An index must be zero-initialized before entries are added to it. It has no
+ * dependencies, so that it can be tested in user space.
+ */
+#define CPUID_INDEX_DIRECT_SIZE 0x20
+#define CPUID_INDEX_HASH_SIZE   8
+
+typedef struct cpuid_index_slot_t {
+    // Position of the first entry of the leaf in the features[] array
+    uint8_t first;
+    // Number of entries (i.e. subleaves) of the leaf, 0 if the leaf is unknown
+    uint8_t count;
+} cpuid_index_slot_t;
+
+typedef struct cpuid_index_t {
+    cpuid_index_slot_t basic[CPUID_INDEX_DIRECT_SIZE];
+    cpuid_index_slot_t extended[CPUID_INDEX_DIRECT_SIZE];
+    cpuid_index_slot_t hash[CPUID_INDEX_HASH_SIZE];
+    uint32_t hash_leaves[CPUID_INDEX_HASH_SIZE];
+} cpuid_index_t;
+
+static inline uint32_t cpuid_index_hash(uint32_t leaf)
+{
+    // The leaves outside of the direct-mapped ranges mostly differ in their
+    // high bits (4000_0000h, 4000_0001h, C000_0000h, etc.)
+    return (leaf ^ (leaf >> 16) ^ (leaf >> 28)) & (CPUID_INDEX_HASH_SIZE - 1);
+}
+
+/* Returns the slot of |leaf|, or of the free slot where it can be added */
+static inline cpuid_index_slot_t * cpuid_index_slot(cpuid_index_t *index,
+                                                    uint32_t leaf)
+{
+    uint32_t i, h;
+
+    if (leaf < CPUID_INDEX_DIRECT_SIZE)
+        return &index->basic[leaf];
+    if (leaf - 0x80000000 < CPUID_INDEX_DIRECT_SIZE)
+        return &index->extended[leaf - 0x80000000];
+
+    h = cpuid_index_hash(leaf);
+    for (i = 0; i < CPUID_INDEX_HASH_SIZE; i++) {
+        if (!index->hash[h].count || index->hash_leaves[h] == leaf)
+            return &index->hash[h];
+        h = (h + 1) & (CPUID_INDEX_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Records that features[|position|] caches a subleaf of |leaf|. The entries of
+ * a leaf must be added in order, and be consecutive in features[].
+ * Returns false if the index is full or the entries are out of order.
+ */
+static inline bool cpuid_index_add(cpuid_index_t *index, uint32_t leaf,
+                                   uint8_t position)
+{
+    cpuid_index_slot_t *slot = cpuid_index_slot(index, leaf);
+
+    if (slot == NULL)
+        return false;
+    if (!slot->count) {
+        slot->first = position;
+        if (slot >= index->hash && slot < index->hash + CPUID_INDEX_HASH_SIZE)
+            index->hash_leaves[slot - index->hash] = leaf;
+    } else if (slot->first + slot->count != position) {
+        return false;
+    }
+    slot->count++;
+    return true;
+}
+
+/* Returns the entries of |leaf|, which number 0 if the leaf is unknown */
+static inline cpuid_index_slot_t cpuid_index_find(cpuid_index_t *index,
+                                                  uint32_t leaf)
+{
+    cpuid_index_slot_t *slot = cpuid_index_slot(index, leaf);
+    cpuid_index_slot_t none = {0, 0};
+
+    return slot != NULL ? *slot : none;
+}
+
+#endif  // HAX_CORE_CPUID_INDEX_H_
@@ -40,6 +40,9 @@ struct hax_t {
     int nx_enable_flag;
     int em64t_enable_flag;
     int ug_enable_flag;
+    // TSC frequency of the host in kHz, or 0 if unknown (see
+    // hax_tsc_init())
+    uint32_t tsc_khz;
 
     /*
      * Common architectural performance monitoring (APM) parameters (version ID,
@@ -57,9 +60,18 @@ struct hax_t {
     struct cpu_pmu_info apm_cpuid_0xa;
 
     hax_list_head hax_vmlist;
+    // VMs indexed by VM ID, protected by hax_lock (see hax_get_vm())
+    struct vm_t **vm_table;
+    int vm_table_size;
     hax_mutex hax_lock;
     uint64_t mem_limit;
     uint64_t mem_quota;
+    // Guest RAM pinned by all VMs, in 4KB pages (see ramblock_get_chunk())
+    hax_atomic_t pinned_pages;
+    // Pinned guest RAM in bytes above which reclaim passes unpin cold chunks
+    // regardless of the per-VM budget, or 0 for no limit (see
+    // hax_set_pin_limit())
+    uint64_t pin_high_water;
 };
 
 uint64_t hax_get_memory_threshold(void);
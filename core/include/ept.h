@@ -54,6 +54,7 @@
 #define ept_cap_sp256T          ((uint64_t)1 << 19)
 
 #define ept_cap_invept          ((uint64_t)1 << 20)
+#define ept_cap_AD              ((uint64_t)1 << 21)
 #define ept_cap_invept_ia       ((uint64_t)1 << 24)
 #define ept_cap_invept_cw       ((uint64_t)1 << 25)
 #define ept_cap_invept_ac       ((uint64_t)1 << 26)
@@ -72,7 +73,18 @@
 #define EPT_INVEPT_SINGLE_CONTEXT 1
 #define EPT_INVEPT_ALL_CONTEXT    2
 
+#define VMX_INVVPID_ALL_CONTEXT   2
+
 void invept(hax_vm_t *hax_vm, uint type);
+// Same as invept(), for the EPT tree with the given EPTP
+void invept_eptp(uint64_t eptp_value, uint type);
+// Same as invept_eptp(), but only on the host CPUs set in the given bitmap
+// (indexed by CPU ID), so that the other CPUs need not enter VMX operation
+void invept_eptp_cpus(uint64_t eptp_value, uint type, const uint64_t *cpus);
+bool invvpid_has_all_context(void);
+// Returns true if the host CPU can set accessed and dirty flags in EPT entries
+bool ept_has_ad_bits(void);
+vmx_result_t invvpid_all_context(void);
 bool ept_set_caps(uint64_t caps);
 
 #endif  // HAX_CORE_EPT_H_
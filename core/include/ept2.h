@@ -71,6 +71,10 @@ typedef union hax_epte {
     };
 } hax_epte;
 
+// The accessed and dirty flags of a |hax_epte|, which the CPU sets on its own if
+// |hax_eptp.track_access| is set
+#define HAX_EPT_AD_MASK ((1ULL << 8) | (1ULL << 9))
+
 typedef union hax_eptp {
     uint64_t value;
     struct {
@@ -101,6 +105,9 @@ typedef struct hax_ept_tree {
     hax_eptp eptp;
     hax_ept_page_kmap freq_pages[HAX_EPT_FREQ_PAGE_COUNT];
     bool invept_pending;
+    // Bitmap of the host CPUs on which a vCPU using this tree has been loaded,
+    // i.e. which may cache translations derived from it (see load_vmcs())
+    uint64_t *cpus;
     hax_spinlock *lock;
     // TODO: pointer to vm_t?
 } hax_ept_tree;
@@ -189,6 +196,26 @@ int ept_tree_invalidate_entries(hax_ept_tree *tree, uint64_t start_gfn,
 // Returns an invalid |hax_epte| on error.
 hax_epte ept_tree_get_entry(hax_ept_tree *tree, uint64_t gfn);
 
+// Collects the accessed flags of the leaf |hax_epte|s of the EPT page table (PT)
+// covering the given GFN, i.e. of the 2MB-aligned GFN range that contains it.
+// The CPU sets the accessed flag of a |hax_epte| when it uses the |hax_epte| to
+// translate a GPA, if |tree->eptp.track_access| is set. Also sets the
+// |invept_pending| flag of |tree| (but does not invoke INVEPT) if any accessed
+// flag is cleared; until INVEPT is invoked, cached translations may be used
+// without setting the flags again.
+// |tree|: The |hax_ept_tree| to scan.
+// |gfn|: Any GFN in the 2MB-aligned GFN range to scan.
+// |clear|: Whether to clear the accessed flags that are set.
+// |bitmap|: A buffer of HAX_EPT_TABLE_SIZE bits (i.e. 8 |uint64_t|s) where bit
+//           n is set if the n-th page in the GFN range has been accessed, or
+//           NULL.
+// Returns the number of leaf |hax_epte|s that are present and accessed (always
+// 0 if |tree->eptp.track_access| is not set), or one of the following error
+// codes:
+// -EINVAL: Invalid input, e.g. |tree| is NULL.
+int ept_tree_harvest_accessed(hax_ept_tree *tree, uint64_t gfn, bool clear,
+                              uint64_t *bitmap);
+
 // A visitor callback invoked by ept_tree_walk() on each |hax_epte| visited
 // along the walk.
 // |tree|: The |hax_ept_tree| that |epte| belongs to.
@@ -240,6 +267,25 @@ void ept_handle_mapping_changed(hax_gpa_space_listener *listener,
                                 uint64_t old_uva, uint8_t old_flags,
                                 uint64_t new_uva, uint8_t new_flags);
 
+// Invalidates the PTEs for a GFN range of a clone in which pages have just been
+// unshared, and flushes any mapping of the template's page frames cached by
+// host CPUs.
+void ept_handle_pages_unshared(hax_gpa_space_listener *listener,
+                               uint64_t start_gfn, uint64_t npages);
+
+// Pins the RAM chunk that backs the given GFN, if not already pinned, and
+// creates the PTEs for the whole GFN range that both the chunk and the given
+// |hax_memslot| cover. In a clone, pages in that range that are shared with the
+// template are mapped read-only to the template's page frames instead.
+// |gpa_space|: The |hax_gpa_space| of the guest.
+// |tree|: The |hax_ept_tree| of the guest.
+// |slot|: The |hax_memslot| containing |gfn|.
+// |gfn|: The GFN to map.
+// Returns 1 on success, or one of the following error codes:
+// -ENOMEM: Memory allocation/mapping error.
+int ept_map_chunk(hax_gpa_space *gpa_space, hax_ept_tree *tree,
+                  hax_memslot *slot, uint64_t gfn);
+
 // Handles an EPT violation due to a guest RAM/ROM access.
 // |gpa_space|: The |hax_gpa_space| of the guest.
 // |tree|: The |hax_ept_tree| of the guest.
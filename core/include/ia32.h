@@ -80,6 +80,7 @@ void ASMCALL asm_cpuid(union cpuid_args_t *state);
 
 void ASMCALL __nmi(void);
 uint32_t ASMCALL asm_fls(uint32_t bit32);
+void ASMCALL asm_pause(void);
 
 uint64_t ia32_rdmsr(uint32_t reg);
 void ia32_wrmsr(uint32_t reg, uint64_t val);
@@ -105,6 +105,21 @@ static inline uint64_t fix_dr7(uint64_t val)
     return (val & 0xffffffff) | DR7_SETBITS;
 }
 
+/*
+ * According to SDM Vol 3C 26.3.1.2, VM entry requires CS to be an accessed
+ * code segment, and TR a busy TSS. The segment types provided by QEMU do not
+ * always meet these requirements, e.g. CS may be of type 10 instead of 11.
+ */
+static inline uint32_t fix_cs_ar(uint32_t ar)
+{
+    return (ar & 0xf) == 0xa ? ar | 0x1 : ar;
+}
+
+static inline uint32_t fix_tr_ar(uint32_t ar)
+{
+    return (ar & ~0xf) | 0xb;
+}
+
 enum {
     IA32_P5_MC_ADDR              = 0x0,
     IA32_P5_MC_TYPE              = 0x1,
@@ -49,6 +49,11 @@ int vcpu_get_regs(struct vcpu_t *vcpu, struct vcpu_state_t *vs);
 int vcpu_set_cpuid(struct vcpu_t *vcpu, hax_cpuid *cpuid_info);
 int vcpu_get_cpuid(struct vcpu_t *vcpu, hax_cpuid *cpuid_info);
 void vcpu_debug(struct vcpu_t *vcpu, struct hax_debug_t *debug);
+int vcpu_get_stats(struct vcpu_t *vcpu, struct hax_vcpu_stats *stats);
+int vcpu_get_state(struct vcpu_t *vcpu, struct hax_vcpu_state *state);
+int vcpu_set_state(struct vcpu_t *vcpu, struct hax_vcpu_state *state);
+int vcpu_set_cpu_hint(struct vcpu_t *vcpu, struct hax_vcpu_cpu_hint *hint);
+int vcpu_set_tsc_khz(struct vcpu_t *vcpu, struct hax_tsc_khz *info);
 
 void * get_vcpu_host(struct vcpu_t *vcpu);
 int set_vcpu_host(struct vcpu_t *vcpu, void *vcpu_host);
@@ -56,11 +61,22 @@ int set_vcpu_host(struct vcpu_t *vcpu, void *vcpu_host);
 struct hax_tunnel * get_vcpu_tunnel(struct vcpu_t *vcpu);
 int hax_vcpu_destroy_hax_tunnel(struct vcpu_t *cv);
 int hax_vcpu_setup_hax_tunnel(struct vcpu_t *cv, struct hax_tunnel_info *info);
+int hax_vcpu_setup_trace(struct vcpu_t *cv, struct hax_trace_info *info);
+int hax_vcpu_setup_regs_page(struct vcpu_t *cv,
+                             struct hax_regs_page_info *info);
 int hax_vm_set_ram(struct vm_t *vm, struct hax_set_ram_info *info);
 int hax_vm_set_ram2(struct vm_t *vm, struct hax_set_ram_info2 *info);
 int hax_vm_protect_ram(struct vm_t *vm, struct hax_protect_ram_info *info);
 int hax_vm_free_all_ram(struct vm_t *vm);
 int hax_vm_add_ramblock(struct vm_t *vm, uint64_t start_uva, uint64_t size);
+int hax_vm_snapshot_save(struct vm_t *vm, struct hax_snapshot_io *io);
+int hax_vm_snapshot_restore(struct vm_t *vm, struct hax_snapshot_io *io);
+int hax_vm_freeze(struct vm_t *vm, struct hax_freeze_info *info);
+int hax_vm_unshare_ram(struct vm_t *vm, struct hax_unshare_ram_info *info);
+int hax_vm_ws_scan(struct vm_t *vm, struct hax_ws_scan *info);
+int hax_vm_ws_set_sampler(struct vm_t *vm, struct hax_ws_sampler *info);
+int hax_vm_ws_get_histogram(struct vm_t *vm, struct hax_ws_histogram *info);
+int hax_vm_reclaim_ram(struct vm_t *vm, struct hax_reclaim_ram *info);
 
 void * get_vm_host(struct vm_t *vm);
 int set_vm_host(struct vm_t *vm, void *vm_host);
@@ -74,6 +90,11 @@ int hax_vcpu_core_open(struct vcpu_t *vcpu);
 int vcpu_teardown(struct vcpu_t *vcpu);
 int vcpu_execute(struct vcpu_t *vcpu);
 int vcpu_interrupt(struct vcpu_t *vcpu, uint8_t vector);
+/*
+ * Called by the host, with preemption disabled, when the thread running |vcpu|
+ * is about to be scheduled out (see hax_vcpu_preempt_notify_begin())
+ */
+void vcpu_sched_out(struct vcpu_t *vcpu);
 
 /*
  * Find a vcpu with corresponding id, |refer| decides whether a reference count
@@ -85,13 +106,16 @@ int hax_put_vcpu(struct vcpu_t *vcpu);
 
 int hax_get_capability(void *buf, int bufLeng, int *outLength);
 int hax_set_memlimit(void *buf, int bufLength, int *outLength);
+int hax_set_pin_limit(struct hax_pin_limit *info);
 struct vm_t * hax_get_vm(int vm_id, int refer);
 int hax_vm_core_open(struct vm_t *vm);
+void hax_vm_core_close(struct vm_t *vm);
 /* Corresponding hax_get_vm with refer == 1 */
 int hax_put_vm(struct vm_t *vm);
 int hax_vm_set_qemuversion(struct vm_t *vm, struct hax_qemu_version *ver);
 
 struct vm_t * hax_create_vm(int *vm_id);
+int hax_clone_vm(int template_vm_id, uint64_t token, int *vm_id);
 int hax_teardown_vm(struct vm_t *vm);
 int vcpu_event_pending(struct vcpu_t *vcpu);
 
@@ -43,6 +43,13 @@ typedef struct hax_chunk {
     uint64_t base_uva;
     // In bytes, page-aligned, == HAX_CHUNK_SIZE in most cases
     uint64_t size;
+    // The following are only used by reclaim passes (see hax_vm_reclaim_ram())
+    // Number of passes in a row that found the chunk unaccessed
+    uint8_t idle;
+    // Whether the current pass has found the chunk accessed
+    bool accessed;
+    // Whether the current pass is going to unpin the chunk
+    bool unpin;
 } hax_chunk;
 
 typedef struct hax_ramblock {
@@ -54,6 +61,10 @@ typedef struct hax_ramblock {
     // One bit per chunk indicating whether the chunk has been (or is being)
     // allocated/pinned or not
     uint8_t *chunks_bitmap;
+    // One bit per chunk indicating whether the chunk has ever been pinned.
+    // Unlike |chunks_bitmap|, it is not cleared when a reclaim pass unpins the
+    // chunk, whose RAM may still hold guest data (see ramblock_unpin_chunk()).
+    uint8_t *populated_bitmap;
     // Reference count of this object
     int ref_count;
     // Whether this RAM block is associated with a stand-alone mapping
@@ -95,13 +106,35 @@ typedef struct hax_gpa_prot {
     uint64_t end_gfn;
 } hax_gpa_prot;
 
+typedef struct hax_gpa_cow {
+    // The GPA space of the frozen template VM this GPA space is a clone of, or
+    // NULL if it is not a clone. A guest page frame that maps to RAM in both
+    // GPA spaces is shared with the template (i.e. maps to the template's host
+    // page frame, read-only) until it is unshared.
+    struct hax_gpa_space *template;
+    // A bitmap where each bit represents the sharing status of a guest page
+    // frame: 1 means unshared (i.e. copied to the clone's own RAM), 0 shared,
+    // if the guest page frame is RAM in the template.
+    uint8_t *bitmap;
+    // The first GFN not covered by the bitmap, beyond which no page is shared
+    uint64_t end_gfn;
+    // Serializes unsharing with the creation of EPT entries for shared pages
+    hax_mutex lock;
+} hax_gpa_cow;
+
 typedef struct hax_gpa_space {
-    // TODO: Add a lock to prevent concurrent accesses to |ramblock_list| and
-    // |memslot_list|
+    // Protects |ramblock_list|, |memslot_list| and the protection bitmap, and
+    // serializes the code that changes them (e.g. SET_RAM) with the code that
+    // walks them, or pins, unpins or accesses guest RAM chunks (e.g. EPT
+    // violation handlers, reclaim passes, snapshots, the working set sampler
+    // and gpa_space_read_data()/gpa_space_write_data() callers). Must be taken
+    // after the vCPUs have been stopped (see hax_vm_stop_vcpus()), if at all.
+    hax_mutex lock;
     hax_list_head ramblock_list;
     hax_list_head memslot_list;
     hax_list_head listener_list;
     hax_gpa_prot prot;
+    hax_gpa_cow cow;
 } hax_gpa_space;
 
 typedef struct hax_gpa_space_listener hax_gpa_space_listener;
@@ -116,6 +149,11 @@ struct hax_gpa_space_listener {
     void (*mapping_changed)(hax_gpa_space_listener *listener, uint64_t start_gfn,
                             uint64_t npages, uint64_t old_uva, uint8_t old_flags,
                             uint64_t new_uva, uint8_t new_flags);
+    // For shared RAM => unshared RAM, in a clone (see |hax_gpa_cow|). Called
+    // once per gpa_space_unshare_range() call, for the smallest GFN range that
+    // covers all pages it has unshared.
+    void (*pages_unshared)(hax_gpa_space_listener *listener, uint64_t start_gfn,
+                           uint64_t npages);
     hax_gpa_space *gpa_space;
     // Points to listener-specific data, e.g. a |hax_ept_tree|
     void *opaque;
@@ -182,6 +220,25 @@ int ramblock_add(hax_list_head *list, uint64_t base_uva, uint64_t size,
 hax_chunk * ramblock_get_chunk(hax_ramblock *block, uint64_t uva_offset,
                                bool alloc);
 
+// Unpins the |hax_chunk| at the given offset in the given |hax_ramblock|’s UVA
+// range and frees it, so that the next ramblock_get_chunk() call with |alloc|
+// set to true pins it anew. The caller must make sure no EPT entry maps the
+// chunk any more, and that no other thread is using the chunk or calling
+// ramblock_get_chunk() for it.
+// |block|: The |hax_ramblock| that contains the |hax_chunk|.
+// |uva_offset|: An offset, in bytes, within the UVA range of |block|. The
+//               |hax_chunk| at this offset will be unpinned.
+// Returns 0 on success (including when the |hax_chunk| is not pinned), or one
+// of the following error codes:
+// -EINVAL: Invalid input, e.g. |block| is NULL, or |uva_offset| is invalid.
+// Otherwise, the error code returned by chunk_free().
+int ramblock_unpin_chunk(hax_ramblock *block, uint64_t uva_offset);
+
+// Returns whether the |hax_chunk| at the given offset in the given
+// |hax_ramblock|'s UVA range has been pinned since the RAM block was last
+// reset, even if it has been unpinned by ramblock_unpin_chunk() since.
+bool ramblock_chunk_populated(hax_ramblock *block, uint64_t uva_offset);
+
 // Increments the reference count of an existing RAM block. The reference count
 // of a new RAM block created by ramblock_add() is initialized to 0. Whenever a
 // new reference to a RAM block is made, this function must be called.
@@ -297,9 +354,12 @@ int gpa_space_write_data(hax_gpa_space *gpa_space, uint64_t start_gpa, int len,
 // |writable|: A buffer to store a Boolean value indicating whether the guest
 //             page frame is writable (i.e. maps to RAM). Can be NULL if the
 //             caller only wants to read from the page.
+// |for_write|: Whether the caller may write to the page. In a clone, a page
+//              still shared with the template is unshared first if true, or
+//              else mapped from the template's RAM.
 // Returns NULL on error.
 void * gpa_space_map_page(hax_gpa_space *gpa_space, uint64_t gfn,
-                          hax_kmap_user *kmap, bool *writable);
+                          hax_kmap_user *kmap, bool *writable, bool for_write);
 
 // Destroys the KVA mapping previously created by gpa_space_map_page().
 void gpa_space_unmap_page(hax_gpa_space *gpa_space, hax_kmap_user *kmap);
@@ -328,6 +388,38 @@ bool gpa_space_is_page_protected(struct hax_gpa_space *gpa_space, uint64_t gfn);
 bool gpa_space_is_chunk_protected(struct hax_gpa_space *gpa_space, uint64_t gfn,
                                   uint64_t *fault_gfn);
 
+// Makes the given |hax_gpa_space| a clone of the given template, whose memory
+// mappings must no longer change, and whose RAM must be pinned in host RAM.
+// |gpa_space|: The GPA space of the clone, which must not be a clone already.
+// |template|: The GPA space of the frozen template VM.
+// Returns 0 on success, or one of the following error codes:
+// -EINVAL: Invalid input, e.g. |gpa_space| is already a clone.
+// -ENOMEM: Memory allocation error.
+int gpa_space_set_template(hax_gpa_space *gpa_space, hax_gpa_space *template);
+
+// Finds the longest run of guest page frames, starting at the given GFN, that
+// are either all shared with the template of a clone, or all not shared.
+// |gpa_space|: The GPA space of the guest, which need not be a clone.
+// |gfn|: The first GFN of the run.
+// |npages|: The maximum length of the run. Must not be 0.
+// |template_slot|: A buffer to store a pointer to the template's |hax_memslot|
+//                  covering the whole run if the run is shared, or NULL if it
+//                  is not. Must not be NULL.
+// Returns the length of the run, which is between 1 and |npages|.
+uint64_t gpa_space_get_shared_run(hax_gpa_space *gpa_space, uint64_t gfn,
+                                  uint64_t npages,
+                                  hax_memslot **template_slot);
+
+// Copies the guest page frames of a clone in the given GFN range that are still
+// shared from the template's RAM to the clone's own RAM, and notifies the
+// listeners of the clone's GPA space once for the whole range.
+// Returns 1 if any guest page frame has been unshared, 0 if none was shared, or
+// one of the following error codes:
+// -ENOMEM: Unable to pin or map a guest page frame. The listeners are still
+//          notified of the pages unshared before the failure.
+int gpa_space_unshare_range(hax_gpa_space *gpa_space, uint64_t start_gfn,
+                            uint64_t npages);
+
 // Allocates a |hax_chunk| for the given UVA range, and pins the corresponding
 // host page frames in RAM.
 // |base_uva|: The start of the UVA range. Should be page-aligned.
@@ -66,6 +66,23 @@ struct gstate {
 
 struct per_cpu_data;
 
+/*
+ * Groups of VMCS fields that are read on demand after a VM exit (see
+ * vcpu_vmcs_cache_fetch()), and tracked in vcpu_vmx_data::vmcs_cache_valid.
+ */
+#define VMCS_CACHE_EXIT_QUALIFICATION 0x00000001
+#define VMCS_CACHE_EXIT_INTR_INFO     0x00000002
+#define VMCS_CACHE_EXIT_ERROR_CODE    0x00000004
+#define VMCS_CACHE_EXIT_INSTR_LENGTH  0x00000008
+#define VMCS_CACHE_EXIT_GPA           0x00000010
+// vcpu_state_t::_rsp
+#define VMCS_CACHE_RSP                0x00000020
+// vcpu_state_t::_cs, _ds and _es
+#define VMCS_CACHE_SEGS               0x00000040
+// vcpu_state_t::_cr0, _cr3 and _cr4
+#define VMCS_CACHE_CRS                0x00000080
+#define VMCS_CACHE_ALL                0x000000ff
+
 struct vcpu_vmx_data {
     uint32_t pin_ctls_base;
     uint32_t pcpu_ctls_base;
@@ -97,6 +114,17 @@ struct vcpu_vmx_data {
     interruptibility_state_t interruptibility_state;
 
     uint64_t exit_gpa;
+
+    // VMCS_CACHE_* groups read since the last VM entry
+    uint32_t vmcs_cache_valid;
+
+    // Values last written to the host-state fields of the VMCS, indexed by
+    // VMCS_HOST_SHADOW_SLOT(), and the bitmap of those written at least once
+    uint64_t host_state_shadow[VMCS_NR_HOST_SHADOW_SLOTS];
+    uint64_t host_state_valid;
+    // ID + 1 of the host CPU whose state vcpu_save_host_cpu_state() last
+    // wrote, or 0 if none
+    uint32_t host_cpu_state_of;
 };
 
 /* Information saved by instruction decoder and used by post-MMIO handler */
@@ -138,8 +166,63 @@ struct mmio_fetch_cache {
     int hit_count;
 };
 
+struct vcpu_exit_stats {
+    // Number of exits
+    uint64_t count;
+    // Number of VMREADs from VM entry to the end of exit handling
+    uint64_t vmreads;
+    // Number of exits handled without returning to user space
+    uint64_t resumes;
+    // TSC cycles from VM exit to the next VM entry, for those exits
+    uint64_t resume_cycles;
+    // Number of exits handled on the fast path (see vcpu_fast_vmexit_handler())
+    uint64_t fast;
+    // TSC cycles spent in cpu_vmexit_handler(), for the other exits
+    uint64_t handler_cycles;
+};
+
+// Slots per top talker table (see vcpu_stats_talker())
+#define VCPU_NR_TALKERS 64
+
+struct vcpu_talker {
+    uint64_t key;
+    uint64_t count;
+};
+
+/* See struct hax_vcpu_stats */
+struct vcpu_stats {
+    uint64_t user_exits[HAX_STATS_NR_EXIT_STATUSES];
+    uint64_t handler_hist[HAX_STATS_NR_HIST_BUCKETS];
+    uint64_t guest_hist[HAX_STATS_NR_HIST_BUCKETS];
+    struct vcpu_talker io_ports[VCPU_NR_TALKERS];
+    struct vcpu_talker mmio_pages[VCPU_NR_TALKERS];
+    struct vcpu_talker msrs[VCPU_NR_TALKERS];
+    uint64_t vpid_allocs;
+    uint64_t vpid_flushes;
+    uint64_t vmcs_loads;
+    uint64_t migrations;
+};
+
+static inline void vcpu_stats_hist(uint64_t *hist, uint64_t cycles)
+{
+    uint32_t bucket;
+
+    if (cycles >> 32) {
+        bucket = 32 + asm_fls((uint32_t)(cycles >> 32));
+    } else {
+        bucket = asm_fls((uint32_t)cycles);
+    }
+    hist[min(bucket, HAX_STATS_NR_HIST_BUCKETS - 1)]++;
+}
+
+// Default size of the I/O buffer (see hax_tunnel_info::io_size)
 #define IOS_MAX_BUFFER 64
 
+// Fixed-point format of the TSC multiplier: 16 integer and 48 fraction bits
+// (cf. IA SDM Vol. 3C 25.3)
+#define VCPU_TSC_RATIO_SHIFT 48
+#define VCPU_TSC_RATIO_ONE   (1ULL << VCPU_TSC_RATIO_SHIFT)
+
 struct vcpu_t {
     uint16_t vcpu_id;
     uint32_t cpu_id;
@@ -155,6 +238,10 @@ struct vcpu_t {
      * Reference: SDM, Volume 3, Chapter 4.11.2 & Chapter 28.1.
      */
     uint16_t vpid;
+    // Host CPU and generation that |vpid| belongs to. A generation of 0 means
+    // the vCPU needs a fresh VPID before its next VM entry.
+    uint32_t vpid_cpu;
+    uint64_t vpid_generation;
     uint32_t launched;
     /*
      * This one should co-exist with the is_running and paused,
@@ -171,7 +258,10 @@ struct vcpu_t {
     uint64_t xcr0;
     struct hax_tunnel *tunnel;
     uint8_t *io_buf;
+    uint32_t io_buf_size;
     struct hax_page *vmcs_page;
+    /* The EPTP last written to the VMCS (see load_dirty_vmcs_fields()) */
+    uint64_t eptp;
     void *vcpu_host;
     struct {
         uint64_t paused                          : 1;
@@ -195,11 +285,22 @@ struct vcpu_t {
         uint64_t interruptibility_dirty          : 1;
         uint64_t pcpu_ctls_dirty                 : 1;
         uint64_t pae_pdpt_dirty                  : 1;
-        uint64_t padding                         : 46;
+        /* Keep the VMCS current between exits (see cpu_vmx_execute()) */
+        uint64_t vmcs_keep                       : 1;
+        /* Restore host MSRs lazily (see cpu_vmx_execute()) */
+        uint64_t lazy_host_msrs                  : 1;
+        uint64_t padding                         : 44;
     };
 
     /* For TSC offseting feature*/
     int64_t tsc_offset;
+    /*
+     * For TSC scaling: guest TSC = (host TSC * tsc_ratio >> 48) + tsc_offset.
+     * tsc_inverse_ratio converts guest TSC ticks back to host TSC ticks. Both
+     * are VCPU_TSC_RATIO_ONE unless the guest TSC frequency was set.
+     */
+    uint64_t tsc_ratio;
+    uint64_t tsc_inverse_ratio;
 
     /* vmx control and states */
     struct vcpu_vmx_data vmx;
@@ -221,9 +322,36 @@ struct vcpu_t {
     uint32_t intr_pending[8];
     uint32_t nr_pending_intrs;
 
+    /* Halt polling (see exit_hlt()) */
+    uint64_t halt_poll_cycles;
+    uint64_t halt_poll_success;
+    uint64_t halt_poll_fail;
+
+    // Number of PAUSE-loop exits
+    uint64_t ple_exits;
+    // Whether the vCPU is in guest mode, for siblings looking for a vCPU to
+    // yield to. Unlike |is_running|, may be read by other threads.
+    volatile uint32_t in_guest;
+
+    /* Exit accounting, indexed by basic exit reason (see cpu_vmx_execute()) */
+#define VCPU_NR_EXIT_REASONS (VMX_EXIT_XRSTORS + 1)
+    uint64_t nr_vmreads;
+    struct vcpu_exit_stats exit_stats[VCPU_NR_EXIT_REASONS];
+    struct vcpu_stats stats;
+
     struct gstate gstate;
     struct hax_vcpu_mem *tunnel_vcpumem;
     struct hax_vcpu_mem *iobuf_vcpumem;
+    struct hax_vcpu_mem *trace_vcpumem;
+    struct hax_vcpu_mem *regs_vcpumem;
+    // Trace ring shared with user space, or NULL if tracing is disabled (see
+    // hax_vcpu_setup_trace())
+    struct hax_trace_ring *trace;
+    // Private copy of trace->nr_events - 1, which user space could modify
+    uint32_t trace_mask;
+    // Register page shared with user space, or NULL if not set up (see
+    // hax_vcpu_setup_regs_page())
+    struct hax_regs_page *regs_page;
 
     struct em_context_t emulate_ctxt;
     struct vcpu_post_mmio post_mmio;
@@ -246,10 +374,28 @@ void vcpu_load_guest_state(struct vcpu_t *vcpu);
 void vcpu_save_guest_state(struct vcpu_t *vcpu);
 void vcpu_load_host_state(struct vcpu_t *vcpu);
 void vcpu_save_host_state(struct vcpu_t *vcpu);
+void vcpu_put_guest_msrs(struct vcpu_t *vcpu);
+void vcpu_release_fpu(struct vcpu_t *vcpu);
 
 int vcpu_vmexit_handler(struct vcpu_t *vcpu, exit_reason_t exit_reason,
                         struct hax_tunnel *htun);
+bool vcpu_fast_vmexit_handler(struct vcpu_t *vcpu, exit_reason_t exit_reason,
+                              struct hax_tunnel *htun);
+void vcpu_msr_init_bitmap(void);
+
+void vcpu_trace_event(struct vcpu_t *vcpu, uint16_t type, uint32_t info,
+                      uint64_t tsc, uint64_t qualification, uint64_t address);
+void vcpu_trace_vmexit(struct vcpu_t *vcpu, uint32_t basic_reason,
+                       uint64_t tsc);
+// Records a trace event, but only evaluates the arguments if tracing is
+// enabled, so that it costs a single branch otherwise
+#define vcpu_trace(vcpu, type, info, tsc)                                     \
+    do {                                                                      \
+        if ((vcpu)->trace)                                                    \
+            vcpu_trace_event(vcpu, type, info, tsc, 0, 0);                    \
+    } while (0)
 void vcpu_vmread_all(struct vcpu_t *vcpu);
+void vcpu_vmcs_cache_fetch(struct vcpu_t *vcpu, uint32_t fields);
 void vcpu_vmwrite_all(struct vcpu_t *vcpu);
 
 int vcpu_teardown(struct vcpu_t *vcpu);
@@ -265,11 +411,35 @@ int vcpu_get_xcr(struct vcpu_t *vcpu, uint32_t index, uint64_t *value);
 int vcpu_set_cpuid(struct vcpu_t *vcpu, hax_cpuid *cpuid_info);
 int vcpu_get_cpuid(struct vcpu_t *vcpu, hax_cpuid *cpuid_info);
 void vcpu_debug(struct vcpu_t *vcpu, struct hax_debug_t *debug);
+int vcpu_get_stats(struct vcpu_t *vcpu, struct hax_vcpu_stats *stats);
+int vcpu_get_state(struct vcpu_t *vcpu, struct hax_vcpu_state *state);
+int vcpu_set_state(struct vcpu_t *vcpu, struct hax_vcpu_state *state);
+int vcpu_set_cpu_hint(struct vcpu_t *vcpu, struct hax_vcpu_cpu_hint *hint);
+int vcpu_set_tsc_khz(struct vcpu_t *vcpu, struct hax_tsc_khz *info);
 
 /* The declaration for OS wrapper code */
 int hax_vcpu_destroy_host(struct vcpu_t *cvcpu, void *vcpu_host);
 int hax_vcpu_create_host(struct vcpu_t *cvcpu, void *vm_host, int vm_id,
                          int vcpu_id);
+/*
+ * Yields the processor, preferably to the host thread of the vCPU whose host
+ * data is |target_host| (if not NULL), if the host supports directed yield.
+ */
+void hax_vcpu_yield(struct vcpu_t *cvcpu, void *target_host);
+/*
+ * Asks the host scheduler to prefer running the current thread, which runs
+ * |cvcpu|, on host CPU |cpu_id|, or to drop the preference if |cpu_id| is -1.
+ * Returns 0 on success, or -ENOSYS if the host does not support it.
+ */
+int hax_vcpu_set_cpu_hint(struct vcpu_t *cvcpu, void *vcpu_host, int cpu_id);
+/*
+ * Asks the host to call vcpu_sched_out() whenever the current thread, which
+ * runs |cvcpu|, is about to be scheduled out, until
+ * hax_vcpu_preempt_notify_end() is called.
+ * Returns 0 on success, or -ENOSYS if the host does not support it.
+ */
+int hax_vcpu_preempt_notify_begin(struct vcpu_t *cvcpu, void *vcpu_host);
+void hax_vcpu_preempt_notify_end(struct vcpu_t *cvcpu, void *vcpu_host);
 
 int hax_vm_destroy_host(struct vm_t *vm, void *vm_host);
 int hax_vm_create_host(struct vm_t *cvm, int vm_id);
@@ -281,7 +451,7 @@ int vcpu_takeoff(struct vcpu_t *vcpu);
 void *vcpu_vmcs_va(struct vcpu_t *vcpu);
 hax_paddr_t vcpu_vmcs_pa(struct vcpu_t *vcpu);
 int set_vcpu_tunnel(struct vcpu_t *vcpu, struct hax_tunnel *tunnel,
-                    uint8_t *iobuf);
+                    uint8_t *iobuf, uint32_t iobuf_size);
 
 static inline bool valid_vcpu_id(int vcpu_id)
 {
@@ -292,5 +462,7 @@ static inline bool valid_vcpu_id(int vcpu_id)
 
 bool vcpu_is_panic(struct vcpu_t *vcpu);
 void vcpu_set_panic(struct vcpu_t *vcpu);
+void vcpu_arm_preemption_timer(struct vcpu_t *vcpu, struct hax_tunnel *htun);
+void vcpu_vpid_update(struct vcpu_t *vcpu);
 
 #endif  // HAX_CORE_VCPU_H_
@@ -49,28 +49,64 @@ struct hax_p2m_entry {
 
 #define VM_SPARE_RAMSIZE       0x5800000
 
+// State of the working set sampler (see hax_vm_ws_set_sampler())
+typedef struct hax_ws_state {
+    // Number of samples each guest page frame below |end_gfn| has gone without
+    // being accessed, saturating at 255
+    uint8_t *ages;
+    uint64_t end_gfn;
+    uint64_t nr_samples;
+    // Nanoseconds between two samples, or 0 if the sampler is off
+    uint64_t interval;
+    // Host uptime (see hax_get_uptime_ns()) from which the next sample, or the
+    // next slice of the sample in progress, is due (see ws_sample())
+    volatile uint64_t next_time;
+    // GFN from which the sample in progress resumes, or 0 if none is
+    uint64_t next_gfn;
+    hax_mutex lock;
+} hax_ws_state;
+
 struct vm_t {
     hax_mutex vm_lock;
     hax_atomic_t ref_count;
 #define VM_STATE_FLAGS_OPENED      0x1
 #define VM_STATE_FLAGS_MEM_ALLOC   0x2
+// RAM and memory mappings are frozen (see hax_vm_freeze())
+#define VM_STATE_FLAGS_FROZEN      0x4
+// vCPUs are kept from running (see hax_vm_stop_vcpus())
+#define VM_STATE_FLAGS_STOPPED     0x8
     uint64_t flags;
 #define VM_FEATURES_FASTMMIO_BASIC 0x1
 #define VM_FEATURES_FASTMMIO_EXTRA 0x2
+#define VM_FEATURES_IOBUF_SIZE     0x4
     uint32_t features;
     int vm_id;
-#define VPID_SEED_BITS 64
-    uint8_t vpid_seed[VPID_SEED_BITS / 8];
     int fd;
     hax_list_head hvm_list;
     hax_list_head vcpu_list;
+    // vCPUs indexed by vCPU ID, protected by vm_lock (see hax_get_vcpu())
+    struct vcpu_t **vcpu_table;
+    int vcpu_table_size;
     uint16_t bsp_vcpu_id;
+    // ID of the vCPU last yielded to on a PAUSE-loop exit
+    int ple_last_target;
+    // Host TSC value before which PAUSE-loop exits do not look for a vCPU to
+    // yield to again (see vcpu_pick_yield_target())
+    volatile uint64_t ple_next_scan;
     uint64_t valid_xcr0;
     void *vm_host;
     void *p2m_map[MAX_GMEM_G];
     hax_gpa_space gpa_space;
     hax_ept_tree ept_tree;
     hax_gpa_space_listener gpa_space_listener;
+    // The frozen VM this VM is a clone of (see hax_clone_vm()), referenced
+    // until this VM is torn down, or NULL
+    struct vm_t *template_vm;
+    // Secret that HAX_IOCTL_CLONE_VM must be given to clone this VM (see
+    // hax_vm_freeze()), or 0 if this VM is not frozen or has been closed.
+    // Protected by vm_lock.
+    uint64_t clone_token;
+    hax_ws_state ws;
 #ifdef HAX_ARCH_X86_32
     uint64_t hva_limit;
     uint64_t hva_index;
@@ -104,7 +140,8 @@ enum exit_status {
     HAX_EXIT_PAUSED,
     HAX_EXIT_FAST_MMIO,
     HAX_EXIT_PAGEFAULT,
-    HAX_EXIT_DEBUG
+    HAX_EXIT_DEBUG,
+    HAX_EXIT_TIMER
 };
 
 enum run_flag {
@@ -119,12 +156,21 @@ enum run_flag {
 uint64_t hax_gpfn_to_hpa(struct vm_t *vm, uint64_t gpfn);
 
 struct vm_t *hax_create_vm(int *vm_id);
+int hax_clone_vm(int template_vm_id, uint64_t token, int *vm_id);
 int hax_teardown_vm(struct vm_t *vm);
 
 int _hax_teardown_vm(struct vm_t *vm);
 void hax_teardown_vcpus(struct vm_t *vm);
 int hax_destroy_host_interface(void);
 int hax_vm_set_qemuversion(struct vm_t *vm, struct hax_qemu_version *ver);
+// Stops all the vCPUs of the given VM and keeps them stopped until
+// hax_vm_resume_vcpus() is called. Returns -EBUSY if they are already stopped.
+int hax_vm_stop_vcpus(struct vm_t *vm);
+void hax_vm_resume_vcpus(struct vm_t *vm);
+// Takes a working set sample if the sampler is on and a sample is due. Called
+// by vCPU threads, outside guest mode.
+void hax_vm_ws_tick(struct vm_t *vm);
+int hax_table_reserve(void ***table, int *size, int index, int max_size);
 
 uint64_t vm_get_eptp(struct vm_t *vm);
 
@@ -118,6 +118,8 @@ enum component_index_t {
     VMX_ENTRY_EXCEPTION_ERROR_CODE              = 0x00004018,
     VMX_ENTRY_INSTRUCTION_LENGTH                = 0x0000401a,
     VMX_TPR_THRESHOLD                           = 0x0000401c,
+    VMX_PLE_GAP                                 = 0x00004020,
+    VMX_PLE_WINDOW                              = 0x00004022,
 
     VMX_CR0_MASK                                = 0x00006000,
     VMX_CR4_MASK                                = 0x00006002,
@@ -137,6 +139,7 @@ enum component_index_t {
     VMX_VAPIC_PAGE                              = 0x00002012,
     VMX_APIC_ACCESS_PAGE                        = 0x00002014,
     VMX_EPTP                                    = 0x0000201a,
+    VMX_TSC_MULTIPLIER                          = 0x00002032,
     VMX_PREEMPTION_TIMER                        = 0x0000482e,
 
     VMX_INSTRUCTION_ERROR_CODE                  = 0x00004400,
@@ -298,7 +301,8 @@ typedef enum component_index_t component_index_t;
 #define UNRESTRICTED_GUEST                     0x00000080
 #define PAUSE_LOOP_EXITING                     0x00000400
 #define ENABLE_INVPCID                         0x00001000
-#define SECONDARY_CONTROLS_DEFINED             0x000014ff
+#define USE_TSC_SCALING                        0x02000000
+#define SECONDARY_CONTROLS_DEFINED             0x020014ff
 
 // Exit Controls
 #define EXIT_CONTROL_SAVE_DEBUG_CONTROLS       0x00000004
@@ -635,11 +639,28 @@ typedef enum encode_t encode_t;
 #define ENCODE_MASK    0x3
 #define ENCODE_SHIFT    13
 
+// Intel SDM Vol. 3D: Table B-*: the encoding of a VMCS component also tells
+// its width and whether it belongs to the host-state area
+#define VMCS_FIELD_WIDTH(component) \
+        (((component) >> ENCODE_SHIFT) & ENCODE_MASK)
+#define VMCS_FIELD_IS_HOST_STATE(component) ((((component) >> 10) & 0x3) == 3)
+
+// Index of a host-state field in vcpu_vmx_data::host_state_shadow
+#define VMCS_HOST_SHADOW_SLOT(component) \
+        (VMCS_FIELD_WIDTH(component) << 4 | (((component) >> 1) & 0xf))
+#define VMCS_NR_HOST_SHADOW_SLOTS 64
+
 struct invept_desc {
     uint64_t eptp;
     uint64_t rsvd;
 };
 
+// Intel SDM Vol. 3C: Figure 30-2. INVVPID Descriptor
+struct invvpid_desc {
+    uint64_t vpid;
+    uint64_t gla;
+};
+
 // Intel SDM Vol. 3C: Table 24-12. Format of an MSR Entry
 typedef struct ALIGNED(16) vmx_msr_entry {
     uint64_t index;
@@ -650,6 +671,7 @@ struct vcpu_state_t;
 struct vcpu_t;
 
 vmx_result_t ASMCALL asm_invept(uint type, struct invept_desc *desc);
+vmx_result_t ASMCALL asm_invvpid(uint type, struct invvpid_desc *desc);
 vmx_result_t ASMCALL asm_vmclear(const hax_paddr_t *addr_in);
 vmx_result_t ASMCALL asm_vmptrld(const hax_paddr_t *addr_in);
 vmx_result_t ASMCALL asm_vmxon(const hax_paddr_t *addr_in);
@@ -666,8 +688,23 @@ uint64_t vmread(struct vcpu_t *vcpu, component_index_t component);
 uint64_t vmread_dump(struct vcpu_t *vcpu, unsigned enc, const char *name);
 void vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
                  component_index_t component, uint64_t source_val);
+void vmx_vmwrite_32(struct vcpu_t *vcpu, const char *name,
+                    component_index_t component, uint64_t source_val);
+void vmx_vmwrite_64(struct vcpu_t *vcpu, const char *name,
+                    component_index_t component, uint64_t source_val);
+void vmx_vmwrite_natural(struct vcpu_t *vcpu, const char *name,
+                         component_index_t component, uint64_t source_val);
 
-#define vmwrite(vcpu, x, y) vmx_vmwrite(vcpu, #x, x, y)
+/*
+ * The component is almost always a constant, in which case the compiler picks
+ * the accessor for its width, and vmx_vmwrite() does not have to decode it.
+ */
+#define vmwrite(vcpu, x, y)                                               \
+        (VMCS_FIELD_WIDTH(x) == ENCODE_64                                 \
+         ? vmx_vmwrite_64(vcpu, #x, x, y)                                 \
+         : VMCS_FIELD_WIDTH(x) == ENCODE_NATURAL                          \
+           ? vmx_vmwrite_natural(vcpu, #x, x, y)                          \
+           : vmx_vmwrite_32(vcpu, #x, x, y))
 
 #define VMREAD_SEG(vcpu, seg, val)                                 \
     do {                                                           \
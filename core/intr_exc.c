@@ -101,6 +101,7 @@ static void hax_inject_intr(struct vcpu_t *vcpu, uint8_t vector)
     uint32_t intr_info;
     intr_info = (1 << 31) | vector;
     vmwrite(vcpu, VMX_ENTRY_INTERRUPT_INFO, intr_info);
+    vcpu_trace(vcpu, HAX_TRACE_INJECT, intr_info, ia32_rdtsc());
     vcpu_ack_intr(vcpu, vector);
     vcpu->event_injected = 1;
 }
@@ -142,7 +143,7 @@ uint hax_intr_is_blocked(struct vcpu_t *vcpu)
 void hax_handle_idt_vectoring(struct vcpu_t *vcpu)
 {
     uint8_t vector;
-    uint32_t idt_vec = vmread(vcpu, VM_EXIT_INFO_IDT_VECTORING);
+    uint32_t idt_vec = vmx(vcpu, exit_idt_vectoring);
 
     if (idt_vec & 0x80000000) {
         if (!(idt_vec & 0x700)) {
@@ -204,7 +205,10 @@ void hax_inject_exception(struct vcpu_t *vcpu, uint8_t vector, uint32_t error_co
     uint32_t intr_info = 0;
     uint8_t first_vec;
     uint32_t vect_info = vmx(vcpu, exit_idt_vectoring);
-    uint32_t exit_instr_length = vmx(vcpu, exit_instr_length);
+    uint32_t exit_instr_length;
+
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_INSTR_LENGTH);
+    exit_instr_length = vmx(vcpu, exit_instr_length);
 
     if (vcpu->event_injected == 1)
         hax_log(HAX_LOGD, "Event is injected already!!:\n");
@@ -242,6 +246,7 @@ void hax_inject_exception(struct vcpu_t *vcpu, uint8_t vector, uint32_t error_co
         vmwrite(vcpu, VMX_ENTRY_INTERRUPT_INFO, intr_info);
     }
 
+    vcpu_trace(vcpu, HAX_TRACE_INJECT, intr_info, ia32_rdtsc());
     hax_log(HAX_LOGD, "Guest is injecting exception info:%x\n", intr_info);
     vcpu->event_injected = 1;
 }
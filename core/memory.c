@@ -32,10 +32,16 @@
 
 #include "driver.h"
 #include "ept.h"
+#include "ia32.h"
+#include "interface.h"
 #include "paging.h"
 #include "vcpu.h"
 #include "vm.h"
 
+// Number of EPT leaf tables (2MB of guest RAM each) the working set sampler
+// harvests per vCPU tick (see ws_sample())
+#define WS_SAMPLE_MAX_REGIONS 64
+
 static int handle_alloc_ram(struct vm_t *vm, uint64_t start_uva, uint64_t size)
 {
     int ret;
@@ -63,7 +69,13 @@ static int handle_alloc_ram(struct vm_t *vm, uint64_t start_uva, uint64_t size)
 
 int hax_vm_add_ramblock(struct vm_t *vm, uint64_t start_uva, uint64_t size)
 {
-    return handle_alloc_ram(vm, start_uva, size);
+    int ret;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    ret = hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags) ? -EBUSY
+          : handle_alloc_ram(vm, start_uva, size);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    return ret;
 }
 
 int hax_vm_free_all_ram(struct vm_t *vm)
@@ -123,6 +135,12 @@ static int handle_set_ram(struct vm_t *vm, uint64_t start_gpa, uint64_t size,
     }
 
     hax_assert(vm != NULL);
+    // Must be called with |gpa_space->lock| held, so that the VM cannot be
+    // frozen in the meantime
+    if (hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags)) {
+        hax_log(HAX_LOGE, "%s: VM #%d is frozen\n", __func__, vm->vm_id);
+        return -EBUSY;
+    }
     gpa_space = &vm->gpa_space;
     start_gfn = start_gpa >> PG_ORDER_4K;
     npages = size >> PG_ORDER_4K;
@@ -156,33 +174,664 @@ static int handle_set_ram(struct vm_t *vm, uint64_t start_gpa, uint64_t size,
 
 int hax_vm_set_ram(struct vm_t *vm, struct hax_set_ram_info *info)
 {
-    return handle_set_ram(vm, info->pa_start, info->size, info->va,
-                          info->flags);
+    int ret;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    ret = handle_set_ram(vm, info->pa_start, info->size, info->va,
+                         info->flags);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    return ret;
 }
 
 int hax_vm_set_ram2(struct vm_t *vm, struct hax_set_ram_info2 *info)
 {
-    return handle_set_ram(vm, info->pa_start, info->size, info->va,
-                          info->flags);
+    int ret;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    ret = handle_set_ram(vm, info->pa_start, info->size, info->va,
+                         info->flags);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    return ret;
 }
 
 int hax_vm_protect_ram(struct vm_t *vm, struct hax_protect_ram_info *info)
 {
-    return gpa_space_protect_range(&vm->gpa_space, info->pa_start, info->size,
-                                   info->flags);
+    int ret;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    ret = hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags) ? -EBUSY
+          : gpa_space_protect_range(&vm->gpa_space, info->pa_start,
+                                    info->size, info->flags);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    return ret;
+}
+
+int hax_vm_freeze(struct vm_t *vm, struct hax_freeze_info *info)
+{
+    hax_memslot *slot;
+    uint64_t token;
+    int ret;
+
+    if (hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags)) {
+        hax_mutex_lock(vm->vm_lock);
+        info->token = vm->clone_token;
+        hax_mutex_unlock(vm->vm_lock);
+        return 0;
+    }
+
+    // The token keeps processes the owner has not handed it to from cloning
+    // the VM, and thus from reading its RAM. 0 means the VM cannot be cloned.
+    do {
+        ret = hax_get_random_bytes(&token, sizeof(token));
+        if (ret)
+            return ret;
+    } while (!token);
+
+    // A vCPU in guest mode may still be dirtying RAM
+    ret = hax_vm_stop_vcpus(vm);
+    if (ret)
+        return ret;
+    // Keeps the RAM mappings from changing until the VM is frozen
+    hax_mutex_lock(vm->gpa_space.lock);
+    if (hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags)) {
+        // Frozen by another thread in the meantime
+        ret = 0;
+        goto out;
+    }
+
+    // Clones may run in other processes, which cannot pin the template's RAM
+    // on demand, so pin all of it now
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        hax_ramblock *block = slot->block;
+        uint64_t offset = slot->offset_within_block;
+        uint64_t end = offset + (slot->npages << PG_ORDER_4K);
+
+        if (slot->flags & HAX_MEMSLOT_READONLY)
+            continue;
+        while (offset < end) {
+            if (!ramblock_get_chunk(block, offset, true)) {
+                hax_log(HAX_LOGE, "%s: Failed to pin chunk: base_gfn=0x%llx,"
+                        " offset=0x%llx\n", __func__, slot->base_gfn, offset);
+                ret = -ENOMEM;
+                goto out;
+            }
+            offset = (offset & ~((uint64_t)HAX_CHUNK_SIZE - 1)) +
+                     HAX_CHUNK_SIZE;
+        }
+    }
+
+    hax_mutex_lock(vm->vm_lock);
+    vm->clone_token = token;
+    hax_mutex_unlock(vm->vm_lock);
+    hax_test_and_set_bit(VM_STATE_FLAGS_FROZEN, &vm->flags);
+    hax_log(HAX_LOGI, "%s: VM #%d is frozen\n", __func__, vm->vm_id);
+out:
+    hax_mutex_unlock(vm->gpa_space.lock);
+    hax_vm_resume_vcpus(vm);
+    if (!ret) {
+        hax_mutex_lock(vm->vm_lock);
+        info->token = vm->clone_token;
+        hax_mutex_unlock(vm->vm_lock);
+    }
+    return ret;
+}
+
+int hax_vm_unshare_ram(struct vm_t *vm, struct hax_unshare_ram_info *info)
+{
+    uint64_t start_gfn, end_gfn;
+    int ret;
+
+    if (!info->size || info->pa_start + info->size < info->pa_start) {
+        hax_log(HAX_LOGE, "%s: Invalid range: pa_start=0x%llx, size=0x%llx\n",
+                __func__, info->pa_start, info->size);
+        return -EINVAL;
+    }
+    if (!vm->template_vm)
+        return 0;
+
+    start_gfn = info->pa_start >> PG_ORDER_4K;
+    end_gfn = (info->pa_start + info->size + PAGE_SIZE_4K - 1) >> PG_ORDER_4K;
+    hax_mutex_lock(vm->gpa_space.lock);
+    ret = gpa_space_unshare_range(&vm->gpa_space, start_gfn,
+                                  end_gfn - start_gfn);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    if (ret < 0) {
+        hax_log(HAX_LOGE, "%s: Failed to unshare range: pa_start=0x%llx, "
+                "size=0x%llx, ret=%d\n", __func__, info->pa_start, info->size,
+                ret);
+        return ret;
+    }
+    return 0;
+}
+
+// Invokes INVEPT if accessed flags have been cleared, so that the CPU sets them
+// again on the next access instead of using cached translations
+static void ws_flush(struct vm_t *vm)
+{
+    hax_ept_tree *ept_tree = &vm->ept_tree;
+
+    if (!hax_test_and_clear_bit(0, (uint64_t *)&ept_tree->invept_pending)) {
+        // INVEPT pending flag was set
+        invept(vm, EPT_INVEPT_SINGLE_CONTEXT);
+    }
+}
+
+// Turns on EPT accessed and dirty flags for the given VM, which is only done
+// the first time working set estimation or RAM reclaim needs them, so that the
+// guest accesses of other VMs do not pay for the CPU setting them.
+// Returns 1 if they have just been turned on, 0 if they already were, or one
+// of the following error codes:
+// -ENOSYS: The host CPU does not support them.
+// -EBUSY: The vCPUs of the VM are already stopped by another thread.
+static int ws_enable_tracking(struct vm_t *vm)
+{
+    hax_ept_tree *tree = &vm->ept_tree;
+    int ret;
+
+    if (tree->eptp.track_access)
+        return 0;
+    if (!ept_has_ad_bits())
+        return -ENOSYS;
+    // The vCPUs pick up the new EPTP on their next VM entry (see
+    // load_dirty_vmcs_fields())
+    ret = hax_vm_stop_vcpus(vm);
+    if (ret)
+        return ret;
+    if (!tree->eptp.track_access) {
+        tree->eptp.track_access = 1;
+        // Translations cached until now would not set the accessed flags
+        invept(vm, EPT_INVEPT_SINGLE_CONTEXT);
+        ret = 1;
+        hax_log(HAX_LOGI, "%s: VM #%d: eptp=0x%llx\n", __func__, vm->vm_id,
+                tree->eptp.value);
+    }
+    hax_vm_resume_vcpus(vm);
+    return ret;
+}
+
+int hax_vm_ws_scan(struct vm_t *vm, struct hax_ws_scan *info)
+{
+    bool clear = !(info->flags & HAX_WS_SCAN_KEEP);
+    uint64_t gfn;
+    uint32_t i;
+    int ret;
+
+    if ((info->pa_start & (HAX_WS_REGION_SIZE - 1)) || !info->nr_regions ||
+        info->nr_regions > HAX_WS_SCAN_MAX_REGIONS ||
+        (info->flags & ~HAX_WS_SCAN_KEEP)) {
+        hax_log(HAX_LOGE, "%s: Invalid input: pa_start=0x%llx, nr_regions=%u,"
+                " flags=0x%x\n", __func__, info->pa_start, info->nr_regions,
+                info->flags);
+        return -EINVAL;
+    }
+    ret = ws_enable_tracking(vm);
+    if (ret < 0)
+        return ret;
+
+    memset(info->counts, 0, sizeof(info->counts));
+    info->nr_accessed = 0;
+    gfn = info->pa_start >> PG_ORDER_4K;
+    for (i = 0; i < info->nr_regions; i++) {
+        ret = ept_tree_harvest_accessed(&vm->ept_tree, gfn, clear, NULL);
+        if (ret < 0)
+            break;
+        info->counts[i] = (uint16_t)ret;
+        info->nr_accessed += ret;
+        gfn += HAX_WS_REGION_SIZE >> PG_ORDER_4K;
+    }
+    ws_flush(vm);
+    return ret < 0 ? ret : 0;
+}
+
+// Makes sure |ws->ages| covers all RAM mappings. Must be called with
+// |gpa_space.lock| and |ws->lock| held.
+static int ws_resize_ages(struct vm_t *vm)
+{
+    hax_ws_state *ws = &vm->ws;
+    hax_memslot *slot;
+    uint64_t end_gfn = 0;
+    uint8_t *ages;
+
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        if (!(slot->flags & HAX_MEMSLOT_READONLY) &&
+            slot->base_gfn + slot->npages > end_gfn) {
+            end_gfn = slot->base_gfn + slot->npages;
+        }
+    }
+    if (end_gfn <= ws->end_gfn)
+        return 0;
+
+    ages = (uint8_t *)hax_vmalloc(end_gfn, 0);
+    if (!ages) {
+        hax_log(HAX_LOGE, "%s: Failed to allocate idle ages: end_gfn=0x%llx\n",
+                __func__, end_gfn);
+        return -ENOMEM;
+    }
+    // Pages not covered until now start out as just accessed
+    memset(ages + ws->end_gfn, 0, end_gfn - ws->end_gfn);
+    if (ws->ages) {
+        memcpy(ages, ws->ages, ws->end_gfn);
+        hax_vfree(ws->ages, ws->end_gfn);
+    }
+    ws->ages = ages;
+    ws->end_gfn = end_gfn;
+    return 0;
+}
+
+// Harvests the accessed flags of guest RAM, and of ROM too if |rom| is true,
+// from |start_gfn| on, in at most |max_regions| EPT leaf tables. Resets the
+// idle age of each accessed page if the sampler is on, and ages the other pages
+// if |age| is true. Also marks the chunks backing accessed pages, so that
+// accesses seen by the sampler count for hax_vm_reclaim_ram() as well.
+// Returns the GFN to resume from, or ~0ULL if the end of guest RAM has been
+// reached. Must be called with |gpa_space.lock| and |ws->lock| held, in that
+// order.
+static uint64_t ws_harvest(struct vm_t *vm, bool age, bool rom,
+                           uint64_t start_gfn, uint max_regions)
+{
+    hax_ws_state *ws = &vm->ws;
+    hax_memslot *slot;
+    uint64_t bitmap[HAX_EPT_TABLE_SIZE / 64];
+    uint64_t region = ~0ULL;
+    uint nr_regions = 0;
+
+    // The memslot list is sorted by GFN, so memslots sharing a region are
+    // visited one after another and the region is only harvested once
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        bool is_rom = slot->flags & HAX_MEMSLOT_READONLY;
+        uint64_t gfn, end_gfn = slot->base_gfn + slot->npages;
+
+        if ((is_rom && !rom) || end_gfn <= start_gfn)
+            continue;
+        gfn = slot->base_gfn > start_gfn ? slot->base_gfn : start_gfn;
+        for (; gfn < end_gfn; gfn++) {
+            uint i = (uint)(gfn & (HAX_EPT_TABLE_SIZE - 1));
+            bool accessed;
+
+            if (gfn >> HAX_EPT_TABLE_SHIFT != region) {
+                // Only stop where no page of the region has been seen yet
+                if (nr_regions++ == max_regions)
+                    return gfn;
+                region = gfn >> HAX_EPT_TABLE_SHIFT;
+                if (ept_tree_harvest_accessed(&vm->ept_tree, gfn, true,
+                                              bitmap) < 0) {
+                    memset(bitmap, 0, sizeof(bitmap));
+                }
+            }
+            accessed = bitmap[i / 64] & (1ULL << (i % 64));
+            if (!is_rom && gfn < ws->end_gfn) {
+                if (accessed) {
+                    ws->ages[gfn] = 0;
+                } else if (age && ws->ages[gfn] < 0xff) {
+                    ws->ages[gfn]++;
+                }
+            }
+            if (accessed) {
+                hax_chunk *chunk;
+
+                chunk = ramblock_get_chunk(slot->block,
+                                           slot->offset_within_block +
+                                           ((gfn - slot->base_gfn) <<
+                                            PG_ORDER_4K), false);
+                if (chunk) {
+                    chunk->accessed = true;
+                }
+            }
+        }
+    }
+    return ~0ULL;
+}
+
+// Takes the next slice of the sample in progress, or starts a new sample.
+// The sample is spread over as many vCPU ticks as it takes to go through
+// guest RAM WS_SAMPLE_MAX_REGIONS EPT leaf tables at a time, so that a single
+// VM exit does not pay for harvesting all of guest RAM.
+static void ws_sample(struct vm_t *vm)
+{
+    hax_ws_state *ws = &vm->ws;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    hax_mutex_lock(ws->lock);
+    // The sampler may have been turned off in the meantime
+    if (!ws->interval)
+        goto out;
+    if (!ws->next_gfn && ws_resize_ages(vm)) {
+        ws->next_time = hax_get_uptime_ns() + ws->interval;
+        goto out;
+    }
+
+    ws->next_gfn = ws_harvest(vm, true, false, ws->next_gfn,
+                              WS_SAMPLE_MAX_REGIONS);
+    ws_flush(vm);
+    if (ws->next_gfn == ~0ULL) {
+        ws->next_gfn = 0;
+        ws->nr_samples++;
+        ws->next_time = hax_get_uptime_ns() + ws->interval;
+    } else {
+        // The next tick continues the sample
+        ws->next_time = 0;
+    }
+out:
+    hax_mutex_unlock(ws->lock);
+    hax_mutex_unlock(vm->gpa_space.lock);
+}
+
+void hax_vm_ws_tick(struct vm_t *vm)
+{
+    hax_ws_state *ws = &vm->ws;
+    uint64_t next_time = ws->next_time;
+
+    if (!ws->interval || hax_get_uptime_ns() < next_time)
+        return;
+    // Only one of the vCPUs that find the sample due takes it, and the others
+    // skip it until ws_sample() sets |ws->next_time| again
+    if (!hax_cmpxchg64(next_time, ~0ULL, &ws->next_time))
+        return;
+    ws_sample(vm);
+}
+
+int hax_vm_ws_set_sampler(struct vm_t *vm, struct hax_ws_sampler *info)
+{
+    hax_ws_state *ws = &vm->ws;
+
+    if (info->interval_ms) {
+        int ret = ws_enable_tracking(vm);
+        if (ret < 0)
+            return ret;
+    }
+    hax_mutex_lock(ws->lock);
+    if (info->interval_ms) {
+        ws->interval = (uint64_t)info->interval_ms * 1000000;
+        ws->next_time = hax_get_uptime_ns() + ws->interval;
+    } else {
+        ws->interval = 0;
+        if (ws->ages) {
+            hax_vfree(ws->ages, ws->end_gfn);
+        }
+        ws->ages = NULL;
+        ws->end_gfn = 0;
+        ws->nr_samples = 0;
+        ws->next_gfn = 0;
+    }
+    hax_mutex_unlock(ws->lock);
+    hax_log(HAX_LOGI, "%s: VM #%d: interval_ms=%u\n", __func__, vm->vm_id,
+            info->interval_ms);
+    return 0;
+}
+
+int hax_vm_ws_get_histogram(struct vm_t *vm, struct hax_ws_histogram *info)
+{
+    hax_ws_state *ws = &vm->ws;
+    hax_memslot *slot, *found = NULL;
+    uint64_t gfn, end_gfn;
+
+    hax_mutex_lock(vm->gpa_space.lock);
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        if (!(slot->flags & HAX_MEMSLOT_READONLY) &&
+            (slot->base_gfn + slot->npages) << PG_ORDER_4K > info->pa_start) {
+            found = slot;
+            break;
+        }
+    }
+    if (!found) {
+        hax_mutex_unlock(vm->gpa_space.lock);
+        return -ENOENT;
+    }
+
+    info->pa_start = found->base_gfn << PG_ORDER_4K;
+    info->size = found->npages << PG_ORDER_4K;
+    memset(info->counts, 0, sizeof(info->counts));
+    hax_mutex_lock(ws->lock);
+    info->nr_samples = ws->nr_samples;
+    end_gfn = found->base_gfn + found->npages;
+    if (end_gfn > ws->end_gfn) {
+        end_gfn = ws->end_gfn;
+    }
+    for (gfn = found->base_gfn; gfn < end_gfn; gfn++) {
+        uint8_t age = ws->ages[gfn];
+        int bucket = 0;
+
+        // Bucket n > 0 holds ages 2^(n-1) to 2^n - 1
+        while (age && bucket < HAX_WS_HISTOGRAM_BUCKETS - 1) {
+            age >>= 1;
+            bucket++;
+        }
+        info->counts[bucket]++;
+    }
+    hax_mutex_unlock(ws->lock);
+    hax_mutex_unlock(vm->gpa_space.lock);
+    return 0;
+}
+
+// Ages the pinned chunks of the given VM after their accessed flags have been
+// harvested. All chunks count as accessed if |fresh| is true, i.e. if accessed
+// flags have only just been turned on and could not be harvested yet.
+// Returns the guest RAM pinned by the VM, in bytes, and the highest idle age in
+// |*max_idle|.
+static uint64_t reclaim_age_chunks(struct vm_t *vm, bool fresh, int *max_idle)
+{
+    hax_ramblock *block;
+    uint64_t pinned = 0;
+
+    *max_idle = 0;
+    hax_list_entry_for_each(block, &vm->gpa_space.ramblock_list, hax_ramblock,
+                            entry) {
+        uint64_t i, nchunks = (block->size - 1) / HAX_CHUNK_SIZE + 1;
+
+        for (i = 0; i < nchunks; i++) {
+            hax_chunk *chunk = block->chunks[i];
+
+            if (!chunk)
+                continue;
+            pinned += chunk->size;
+            if (chunk->accessed || fresh) {
+                chunk->idle = 0;
+            } else if (chunk->idle < 0xff) {
+                chunk->idle++;
+            }
+            chunk->accessed = false;
+            if (chunk->idle > *max_idle) {
+                *max_idle = chunk->idle;
+            }
+        }
+    }
+    return pinned;
+}
+
+// Invalidates the EPT entries of all the GFN ranges that map the given chunk.
+// Returns 0 on success, or a negative error code if some of them may still be
+// present.
+static int reclaim_unmap_chunk(struct vm_t *vm, hax_ramblock *block,
+                               hax_chunk *chunk)
+{
+    hax_memslot *slot;
+    uint64_t low = chunk->base_uva - block->base_uva;
+    uint64_t high = low + chunk->size;
+
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        uint64_t start = slot->offset_within_block;
+        uint64_t end = start + (slot->npages << PG_ORDER_4K);
+        int ret;
+
+        if (slot->block != block)
+            continue;
+        if (start < low) {
+            start = low;
+        }
+        if (end > high) {
+            end = high;
+        }
+        if (start >= end)
+            continue;
+        ret = ept_tree_invalidate_entries(&vm->ept_tree, slot->base_gfn +
+                ((start - slot->offset_within_block) >> PG_ORDER_4K),
+                (end - start) >> PG_ORDER_4K);
+        if (ret < 0) {
+            hax_log(HAX_LOGE, "%s: Failed to invalidate PTEs: ret=%d, "
+                    "base_gfn=0x%llx, chunk.base_uva=0x%llx\n", __func__,
+                    ret, slot->base_gfn, chunk->base_uva);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int hax_vm_reclaim_ram(struct vm_t *vm, struct hax_reclaim_ram *info)
+{
+    hax_ws_state *ws = &vm->ws;
+    hax_ramblock *block;
+    uint64_t pinned, global, high_water, excess = 0, marked = 0;
+    int idle, max_idle, ret;
+    bool fresh;
+
+    if (!info->min_idle || info->pad) {
+        hax_log(HAX_LOGE, "%s: Invalid input: min_idle=%u, pad=0x%x\n",
+                __func__, info->min_idle, info->pad);
+        return -EINVAL;
+    }
+    ret = ws_enable_tracking(vm);
+    if (ret < 0)
+        return ret;
+    fresh = ret;
+    // Nothing may use a chunk or map it in the EPT while it is being unpinned:
+    // stopping the vCPUs takes care of the guest, and |gpa_space.lock| of other
+    // user space threads (e.g. SET_RAM2 freeing the RAM block of the chunk)
+    ret = hax_vm_stop_vcpus(vm);
+    if (ret)
+        return ret;
+    hax_mutex_lock(vm->gpa_space.lock);
+    // Clones rely on the RAM of their template staying pinned
+    if (hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags)) {
+        hax_mutex_unlock(vm->gpa_space.lock);
+        hax_vm_resume_vcpus(vm);
+        return -EBUSY;
+    }
+
+    hax_mutex_lock(ws->lock);
+    if (ws->interval) {
+        // Accesses found here count towards the working set too
+        ws_resize_ages(vm);
+    }
+    ws_harvest(vm, false, true, 0, ~0U);
+    hax_mutex_unlock(ws->lock);
+    pinned = reclaim_age_chunks(vm, fresh, &max_idle);
+
+    if (info->budget && pinned > info->budget) {
+        excess = pinned - info->budget;
+    }
+    global = (uint64_t)hax->pinned_pages << PG_ORDER_4K;
+    high_water = hax->pin_high_water;
+    if (high_water && global > high_water && global - high_water > excess) {
+        excess = global - high_water;
+    }
+
+    // Pick the coldest chunks first
+    for (idle = max_idle; idle >= (int)info->min_idle && marked < excess;
+         idle--) {
+        hax_list_entry_for_each(block, &vm->gpa_space.ramblock_list,
+                                hax_ramblock, entry) {
+            uint64_t i, nchunks = (block->size - 1) / HAX_CHUNK_SIZE + 1;
+
+            for (i = 0; i < nchunks && marked < excess; i++) {
+                hax_chunk *chunk = block->chunks[i];
+
+                if (!chunk || chunk->idle != idle)
+                    continue;
+                if (reclaim_unmap_chunk(vm, block, chunk) < 0)
+                    continue;
+                chunk->unpin = true;
+                marked += chunk->size;
+            }
+        }
+    }
+    // No host CPU may keep using cached translations to the chunks once they
+    // are unpinned
+    ws_flush(vm);
+
+    info->reclaimed = 0;
+    if (marked) {
+        hax_list_entry_for_each(block, &vm->gpa_space.ramblock_list,
+                                hax_ramblock, entry) {
+            uint64_t i, nchunks = (block->size - 1) / HAX_CHUNK_SIZE + 1;
+
+            for (i = 0; i < nchunks; i++) {
+                hax_chunk *chunk = block->chunks[i];
+                uint64_t size;
+
+                if (!chunk || !chunk->unpin)
+                    continue;
+                size = chunk->size;
+                if (!ramblock_unpin_chunk(block, i << HAX_CHUNK_SHIFT)) {
+                    info->reclaimed += size;
+                }
+            }
+        }
+    }
+    hax_mutex_unlock(vm->gpa_space.lock);
+    hax_vm_resume_vcpus(vm);
+
+    info->pinned = pinned - info->reclaimed;
+    hax_log(HAX_LOGI, "%s: VM #%d: budget=0x%llx, global=0x%llx, "
+            "high_water=0x%llx, pinned=0x%llx, reclaimed=0x%llx\n", __func__,
+            vm->vm_id, info->budget, global, high_water, info->pinned,
+            info->reclaimed);
+    return 0;
+}
+
+static int hax_vcpu_resize_iobuf(struct vcpu_t *cv, uint32_t io_size)
+{
+    struct hax_vcpu_mem iobuf;
+    int ret;
+
+    memset(&iobuf, 0, sizeof(iobuf));
+    ret = hax_setup_vcpumem(&iobuf, 0, io_size, 0);
+    if (ret < 0)
+        return ret;
+
+    hax_clear_vcpumem(cv->iobuf_vcpumem);
+    *cv->iobuf_vcpumem = iobuf;
+    set_vcpu_tunnel(cv, NULL, NULL, 0);
+    set_vcpu_tunnel(cv, (struct hax_tunnel *)cv->tunnel_vcpumem->kva,
+                    (uint8_t *)cv->iobuf_vcpumem->kva, io_size);
+    return 0;
 }
 
 int hax_vcpu_setup_hax_tunnel(struct vcpu_t *cv, struct hax_tunnel_info *info)
 {
     int ret = -ENOMEM;
+    uint32_t io_size;
 
     if (!cv || !info)
         return -EINVAL;
 
+    // A larger I/O buffer allows REP INS/OUTS to transfer more data per exit.
+    // Older clients do not initialize this field (formerly padding), so it is
+    // only read if the client has declared API v5 or later. Out-of-range
+    // requests fall back to the default size.
+    io_size = (cv->vm->features & VM_FEATURES_IOBUF_SIZE) ? info->io_size : 0;
+    if (io_size <= IOS_MAX_BUFFER || io_size > HAX_IOBUF_MAX_SIZE) {
+        io_size = IOS_MAX_BUFFER;
+    }
+
     // The tunnel and iobuf are always set together.
     if (cv->tunnel && cv->iobuf_vcpumem) {
         hax_log(HAX_LOGI, "setup hax tunnel request for already setup one\n");
+        // The tunnel is first set up by vcpu_create() with the default I/O
+        // buffer size, so honor the size requested by user space here.
+        if (io_size != cv->io_buf_size) {
+            ret = hax_vcpu_resize_iobuf(cv, io_size);
+            if (ret < 0) {
+                hax_log(HAX_LOGW, "%s: Failed to resize I/O buffer to %u "
+                        "bytes: ret=%d\n", __func__, io_size, ret);
+            }
+        }
         info->size = HAX_PAGE_SIZE;
+        info->io_size = (uint16_t)cv->io_buf_size;
         info->va = cv->tunnel_vcpumem->uva;
         info->io_va = cv->iobuf_vcpumem->uva;
         return 0;
@@ -200,15 +849,16 @@ int hax_vcpu_setup_hax_tunnel(struct vcpu_t *cv, struct hax_tunnel_info *info)
     if (ret < 0)
         goto error;
 
-    ret = hax_setup_vcpumem(cv->iobuf_vcpumem, 0, IOS_MAX_BUFFER, 0);
+    ret = hax_setup_vcpumem(cv->iobuf_vcpumem, 0, io_size, 0);
     if (ret < 0)
         goto error;
 
     info->va = cv->tunnel_vcpumem->uva;
     info->io_va = cv->iobuf_vcpumem->uva;
     info->size = HAX_PAGE_SIZE;
+    info->io_size = (uint16_t)io_size;
     set_vcpu_tunnel(cv, (struct hax_tunnel *)cv->tunnel_vcpumem->kva,
-                    (uint8_t *)cv->iobuf_vcpumem->kva);
+                    (uint8_t *)cv->iobuf_vcpumem->kva, io_size);
     return 0;
 error:
     if (cv->tunnel_vcpumem) {
@@ -228,13 +878,141 @@ error:
     return ret;
 }
 
+static void hax_vcpu_destroy_trace(struct vcpu_t *cv)
+{
+    if (!cv->trace_vcpumem)
+        return;
+
+    cv->trace = NULL;
+    cv->trace_mask = 0;
+    hax_clear_vcpumem(cv->trace_vcpumem);
+    hax_vfree(cv->trace_vcpumem, sizeof(struct hax_vcpu_mem));
+    cv->trace_vcpumem = NULL;
+}
+
+int hax_vcpu_setup_trace(struct vcpu_t *cv, struct hax_trace_info *info)
+{
+    struct hax_vcpu_mem *vcpumem;
+    struct hax_trace_ring *ring;
+    uint32_t size, nr_events;
+    int ret;
+
+    if (!cv || !info)
+        return -EINVAL;
+
+    size = info->size;
+    info->va = 0;
+    info->size = 0;
+    if (size > HAX_TRACE_MAX_SIZE)
+        return -EINVAL;
+
+    // Serialize with vcpu_execute(), which writes to the ring
+    hax_mutex_lock(cv->tmutex);
+    hax_vcpu_destroy_trace(cv);
+    if (!size) {
+        hax_mutex_unlock(cv->tmutex);
+        return 0;
+    }
+
+    size = max(size, HAX_PAGE_SIZE);
+    nr_events = (size - sizeof(struct hax_trace_ring)) /
+                sizeof(struct hax_trace_event);
+    nr_events = 1U << asm_fls(nr_events);
+    size = sizeof(struct hax_trace_ring) +
+           nr_events * sizeof(struct hax_trace_event);
+
+    ret = -ENOMEM;
+    vcpumem = hax_vmalloc(sizeof(struct hax_vcpu_mem), 0);
+    if (!vcpumem)
+        goto out;
+    ret = hax_setup_vcpumem(vcpumem, 0, size, 0);
+    if (ret < 0) {
+        hax_vfree(vcpumem, sizeof(struct hax_vcpu_mem));
+        goto out;
+    }
+
+    ring = (struct hax_trace_ring *)vcpumem->kva;
+    memset(ring, 0, sizeof(*ring));
+    ring->vcpu_id = cv->vcpu_id;
+    ring->nr_events = nr_events;
+    cv->trace_vcpumem = vcpumem;
+    cv->trace_mask = nr_events - 1;
+    cv->trace = ring;
+
+    info->va = vcpumem->uva;
+    info->size = size;
+out:
+    hax_mutex_unlock(cv->tmutex);
+    return ret;
+}
+
+static void hax_vcpu_destroy_regs_page(struct vcpu_t *cv)
+{
+    if (!cv->regs_vcpumem)
+        return;
+
+    cv->regs_page = NULL;
+    hax_clear_vcpumem(cv->regs_vcpumem);
+    hax_vfree(cv->regs_vcpumem, sizeof(struct hax_vcpu_mem));
+    cv->regs_vcpumem = NULL;
+}
+
+int hax_vcpu_setup_regs_page(struct vcpu_t *cv,
+                             struct hax_regs_page_info *info)
+{
+    struct hax_vcpu_mem *vcpumem;
+    struct hax_regs_page *page;
+    int ret = 0;
+
+    if (!cv || !info)
+        return -EINVAL;
+
+    // Serialize with vcpu_execute(), which accesses the page
+    hax_mutex_lock(cv->tmutex);
+    if (cv->regs_vcpumem) {
+        // Already set up
+        goto out;
+    }
+
+    ret = -ENOMEM;
+    vcpumem = hax_vmalloc(sizeof(struct hax_vcpu_mem), 0);
+    if (!vcpumem)
+        goto fail;
+    ret = hax_setup_vcpumem(vcpumem, 0, HAX_PAGE_SIZE, 0);
+    if (ret < 0) {
+        hax_vfree(vcpumem, sizeof(struct hax_vcpu_mem));
+        goto fail;
+    }
+
+    page = (struct hax_regs_page *)vcpumem->kva;
+    memset(page, 0, HAX_PAGE_SIZE);
+    vcpu_get_regs(cv, &page->regs);
+    page->valid = HAX_REGS_ALL;
+    cv->regs_vcpumem = vcpumem;
+    cv->regs_page = page;
+out:
+    info->va = cv->regs_vcpumem->uva;
+    info->size = HAX_PAGE_SIZE;
+    hax_mutex_unlock(cv->tmutex);
+    return 0;
+fail:
+    info->va = 0;
+    info->size = 0;
+    hax_mutex_unlock(cv->tmutex);
+    return ret;
+}
+
 int hax_vcpu_destroy_hax_tunnel(struct vcpu_t *cv)
 {
     if (!cv)
         return -EINVAL;
+    // The trace ring and register page are mapped along with the tunnel, so
+    // they go with it
+    hax_vcpu_destroy_trace(cv);
+    hax_vcpu_destroy_regs_page(cv);
     if (!cv->tunnel_vcpumem && !cv->iobuf_vcpumem)
         return 0;
-    set_vcpu_tunnel(cv, NULL, NULL);
+    set_vcpu_tunnel(cv, NULL, NULL, 0);
 
     if (cv->tunnel_vcpumem) {
         hax_assert(cv->tunnel_vcpumem->uva);
@@ -56,6 +56,8 @@ int mmio_fetch_instruction(struct vcpu_t *vcpu, uint64_t gva, uint8_t *buf,
     // A valid IA instruction is never longer than 15 bytes
     hax_assert(len > 0 && len <= 15);
     end_gva = gva + (uint)len - 1;
+    // The instruction cache is keyed on CR3
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
 
     if ((gva >> PG_ORDER_4K) != (end_gva >> PG_ORDER_4K)) {
         uint32_t ret;
@@ -176,8 +178,10 @@ uint32_t vcpu_read_guest_virtual(struct vcpu_t *vcpu, hax_vaddr_t addr,
 //                  __func__, addr + offset, gpa, len);
 //      }
 
+        hax_mutex_lock(vcpu->vm->gpa_space.lock);
         len2 = gpa_space_read_data(&vcpu->vm->gpa_space, gpa, (int)len,
                                    (uint8_t *)(dstp + offset));
+        hax_mutex_unlock(vcpu->vm->gpa_space.lock);
         if (len2 <= 0) {
             vcpu_set_panic(vcpu);
             hax_log(HAX_LOGPANIC, "%s: read guest virtual error, gpa:0x%llx, "
@@ -226,8 +230,10 @@ uint32_t vcpu_write_guest_virtual(struct vcpu_t *vcpu, hax_vaddr_t addr,
             return false;
         }
 
+        hax_mutex_lock(vcpu->vm->gpa_space.lock);
         len2 = (uint64_t)gpa_space_write_data(&vcpu->vm->gpa_space, gpa, len,
                                               (uint8_t *)(srcp + offset));
+        hax_mutex_unlock(vcpu->vm->gpa_space.lock);
         if (len2 <= 0) {
             vcpu_set_panic(vcpu);
             hax_log(HAX_LOGPANIC, "%s: write guest virtual error, gpa:0x%llx, "
@@ -298,8 +304,9 @@ static void * mmio_map_guest_virtual_page_slow(struct vcpu_t *vcpu,
     hax_log(HAX_LOGD, "%s: gva=0x%llx => gpa=0x%llx, vcpu_id=0x%u\n", __func__,
             gva_aligned, gpa, vcpu->vcpu_id);
 
+    // Only used to fetch instructions
     kva = gpa_space_map_page(&vcpu->vm->gpa_space, gpa >> PG_ORDER_4K, kmap,
-                             NULL);
+                             NULL, false);
     if (!kva) {
         hax_log(HAX_LOGE, "%s: gpa_space_map_page() failed: vcpu_id=%u, "
                 "gva=0x%llx, gpa=0x%llx\n", __func__, vcpu->vcpu_id, gva, gpa);
@@ -311,6 +318,8 @@ static void * mmio_map_guest_virtual_page_slow(struct vcpu_t *vcpu,
 
 static pagemode_t vcpu_get_pagemode(struct vcpu_t *vcpu)
 {
+    // Also covers the page walk that follows (see vcpu_translate())
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
     if (!(vcpu->state->_cr0 & CR0_PG))
         return PM_FLAT;
 
@@ -87,6 +87,7 @@ const char *name_vmcs_component(int value)
     CASE(VMX_VAPIC_PAGE);
     CASE(VMX_APIC_ACCESS_PAGE);
     CASE(VMX_EPTP);
+    CASE(VMX_TSC_MULTIPLIER);
     CASE(VMX_PREEMPTION_TIMER);
     CASE(VMX_INSTRUCTION_ERROR_CODE);
     CASE(VM_EXIT_INFO_REASON);
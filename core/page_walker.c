@@ -608,7 +608,7 @@ uint32_t pw_perform_page_walk(
             pml4t_gpa = first_table;
             pml4t_hva = gpa_space_map_page(&vcpu->vm->gpa_space,
                                            pml4t_gpa >> PG_ORDER_4K,
-                                           &pml4t_kmap, NULL);
+                                           &pml4t_kmap, NULL, set_ad_bits);
 
             if (pml4t_hva == NULL) {
                 retval = TF_FAILED;
@@ -634,9 +634,10 @@ uint32_t pw_perform_page_walk(
             pdpt_gpa = first_table;
         }
 
+        // PAE PDPTEs (unlike IA-32e ones) have no accessed flag to update
         pdpt_page_hva = gpa_space_map_page(&vcpu->vm->gpa_space,
-                                           pdpt_gpa >> PG_ORDER_4K,
-                                           &pdpt_kmap, NULL);
+                                           pdpt_gpa >> PG_ORDER_4K, &pdpt_kmap,
+                                           NULL, set_ad_bits && is_lme);
 
         if (pdpt_page_hva == NULL) {
             retval = TF_FAILED;
@@ -707,7 +708,7 @@ uint32_t pw_perform_page_walk(
 
     pd_gpa = is_pae ? pw_retrieve_phys_addr(&pdpte_val, is_pae) : first_table;
     pd_hva = gpa_space_map_page(&vcpu->vm->gpa_space, pd_gpa >> PG_ORDER_4K,
-                                &pd_kmap, NULL);
+                                &pd_kmap, NULL, set_ad_bits);
 
     if (pd_hva == NULL) {
         retval = TF_FAILED;
@@ -778,7 +779,7 @@ uint32_t pw_perform_page_walk(
     *order = PG_ORDER_4K;
     pt_gpa = pw_retrieve_phys_addr(&pde_val, is_pae);
     pt_hva = gpa_space_map_page(&vcpu->vm->gpa_space, pt_gpa >> 12, &pt_kmap,
-                                NULL);
+                                NULL, set_ad_bits);
 
     if (pt_hva == NULL) {
         retval = TF_FAILED;
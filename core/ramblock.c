@@ -32,6 +32,9 @@
 
 #include "hax.h"
 
+#include "driver.h"
+#include "paging.h"
+
 static inline uint64_t ramblock_count_chunks(hax_ramblock *block)
 {
     // Assuming block != NULL && block->size != 0
@@ -52,13 +55,22 @@ static inline uint64_t ramblock_count_bitmap_size(uint64_t nchunks)
     return chunks_bitmap_size;
 }
 
+// Keeps track of the guest RAM pinned by all VMs, for the high-water mark of
+// reclaim passes
+static inline void ramblock_account_pinned(hax_chunk *chunk, bool pinned)
+{
+    int npages = (int)(chunk->size >> PG_ORDER_4K);
+
+    hax_atomic_add(&hax->pinned_pages, pinned ? npages : -npages);
+}
+
 static hax_ramblock * ramblock_alloc(uint64_t base_uva, uint64_t size)
 {
     hax_ramblock *block;
     uint64_t nchunks;
     hax_chunk **chunks;
     uint64_t chunks_bitmap_size;
-    uint8_t *chunks_bitmap;
+    uint8_t *chunks_bitmap, *populated_bitmap;
 
     block = (hax_ramblock *) hax_vmalloc(sizeof(*block), 0);
     if (!block) {
@@ -92,6 +104,19 @@ static hax_ramblock * ramblock_alloc(uint64_t base_uva, uint64_t size)
     }
     memset(chunks_bitmap, 0, chunks_bitmap_size);
     block->chunks_bitmap = chunks_bitmap;
+
+    populated_bitmap = (uint8_t *) hax_vmalloc(chunks_bitmap_size, 0);
+    if (!populated_bitmap) {
+        hax_log(HAX_LOGE, "%s: Failed to allocate populated bitmap: "
+                "nchunks=0x%llx, chunks_bitmap_size=0x%llx, size=0x%llx\n",
+                __func__, nchunks, chunks_bitmap_size, size);
+        hax_vfree(chunks_bitmap, chunks_bitmap_size);
+        hax_vfree(chunks, nchunks * sizeof(*chunks));
+        hax_vfree(block, sizeof(*block));
+        return NULL;
+    }
+    memset(populated_bitmap, 0, chunks_bitmap_size);
+    block->populated_bitmap = populated_bitmap;
     block->is_standalone = false;
     block->ref_count = 0;
 
@@ -140,6 +165,7 @@ static void ramblock_free_chunks(hax_ramblock *block, bool destroy)
                     block->size);
         }
         chunks[i] = NULL;
+        ramblock_account_pinned(chunk, false);
         ret = chunk_free(chunk);
         if (ret) {
             hax_log(HAX_LOGW, "%s: Failed to free chunk: i=%llu, "
@@ -155,6 +181,9 @@ static void ramblock_free_chunks(hax_ramblock *block, bool destroy)
             block->chunks_bitmap[i] = 0;
         }
     }
+    // The RAM block is being reset or destroyed, so its RAM is no longer
+    // guest RAM
+    memset(block->populated_bitmap, 0, chunks_bitmap_size);
 
     hax_log(HAX_LOGI, "%s: All chunks freed: %lluKB total, %lluKB used\n",
             __func__, block->size / 1024, nbytes_used / 1024);
@@ -162,7 +191,8 @@ static void ramblock_free_chunks(hax_ramblock *block, bool destroy)
     if (!destroy)
         return;
 
-    // Free the chunks bitmap
+    // Free the chunks bitmaps
+    hax_vfree(block->populated_bitmap, chunks_bitmap_size);
     hax_vfree(block->chunks_bitmap, chunks_bitmap_size);
     // Free the chunks array
     hax_vfree(chunks, nchunks * sizeof(*chunks));
@@ -369,6 +399,9 @@ hax_chunk * ramblock_get_chunk(hax_ramblock *block, uint64_t uva_offset,
         }
         hax_assert(chunk != NULL);
         hax_assert(block->chunks[chunk_index] == NULL);
+        ramblock_account_pinned(chunk, true);
+        hax_test_and_set_bit((int) chunk_index,
+                             (uint64_t *) block->populated_bitmap);
         block->chunks[chunk_index] = chunk;
     } else {
         // The bit corresponding to this chunk has been set, possibly by another
@@ -404,6 +437,54 @@ done:
     return block->chunks[chunk_index];
 }
 
+int ramblock_unpin_chunk(hax_ramblock *block, uint64_t uva_offset)
+{
+    uint64_t chunk_index;
+    hax_chunk *chunk;
+    int ret;
+
+    if (!block) {
+        hax_log(HAX_LOGE, "%s: block == NULL\n", __func__);
+        return -EINVAL;
+    }
+    if (uva_offset >= block->size) {
+        hax_log(HAX_LOGW, "%s: uva_offset=0x%llx >= block->size=0x%llx\n",
+                __func__, uva_offset, block->size);
+        return -EINVAL;
+    }
+
+    chunk_index = uva_offset >> HAX_CHUNK_SHIFT;
+    chunk = block->chunks[chunk_index];
+    if (!chunk)
+        return 0;
+
+    // Same order as in ramblock_free_chunks()
+    if (hax_test_and_clear_bit((int) chunk_index,
+                               (uint64_t *) block->chunks_bitmap)) {
+        hax_log(HAX_LOGW, "%s: chunks[%llu] existed but its bit in "
+                "chunks_bitmap was not set: size=0x%llx, block.size=0x%llx\n",
+                __func__, chunk_index, chunk->size, block->size);
+    }
+    block->chunks[chunk_index] = NULL;
+    ramblock_account_pinned(chunk, false);
+    ret = chunk_free(chunk);
+    if (ret) {
+        hax_log(HAX_LOGW, "%s: Failed to free chunk: index=%llu, "
+                "base_uva=0x%llx, size=0x%llx, ret=%d\n", __func__,
+                chunk_index, chunk->base_uva, chunk->size, ret);
+    }
+    return ret;
+}
+
+bool ramblock_chunk_populated(hax_ramblock *block, uint64_t uva_offset)
+{
+    if (!block || uva_offset >= block->size)
+        return false;
+
+    return hax_test_bit((int) (uva_offset >> HAX_CHUNK_SHIFT),
+                        (uint64_t *) block->populated_bitmap);
+}
+
 void ramblock_ref(hax_ramblock *block)
 {
     if (block == NULL) {
@@ -0,0 +1,715 @@
+/*
+ * Copyright (c) 2020 Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Saves and restores the state of a whole VM as a stream of records (see
+// struct hax_snapshot_record), which user space moves between a file and a
+// buffer it passes to HAX_VM_IOCTL_SNAPSHOT_{SAVE,RESTORE}.
+
+#include "hax.h"
+#include "hax_host_mem.h"
+
+#include "ept2.h"
+#include "ia32_defs.h"
+#include "interface.h"
+#include "paging.h"
+#include "vcpu.h"
+#include "vm.h"
+
+// The cursor holds the stage in its top byte, and the position within the
+// stage (vCPU ID or GFN) in the rest
+#define SNAPSHOT_STAGE_SHIFT 56
+#define SNAPSHOT_POS_MASK    ((1ULL << SNAPSHOT_STAGE_SHIFT) - 1)
+#define SNAPSHOT_CURSOR(stage, pos) \
+        (((uint64_t)(stage) << SNAPSHOT_STAGE_SHIFT) | (pos))
+
+enum {
+    SNAPSHOT_STAGE_HEADER = 0,
+    SNAPSHOT_STAGE_VCPUS,
+    SNAPSHOT_STAGE_RAM,
+    SNAPSHOT_STAGE_END
+};
+
+#define SNAPSHOT_ALIGN(size) (((size) + 15) & ~15U)
+
+// MSRs saved along with the state returned by vcpu_get_state(). Those the vCPU
+// does not support are left out of its record.
+static const uint32_t snapshot_msrs[] = {
+    IA32_SYSENTER_CS,
+    IA32_SYSENTER_ESP,
+    IA32_SYSENTER_EIP,
+    IA32_CR_PAT,
+    IA32_EFER,
+    IA32_STAR,
+    IA32_LSTAR,
+    IA32_CSTAR,
+    IA32_SF_MASK,
+    IA32_KERNEL_GS_BASE,
+    IA32_TSC_AUX,
+    IA32_MTRR_DEF_TYPE,
+    IA32_MTRR_PHYSBASE0,
+    IA32_MTRR_PHYSMASK0,
+    IA32_MTRR_PHYSBASE1,
+    IA32_MTRR_PHYSMASK1,
+    IA32_MTRR_PHYSBASE2,
+    IA32_MTRR_PHYSMASK2,
+    IA32_MTRR_PHYSBASE3,
+    IA32_MTRR_PHYSMASK3,
+    IA32_MTRR_PHYSBASE4,
+    IA32_MTRR_PHYSMASK4,
+    IA32_MTRR_PHYSBASE5,
+    IA32_MTRR_PHYSMASK5,
+    IA32_MTRR_PHYSBASE6,
+    IA32_MTRR_PHYSMASK6,
+    IA32_MTRR_PHYSBASE7,
+    IA32_MTRR_PHYSMASK7,
+    IA32_MTRR_PHYSBASE8,
+    IA32_MTRR_PHYSMASK8,
+    IA32_MTRR_PHYSBASE9,
+    IA32_MTRR_PHYSMASK9,
+    IA32_TSC
+};
+
+#define SNAPSHOT_NR_MSRS (sizeof(snapshot_msrs) / sizeof(snapshot_msrs[0]))
+
+// The user space buffer, pinned and mapped into KVA space
+typedef struct snapshot_buf {
+    hax_chunk *chunk;
+    hax_kmap_user kmap;
+    uint8_t *kva;
+    uint32_t size;
+    uint32_t used;
+} snapshot_buf;
+
+static int snapshot_buf_map(snapshot_buf *buf, struct hax_snapshot_io *io)
+{
+    int ret;
+
+    if ((io->va & (PAGE_SIZE_4K - 1)) || (io->size & (PAGE_SIZE_4K - 1)) ||
+        io->size < HAX_SNAPSHOT_BUFFER_MIN ||
+        io->size > HAX_SNAPSHOT_BUFFER_MAX) {
+        hax_log(HAX_LOGE, "%s: Invalid buffer: va=0x%llx, size=0x%x\n",
+                __func__, io->va, io->size);
+        return -EINVAL;
+    }
+
+    ret = chunk_alloc(io->va, io->size, &buf->chunk);
+    if (ret) {
+        hax_log(HAX_LOGE, "%s: Failed to pin the buffer: ret=%d, va=0x%llx,"
+                " size=0x%x\n", __func__, ret, io->va, io->size);
+        return ret;
+    }
+    buf->kva = (uint8_t *)hax_map_user_pages(&buf->chunk->memdesc, 0,
+                                             io->size, &buf->kmap);
+    if (!buf->kva) {
+        hax_log(HAX_LOGE, "%s: Failed to map the buffer: va=0x%llx,"
+                " size=0x%x\n", __func__, io->va, io->size);
+        chunk_free(buf->chunk);
+        return -ENOMEM;
+    }
+    buf->size = io->size;
+    buf->used = 0;
+    return 0;
+}
+
+static void snapshot_buf_unmap(snapshot_buf *buf)
+{
+    hax_unmap_user_pages(&buf->kmap);
+    chunk_free(buf->chunk);
+}
+
+// Returns the record at the end of the buffer, if there is room for |size|
+// bytes of data in it, or NULL otherwise
+static struct hax_snapshot_record * snapshot_reserve(snapshot_buf *buf,
+                                                     uint32_t size)
+{
+    if (buf->size - buf->used < sizeof(struct hax_snapshot_record) +
+                                SNAPSHOT_ALIGN(size))
+        return NULL;
+    return (struct hax_snapshot_record *)(buf->kva + buf->used);
+}
+
+// Completes a record obtained from snapshot_reserve(), whose data is |size|
+// bytes long at most the size reserved, and appends it to the buffer
+static void snapshot_commit(snapshot_buf *buf, struct hax_snapshot_record *rec,
+                            uint32_t type, uint64_t id, uint32_t size)
+{
+    uint32_t aligned_size = SNAPSHOT_ALIGN(size);
+
+    memset((uint8_t *)(rec + 1) + size, 0, aligned_size - size);
+    rec->type = type;
+    rec->size = aligned_size;
+    rec->id = id;
+    buf->used += sizeof(*rec) + aligned_size;
+}
+
+static bool page_is_zero(const uint8_t *page)
+{
+    const uint64_t *p = (const uint64_t *)page;
+    int i;
+
+    for (i = 0; i < (int)(PAGE_SIZE_4K / sizeof(uint64_t)); i++) {
+        if (p[i])
+            return false;
+    }
+    return true;
+}
+
+// Each of the snapshot_save_*() functions below returns 0 when it has saved
+// everything in its stage, 1 if the buffer is full, with |*pos| updated to
+// where the next call should resume, or a negative error code.
+
+static int snapshot_save_header(struct vm_t *vm, snapshot_buf *buf,
+                                uint32_t flags)
+{
+    struct hax_snapshot_record *rec;
+    struct hax_snapshot_header *header;
+    uint32_t nr_vcpus = 0;
+    int i;
+
+    rec = snapshot_reserve(buf, sizeof(*header));
+    if (!rec)
+        return 1;
+
+    hax_mutex_lock(vm->vm_lock);
+    for (i = 0; i < vm->vcpu_table_size; i++) {
+        if (vm->vcpu_table[i]) {
+            nr_vcpus++;
+        }
+    }
+    hax_mutex_unlock(vm->vm_lock);
+
+    header = (struct hax_snapshot_header *)(rec + 1);
+    memset(header, 0, sizeof(*header));
+    header->magic = HAX_SNAPSHOT_MAGIC;
+    header->version = HAX_SNAPSHOT_VERSION;
+    header->nr_vcpus = nr_vcpus;
+    header->flags = flags;
+    header->page_size = PAGE_SIZE_4K;
+    snapshot_commit(buf, rec, HAX_SNAPSHOT_REC_HEADER, 0, sizeof(*header));
+    return 0;
+}
+
+static int snapshot_save_vcpus(struct vm_t *vm, snapshot_buf *buf,
+                               uint64_t *pos)
+{
+    uint64_t vcpu_id;
+
+    for (vcpu_id = *pos; vcpu_id < HAX_MAX_VCPUS; vcpu_id++) {
+        struct vcpu_t *vcpu;
+        struct hax_snapshot_record *rec;
+        struct hax_vcpu_state *state;
+        uint32_t i, n = 0;
+        int ret;
+
+        vcpu = hax_get_vcpu(vm->vm_id, (int)vcpu_id, 1);
+        if (!vcpu)
+            continue;
+
+        rec = snapshot_reserve(buf, sizeof(*state) +
+                               SNAPSHOT_NR_MSRS * sizeof(struct vmx_msr));
+        if (!rec) {
+            hax_put_vcpu(vcpu);
+            *pos = vcpu_id;
+            return 1;
+        }
+
+        state = (struct hax_vcpu_state *)(rec + 1);
+        memset(state, 0, sizeof(*state));
+        state->version = HAX_VCPU_STATE_VERSION;
+        state->size = sizeof(*state);
+        state->flags = HAX_VCPU_STATE_ALL & ~HAX_VCPU_STATE_MSRS;
+        ret = vcpu_get_state(vcpu, state);
+        if (ret) {
+            hax_put_vcpu(vcpu);
+            return ret;
+        }
+        for (i = 0; i < SNAPSHOT_NR_MSRS; i++) {
+            struct vmx_msr *msr = &state->msrs[n];
+
+            msr->entry = snapshot_msrs[i];
+            if (!vcpu_get_msr(vcpu, msr->entry, &msr->value)) {
+                n++;
+            }
+        }
+        state->flags |= HAX_VCPU_STATE_MSRS;
+        state->nr_msrs = n;
+        hax_put_vcpu(vcpu);
+
+        snapshot_commit(buf, rec, HAX_SNAPSHOT_REC_VCPU, vcpu_id,
+                        sizeof(*state) + n * sizeof(struct vmx_msr));
+    }
+    return 0;
+}
+
+// Saves the non-zero pages among the |max_pages| pages (at most) starting at
+// |gfn| in |slot|, without crossing a chunk boundary, and stores the number of
+// pages dealt with in |*npages|. Pages of chunks that have never been pinned
+// are skipped, unless |flags| has HAX_SNAPSHOT_SAVE_ALL_RAM. Pages a clone
+// still shares with its template are read from the template.
+static int snapshot_save_pages(hax_gpa_space *gpa_space, hax_memslot *slot,
+                               snapshot_buf *buf, uint64_t gfn,
+                               uint64_t max_pages, uint32_t flags,
+                               uint64_t *npages)
+{
+    hax_memslot *template_slot;
+    hax_ramblock *block;
+    hax_chunk *chunk;
+    hax_kmap_user kmap;
+    struct hax_snapshot_record *rec;
+    struct hax_snapshot_ram *ram;
+    uint64_t offset_within_block, offset_within_chunk, bitmap = 0;
+    uint64_t n, i;
+    uint8_t *kva, *data;
+    uint32_t nr_saved = 0;
+    bool pin;
+
+    max_pages = gpa_space_get_shared_run(gpa_space, gfn, max_pages,
+                                         &template_slot);
+    if (template_slot) {
+        slot = template_slot;
+    }
+    block = slot->block;
+    offset_within_block = slot->offset_within_block +
+                          ((gfn - slot->base_gfn) << PG_ORDER_4K);
+    n = (HAX_CHUNK_SIZE - (offset_within_block & (HAX_CHUNK_SIZE - 1))) >>
+        PG_ORDER_4K;
+    if (n > max_pages) {
+        n = max_pages;
+    }
+
+    // The template's RAM is pinned when it is frozen. A chunk unpinned by a
+    // reclaim pass still holds guest data, so it is pinned again.
+    pin = !template_slot && ((flags & HAX_SNAPSHOT_SAVE_ALL_RAM) ||
+                             ramblock_chunk_populated(block,
+                                                      offset_within_block));
+    chunk = ramblock_get_chunk(block, offset_within_block, pin);
+    if (!chunk) {
+        if (pin)
+            return -ENOMEM;
+        // Never touched by the guest
+        *npages = n;
+        return 0;
+    }
+
+    if (n > HAX_SNAPSHOT_RAM_PAGES) {
+        n = HAX_SNAPSHOT_RAM_PAGES;
+    }
+    offset_within_chunk = offset_within_block -
+                          (chunk->base_uva - block->base_uva);
+    kva = (uint8_t *)hax_map_user_pages(&chunk->memdesc, offset_within_chunk,
+                                        n << PG_ORDER_4K, &kmap);
+    if (!kva) {
+        hax_log(HAX_LOGE, "%s: Failed to map gfn=0x%llx, npages=%llu\n",
+                __func__, gfn, n);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!page_is_zero(kva + (i << PG_ORDER_4K))) {
+            bitmap |= 1ULL << i;
+            nr_saved++;
+        }
+    }
+    if (!bitmap) {
+        hax_unmap_user_pages(&kmap);
+        *npages = n;
+        return 0;
+    }
+
+    rec = snapshot_reserve(buf, sizeof(*ram) + (nr_saved << PG_ORDER_4K));
+    if (!rec) {
+        hax_unmap_user_pages(&kmap);
+        return 1;
+    }
+    ram = (struct hax_snapshot_ram *)(rec + 1);
+    ram->npages = (uint32_t)n;
+    ram->pad = 0;
+    ram->bitmap = bitmap;
+    data = (uint8_t *)(ram + 1);
+    for (i = 0; i < n; i++) {
+        if (bitmap & (1ULL << i)) {
+            memcpy(data, kva + (i << PG_ORDER_4K), PAGE_SIZE_4K);
+            data += PAGE_SIZE_4K;
+        }
+    }
+    hax_unmap_user_pages(&kmap);
+
+    snapshot_commit(buf, rec, HAX_SNAPSHOT_REC_RAM, gfn,
+                    sizeof(*ram) + (nr_saved << PG_ORDER_4K));
+    *npages = n;
+    return 0;
+}
+
+static int snapshot_save_ram(struct vm_t *vm, snapshot_buf *buf,
+                             uint64_t *pos, uint32_t flags)
+{
+    hax_memslot *slot;
+    uint64_t gfn = *pos;
+
+    // The memslot list is sorted by GFN
+    hax_list_entry_for_each(slot, &vm->gpa_space.memslot_list, hax_memslot,
+                            entry) {
+        uint64_t end_gfn = slot->base_gfn + slot->npages;
+
+        // ROM contents are provided by user space, which restores them itself
+        if ((slot->flags & HAX_MEMSLOT_READONLY) || gfn >= end_gfn)
+            continue;
+        if (gfn < slot->base_gfn) {
+            gfn = slot->base_gfn;
+        }
+        while (gfn < end_gfn) {
+            uint64_t npages = 0;
+            int ret;
+
+            ret = snapshot_save_pages(&vm->gpa_space, slot, buf, gfn,
+                                      end_gfn - gfn, flags, &npages);
+            if (ret) {
+                *pos = gfn;
+                return ret;
+            }
+            gfn += npages;
+        }
+    }
+    return 0;
+}
+
+static int snapshot_save_end(snapshot_buf *buf)
+{
+    struct hax_snapshot_record *rec;
+
+    rec = snapshot_reserve(buf, 0);
+    if (!rec)
+        return 1;
+    snapshot_commit(buf, rec, HAX_SNAPSHOT_REC_END, 0, 0);
+    return 0;
+}
+
+int hax_vm_snapshot_save(struct vm_t *vm, struct hax_snapshot_io *io)
+{
+    snapshot_buf buf;
+    uint32_t stage;
+    uint64_t pos;
+    int ret = 0;
+
+    io->bytes = 0;
+    if (io->cursor == HAX_SNAPSHOT_CURSOR_DONE)
+        return 0;
+    if (io->flags & ~HAX_SNAPSHOT_SAVE_ALL_RAM) {
+        hax_log(HAX_LOGE, "%s: Invalid flags 0x%x\n", __func__, io->flags);
+        return -EINVAL;
+    }
+    ret = hax_vm_stop_vcpus(vm);
+    if (ret)
+        return ret;
+    hax_mutex_lock(vm->gpa_space.lock);
+
+    ret = snapshot_buf_map(&buf, io);
+    if (ret)
+        goto out;
+
+    stage = (uint32_t)(io->cursor >> SNAPSHOT_STAGE_SHIFT);
+    pos = io->cursor & SNAPSHOT_POS_MASK;
+    while (stage <= SNAPSHOT_STAGE_END) {
+        switch (stage) {
+            case SNAPSHOT_STAGE_HEADER: {
+                ret = snapshot_save_header(vm, &buf, io->flags);
+                break;
+            }
+            case SNAPSHOT_STAGE_VCPUS: {
+                ret = snapshot_save_vcpus(vm, &buf, &pos);
+                break;
+            }
+            case SNAPSHOT_STAGE_RAM: {
+                ret = snapshot_save_ram(vm, &buf, &pos, io->flags);
+                break;
+            }
+            default: {
+                ret = snapshot_save_end(&buf);
+                break;
+            }
+        }
+        if (ret)
+            break;
+        stage++;
+        pos = 0;
+    }
+    snapshot_buf_unmap(&buf);
+    if (ret < 0)
+        goto out;
+
+    io->bytes = buf.used;
+    io->cursor = stage > SNAPSHOT_STAGE_END ? HAX_SNAPSHOT_CURSOR_DONE
+                 : SNAPSHOT_CURSOR(stage, pos);
+    ret = 0;
+out:
+    hax_mutex_unlock(vm->gpa_space.lock);
+    hax_vm_resume_vcpus(vm);
+    return ret;
+}
+
+// The snapshot_restore_*() functions below take a copy of the record header,
+// and the data of the record in the user space buffer. User space may modify
+// the latter at any time, so they copy what they validate before using it.
+
+static int snapshot_restore_header(struct hax_snapshot_record *rec,
+                                   const uint8_t *data)
+{
+    struct hax_snapshot_header header;
+
+    if (rec->size < sizeof(header)) {
+        hax_log(HAX_LOGE, "%s: Truncated record: size=%u\n", __func__,
+                rec->size);
+        return -EINVAL;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != HAX_SNAPSHOT_MAGIC ||
+        header.version != HAX_SNAPSHOT_VERSION ||
+        header.page_size != PAGE_SIZE_4K) {
+        hax_log(HAX_LOGE, "%s: Unsupported snapshot: magic=0x%x,"
+                " version=%u\n", __func__, header.magic, header.version);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int snapshot_restore_vcpu(struct vm_t *vm,
+                                 struct hax_snapshot_record *rec,
+                                 const uint8_t *data)
+{
+    struct hax_vcpu_state header, *state;
+    struct vcpu_t *vcpu;
+    uint32_t nr_msrs, size;
+    int ret;
+
+    if (rec->size < sizeof(header)) {
+        hax_log(HAX_LOGE, "%s: Truncated record: size=%u\n", __func__,
+                rec->size);
+        return -EINVAL;
+    }
+    memcpy(&header, data, sizeof(header));
+    nr_msrs = header.nr_msrs;
+    if (nr_msrs > HAX_MAX_VCPU_STATE_MSRS ||
+        rec->size < sizeof(header) + nr_msrs * sizeof(struct vmx_msr)) {
+        hax_log(HAX_LOGE, "%s: Truncated record: size=%u, nr_msrs=%u\n",
+                __func__, rec->size, nr_msrs);
+        return -EINVAL;
+    }
+
+    size = sizeof(*state) + nr_msrs * sizeof(struct vmx_msr);
+    state = hax_vmalloc(size, HAX_MEM_NONPAGE);
+    if (!state)
+        return -ENOMEM;
+    memcpy(state, data, size);
+    state->nr_msrs = nr_msrs;
+
+    // User space creates the vCPUs before restoring their state
+    vcpu = hax_get_vcpu(vm->vm_id, (int)rec->id, 1);
+    if (!vcpu) {
+        hax_log(HAX_LOGE, "%s: No vCPU #%llu\n", __func__, rec->id);
+        hax_vfree(state, size);
+        return -ENOENT;
+    }
+    ret = vcpu_set_state(vcpu, state);
+    if (!ret && state->done < state->nr_msrs) {
+        // Probably a host that does not support the MSR, so carry on
+        hax_log(HAX_LOGW, "%s: vCPU #%llu: failed to restore MSR 0x%llx\n",
+                __func__, rec->id, state->msrs[state->done].entry);
+    }
+    hax_put_vcpu(vcpu);
+    hax_vfree(state, size);
+    return ret;
+}
+
+static int snapshot_restore_ram(struct vm_t *vm,
+                                struct hax_snapshot_record *rec,
+                                const uint8_t *data)
+{
+    struct hax_snapshot_ram ram;
+    uint64_t gfn, nr_saved = 0;
+    uint32_t i;
+    int ret;
+
+    if (rec->size < sizeof(ram)) {
+        hax_log(HAX_LOGE, "%s: Invalid record: size=%u\n", __func__,
+                rec->size);
+        return -EINVAL;
+    }
+    memcpy(&ram, data, sizeof(ram));
+    if (ram.npages > HAX_SNAPSHOT_RAM_PAGES) {
+        hax_log(HAX_LOGE, "%s: Invalid record: npages=%u\n", __func__,
+                ram.npages);
+        return -EINVAL;
+    }
+    for (i = 0; i < ram.npages; i++) {
+        if (ram.bitmap & (1ULL << i)) {
+            nr_saved++;
+        }
+    }
+    if (rec->size < sizeof(ram) + (nr_saved << PG_ORDER_4K)) {
+        hax_log(HAX_LOGE, "%s: Truncated record: size=%u, gfn=0x%llx\n",
+                __func__, rec->size, rec->id);
+        return -EINVAL;
+    }
+
+    // The page contents are guest data, which need no validation
+    data += sizeof(ram);
+    for (i = 0; i < ram.npages; i++) {
+        hax_memslot *slot;
+
+        if (!(ram.bitmap & (1ULL << i)))
+            continue;
+        gfn = rec->id + i;
+        // Pins the chunk backing |gfn|, if not yet pinned
+        ret = gpa_space_write_data(&vm->gpa_space, gfn << PG_ORDER_4K,
+                                   PAGE_SIZE_4K, (uint8_t *)data);
+        if (ret != PAGE_SIZE_4K) {
+            hax_log(HAX_LOGE, "%s: Failed to restore gfn=0x%llx: ret=%d\n",
+                    __func__, gfn, ret);
+            return ret < 0 ? ret : -EINVAL;
+        }
+        data += PAGE_SIZE_4K;
+
+        // Map the chunk in the EPT right away, so the restored guest does not
+        // take an EPT violation for each chunk of its working set
+        if (ept_tree_get_entry(&vm->ept_tree, gfn).perm != HAX_EPT_PERM_NONE)
+            continue;
+        slot = memslot_find(&vm->gpa_space, gfn);
+        if (slot) {
+            ret = ept_map_chunk(&vm->gpa_space, &vm->ept_tree, slot, gfn);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+int hax_vm_snapshot_restore(struct vm_t *vm, struct hax_snapshot_io *io)
+{
+    snapshot_buf buf;
+    uint32_t avail;
+    int ret = 0;
+
+    avail = io->bytes;
+    io->bytes = 0;
+    if (io->cursor == HAX_SNAPSHOT_CURSOR_DONE)
+        return 0;
+    if (io->flags || avail > io->size) {
+        hax_log(HAX_LOGE, "%s: Invalid flags 0x%x or bytes 0x%x\n", __func__,
+                io->flags, avail);
+        return -EINVAL;
+    }
+    // The RAM of a frozen VM may be shared with its clones
+    if (hax_test_bit(VM_STATE_FLAGS_FROZEN, &vm->flags))
+        return -EBUSY;
+    ret = hax_vm_stop_vcpus(vm);
+    if (ret)
+        return ret;
+    hax_mutex_lock(vm->gpa_space.lock);
+
+    ret = snapshot_buf_map(&buf, io);
+    if (ret)
+        goto out;
+
+    // Only whole records are consumed
+    while (avail - buf.used >= sizeof(struct hax_snapshot_record)) {
+        struct hax_snapshot_record rec;
+        const uint8_t *data;
+
+        memcpy(&rec, buf.kva + buf.used, sizeof(rec));
+        data = buf.kva + buf.used + sizeof(rec);
+        if (rec.size & 15) {
+            ret = -EINVAL;
+            break;
+        }
+        if (avail - buf.used - sizeof(rec) < rec.size)
+            break;
+
+        if (io->cursor == 0) {
+            // The stream must start with a header
+            if (rec.type != HAX_SNAPSHOT_REC_HEADER) {
+                ret = -EINVAL;
+                break;
+            }
+        } else if (rec.type == HAX_SNAPSHOT_REC_HEADER) {
+            ret = -EINVAL;
+            break;
+        }
+
+        switch (rec.type) {
+            case HAX_SNAPSHOT_REC_HEADER: {
+                ret = snapshot_restore_header(&rec, data);
+                if (!ret) {
+                    io->cursor = SNAPSHOT_CURSOR(SNAPSHOT_STAGE_VCPUS, 0);
+                }
+                break;
+            }
+            case HAX_SNAPSHOT_REC_VCPU: {
+                ret = snapshot_restore_vcpu(vm, &rec, data);
+                break;
+            }
+            case HAX_SNAPSHOT_REC_RAM: {
+                ret = snapshot_restore_ram(vm, &rec, data);
+                break;
+            }
+            case HAX_SNAPSHOT_REC_END: {
+                io->cursor = HAX_SNAPSHOT_CURSOR_DONE;
+                break;
+            }
+            default: {
+                hax_log(HAX_LOGE, "%s: Unknown record type %u\n", __func__,
+                        rec.type);
+                ret = -EINVAL;
+                break;
+            }
+        }
+        if (ret)
+            break;
+        buf.used += sizeof(rec) + rec.size;
+        if (io->cursor == HAX_SNAPSHOT_CURSOR_DONE)
+            break;
+    }
+    snapshot_buf_unmap(&buf);
+    if (ret < 0)
+        goto out;
+
+    // A full buffer always holds at least one record, as no valid record is
+    // larger than HAX_SNAPSHOT_BUFFER_MIN
+    if (!buf.used && avail == io->size) {
+        hax_log(HAX_LOGE, "%s: Record too large\n", __func__);
+        ret = -EINVAL;
+        goto out;
+    }
+    io->bytes = buf.used;
+    ret = 0;
+out:
+    hax_mutex_unlock(vm->gpa_space.lock);
+    hax_vm_resume_vcpus(vm);
+    return ret;
+}
@@ -44,6 +44,7 @@
 #include "intr.h"
 #include "mmio.h"
 #include "mtrr.h"
+#include "name.h"
 #include "paging.h"
 #include "vm.h"
 #include "vmx.h"
@@ -81,6 +82,8 @@ static void vcpu_init_emulator(struct vcpu_t *vcpu);
 
 static void vmread_cr(struct vcpu_t *vcpu);
 static void vmwrite_cr(struct vcpu_t *vcpu);
+static uint64_t vcpu_guest_tsc(struct vcpu_t *vcpu);
+static uint64_t vcpu_guest_to_host_ticks(struct vcpu_t *vcpu, uint64_t ticks);
 
 static int exit_exc_nmi(struct vcpu_t *vcpu, struct hax_tunnel *htun);
 static int exit_interrupt(struct vcpu_t *vcpu, struct hax_tunnel *htun);
@@ -102,6 +105,8 @@ static int exit_ept_misconfiguration(struct vcpu_t *vcpu,
                                      struct hax_tunnel *htun);
 static int exit_ept_violation(struct vcpu_t *vcpu, struct hax_tunnel *htun);
 static int exit_xsetbv(struct vcpu_t *vcpu, struct hax_tunnel *htun);
+static int exit_pause(struct vcpu_t *vcpu, struct hax_tunnel *htun);
+static int exit_preemption_timer(struct vcpu_t *vcpu, struct hax_tunnel *htun);
 static int exit_unsupported_instruction(struct vcpu_t *vcpu,
                                         struct hax_tunnel *htun);
 static int null_handler(struct vcpu_t *vcpu, struct hax_tunnel *hun);
@@ -112,6 +117,7 @@ static void handle_machine_check(struct vcpu_t *vcpu);
 static void handle_mem_fault(struct vcpu_t *vcpu, struct hax_tunnel *htun);
 static void vmwrite_efer(struct vcpu_t *vcpu);
 
+static bool vcpu_msr_has_fast_path(uint32_t msr, bool write);
 static int handle_msr_read(struct vcpu_t *vcpu, uint32_t msr, uint64_t *val);
 static int handle_msr_write(struct vcpu_t *vcpu, uint32_t msr, uint64_t val,
                             bool by_host);
@@ -119,6 +125,8 @@ static void vcpu_dump(struct vcpu_t *vcpu, uint32_t mask, const char *caption);
 static void vcpu_state_dump(struct vcpu_t *vcpu);
 static void vcpu_enter_fpu_state(struct vcpu_t *vcpu);
 static int vcpu_get_cpl(struct vcpu_t *vcpu);
+static int vcpu_load_regs_page(struct vcpu_t *vcpu);
+static void vcpu_sync_regs_page(struct vcpu_t *vcpu);
 
 static int vcpu_set_apic_base(struct vcpu_t *vcpu, uint64_t val);
 static bool vcpu_is_bsp(struct vcpu_t *vcpu);
@@ -203,8 +211,8 @@ static uint64_t vcpu_read_cr(struct vcpu_state_t *state, uint32_t n)
             break;
         }
         default: {
-            hax_log(HAX_LOGW, "Ignored unsupported CR%d read, returning 0\n",
-                    n);
+            hax_log_ratelimited(HAX_LOGW, "Ignored unsupported CR%d read, "
+                                "returning 0\n", n);
             break;
         }
     }
@@ -277,7 +285,7 @@ int set_vcpu_host(struct vcpu_t *vcpu, void *vcpu_host)
 }
 
 int set_vcpu_tunnel(struct vcpu_t *vcpu, struct hax_tunnel *tunnel,
-                    uint8_t *iobuf)
+                    uint8_t *iobuf, uint32_t iobuf_size)
 {
     if (!vcpu || (vcpu->tunnel && tunnel && vcpu->tunnel != tunnel) ||
             (vcpu->io_buf && iobuf && vcpu->io_buf != iobuf))
@@ -285,6 +293,7 @@ int set_vcpu_tunnel(struct vcpu_t *vcpu, struct hax_tunnel *tunnel,
 
     vcpu->tunnel = tunnel;
     vcpu->io_buf = iobuf;
+    vcpu->io_buf_size = iobuf_size;
 
     return 0;
 }
@@ -294,88 +303,55 @@ struct hax_tunnel * get_vcpu_tunnel(struct vcpu_t *vcpu)
     return vcpu ? vcpu->tunnel : NULL;
 }
 
+#define VPID_MAX 0xffff
+
 /*
- * vcpu_vpid_alloc()
- *
- * Allocate a non-zero unique VPID for virtual processor.
- * The allocated VPID is stored in vcpu->vpid.
- * In the case of allocating failure, the vcpu->vpid will keeps zero, which
- * means "do not enable VPID feature".
+ * Each host CPU hands out VPIDs 1, 2, ... in turn, all tagged with the current
+ * generation of that CPU. A vCPU keeps its VPID for as long as it runs on the
+ * same CPU in the same generation; otherwise it takes a fresh VPID, which no
+ * other vCPU has used on this CPU since the last flush. So VPIDs never need to
+ * be freed, and the only INVVPID is the one that starts a new generation when
+ * a CPU runs out of VPIDs (or runs a vCPU for the first time, as the TLB may
+ * hold entries from another VMM).
  *
- * Param: vcpu - specify the virtual processor who will get the VPID
- * Return Value: 0 - means success.  Negative value - means failure.
+ * Must be called with the VMCS loaded, before VM entry.
  */
-static int vcpu_vpid_alloc(struct vcpu_t *vcpu)
+void vcpu_vpid_update(struct vcpu_t *vcpu)
 {
-    uint32_t vpid_seed_bits = sizeof(vcpu->vm->vpid_seed) * 8;
-    uint8_t bit, max_bit;
-
-    max_bit = vpid_seed_bits > 0xff ? 0xff : vpid_seed_bits;
-
-    if (0 != vcpu->vpid) {
-        hax_log(HAX_LOGW, "vcpu_vpid_alloc: vcpu %u in vm %d already has a "
-                "valid VPID 0x%x.\n", vcpu->vcpu_id, vcpu->vm->vm_id,
-                vcpu->vpid);
-        return -1;
-    }
+    struct per_cpu_data *cpu_data = current_cpu_data();
+    vmx_result_t res;
 
-    for (bit = 0; bit < max_bit; bit++) {
-        if (!hax_test_and_set_bit(bit, (uint64_t *)vcpu->vm->vpid_seed))
-            break;
-    }
+    if (!(vmx(vcpu, scpu_ctls) & ENABLE_VPID))
+        return;
+    if (vcpu->vpid_generation == cpu_data->vpid_generation &&
+        vcpu->vpid_cpu == cpu_data->cpu_id && vcpu->vpid_generation != 0)
+        return;
 
-    if (bit == max_bit) {
-        // No available VPID resource
-        hax_log(HAX_LOGE, "vcpu_vpid_alloc: no available vpid resource. "
-                "vcpu: %u, vm: %d\n", vcpu->vcpu_id, vcpu->vm->vm_id);
-        return -2;
+    if (cpu_data->vpid_generation == 0 || cpu_data->vpid_next > VPID_MAX) {
+        res = invvpid_all_context();
+        if (res != VMX_SUCCEED) {
+            hax_log(HAX_LOGE, "[#%u] INVVPID failed (err=0x%x)\n",
+                    cpu_data->cpu_id, res);
+        }
+        cpu_data->vpid_generation++;
+        cpu_data->vpid_next = 1;
+        vcpu->stats.vpid_flushes++;
     }
 
-    /*
-     * We split vpid as high byte and low byte, the vpid seed is used to
-     * generate low byte. We use the index of first zero bit in vpid seed plus 1
-     * as the value of low_byte, and use vcpu->vm->vm_id as the value of high
-     * byte.
-     * Note: vpid can't be zero.
-     */
-    vcpu->vpid = (uint16_t)(vcpu->vm->vm_id << 8) + (uint16_t)(bit + 1);
-    hax_log(HAX_LOGI, "vcpu_vpid_alloc: succeed! vpid: 0x%x. vcpu_id: %u, "
-            "vm_id: %d.\n", vcpu->vpid, vcpu->vcpu_id, vcpu->vm->vm_id);
-
-    return 0;
+    vcpu->vpid = (uint16_t)cpu_data->vpid_next++;
+    vcpu->vpid_cpu = cpu_data->cpu_id;
+    vcpu->vpid_generation = cpu_data->vpid_generation;
+    vcpu->stats.vpid_allocs++;
+    vmwrite(vcpu, VMX_VPID, vcpu->vpid);
 }
 
 /*
- * vcpu_vpid_free()
- *
- * Free the VPID that stored in vcpu->vpid for virtual processor.
- * The value of vcpu->vpid will be reset to zero after freeing.
- *
- * Param: vcpu - specify the virtual processor whose VPID will be freed.
- * Return Value: 0 - means success.
- *               Negative value - means vcpu->vpid has been already freed.
+ * Makes the vCPU take a fresh VPID at its next VM entry, which discards the
+ * guest TLB entries tagged with its current VPID without flushing the TLB.
  */
-static int vcpu_vpid_free(struct vcpu_t *vcpu)
+static void vcpu_vpid_invalidate(struct vcpu_t *vcpu)
 {
-    uint8_t bit = (vcpu->vpid & 0xff) - 1;
-
-    if (0 == vcpu->vpid) {
-        hax_log(HAX_LOGW, "vcpu_vpid_free: vcpu %u in vm %d does not have a "
-                "valid VPID.\n", vcpu->vcpu_id, vcpu->vm->vm_id);
-        return -1;
-    }
-
-    hax_log(HAX_LOGI, "vcpu_vpid_free: Clearing bit: 0x%x, vpid_seed: 0x%llx. "
-            "vcpu_id: %u, vm_id: %d.\n", bit, *(uint64_t *)vcpu->vm->vpid_seed,
-            vcpu->vcpu_id, vcpu->vm->vm_id);
-    if (0 != hax_test_and_clear_bit(bit, (uint64_t *)(vcpu->vm->vpid_seed))) {
-        hax_log(HAX_LOGW, "vcpu_vpid_free: bit for vpid 0x%x of vcpu %u in vm "
-                "%d was already clear.\n", vcpu->vpid, vcpu->vcpu_id,
-                vcpu->vm->vm_id);
-    }
-    vcpu->vpid = 0;
-
-    return 0;
+    vcpu->vpid_generation = 0;
 }
 
 static int (*handler_funcs[])(struct vcpu_t *vcpu, struct hax_tunnel *htun) = {
@@ -397,6 +373,8 @@ static int (*handler_funcs[])(struct vcpu_t *vcpu, struct hax_tunnel *htun) = {
     [VMX_EXIT_EPT_VIOLATION]      = exit_ept_violation,
     [VMX_EXIT_EPT_MISCONFIG]      = exit_ept_misconfiguration,
     [VMX_EXIT_XSETBV]             = exit_xsetbv,
+    [VMX_EXIT_PAUSE]              = exit_pause,
+    [VMX_EXIT_VMX_TIMER_EXIT]     = exit_preemption_timer,
     [VMX_EXIT_GETSEC]             = exit_unsupported_instruction,
     [VMX_EXIT_INVD]               = exit_unsupported_instruction,
     [VMX_EXIT_VMCALL]             = exit_unsupported_instruction,
@@ -426,6 +404,19 @@ struct vcpu_t *vcpu_create(struct vm_t *vm, void *vm_host, int vcpu_id)
     if (!valid_vcpu_id(vcpu_id))
         return NULL;
 
+    // Make room for the new vCPU in the table now, as publishing it must not
+    // fail
+    hax_mutex_lock(vm->vm_lock);
+    if (hax_table_reserve((void ***)&vm->vcpu_table, &vm->vcpu_table_size,
+                          vcpu_id, HAX_MAX_VCPUS) ||
+        vm->vcpu_table[vcpu_id]) {
+        hax_mutex_unlock(vm->vm_lock);
+        hax_log(HAX_LOGE, "%s: Cannot add vCPU %d to VM %d\n", __func__,
+                vcpu_id, vm->vm_id);
+        return NULL;
+    }
+    hax_mutex_unlock(vm->vm_lock);
+
     vcpu = (struct vcpu_t *)hax_vmalloc(sizeof(struct vcpu_t), HAX_MEM_NONPAGE);
     if (!vcpu)
         goto fail_0;
@@ -434,6 +425,7 @@ struct vcpu_t *vcpu_create(struct vm_t *vm, void *vm_host, int vcpu_id)
 
     memset(vcpu, 0, sizeof(struct vcpu_t));
 
+    memset(&info, 0, sizeof(info));
     if (hax_vcpu_setup_hax_tunnel(vcpu, &info) < 0) {
         hax_log(HAX_LOGE, "cannot setup hax_tunnel for vcpu.\n");
         goto fail_1;
@@ -471,9 +463,6 @@ struct vcpu_t *vcpu_create(struct vm_t *vm, void *vm_host, int vcpu_id)
     vcpu->vcpu_id = vcpu_id;
     vcpu->is_running = 0;
     vcpu->vm = vm;
-    // Must ensure it is called before fill_common_vmcs is called
-    vcpu_vpid_alloc(vcpu);
-
     // Prepare guest environment
     vcpu_init(vcpu);
 
@@ -485,6 +474,7 @@ struct vcpu_t *vcpu_create(struct vm_t *vm, void *vm_host, int vcpu_id)
     // Publish the vcpu
     hax_mutex_lock(vm->vm_lock);
     hax_list_add(&vcpu->vcpu_list, &vm->vcpu_list);
+    vm->vcpu_table[vcpu_id] = vcpu;
     // The caller should get_vm thus no race with vm destroy
     hax_atomic_add(&vm->ref_count, 1);
     hax_mutex_unlock(vm->vm_lock);
@@ -530,17 +520,164 @@ int hax_vcpu_core_open(struct vcpu_t *vcpu)
     return 0;
 }
 
+static void vcpu_log_exit_stats(struct vcpu_t *vcpu)
+{
+    int i;
+
+    for (i = 0; i < VCPU_NR_EXIT_REASONS; i++) {
+        struct vcpu_exit_stats *stats = &vcpu->exit_stats[i];
+
+        if (!stats->count)
+            continue;
+        hax_log(HAX_LOGI, "vcpu %d: %s: %llu exits (%llu on the fast path), "
+                "%llu VMREADs, %llu resumed in %llu cycles\n", vcpu->vcpu_id,
+                name_vmx_exit(i), stats->count, stats->fast, stats->vmreads,
+                stats->resumes, stats->resume_cycles);
+    }
+}
+
+/*
+ * Counts one occurrence of |key| in a direct-mapped table of frequent keys.
+ * A key that collides with the key of its slot wears the count of the latter
+ * down by one, and takes over the slot once it reaches 0, so that a slot ends
+ * up owned by the most frequent of the keys mapped to it. The counts are thus
+ * approximations, but cost no more than the exit counters to maintain.
+ */
+static void vcpu_stats_talker(struct vcpu_talker *table, uint64_t key)
+{
+    struct vcpu_talker *talker;
+
+    // Fibonacci hashing, as I/O ports tend to share their low bits
+    talker = &table[(key * 0x9e3779b97f4a7c15ULL) >> 58];
+    if (talker->key == key) {
+        talker->count++;
+    } else if (!talker->count) {
+        talker->key = key;
+        talker->count = 1;
+    } else {
+        talker->count--;
+    }
+}
+
+/* Accounts for a return to user space from vcpu_execute() */
+static void vcpu_stats_user_exit(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    uint32_t status = htun->_exit_status;
+
+    vcpu->stats.user_exits[status < HAX_STATS_NR_EXIT_STATUSES ? status : 0]++;
+    if (status == HAX_EXIT_IO) {
+        vcpu_stats_talker(vcpu->stats.io_ports, htun->io._port);
+    } else if (status == HAX_EXIT_FAST_MMIO) {
+        struct hax_fastmmio *hft = (struct hax_fastmmio *)vcpu->io_buf;
+        vcpu_stats_talker(vcpu->stats.mmio_pages, hft->gpa >> PG_ORDER_4K);
+    }
+}
+
+/* Copies the |nr| most frequent keys of |table| to |top| */
+static void vcpu_stats_top(struct vcpu_talker *table,
+                           struct hax_stats_talker *top, int nr)
+{
+    struct vcpu_talker talkers[VCPU_NR_TALKERS];
+    int i, j, max;
+
+    // The vCPU thread may be updating the table meanwhile
+    memcpy(talkers, table, sizeof(talkers));
+    for (i = 0; i < nr; i++) {
+        max = 0;
+        for (j = 1; j < VCPU_NR_TALKERS; j++) {
+            if (talkers[j].count > talkers[max].count) {
+                max = j;
+            }
+        }
+        top[i].key = talkers[max].count ? talkers[max].key : 0;
+        top[i].count = talkers[max].count;
+        talkers[max].count = 0;
+    }
+}
+
+int vcpu_get_stats(struct vcpu_t *vcpu, struct hax_vcpu_stats *stats)
+{
+    struct vcpu_stats *vs = &vcpu->stats;
+    int i;
+
+    // Lock-free, so the counters may be slightly out of sync with each other
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < min(VCPU_NR_EXIT_REASONS, HAX_STATS_NR_EXIT_REASONS); i++) {
+        struct vcpu_exit_stats *es = &vcpu->exit_stats[i];
+
+        stats->exits[i].count = es->count;
+        stats->exits[i].fast = es->fast;
+        stats->exits[i].resumes = es->resumes;
+        stats->exits[i].resume_cycles = es->resume_cycles;
+        stats->exits[i].handler_cycles = es->handler_cycles;
+    }
+    memcpy(stats->user_exits, vs->user_exits, sizeof(stats->user_exits));
+    memcpy(stats->handler_hist, vs->handler_hist, sizeof(stats->handler_hist));
+    memcpy(stats->guest_hist, vs->guest_hist, sizeof(stats->guest_hist));
+    vcpu_stats_top(vs->io_ports, stats->io_ports, HAX_STATS_NR_TOP);
+    vcpu_stats_top(vs->mmio_pages, stats->mmio_pages, HAX_STATS_NR_TOP);
+    vcpu_stats_top(vs->msrs, stats->msrs, HAX_STATS_NR_TOP);
+    stats->vpid_allocs = vs->vpid_allocs;
+    stats->vpid_flushes = vs->vpid_flushes;
+    stats->vmcs_loads = vs->vmcs_loads;
+    stats->migrations = vs->migrations;
+    return 0;
+}
+
+/*
+ * Appends an event to the trace ring, which must be enabled. Only the vCPU
+ * thread writes to the ring, with vcpu->tmutex held.
+ */
+void vcpu_trace_event(struct vcpu_t *vcpu, uint16_t type, uint32_t info,
+                      uint64_t tsc, uint64_t qualification, uint64_t address)
+{
+    struct hax_trace_ring *ring = vcpu->trace;
+    uint64_t head = ring->head;
+    struct hax_trace_event *event = &ring->events[head & vcpu->trace_mask];
+
+    event->tsc = tsc;
+    event->type = type;
+    event->pad = 0;
+    event->info = info;
+    event->qualification = qualification;
+    event->address = address;
+    // Make sure a reader that sees the new head also sees the event
+    hax_smp_mb();
+    ring->head = head + 1;
+}
+
+/* Records the VM exit that just occurred, with the VMCS still loaded */
+void vcpu_trace_vmexit(struct vcpu_t *vcpu, uint32_t basic_reason,
+                       uint64_t tsc)
+{
+    uint32_t fields = VMCS_CACHE_EXIT_QUALIFICATION;
+    uint64_t address = 0;
+
+    if (basic_reason == VMX_EXIT_EPT_VIOLATION ||
+        basic_reason == VMX_EXIT_EPT_MISCONFIG) {
+        fields |= VMCS_CACHE_EXIT_GPA;
+    }
+    // The exit handler would read these anyway
+    vcpu_vmcs_cache_fetch(vcpu, fields);
+    if (fields & VMCS_CACHE_EXIT_GPA) {
+        address = vmx(vcpu, exit_gpa);
+    } else if (basic_reason == VMX_EXIT_IO) {
+        address = vmx(vcpu, exit_qualification).io.port;
+    }
+    vcpu_trace_event(vcpu, HAX_TRACE_VM_EXIT, basic_reason, tsc,
+                     vmx(vcpu, exit_qualification).raw, address);
+}
+
 static int _vcpu_teardown(struct vcpu_t *vcpu)
 {
     int vcpu_id = vcpu->vcpu_id;
 
+    vcpu_log_exit_stats(vcpu);
+
     if (vcpu->mmio_fetch.kva) {
         gpa_space_unmap_page(&vcpu->vm->gpa_space, &vcpu->mmio_fetch.kmap);
     }
 
-    // TODO: we should call invvpid after calling vcpu_vpid_free().
-    vcpu_vpid_free(vcpu);
-
     if (vcpu->gstate.gfxpage) {
         hax_free_pages(vcpu->gstate.gfxpage);
     }
@@ -561,6 +698,9 @@ int vcpu_teardown(struct vcpu_t *vcpu)
 
     hax_mutex_lock(vm->vm_lock);
     hax_list_del(&vcpu->vcpu_list);
+    if (vm->vcpu_table[vcpu->vcpu_id] == vcpu) {
+        vm->vcpu_table[vcpu->vcpu_id] = NULL;
+    }
     hax_mutex_unlock(vm->vm_lock);
 
     ret = _vcpu_teardown(vcpu);
@@ -589,6 +729,8 @@ static void vcpu_init(struct vcpu_t *vcpu)
 
     vcpu->ref_count = 1;
 
+    vcpu->tsc_ratio = VCPU_TSC_RATIO_ONE;
+    vcpu->tsc_inverse_ratio = VCPU_TSC_RATIO_ONE;
     vcpu->tsc_offset = 0ULL - ia32_rdtsc();
 
     // Prepare the vcpu state to Power-up
@@ -605,7 +747,7 @@ static void vcpu_init(struct vcpu_t *vcpu)
     set_gdt(state, 0, 0xffff);
     set_idt(state, 0, 0xffff);
     get_segment_desc_t(&state->_ldt, 0, 0, 0xffff, 0x82);
-    get_segment_desc_t(&state->_tr, 0, 0, 0xffff, 0x83);
+    get_segment_desc_t(&state->_tr, 0, 0, 0xffff, 0x8b);
 
     state->_dr0 = state->_dr1 = state->_dr2 = state->_dr3 = 0x0;
     state->_dr6 = DR6_SETBITS;
@@ -952,7 +1094,19 @@ static int is_emt64_msr(uint64_t entry)
     return 0;
 }
 
-void save_guest_msr(struct vcpu_t *vcpu)
+/*
+ * The guest values of the MSRs in gmsr_list[] and of IA32_TSC_AUX are not used
+ * by the host kernel, so they may be left in the host processor after VM exit
+ * until the vCPU thread returns to user space or gets scheduled out (see
+ * vcpu_put_guest_msrs()). Meanwhile, the processor is their owner, and the
+ * copy in gstate is stale.
+ */
+static inline bool guest_msrs_live(struct vcpu_t *vcpu)
+{
+    return get_cpu_data(vcpu->cpu_id)->msr_owner == vcpu;
+}
+
+static void save_guest_syscall_msrs(struct vcpu_t *vcpu)
 {
     int i;
     struct gstate *gstate = &vcpu->gstate;
@@ -968,6 +1122,16 @@ void save_guest_msr(struct vcpu_t *vcpu)
     if (cpu_has_feature(X86_FEATURE_RDTSCP)) {
         gstate->tsc_aux = ia32_rdmsr(IA32_TSC_AUX);
     }
+}
+
+void save_guest_msr(struct vcpu_t *vcpu)
+{
+    int i;
+    struct gstate *gstate = &vcpu->gstate;
+
+    if (!vcpu->lazy_host_msrs) {
+        save_guest_syscall_msrs(vcpu);
+    }
 
     if (!hax->apm_version)
         return;
@@ -988,20 +1152,25 @@ void load_guest_msr(struct vcpu_t *vcpu)
     bool em64t_support = cpu_has_feature(X86_FEATURE_EM64T);
     uint32_t count = 0;
 
-    for (i = 0; i < NR_GMSR; ++i) {
-        if (em64t_support || !is_emt64_msr(gstate->gmsr[i].entry)) {
-            gstate->gmsr_autoload[count].index = gstate->gmsr[i].entry;
-            gstate->gmsr_autoload[count++].data = gstate->gmsr[i].value;
+    // Otherwise, the processor already holds the guest values
+    if (!guest_msrs_live(vcpu)) {
+        for (i = 0; i < NR_GMSR; ++i) {
+            if (em64t_support || !is_emt64_msr(gstate->gmsr[i].entry)) {
+                gstate->gmsr_autoload[count].index = gstate->gmsr[i].entry;
+                gstate->gmsr_autoload[count++].data = gstate->gmsr[i].value;
+            }
         }
-    }
 
-    if (cpu_has_feature(X86_FEATURE_RDTSCP)) {
-        gstate->gmsr_autoload[count].index = (uint32_t)IA32_TSC_AUX;
-        gstate->gmsr_autoload[count++].data = gstate->tsc_aux;
+        if (cpu_has_feature(X86_FEATURE_RDTSCP)) {
+            gstate->gmsr_autoload[count].index = (uint32_t)IA32_TSC_AUX;
+            gstate->gmsr_autoload[count++].data = gstate->tsc_aux;
+        }
     }
 
-    if (!hax->apm_version)
+    if (!hax->apm_version) {
+        vmwrite(vcpu, VMX_ENTRY_MSR_LOAD_COUNT, count);
         return;
+    }
 
     // APM v1: restore IA32_PMCx and IA32_PERFEVTSELx
     for (i = 0; i < (int)hax->apm_general_count; ++i) {
@@ -1022,15 +1191,20 @@ static void save_host_msr(struct vcpu_t *vcpu)
     int i;
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
     bool em64t_support = cpu_has_feature(X86_FEATURE_EM64T);
+    bool live = guest_msrs_live(vcpu);
 
     for (i = 0; i < NR_HMSR; i++) {
+        // The processor still holds guest values, the host values saved
+        // before they were loaded remain valid
+        if (live && hmsr_list[i] != IA32_EFER)
+            continue;
         hstate->hmsr[i].entry = hmsr_list[i];
         if (em64t_support || !is_emt64_msr(hmsr_list[i])) {
             hstate->hmsr[i].value = ia32_rdmsr(hstate->hmsr[i].entry);
         }
     }
 
-    if (cpu_has_feature(X86_FEATURE_RDTSCP)) {
+    if (!live && cpu_has_feature(X86_FEATURE_RDTSCP)) {
         hstate->tsc_aux = ia32_rdmsr(IA32_TSC_AUX);
     }
 
@@ -1046,10 +1220,9 @@ static void save_host_msr(struct vcpu_t *vcpu)
     }
 }
 
-static void load_host_msr(struct vcpu_t *vcpu)
+static void load_host_syscall_msrs(struct hstate *hstate, bool efer_only)
 {
     int i;
-    struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
     bool em64t_support = cpu_has_feature(X86_FEATURE_EM64T);
 
     // Load below MSR values manually on VM exits.
@@ -1062,6 +1235,8 @@ static void load_host_msr(struct vcpu_t *vcpu)
     // * IA32_KERNEL_GS_BASE
     //   See IA SDM Vol. 3C 31.10.4.4 (Handling the SWAPGS Instruction).
     for (i = 0; i < NR_HMSR; ++i) {
+        if (efer_only && hstate->hmsr[i].entry != IA32_EFER)
+            continue;
         if (em64t_support || !is_emt64_msr(hstate->hmsr[i].entry)) {
             ia32_wrmsr(hstate->hmsr[i].entry, hstate->hmsr[i].value);
         }
@@ -1070,9 +1245,22 @@ static void load_host_msr(struct vcpu_t *vcpu)
     // * IA32_TSC_AUX
     //   BSOD will occur in host after automatic loading for a while, sometimes
     //   even after VM is shutdown.
-    if (cpu_has_feature(X86_FEATURE_RDTSCP)) {
+    if (!efer_only && cpu_has_feature(X86_FEATURE_RDTSCP)) {
         ia32_wrmsr(IA32_TSC_AUX, hstate->tsc_aux);
     }
+}
+
+static void load_host_msr(struct vcpu_t *vcpu)
+{
+    int i;
+    struct per_cpu_data *cpu_data = get_cpu_data(vcpu->cpu_id);
+    struct hstate *hstate = &cpu_data->hstate;
+
+    // EFER is always restored right away, since it affects the host kernel
+    load_host_syscall_msrs(hstate, vcpu->lazy_host_msrs);
+    if (vcpu->lazy_host_msrs) {
+        cpu_data->msr_owner = vcpu;
+    }
 
     if (!hax->apm_version)
         return;
@@ -1089,6 +1277,25 @@ static void load_host_msr(struct vcpu_t *vcpu)
     }
 }
 
+/*
+ * Stores the guest MSR values left in the current host processor after VM exit
+ * of |vcpu|, if any, back into gstate, and restores the host values.
+ */
+void vcpu_put_guest_msrs(struct vcpu_t *vcpu)
+{
+    struct per_cpu_data *cpu_data;
+    preempt_flag flags;
+
+    hax_disable_preemption(&flags);
+    cpu_data = current_cpu_data();
+    if (cpu_data->msr_owner == vcpu) {
+        save_guest_syscall_msrs(vcpu);
+        load_host_syscall_msrs(&cpu_data->hstate, false);
+        cpu_data->msr_owner = NULL;
+    }
+    hax_enable_preemption(&flags);
+}
+
 static inline bool is_host_debug_enabled(struct vcpu_t *vcpu)
 {
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
@@ -1170,6 +1377,12 @@ static void load_dirty_vmcs_fields(struct vcpu_t *vcpu)
         vmwrite(vcpu, GUEST_FS_BASE, vcpu->state->_fs.base);
         vcpu->fs_base_dirty = 0;
     }
+
+    // EPTP, which changes when EPT accessed flags are turned on for the VM
+    if (vcpu->eptp != vm_get_eptp(vcpu->vm)) {
+        vcpu->eptp = vm_get_eptp(vcpu->vm);
+        vmwrite(vcpu, VMX_EPTP, vcpu->eptp);
+    }
 }
 
 static inline bool is_guest_dr_dirty(struct vcpu_t *vcpu)
@@ -1251,7 +1464,12 @@ static void load_host_xsave_state(struct vcpu_t *vcpu)
     vcpu_state_t *state = vcpu->state;
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
 
-    if ((state->_cr4 & CR4_OSXSAVE) && (vcpu->xcr0 != hstate->xcr0)) {
+    if (vcpu->xcr0 == hstate->xcr0)
+        return;
+
+    // CR4.OSXSAVE is owned by the guest
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
+    if (state->_cr4 & CR4_OSXSAVE) {
         ia32_xsetbv(XCR_XFEATURE_ENABLED_MASK, hstate->xcr0);
     }
 }
@@ -1261,26 +1479,25 @@ static void load_guest_xsave_state(struct vcpu_t *vcpu)
     vcpu_state_t *state = vcpu->state;
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
 
-    if ((state->_cr4 & CR4_OSXSAVE) && (vcpu->xcr0 != hstate->xcr0)) {
+    if (vcpu->xcr0 == hstate->xcr0)
+        return;
+
+    // CR4.OSXSAVE is owned by the guest
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
+    if (state->_cr4 & CR4_OSXSAVE) {
         ia32_xsetbv(XCR_XFEATURE_ENABLED_MASK, vcpu->xcr0);
     }
 }
 
-void vcpu_save_host_state(struct vcpu_t *vcpu)
+/*
+ * Writes the host state fields that only depend on the host CPU. These include
+ * MSRs, which are slow to read, so this is skipped altogether (see
+ * vcpu_save_host_state()) unless the vCPU has moved to another CPU.
+ */
+static void vcpu_save_host_cpu_state(struct vcpu_t *vcpu)
 {
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
 
-    // In case we do not know the specific operations with different OSes,
-    // we save all of them at the initial time
-    uint16_t gs = get_kernel_gs();
-    uint16_t fs = get_kernel_fs();
-
-    get_kernel_gdt(&hstate->host_gdtr);
-    get_kernel_idt(&hstate->host_idtr);
-
-    vmwrite(vcpu, HOST_CR3, get_cr3());
-    vmwrite(vcpu, HOST_CR4, get_cr4());
-
     hstate->_efer = ia32_rdmsr(IA32_EFER);
 
     if (vmx(vcpu, exit_ctls) & EXIT_CONTROL_LOAD_EFER) {
@@ -1306,6 +1523,37 @@ void vcpu_save_host_state(struct vcpu_t *vcpu)
         hax_log(HAX_LOGD, "Kernel SS %x with 0x7\n", get_kernel_ss());
     }
 
+    vmwrite(vcpu, HOST_TR_SELECTOR, get_kernel_tr_selector());
+    vmwrite(vcpu, HOST_TR_BASE, get_kernel_tr_base());
+    vmwrite(vcpu, HOST_GDTR_BASE, get_kernel_gdtr_base_4vmcs());
+    vmwrite(vcpu, HOST_IDTR_BASE, get_kernel_idtr_base());
+
+    // Handle SYSENTER/SYSEXIT MSR
+    vmwrite(vcpu, HOST_SYSENTER_CS, ia32_rdmsr(IA32_SYSENTER_CS));
+    vmwrite(vcpu, HOST_SYSENTER_EIP, ia32_rdmsr(IA32_SYSENTER_EIP));
+    vmwrite(vcpu, HOST_SYSENTER_ESP, ia32_rdmsr(IA32_SYSENTER_ESP));
+}
+
+void vcpu_save_host_state(struct vcpu_t *vcpu)
+{
+    struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
+
+    // In case we do not know the specific operations with different OSes,
+    // we save all of them at the initial time
+    uint16_t gs = get_kernel_gs();
+    uint16_t fs = get_kernel_fs();
+
+    get_kernel_gdt(&hstate->host_gdtr);
+    get_kernel_idt(&hstate->host_idtr);
+
+    vmwrite(vcpu, HOST_CR3, get_cr3());
+    vmwrite(vcpu, HOST_CR4, get_cr4());
+
+    if (vmx(vcpu, host_cpu_state_of) != vcpu->cpu_id + 1) {
+        vcpu_save_host_cpu_state(vcpu);
+        vmx(vcpu, host_cpu_state_of) = vcpu->cpu_id + 1;
+    }
+
     vmwrite(vcpu, HOST_DS_SELECTOR, get_kernel_ds() & 0xfff8);
     if (get_kernel_ds() & 0x7) {
         hstate->ds = get_kernel_ds();
@@ -1367,16 +1615,6 @@ void vcpu_save_host_state(struct vcpu_t *vcpu)
 #endif
     }
 
-    vmwrite(vcpu, HOST_TR_SELECTOR, get_kernel_tr_selector());
-    vmwrite(vcpu, HOST_TR_BASE, get_kernel_tr_base());
-    vmwrite(vcpu, HOST_GDTR_BASE, get_kernel_gdtr_base_4vmcs());
-    vmwrite(vcpu, HOST_IDTR_BASE, get_kernel_idtr_base());
-
-    // Handle SYSENTER/SYSEXIT MSR
-    vmwrite(vcpu, HOST_SYSENTER_CS, ia32_rdmsr(IA32_SYSENTER_CS));
-    vmwrite(vcpu, HOST_SYSENTER_EIP, ia32_rdmsr(IA32_SYSENTER_EIP));
-    vmwrite(vcpu, HOST_SYSENTER_ESP, ia32_rdmsr(IA32_SYSENTER_ESP));
-
     // LDTR is unusable from spec, do we need ldt for host?
     hstate->ldt_selector = get_kernel_ldt();
 
@@ -1447,13 +1685,20 @@ static void fill_common_vmcs(struct vcpu_t *vcpu)
         ((uint64_t)SECONDARY_CONTROLS << 32)) != 0) {
         if ((ia32_rdmsr(IA32_VMX_SECONDARY_CTLS) &
             ((uint64_t)ENABLE_VPID << 32)) != 0) {
-            if (0 != vcpu->vpid) {
+            // The VPID is assigned before each VM entry (see
+            // vcpu_vpid_update())
+            if (invvpid_has_all_context()) {
                 scpu_ctls |= ENABLE_VPID;
-                vmwrite(vcpu, VMX_VPID, vcpu->vpid);
             }
         }
     }
 
+    // Let a guest spinning on a lock held by a preempted vCPU give up the host
+    // CPU (cf. Intel SDM Vol. 3C Table 24-7, bit 10: PAUSE-loop exiting)
+    if (config.ple_gap > 0) {
+        scpu_ctls |= PAUSE_LOOP_EXITING;
+    }
+
     // Make the INVPCID instruction available to the guest if the host supports
     // it (cf. Intel SDM Vol. 3C Table 24-7, bit 12: Enable INVPCID)
     if (cpu_has_feature(X86_FEATURE_INVPCID)) {
@@ -1461,6 +1706,11 @@ static void fill_common_vmcs(struct vcpu_t *vcpu)
         scpu_ctls |= ENABLE_INVPCID;
     }
 
+    // Enable TSC scaling whenever the host supports it, so that the guest TSC
+    // frequency can be changed later on (see vcpu_set_tsc_khz()). With the
+    // default multiplier of 1.0 the guest TSC runs at the host frequency.
+    scpu_ctls |= USE_TSC_SCALING;
+
 #ifdef HAX_ARCH_X86_64
     exit_ctls = EXIT_CONTROL_HOST_ADDR_SPACE_SIZE | EXIT_CONTROL_LOAD_EFER |
                 EXIT_CONTROL_SAVE_DEBUG_CONTROLS | EXIT_CONTROL_LOAD_PAT;
@@ -1534,6 +1784,17 @@ static void fill_common_vmcs(struct vcpu_t *vcpu)
         WRITE_CONTROLS(vcpu, VMX_SECONDARY_PROCESSOR_CONTROLS, scpu_ctls);
     }
 
+    // WRITE_CONTROLS() has cleared PAUSE_LOOP_EXITING if it is not supported
+    if (scpu_ctls & PAUSE_LOOP_EXITING) {
+        vmwrite(vcpu, VMX_PLE_GAP, config.ple_gap);
+        vmwrite(vcpu, VMX_PLE_WINDOW, config.ple_window);
+    }
+
+    // Likewise for USE_TSC_SCALING
+    if (scpu_ctls & USE_TSC_SCALING) {
+        vmwrite(vcpu, VMX_TSC_MULTIPLIER, vcpu->tsc_ratio);
+    }
+
     vcpu_update_exception_bitmap(vcpu);
 
     WRITE_CONTROLS(vcpu, VMX_EXIT_CONTROLS, exit_ctls);
@@ -1594,8 +1855,6 @@ static void vcpu_prepare(struct vcpu_t *vcpu)
     hax_mutex_unlock(vcpu->tmutex);
 }
 
-static void vcpu_exit_fpu_state(struct vcpu_t *vcpu);
-
 void vcpu_load_host_state(struct vcpu_t *vcpu)
 {
     struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
@@ -1639,7 +1898,7 @@ void vcpu_load_host_state(struct vcpu_t *vcpu)
     load_host_dr(vcpu);
     load_host_xsave_state(vcpu);
 
-    vcpu_exit_fpu_state(vcpu);
+    // The guest FPU state is left loaded (see vcpu_release_fpu())
 }
 
 void vcpu_save_guest_state(struct vcpu_t *vcpu)
@@ -1741,7 +2000,7 @@ static void handle_io_post(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 
     if (htun->io._flags == 1) {
         size = htun->io._count * htun->io._size;
-        if (!vcpu_write_guest_virtual(vcpu, htun->io._vaddr, IOS_MAX_BUFFER,
+        if (!vcpu_write_guest_virtual(vcpu, htun->io._vaddr, vcpu->io_buf_size,
                                       (void *)vcpu->io_buf, size, 0)) {
             vcpu_set_panic(vcpu);
             hax_log(HAX_LOGPANIC, "Unexpected page fault, kill the VM!\n");
@@ -1776,7 +2035,21 @@ int vcpu_execute(struct vcpu_t *vcpu)
     int err = 0;
 
     hax_mutex_lock(vcpu->tmutex);
+    vcpu_trace(vcpu, HAX_TRACE_USER_ENTRY, 0, ia32_rdtsc());
+    // The VM is being saved, restored, frozen or reclaimed (see
+    // hax_vm_stop_vcpus()), so leave the VCPU state, including the registers
+    // page, alone
+    if (hax_test_bit(VM_STATE_FLAGS_STOPPED, &vcpu->vm->flags)) {
+        htun->_exit_status = HAX_EXIT_PAUSED;
+        goto out_stopped;
+    }
+    if (vcpu->regs_page) {
+        err = vcpu_load_regs_page(vcpu);
+        if (err)
+            goto out;
+    }
     hax_log(HAX_LOGD, "vcpu begin to run....\n");
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
     // QEMU will do realmode stuff for us
     if (!hax->ug_enable_flag && !(vcpu->state->_cr0 & CR0_PE)) {
         htun->_exit_reason = 0;
@@ -1805,8 +2078,9 @@ int vcpu_execute(struct vcpu_t *vcpu)
         }
     }
 
-    // Check if Qemu pauses VM
-    if (htun->_exit_reason == HAX_EXIT_PAUSED) {
+    // Check if Qemu pauses VM, or if the VM has become a template for clones
+    if (htun->_exit_reason == HAX_EXIT_PAUSED ||
+        hax_test_bit(VM_STATE_FLAGS_FROZEN, &vcpu->vm->flags)) {
         htun->_exit_status = HAX_EXIT_PAUSED;
         hax_log(HAX_LOGD, "vcpu paused\n");
         goto out;
@@ -1814,6 +2088,7 @@ int vcpu_execute(struct vcpu_t *vcpu)
 
     err = cpu_vmx_execute(vcpu, htun);
     vcpu_is_panic(vcpu);
+    hax_vm_ws_tick(vcpu->vm);
 out:
     if (err) {
         vcpu->cur_state = GS_STALE;
@@ -1821,6 +2096,12 @@ out:
         vcpu_is_panic(vcpu);
     }
     htun->apic_base = vcpu->gstate.apic_base;
+    if (vcpu->regs_page) {
+        vcpu_sync_regs_page(vcpu);
+    }
+out_stopped:
+    vcpu_stats_user_exit(vcpu, htun);
+    vcpu_trace(vcpu, HAX_TRACE_USER_EXIT, htun->_exit_status, ia32_rdtsc());
     hax_mutex_unlock(vcpu->tmutex);
 
     return err;
@@ -1843,6 +2124,45 @@ int vcpu_vmexit_handler(struct vcpu_t *vcpu, exit_reason_t exit_reason,
     return ret;
 }
 
+/*
+ * Handles the VM exit right after it occurs, with the VMCS still loaded and
+ * interrupts disabled, if it is one of the frequent exits whose handler never
+ * sleeps nor needs user space (e.g. CPUID or WRMSR to a syscall MSR).
+ * Returns true if the exit has been handled and the guest can be re-entered
+ * right away, false if it must go through vcpu_vmexit_handler() instead.
+ * This function must be protected by _tmutex.
+ */
+bool vcpu_fast_vmexit_handler(struct vcpu_t *vcpu, exit_reason_t exit_reason,
+                              struct hax_tunnel *htun)
+{
+    uint basic_reason = exit_reason.basic_reason;
+    int ret;
+
+    switch (basic_reason) {
+        case VMX_EXIT_CPUID:
+        case VMX_EXIT_XSETBV: {
+            break;
+        }
+        case VMX_EXIT_MSR_READ:
+        case VMX_EXIT_MSR_WRITE: {
+            if (!vcpu_msr_has_fast_path(vcpu->state->_ecx,
+                                        basic_reason == VMX_EXIT_MSR_WRITE))
+                return false;
+            break;
+        }
+        default: {
+            return false;
+        }
+    }
+
+    vmx(vcpu, exit_reason) = exit_reason;
+    vcpu->event_injected = 0;
+    // These handlers never return to user space, and must not be run twice
+    ret = handler_funcs[basic_reason](vcpu, htun);
+    hax_assert(ret == HAX_RESUME);
+    return true;
+}
+
 static void advance_rip(struct vcpu_t *vcpu)
 {
     struct vcpu_state_t *state = vcpu->state;
@@ -1857,6 +2177,7 @@ static void advance_rip(struct vcpu_t *vcpu)
         vcpu->interruptibility_dirty = 1;
     }
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_INSTR_LENGTH);
     state->_rip += vmx(vcpu, exit_instr_length);
     vcpu->rip_dirty = 1;
 }
@@ -1869,7 +2190,6 @@ void vcpu_vmread_all(struct vcpu_t *vcpu)
     if (vcpu->cur_state == GS_STALE) {
         preempt_flag flags;
 
-        // CRs were already updated
         // TODO: Always read RIP, RFLAGs, maybe reduce them in future!
         if ((vmcs_err = load_vmcs(vcpu, &flags))) {
             vcpu_set_panic(vcpu);
@@ -1890,6 +2210,8 @@ void vcpu_vmread_all(struct vcpu_t *vcpu)
         VMREAD_SEG(vcpu, CS, state->_cs);
         VMREAD_SEG(vcpu, DS, state->_ds);
         VMREAD_SEG(vcpu, ES, state->_es);
+        vmx(vcpu, vmcs_cache_valid) |= VMCS_CACHE_RSP | VMCS_CACHE_SEGS;
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
         if (!vcpu->fs_base_dirty)
             VMREAD_SEG(vcpu, FS, state->_fs);
         VMREAD_SEG(vcpu, GS, state->_gs);
@@ -1937,6 +2259,9 @@ void vcpu_vmwrite_all(struct vcpu_t *vcpu)
             vmx(vcpu, interruptibility_state).raw);
 
     vmwrite_cr(vcpu);
+    // The VMCS now matches vcpu->state
+    vmx(vcpu, vmcs_cache_valid) |= VMCS_CACHE_RSP | VMCS_CACHE_SEGS |
+                                   VMCS_CACHE_CRS;
 }
 
 // Prepares the values (4 GPAs) to be loaded into VMCS fields PDPTE{0..3}.
@@ -1946,20 +2271,26 @@ void vcpu_vmwrite_all(struct vcpu_t *vcpu)
 // Returns 0 on success, < 0 on error.
 static int vcpu_prepare_pae_pdpt(struct vcpu_t *vcpu)
 {
-    uint64_t cr3 = vcpu->state->_cr3;
+    uint64_t cr3;
     int pdpt_size = (int)sizeof(vcpu->pae_pdptes);
+    uint64_t gpa;
+    int ret;
+
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
+    cr3 = vcpu->state->_cr3;
     // CR3 is the GPA of the page-directory-pointer table. According to IASDM
     // Vol. 3A 4.4.1, Table 4-7, bits 63..32 and 4..0 of this GPA are ignored.
-    uint64_t gpa = cr3 & 0xffffffe0;
-    int ret;
+    gpa = cr3 & 0xffffffe0;
 
     // On Mac, the following call may somehow cause the XNU kernel to preempt
     // the current process (QEMU), even if preemption has been previously
     // disabled via hax_disable_preemption() (which is implemented on Mac by
     // simply disabling IRQs). Therefore, it is not safe to call this function
     // with preemption disabled.
+    hax_mutex_lock(vcpu->vm->gpa_space.lock);
     ret = gpa_space_read_data(&vcpu->vm->gpa_space, gpa, pdpt_size,
                               (uint8_t *)vcpu->pae_pdptes);
+    hax_mutex_unlock(vcpu->vm->gpa_space.lock);
     // The PAE PDPT cannot span two page frames
     if (ret != pdpt_size) {
         hax_log(HAX_LOGE, "%s: Failed to read PAE PDPT: cr3=0x%llx, ret=%d\n",
@@ -1970,6 +2301,7 @@ static int vcpu_prepare_pae_pdpt(struct vcpu_t *vcpu)
     return 0;
 }
 
+// The caller must have fetched VMCS_CACHE_CRS, see vcpu_vmcs_cache_fetch()
 static void vmwrite_cr(struct vcpu_t *vcpu)
 {
     struct vcpu_state_t *state = vcpu->state;
@@ -2050,6 +2382,7 @@ static void vmwrite_cr(struct vcpu_t *vcpu)
         vcpu->pae_pdpt_dirty = 0;
     }
     vmwrite(vcpu, VMX_EPTP, eptp);
+    vcpu->eptp = eptp;
     // pcpu_ctls |= RDTSC_EXITING;
 
     vmwrite(vcpu, GUEST_CR0, cr0);
@@ -2098,11 +2431,16 @@ static void vmwrite_cr(struct vcpu_t *vcpu)
 
 static void vcpu_enter_fpu_state(struct vcpu_t *vcpu)
 {
-    struct hstate *hstate = &get_cpu_data(vcpu->cpu_id)->hstate;
+    struct per_cpu_data *cpu_data = get_cpu_data(vcpu->cpu_id);
+    struct hstate *hstate = &cpu_data->hstate;
     struct gstate *gstate = &vcpu->gstate;
     struct fx_layout *hfx = (struct fx_layout *)hax_page_va(hstate->hfxpage);
     struct fx_layout *gfx = (struct fx_layout *)hax_page_va(gstate->gfxpage);
 
+    // Still loaded since the last VM exit
+    if (cpu_data->fpu_owner == vcpu)
+        return;
+
     hstate->cr0_ts = !!(get_cr0() & CR0_TS);
 
     // Before executing any FPU instruction (e.g. FXSAVE) in host kernel
@@ -2112,6 +2450,7 @@ static void vcpu_enter_fpu_state(struct vcpu_t *vcpu)
 
     hax_fxsave((mword *)hfx);
     hax_fxrstor((mword *)gfx);
+    cpu_data->fpu_owner = vcpu;
 }
 
 static void vcpu_exit_fpu_state(struct vcpu_t *vcpu)
@@ -2131,6 +2470,23 @@ static void vcpu_exit_fpu_state(struct vcpu_t *vcpu)
     }
 }
 
+/*
+ * Saves the guest FPU state, which stays loaded in the host processor across
+ * the VM exits handled with interrupts disabled, and restores the host FPU
+ * state. Must be called with interrupts disabled, before the host may use the
+ * FPU again, i.e. before interrupts are re-enabled after VM exit.
+ */
+void vcpu_release_fpu(struct vcpu_t *vcpu)
+{
+    struct per_cpu_data *cpu_data = get_cpu_data(vcpu->cpu_id);
+
+    if (cpu_data->fpu_owner != vcpu)
+        return;
+
+    vcpu_exit_fpu_state(vcpu);
+    cpu_data->fpu_owner = NULL;
+}
+
 static bool qemu_support_fastmmio(struct vcpu_t *vcpu)
 {
     struct vm_t *vm = vcpu->vm;
@@ -2160,10 +2516,14 @@ static int vcpu_emulate_insn(struct vcpu_t *vcpu)
     em_mode_t mode;
     em_context_t *em_ctxt = &vcpu->emulate_ctxt;
     uint8_t instr[INSTR_MAX_LEN] = {0};
-    uint64_t cs_base = vcpu->state->_cs.base;
+    uint64_t cs_base;
     uint64_t rip = vcpu->state->_rip;
     uint64_t va;
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_INSTR_LENGTH |
+                          VMCS_CACHE_SEGS | VMCS_CACHE_CRS);
+    cs_base = vcpu->state->_cs.base;
+
     // Clean up the emulation context of the previous MMIO instruction, so that
     // even if things go wrong, the behavior will still be predictable.
     vcpu_init_emulator(vcpu);
@@ -2232,6 +2592,10 @@ static uint64_t vcpu_read_gpr(void *obj, uint32_t reg_index)
         hax_log(HAX_LOGPANIC, "vcpu_read_gpr: Invalid register index\n");
         return 0;
     }
+    // RSP is only read from the VMCS on demand
+    if (reg_index == REG_RSP) {
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_RSP);
+    }
     return vcpu->state->_regs[reg_index];
 }
 
@@ -2243,7 +2607,14 @@ static void vcpu_write_gpr(void *obj, uint32_t reg_index, uint64_t value)
         hax_log(HAX_LOGPANIC, "vcpu_write_gpr: Invalid register index\n");
         return;
     }
+    // Otherwise a later fetch would overwrite the new value
+    if (reg_index == REG_RSP) {
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_RSP);
+    }
     vcpu->state->_regs[reg_index] = value;
+    if (reg_index == REG_RSP) {
+        vmwrite(vcpu, GUEST_RSP, value);
+    }
 }
 
 uint64_t vcpu_read_rflags(void *obj)
@@ -2262,6 +2633,8 @@ void vcpu_write_rflags(void *obj, uint64_t value)
 static uint64_t vcpu_get_segment_base(void *obj, uint32_t segment)
 {
     struct vcpu_t *vcpu = obj;
+
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_SEGS);
     switch (segment) {
     case SEG_CS:
         return vcpu->state->_cs.base;
@@ -2293,6 +2666,7 @@ static em_status_t vcpu_read_memory(void *obj, uint64_t ea, uint64_t *value,
     uint64_t pa;
 
     if (flags & EM_OPS_NO_TRANSLATION) {
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_GPA);
         pa = vmx(vcpu, exit_gpa);
     } else {
         vcpu_translate(vcpu, ea, 0, &pa, NULL, false);
@@ -2331,6 +2705,7 @@ static em_status_t vcpu_write_memory(void *obj, uint64_t ea, uint64_t *value,
     uint64_t pa;
 
     if (flags & EM_OPS_NO_TRANSLATION) {
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_GPA);
         pa = vmx(vcpu, exit_gpa);
     } else {
         vcpu_translate(vcpu, ea, 0, &pa, NULL, false);
@@ -2381,6 +2756,8 @@ static int exit_exc_nmi(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     struct vcpu_state_t *state = vcpu->state;
     interruption_info_t exit_intr_info;
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_INTR_INFO |
+                          VMCS_CACHE_EXIT_QUALIFICATION);
     exit_intr_info.raw = vmx(vcpu, exit_intr_info).raw;
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
     hax_log(HAX_LOGD, "exception vmexit vector:%x\n", exit_intr_info.vector);
@@ -2534,6 +2911,85 @@ static int exit_cpuid(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     return HAX_RESUME;
 }
 
+/*
+ * Busy-waits for up to the current poll window of the vCPU for its timer
+ * deadline (see vcpu_arm_preemption_timer()) to expire. This is the only event
+ * that HAXM can see coming without help from user space: other interrupts are
+ * queued by HAX_VCPU_IOCTL_INTERRUPT, which is issued by this very thread.
+ * Gives up early if user space raises an event, the vCPU is
+ * paused or the thread has a signal pending, since all of them need a return
+ * to user space anyway.
+ * The window adapts to the outcome within [halt_poll_start_cycles,
+ * halt_poll_max_cycles] (see struct config_t).
+ * Returns true if the deadline has expired (and has been cleared), false
+ * otherwise.
+ */
+static bool vcpu_halt_poll(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    uint64_t window, start, min_window, max_window, deadline, now;
+    bool hit = false;
+
+    if (config.halt_poll_max_cycles <= 0)
+        return false;
+    deadline = htun->timer_deadline;
+    if (!deadline || !(vmx(vcpu, pin_ctls) & VMX_TIMER_EXITING))
+        return false;
+
+    max_window = (uint64_t)config.halt_poll_max_cycles;
+    min_window = (uint64_t)config.halt_poll_start_cycles;
+    if (min_window > max_window) {
+        min_window = max_window;
+    }
+    window = vcpu->halt_poll_cycles;
+    if (window < min_window || window > max_window) {
+        window = min_window;
+    }
+
+    // Do not bother if the deadline is (roughly) beyond the window, which is
+    // in host TSC cycles while the deadline is a guest TSC value
+    start = ia32_rdtsc();
+    now = vcpu_guest_tsc(vcpu);
+    if (deadline > now &&
+        vcpu_guest_to_host_ticks(vcpu, deadline - now) > window)
+        return false;
+
+    do {
+        // Each of these needs a return to user space
+        if ((*(volatile uint32_t *)&htun->user_event_pending & 1) ||
+            vcpu->paused || proc_event_pending(vcpu))
+            return false;
+        if (vcpu_guest_tsc(vcpu) >= deadline) {
+            hit = true;
+            break;
+        }
+        asm_pause();
+    } while (ia32_rdtsc() - start < window);
+
+    if (hit) {
+        // The deadline is one-shot (see exit_preemption_timer())
+        htun->timer_deadline = 0;
+        vcpu->halt_poll_success++;
+        if (config.halt_poll_grow > 1) {
+            window *= (uint64_t)config.halt_poll_grow;
+        }
+    } else {
+        vcpu->halt_poll_fail++;
+        if (config.halt_poll_shrink > 1) {
+            window /= (uint64_t)config.halt_poll_shrink;
+        }
+    }
+    if (window < min_window) {
+        window = min_window;
+    } else if (window > max_window) {
+        window = max_window;
+    }
+    vcpu->halt_poll_cycles = window;
+
+    htun->halt_poll_success = vcpu->halt_poll_success;
+    htun->halt_poll_fail = vcpu->halt_poll_fail;
+    return hit;
+}
+
 static int exit_hlt(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 {
     int vector;
@@ -2545,6 +3001,12 @@ static int exit_hlt(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     if (hax_valid_vector(vector))
         return HAX_RESUME;
 
+    // If the timer deadline expires while polling, user space can inject the
+    // timer interrupt right away instead of putting the vCPU to sleep first
+    if (vcpu_halt_poll(vcpu, htun)) {
+        htun->_exit_status = HAX_EXIT_TIMER;
+    }
+
     htun->ready_for_interrupt_injection = 1;
     return HAX_EXIT;
 }
@@ -2573,6 +3035,8 @@ static int exit_cr_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_QUALIFICATION |
+                          VMCS_CACHE_CRS);
     cr = vmx(vcpu, exit_qualification).cr.creg;
 
     switch (vmx(vcpu, exit_qualification).cr.type) {
@@ -2582,7 +3046,8 @@ static int exit_cr_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 
             if (cr == 8) {
                 // TODO: Redirect CR8 write to user space (emulated APIC.TPR)
-                hax_log(HAX_LOGW, "Ignored guest CR8 write, val=0x%llx\n", val);
+                hax_log_ratelimited(HAX_LOGW, "Ignored guest CR8 write, "
+                                    "val=0x%llx\n", val);
                 break;
             }
 
@@ -2655,6 +3120,14 @@ static int exit_cr_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
                 break;
             }
             vcpu_write_cr(state, cr, val);
+            // These changes invalidate the TLB entries of the current VPID
+            // (see IASDM Vol. 3A 4.10.4.1), which the emulated write must do
+            // as well
+            if ((cr == 0 && ((val ^ old_val) & CR0_PG)) ||
+                (cr == 4 && ((val ^ old_val) & (CR4_PAE | CR4_PGE | CR4_PSE |
+                                                CR4_PCIDE)))) {
+                vcpu_vpid_invalidate(vcpu);
+            }
 
             if (is_ept_pae) {
                 // The vCPU is either about to enter PAE paging mode (see IASDM
@@ -2756,13 +3229,17 @@ static int exit_cr_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 static int exit_dr_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 {
     uint64_t *dr = NULL;
-    int dreg = vmx(vcpu, exit_qualification.dr.dreg);
-    int gpr_reg = vmx(vcpu, exit_qualification).dr.gpr;
+    int dreg, gpr_reg;
     bool hbreak_enabled = !!(vcpu->debug_control & HAX_DEBUG_USE_HW_BP);
     struct vcpu_state_t *state = vcpu->state;
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_QUALIFICATION |
+                          VMCS_CACHE_CRS);
+    dreg = vmx(vcpu, exit_qualification.dr.dreg);
+    gpr_reg = vmx(vcpu, exit_qualification).dr.gpr;
+
     // General Detect(GD) Enable flag
     if (state->_dr7 & DR7_GD) {
         state->_dr7 &= ~(uint64_t)DR7_GD;
@@ -2865,8 +3342,12 @@ static int handle_string_io(struct vcpu_t *vcpu, exit_qualification_t *qual,
     elem_size = htun->io._size;
     total_size = count * elem_size;
 
-    // Number of data elements to copy
-    n = total_size > IOS_MAX_BUFFER ? IOS_MAX_BUFFER / elem_size : (uint)count;
+    // Number of data elements to copy. The I/O buffer may span several pages
+    // (see hax_vcpu_setup_hax_tunnel()), and so may the guest buffer: both
+    // vcpu_read_guest_virtual() and vcpu_write_guest_virtual() translate the
+    // GVA range page by page.
+    n = total_size > vcpu->io_buf_size ? vcpu->io_buf_size / elem_size
+                                       : (uint)count;
     htun->io._count = n;
     copy_size = n * elem_size;
 
@@ -2890,7 +3371,7 @@ static int handle_string_io(struct vcpu_t *vcpu, exit_qualification_t *qual,
 
     if (qual->io.direction == HAX_IO_OUT) {
         if (!vcpu_read_guest_virtual(vcpu, start_gva, vcpu->io_buf,
-                                     IOS_MAX_BUFFER, copy_size, 0)) {
+                                     vcpu->io_buf_size, copy_size, 0)) {
             vcpu_set_panic(vcpu);
             hax_log(HAX_LOGPANIC, "%s: vcpu_read_guest_virtual() failed,"
                     " start_gva=0x%llx, elem_size=%u, count=%llu\n",
@@ -2960,6 +3441,7 @@ static int exit_io_access(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     exit_qualification_t *qual = &vmx(vcpu, exit_qualification);
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
 
     // Clear all the fields before using them
     htun->io._direction = 0;
@@ -2988,6 +3470,7 @@ static int exit_msr_read(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     uint64_t val;
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    vcpu_stats_talker(vcpu->stats.msrs, msr);
 
     if (!handle_msr_read(vcpu, msr, &val)) {
         state->_rax = val & 0xffffffff;
@@ -3008,6 +3491,7 @@ static int exit_msr_write(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     uint64_t val = (uint64_t)(state->_edx) << 32 | state->_eax;
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    vcpu_stats_talker(vcpu->stats.msrs, msr | 1ULL << 32);
 
     if (handle_msr_write(vcpu, msr, val, false)) {
         hax_inject_exception(vcpu, VECTOR_GP, 0);
@@ -3018,240 +3502,12 @@ static int exit_msr_write(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     return HAX_RESUME;
 }
 
-/*
- * Returns 0 if handled, else returns 1
- * According to the caller, return 1 will cause GP to guest
- */
-static int misc_msr_read(struct vcpu_t *vcpu, uint32_t msr, uint64_t *val)
-{
-    mtrr_var_t *v;
-
-    if (msr >= IA32_MTRR_PHYSBASE0 && msr <= IA32_MTRR_PHYSMASK9) {
-        hax_assert((msr >> 1 & 0x7f) < NUM_VARIABLE_MTRRS);
-        v = &vcpu->mtrr_current_state.mtrr_var[msr >> 1 & 0x7f];
-        *val = msr & 1 ? v->mask.raw : v->base.raw;
-        return 0;
-    } else if (msr >= MTRRFIX16K_80000 && msr <= MTRRFIX16K_A0000) {
-        *val = vcpu->mtrr_current_state.mtrr_fixed16k[msr & 0x1];
-        return 0;
-    } else if (msr >= MTRRFIX4K_C0000 && msr <= MTRRFIX4K_F8000) {
-        *val = vcpu->mtrr_current_state.mtrr_fixed4k[msr & 0x7];
-        return 0;
-    } else if ((msr >= IA32_MC0_CTL2 && msr <= IA32_MC8_CTL2) ||
-               (msr >= 0x300 && msr <= 0x3ff)) {
-        *val = 0;
-        return 0;
-    }
-
-    return 1;
-}
-
-static int handle_msr_read(struct vcpu_t *vcpu, uint32_t msr, uint64_t *val)
-{
-    int index, r = 0;
-    struct vcpu_state_t *state = vcpu->state;
-    struct gstate *gstate = &vcpu->gstate;
-
-    switch (msr) {
-        case IA32_TSC: {
-            *val = vcpu->tsc_offset + ia32_rdtsc();
-            break;
-        }
-        case IA32_FEATURE_CONTROL: {
-            *val = 0x5u;
-            break;
-        }
-        case IA32_PLATFORM_ID: {
-            *val = 0x18000000000000ULL;
-            break;
-        }
-        case IA32_APIC_BASE: {
-            *val = gstate->apic_base;
-            break;
-        }
-        case IA32_EFER: {
-            *val = state->_efer;
-            break;
-        }
-        case IA32_STAR:
-        case IA32_LSTAR:
-        case IA32_CSTAR:
-        case IA32_SF_MASK:
-        case IA32_KERNEL_GS_BASE: {
-            for (index = 0; index < NR_GMSR; index++) {
-                if (gstate->gmsr[index].entry == msr) {
-                    *val = gstate->gmsr[index].value;
-                    break;
-                }
-                *val = 0;
-            }
-            break;
-        }
-        case IA32_TSC_AUX: {
-            if (!cpu_has_feature(X86_FEATURE_RDTSCP)) {
-                r = 1;
-                break;
-            }
-            *val = gstate->tsc_aux & 0xFFFFFFFF;
-            break;
-        }
-        case IA32_FS_BASE: {
-            if (vcpu->fs_base_dirty)
-                *val = vcpu->state->_fs.base;
-            else
-                *val = vmread(vcpu, GUEST_FS_BASE);
-            break;
-        }
-        case IA32_GS_BASE: {
-            *val = vmread(vcpu, GUEST_GS_BASE);
-            break;
-        }
-        case IA32_SYSENTER_CS: {
-            *val = state->_sysenter_cs;
-            break;
-        }
-        case IA32_SYSENTER_ESP: {
-            *val = state->_sysenter_esp;
-            break;
-        }
-        case IA32_SYSENTER_EIP: {
-            *val = state->_sysenter_eip;
-            break;
-        }
-        // FIXME: Not fully implemented - just restore what guest wrote to MTRR
-        case IA32_MTRRCAP: {
-            *val = vcpu->mtrr_current_state.mtrr_cap.raw;
-            break;
-        }
-        case MTRRFIX64K_00000: {
-            *val = vcpu->mtrr_current_state.mtrr_fixed64k;
-            break;
-        }
-        case IA32_CR_PAT: {
-            *val = vcpu->cr_pat;
-            break;
-        }
-        case IA32_MTRR_DEF_TYPE: {
-            *val = vcpu->mtrr_current_state.mtrr_def_type.raw;
-            break;
-        }
-        case IA32_MCG_CAP: {
-            // 1 MC reporting reg
-            *val = 1;
-            break;
-        }
-        case IA32_MCG_STATUS: {
-            *val = 0;
-            break;
-        }
-        case IA32_MCG_CTL: {
-            *val = 0x3;
-            break;
-        }
-        case IA32_MC0_CTL:
-        case IA32_P5_MC_TYPE: // P4 Maps P5_Type to Status
-        case IA32_MC0_STATUS: {
-            *val = 0;
-            break;
-        }
-        case IA32_P5_MC_ADDR: // P4 Maps P5_Type to Status
-        case IA32_MC0_ADDR: {
-            *val = 0;
-            break;
-        }
-        case IA32_MC0_MISC: {
-            *val = 0;
-            break;
-        }
-        case IA32_THERM_DIODE_OFFSET: {
-            *val = 0;
-            break;
-        }
-        case IA32_FSB_FREQ: {
-            *val = 4;
-            break;
-        }
-        case IA32_TEMP_TARGET: {
-            *val = 0x86791b00;
-            break;
-        }
-        case IA32_BBL_CR_CTL3: {
-            *val = 0xbe702111;
-            break;
-        }
-        case IA32_DEBUGCTL: {
-            // TODO: Will this still work when we support APM v2?
-            *val = 0;
-            break;
-        }
-        case IA32_CPUID_FEATURE_MASK: {
-            cpuid_get_features_mask(vcpu->guest_cpuid, val);
-            break;
-        }
-        case IA32_EBC_FREQUENCY_ID: {
-            *val = 0;
-            break;
-        }
-        case IA32_EBC_HARD_POWERON: {
-            *val = 0;
-            break;
-        }
-        case IA32_EBC_SOFT_POWERON: {
-            *val = 0;
-            break;
-        }
-        case IA32_BIOS_SIGN_ID: {
-            *val = 0x67311111;
-            break;
-        }
-        case IA32_MISC_ENABLE: {
-            *val = 1u << 11 | 1u << 12;
-            break;
-        }
-        // Old Linux kernels may read this MSR without first making sure that
-        // the vCPU supports the "pdcm" feature (which it does not)
-        case IA32_PERF_CAPABILITIES: {
-            *val = 0;
-            hax_log(HAX_LOGI, "handle_msr_read: IA32_PERF_CAPABILITIES\n");
-            break;
-        }
-        // In case the host CPU does not support MSR bitmaps, emulate MSR reads
-        // from performance monitoring registers
-        case IA32_PMC0:
-        case IA32_PMC1:
-        case IA32_PMC2:
-        case IA32_PMC3: {
-            *val = hax->apm_version ? gstate->apm_pmc_msrs[msr - IA32_PMC0] &
-                   hax->apm_general_mask : 0;
-            hax_log(HAX_LOGI, "handle_msr_read: IA32_PMC%u value=0x%llx\n",
-                    msr - IA32_PMC0, *val);
-            break;
-        }
-        case IA32_PERFEVTSEL0:
-        case IA32_PERFEVTSEL1:
-        case IA32_PERFEVTSEL2:
-        case IA32_PERFEVTSEL3: {
-            *val = hax->apm_version
-                   ? gstate->apm_pes_msrs[msr - IA32_PERFEVTSEL0]
-                   : 0;
-            hax_log(HAX_LOGI, "handle_msr_read: IA32_PERFEVTSEL%u "
-                    "value=0x%llx\n", msr - IA32_PERFEVTSEL0, *val);
-            break;
-        }
-        default: {
-            r = misc_msr_read(vcpu, msr, val);
-            break;
-        }
-    }
-
-    return r;
-}
-
 static void vmwrite_efer(struct vcpu_t *vcpu)
 {
     struct vcpu_state_t *state = vcpu->state;
     uint32_t entry_ctls = vmx(vcpu, entry_ctls);
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
     if ((state->_cr0 & CR0_PG) && (state->_efer & IA32_EFER_LME)) {
         state->_efer |= IA32_EFER_LMA;
         entry_ctls |= ENTRY_CONTROL_LONG_MODE_GUEST;
@@ -3269,257 +3525,666 @@ static void vmwrite_efer(struct vcpu_t *vcpu)
     }
 }
 
-static int misc_msr_write(struct vcpu_t *vcpu, uint32_t msr, uint64_t val)
+static inline bool is_pat_valid(uint64_t val)
 {
-    mtrr_var_t *v;
+    if (val & 0xF8F8F8F8F8F8F8F8)
+        return false;
 
-    if (msr >= IA32_MTRR_PHYSBASE0 && msr <= IA32_MTRR_PHYSMASK9) {
-        hax_assert((msr >> 1 & 0x7f) < NUM_VARIABLE_MTRRS);
-        v = &vcpu->mtrr_current_state.mtrr_var[msr >> 1 & 0x7f];
-        if (msr & 1) {
-            v->mask.raw = val;
-        } else {
-            v->base.raw = val;
-        }
-        return 0;
-    } else if (msr >= MTRRFIX16K_80000 && msr <= MTRRFIX16K_A0000) {
-        vcpu->mtrr_current_state.mtrr_fixed16k[msr & 0x1] = val;
-        return 0;
-    } else if (msr >= MTRRFIX4K_C0000 && msr <= MTRRFIX4K_F8000) {
-        vcpu->mtrr_current_state.mtrr_fixed4k[msr & 0x7] = val;
-        return 0;
-    } else if ((msr >= IA32_MC0_CTL2 && msr <= IA32_MC8_CTL2) ||
-               (msr >= 0x300 && msr <= 0x3ff)) {
-        return 0;
+    // 0, 1, 4, 5, 6, 7 are valid values.
+    return (val | ((val & 0x0202020202020202) << 1)) == val;
+}
+
+/*
+ * MSR handlers return 0 if the access has been emulated, or 1 if it must cause
+ * a #GP in the guest (or fail the HAX_VCPU_IOCTL_{GET,SET}_MSRS ioctl).
+ */
+struct vcpu_msr_desc;
+typedef int (*vcpu_msr_read_t)(struct vcpu_t *vcpu,
+                               const struct vcpu_msr_desc *desc, uint32_t msr,
+                               uint64_t *val);
+typedef int (*vcpu_msr_write_t)(struct vcpu_t *vcpu,
+                                const struct vcpu_msr_desc *desc, uint32_t msr,
+                                uint64_t val, bool by_host);
+
+// The handler never sleeps, takes locks or logs (see vcpu_fast_vmexit_handler())
+#define MSR_FAST_READ   0x1
+#define MSR_FAST_WRITE  0x2
+#define MSR_FAST        (MSR_FAST_READ | MSR_FAST_WRITE)
+// The guest accesses the MSR without VM exits (see vcpu_msr_init_bitmap())
+#define MSR_PASSTHROUGH 0x4
+
+/*
+ * Describes how to emulate the consecutive MSRs |first| to |last|. A NULL
+ * handler makes the corresponding access cause a #GP.
+ */
+struct vcpu_msr_desc {
+    uint32_t first;
+    uint32_t last;
+    vcpu_msr_read_t read;
+    vcpu_msr_write_t write;
+    // Value returned by msr_read_const()
+    uint64_t value;
+    uint32_t flags;
+};
+
+static int msr_read_const(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                          uint32_t msr, uint64_t *val)
+{
+    *val = desc->value;
+    return 0;
+}
+
+static int msr_write_ignore(struct vcpu_t *vcpu,
+                            const struct vcpu_msr_desc *desc, uint32_t msr,
+                            uint64_t val, bool by_host)
+{
+    return 0;
+}
+
+/*
+ * Returns (a * b) >> shift, for 0 < shift < 64, without losing the high half of
+ * the 128-bit product. Not all supported compilers have a 128-bit type.
+ */
+static uint64_t mul_u64_shr(uint64_t a, uint64_t b, uint shift)
+{
+    uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+    uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+    uint64_t p00 = a_lo * b_lo, p01 = a_lo * b_hi;
+    uint64_t p10 = a_hi * b_lo, p11 = a_hi * b_hi;
+    uint64_t mid, lo, hi;
+
+    mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+    lo = (p00 & 0xffffffff) | (mid << 32);
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return (hi << (64 - shift)) | (lo >> shift);
+}
+
+/*
+ * Returns num / den in the fixed-point format of the TSC multiplier. The caller
+ * must make sure that the quotient fits in its 16 integer bits.
+ */
+static uint64_t tsc_ratio(uint32_t num, uint32_t den)
+{
+    uint64_t q = num / den, r = num % den;
+    int i;
+
+    // Long division, 24 fraction bits at a time, so that r never overflows
+    for (i = 0; i < VCPU_TSC_RATIO_SHIFT / 24; i++) {
+        r <<= 24;
+        q = (q << 24) | (r / den);
+        r %= den;
     }
+    return q;
+}
 
-    return 1;
+static uint64_t vcpu_scale_tsc(struct vcpu_t *vcpu, uint64_t tsc)
+{
+    if (vcpu->tsc_ratio == VCPU_TSC_RATIO_ONE)
+        return tsc;
+    return mul_u64_shr(tsc, vcpu->tsc_ratio, VCPU_TSC_RATIO_SHIFT);
 }
 
-static inline bool is_pat_valid(uint64_t val)
+// Returns the current guest TSC, as RDTSC in the guest would
+static uint64_t vcpu_guest_tsc(struct vcpu_t *vcpu)
 {
-    if (val & 0xF8F8F8F8F8F8F8F8)
-        return false;
+    return vcpu_scale_tsc(vcpu, ia32_rdtsc()) + vcpu->tsc_offset;
+}
 
-    // 0, 1, 4, 5, 6, 7 are valid values.
-    return (val | ((val & 0x0202020202020202) << 1)) == val;
+// Converts a number of guest TSC ticks to host TSC ticks, rounding up
+static uint64_t vcpu_guest_to_host_ticks(struct vcpu_t *vcpu, uint64_t ticks)
+{
+    if (vcpu->tsc_inverse_ratio == VCPU_TSC_RATIO_ONE)
+        return ticks;
+    // Avoid overflow; callers do not need anything this far away exactly
+    if (ticks > (1ULL << 47)) {
+        ticks = 1ULL << 47;
+    }
+    return mul_u64_shr(ticks, vcpu->tsc_inverse_ratio,
+                       VCPU_TSC_RATIO_SHIFT) + 1;
 }
 
-static int handle_msr_write(struct vcpu_t *vcpu, uint32_t msr, uint64_t val,
-                            bool by_host)
+static int msr_read_tsc(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                        uint32_t msr, uint64_t *val)
+{
+    *val = vcpu_guest_tsc(vcpu);
+    return 0;
+}
+
+static int msr_write_tsc(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t val, bool by_host)
+{
+    vcpu->tsc_offset = val - vcpu_scale_tsc(vcpu, ia32_rdtsc());
+    if (vmx(vcpu, pcpu_ctls) & USE_TSC_OFFSETTING) {
+        vmwrite(vcpu, VMX_TSC_OFFSET, vcpu->tsc_offset);
+    }
+    return 0;
+}
+
+static int msr_read_apic_base(struct vcpu_t *vcpu,
+                              const struct vcpu_msr_desc *desc, uint32_t msr,
+                              uint64_t *val)
+{
+    *val = vcpu->gstate.apic_base;
+    return 0;
+}
+
+static int msr_write_apic_base(struct vcpu_t *vcpu,
+                               const struct vcpu_msr_desc *desc, uint32_t msr,
+                               uint64_t val, bool by_host)
+{
+    return vcpu_set_apic_base(vcpu, val);
+}
+
+static int msr_read_efer(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t *val)
+{
+    *val = vcpu->state->_efer;
+    return 0;
+}
+
+static int msr_write_efer(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                          uint32_t msr, uint64_t val, bool by_host)
 {
-    int index, r = 0;
     struct vcpu_state_t *state = vcpu->state;
-    struct gstate *gstate = &vcpu->gstate;
 
-    switch (msr) {
-        case IA32_TSC: {
-            vcpu->tsc_offset = val - ia32_rdtsc();
-            if (vmx(vcpu, pcpu_ctls) & USE_TSC_OFFSETTING) {
-                vmwrite(vcpu, VMX_TSC_OFFSET, vcpu->tsc_offset);
-            }
-            break;
-        }
-        case IA32_BIOS_SIGN_ID:
-        case IA32_MCG_STATUS:
-        case IA32_MC0_CTL:
-        case IA32_MC0_STATUS:
-        case IA32_MC0_ADDR:
-        case IA32_MC0_MISC:
-        case IA32_DEBUGCTL:
-        case IA32_MISC_ENABLE: {
-            break;
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_CRS);
+    hax_log(HAX_LOGI, "%s writing to EFER[%u]: 0x%x -> 0x%llx, "
+            "_cr0=0x%llx, _cr4=0x%llx\n", by_host ? "Host" : "Guest",
+            vcpu->vcpu_id, state->_efer, val, state->_cr0, state->_cr4);
+
+    /* val - "new" EFER, state->_efer - "old" EFER.*/
+    if ((val &
+         ~((uint64_t)(IA32_EFER_SCE | IA32_EFER_LME |
+                      IA32_EFER_LMA | IA32_EFER_XD)))) {
+        hax_log(HAX_LOGE, "Illegal value 0x%llx written to EFER. "
+                "Reserved bits were set. EFER was 0x%llx\n",
+                val, (uint64_t) state->_efer);
+        return 1;
+    }
+
+    if (!by_host) {
+        /*
+         * Two code paths can lead to handle_msr_write():
+         *  a) The guest invokes the WRMSR instruction;
+         *  b) The host calls the HAX_VCPU_IOCTL_SET_MSRS ioctl.
+         * The following checks are only applicable to guest-initiated
+         * EFER writes, not to host-initiated EFER writes. E.g., when
+         * booting the guest from a VM snapshot, the host (QEMU) may
+         * need to initialize the vCPU in 64-bit mode (CR0.PG = CR4.PAE
+         * = EFER.LME = EFER.LMA = CS.L = 1) via SET_REGS and SET_MSRS
+         * ioctls.
+         */
+        if (((val & IA32_EFER_LMA) ^
+             (state->_efer & IA32_EFER_LMA))) {
+            hax_log_ratelimited(HAX_LOGW, "Ignoring guest write to "
+                                "IA32_EFER.LMA. EFER: 0x%llx -> "
+                                "0x%llx\n", (uint64_t) state->_efer,
+                                val);
+            /*
+             * No need to explicitly fix the LMA bit here:
+             *  val ^= IA32_EFER_LMA;
+             * because in the end vmwrite_efer() will ignore the LMA
+             * bit in |val|.
+             */
         }
-        case IA32_CPUID_FEATURE_MASK: {
-            cpuid_set_features_mask(vcpu->guest_cpuid, val);
-            break;
+        if ((state->_cr0 & CR0_PG) &&
+            ((val & IA32_EFER_LME) ^
+             (state->_efer & IA32_EFER_LME))) {
+            hax_log(HAX_LOGE, "Attempted to enable or disable Long Mode"
+                    " with paging enabled. EFER: 0x%llx -> 0x%llx\n",
+                    (uint64_t) state->_efer, val);
+            return 1;
         }
-        case IA32_EFER: {
-            hax_log(HAX_LOGI, "%s writing to EFER[%u]: 0x%x -> 0x%llx, "
-                    "_cr0=0x%llx, _cr4=0x%llx\n", by_host ? "Host" : "Guest",
-                    vcpu->vcpu_id, state->_efer, val,
-                    state->_cr0, state->_cr4);
-
-            /* val - "new" EFER, state->_efer - "old" EFER.*/
-            if ((val &
-                 ~((uint64_t)(IA32_EFER_SCE | IA32_EFER_LME |
-                              IA32_EFER_LMA | IA32_EFER_XD)))) {
-                hax_log(HAX_LOGE, "Illegal value 0x%llx written to EFER. "
-                        "Reserved bits were set. EFER was 0x%llx\n",
-                        val, (uint64_t) state->_efer);
-                r = 1;
-                break;
-            }
+    }
+    state->_efer = val;
 
-            if (!by_host) {
-                /*
-                 * Two code paths can lead to handle_msr_write():
-                 *  a) The guest invokes the WRMSR instruction;
-                 *  b) The host calls the HAX_VCPU_IOCTL_SET_MSRS ioctl.
-                 * The following checks are only applicable to guest-initiated
-                 * EFER writes, not to host-initiated EFER writes. E.g., when
-                 * booting the guest from a VM snapshot, the host (QEMU) may
-                 * need to initialize the vCPU in 64-bit mode (CR0.PG = CR4.PAE
-                 * = EFER.LME = EFER.LMA = CS.L = 1) via SET_REGS and SET_MSRS
-                 * ioctls.
-                 */
-                if (((val & IA32_EFER_LMA) ^
-                     (state->_efer & IA32_EFER_LMA))) {
-                    hax_log(HAX_LOGW, "Ignoring guest write to IA32_EFER.LMA. "
-                            "EFER: 0x%llx -> 0x%llx\n",
-                            (uint64_t) state->_efer,val);
-                    /*
-                     * No need to explicitly fix the LMA bit here:
-                     *  val ^= IA32_EFER_LMA;
-                     * because in the end vmwrite_efer() will ignore the LMA
-                     * bit in |val|.
-                     */
-                }
-                if ((state->_cr0 & CR0_PG) &&
-                    ((val & IA32_EFER_LME) ^
-                     (state->_efer & IA32_EFER_LME))) {
-                    hax_log(HAX_LOGE, "Attempted to enable or disable Long Mode"
-                            " with paging enabled. EFER: 0x%llx -> 0x%llx\n",
-                            (uint64_t) state->_efer, val);
-                    r = 1;
-                    break;
-                }
-            }
-            state->_efer = val;
+    if (!(ia32_rdmsr(IA32_EFER) & IA32_EFER_LMA) &&
+        (state->_efer & IA32_EFER_LME)) {
+        vcpu_set_panic(vcpu);
+        hax_log(HAX_LOGPANIC,
+                "64-bit guest is not allowed on 32-bit host.\n");
+    } else {
+        vmwrite_efer(vcpu);
+    }
+    return 0;
+}
 
-            if (!(ia32_rdmsr(IA32_EFER) & IA32_EFER_LMA) &&
-                (state->_efer & IA32_EFER_LME)) {
-                vcpu_set_panic(vcpu);
-                hax_log(HAX_LOGPANIC,
-                        "64-bit guest is not allowed on 32-bit host.\n");
-            } else {
-                vmwrite_efer(vcpu);
-            }
+static int msr_read_gmsr(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t *val)
+{
+    struct gstate *gstate = &vcpu->gstate;
+    int index;
+
+    vcpu_put_guest_msrs(vcpu);
+    for (index = 0; index < NR_GMSR; index++) {
+        if (gstate->gmsr[index].entry == msr) {
+            *val = gstate->gmsr[index].value;
             break;
         }
-        case IA32_STAR:
-        case IA32_LSTAR:
-        case IA32_CSTAR:
-        case IA32_SF_MASK:
-        case IA32_KERNEL_GS_BASE: {
-            for (index = 0; index < NR_GMSR; index++) {
-                if (gmsr_list[index] == msr) {
-                    gstate->gmsr[index].value = val;
-                    gstate->gmsr[index].entry = msr;
-                    break;
-                }
-            }
+        *val = 0;
+    }
+    return 0;
+}
+
+static int msr_write_gmsr(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                          uint32_t msr, uint64_t val, bool by_host)
+{
+    struct gstate *gstate = &vcpu->gstate;
+    int index;
+
+    // Otherwise, the value set here would be overwritten
+    vcpu_put_guest_msrs(vcpu);
+    for (index = 0; index < NR_GMSR; index++) {
+        if (gmsr_list[index] == msr) {
+            gstate->gmsr[index].value = val;
+            gstate->gmsr[index].entry = msr;
             break;
         }
-        case IA32_TSC_AUX: {
-            if (!cpu_has_feature(X86_FEATURE_RDTSCP) || (val >> 32)) {
-                r = 1;
-                break;
-            }
-            gstate->tsc_aux = val;
+    }
+    return 0;
+}
+
+static int msr_read_tsc_aux(struct vcpu_t *vcpu,
+                            const struct vcpu_msr_desc *desc, uint32_t msr,
+                            uint64_t *val)
+{
+    if (!cpu_has_feature(X86_FEATURE_RDTSCP))
+        return 1;
+    vcpu_put_guest_msrs(vcpu);
+    *val = vcpu->gstate.tsc_aux & 0xFFFFFFFF;
+    return 0;
+}
+
+static int msr_write_tsc_aux(struct vcpu_t *vcpu,
+                             const struct vcpu_msr_desc *desc, uint32_t msr,
+                             uint64_t val, bool by_host)
+{
+    if (!cpu_has_feature(X86_FEATURE_RDTSCP) || (val >> 32))
+        return 1;
+    vcpu_put_guest_msrs(vcpu);
+    vcpu->gstate.tsc_aux = val;
+    return 0;
+}
+
+static int msr_read_fs_base(struct vcpu_t *vcpu,
+                            const struct vcpu_msr_desc *desc, uint32_t msr,
+                            uint64_t *val)
+{
+    if (vcpu->fs_base_dirty)
+        *val = vcpu->state->_fs.base;
+    else
+        *val = vmread(vcpu, GUEST_FS_BASE);
+    return 0;
+}
+
+static int msr_write_fs_base(struct vcpu_t *vcpu,
+                             const struct vcpu_msr_desc *desc, uint32_t msr,
+                             uint64_t val, bool by_host)
+{
+    /*
+     * During Android emulator running, there are a lot of FS_BASE
+     * msr write. To avoid unnecessary vmcs loading/putting, don't
+     * write it to vmcs until right before next VM entry, when the
+     * VMCS region has been loaded into memory.
+     */
+    vcpu->state->_fs.base = val;
+    vcpu->fs_base_dirty = 1;
+    return 0;
+}
+
+static int msr_read_gs_base(struct vcpu_t *vcpu,
+                            const struct vcpu_msr_desc *desc, uint32_t msr,
+                            uint64_t *val)
+{
+    *val = vmread(vcpu, GUEST_GS_BASE);
+    return 0;
+}
+
+static int msr_write_gs_base(struct vcpu_t *vcpu,
+                             const struct vcpu_msr_desc *desc, uint32_t msr,
+                             uint64_t val, bool by_host)
+{
+    vmwrite(vcpu, GUEST_GS_BASE, val);
+    return 0;
+}
+
+static int msr_read_sysenter(struct vcpu_t *vcpu,
+                             const struct vcpu_msr_desc *desc, uint32_t msr,
+                             uint64_t *val)
+{
+    struct vcpu_state_t *state = vcpu->state;
+
+    switch (msr) {
+        case IA32_SYSENTER_CS: {
+            *val = state->_sysenter_cs;
             break;
         }
-        case IA32_FS_BASE: {
-            /*
-             * During Android emulator running, there are a lot of FS_BASE
-             * msr write. To avoid unnecessary vmcs loading/putting, don't
-             * write it to vmcs until right before next VM entry, when the
-             * VMCS region has been loaded into memory.
-             */
-            vcpu->state->_fs.base = val;
-            vcpu->fs_base_dirty = 1;
+        case IA32_SYSENTER_ESP: {
+            *val = state->_sysenter_esp;
             break;
         }
-        case IA32_GS_BASE: {
-            vmwrite(vcpu, GUEST_GS_BASE, val);
+        default: {
+            *val = state->_sysenter_eip;
             break;
         }
+    }
+    return 0;
+}
+
+static int msr_write_sysenter(struct vcpu_t *vcpu,
+                              const struct vcpu_msr_desc *desc, uint32_t msr,
+                              uint64_t val, bool by_host)
+{
+    struct vcpu_state_t *state = vcpu->state;
+
+    switch (msr) {
         case IA32_SYSENTER_CS: {
             state->_sysenter_cs = val & 0xffff;
             vmwrite(vcpu, GUEST_SYSENTER_CS, state->_sysenter_cs);
             break;
         }
-        case IA32_SYSENTER_EIP: {
-            state->_sysenter_eip = val;
-            vmwrite(vcpu, GUEST_SYSENTER_EIP, state->_sysenter_eip);
-            break;
-        }
         case IA32_SYSENTER_ESP: {
             state->_sysenter_esp = val;
             vmwrite(vcpu, GUEST_SYSENTER_ESP, state->_sysenter_esp);
             break;
         }
-        // FIXME: Not fully implemented - just store what guest writes to MTRR
-        case IA32_MTRRCAP: {
-            vcpu->mtrr_current_state.mtrr_cap.raw = val;
+        default: {
+            state->_sysenter_eip = val;
+            vmwrite(vcpu, GUEST_SYSENTER_EIP, state->_sysenter_eip);
             break;
         }
+    }
+    return 0;
+}
+
+static int msr_read_pat(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                        uint32_t msr, uint64_t *val)
+{
+    *val = vcpu->cr_pat;
+    return 0;
+}
+
+static int msr_write_pat(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t val, bool by_host)
+{
+    // Attempting to write an undefined memory type encoding into the
+    // PAT causes a general-protection (#GP) exception to be generated
+    if (!is_pat_valid(val))
+        return 1;
+
+    vcpu->cr_pat = val;
+    vmwrite(vcpu, GUEST_PAT, vcpu->cr_pat);
+    return 0;
+}
+
+/*
+ * Returns the MTRR that backs |msr|.
+ * FIXME: Not fully implemented - just store what guest writes to MTRR
+ */
+static uint64_t *msr_mtrr(struct vcpu_t *vcpu, uint32_t msr)
+{
+    struct mtrr_t *mtrr = &vcpu->mtrr_current_state;
+    mtrr_var_t *v;
+
+    if (msr >= IA32_MTRR_PHYSBASE0 && msr <= IA32_MTRR_PHYSMASK9) {
+        hax_assert((msr >> 1 & 0x7f) < NUM_VARIABLE_MTRRS);
+        v = &mtrr->mtrr_var[msr >> 1 & 0x7f];
+        return msr & 1 ? &v->mask.raw : &v->base.raw;
+    }
+    if (msr >= MTRRFIX16K_80000 && msr <= MTRRFIX16K_A0000)
+        return &mtrr->mtrr_fixed16k[msr & 0x1];
+    if (msr >= MTRRFIX4K_C0000 && msr <= MTRRFIX4K_F8000)
+        return &mtrr->mtrr_fixed4k[msr & 0x7];
+
+    switch (msr) {
+        case IA32_MTRRCAP: {
+            return &mtrr->mtrr_cap.raw;
+        }
         case MTRRFIX64K_00000: {
-            vcpu->mtrr_current_state.mtrr_fixed64k = val;
-            break;
+            return &mtrr->mtrr_fixed64k;
         }
-        case IA32_CR_PAT: {
-            // Attempting to write an undefined memory type encoding into the
-            // PAT causes a general-protection (#GP) exception to be generated
-            if (!is_pat_valid(val)) {
-                r = 1;
-                break;
-            }
+        default: {
+            return &mtrr->mtrr_def_type.raw;
+        }
+    }
+}
+
+static int msr_read_mtrr(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t *val)
+{
+    *val = *msr_mtrr(vcpu, msr);
+    return 0;
+}
+
+static int msr_write_mtrr(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                          uint32_t msr, uint64_t val, bool by_host)
+{
+    *msr_mtrr(vcpu, msr) = val;
+    return 0;
+}
+
+static int msr_read_features_mask(struct vcpu_t *vcpu,
+                                  const struct vcpu_msr_desc *desc,
+                                  uint32_t msr, uint64_t *val)
+{
+    cpuid_get_features_mask(vcpu->guest_cpuid, val);
+    return 0;
+}
+
+static int msr_write_features_mask(struct vcpu_t *vcpu,
+                                   const struct vcpu_msr_desc *desc,
+                                   uint32_t msr, uint64_t val, bool by_host)
+{
+    cpuid_set_features_mask(vcpu->guest_cpuid, val);
+    return 0;
+}
+
+// Old Linux kernels may read this MSR without first making sure that the vCPU
+// supports the "pdcm" feature (which it does not)
+static int msr_read_perf_capabilities(struct vcpu_t *vcpu,
+                                      const struct vcpu_msr_desc *desc,
+                                      uint32_t msr, uint64_t *val)
+{
+    *val = 0;
+    hax_log(HAX_LOGI, "handle_msr_read: IA32_PERF_CAPABILITIES\n");
+    return 0;
+}
 
-            vcpu->cr_pat = val;
-            vmwrite(vcpu, GUEST_PAT, vcpu->cr_pat);
-            break;
-        }
-        case IA32_MTRR_DEF_TYPE: {
-            vcpu->mtrr_current_state.mtrr_def_type.raw = val;
-            break;
-        }
-        case IA32_APIC_BASE: {
-            r = vcpu_set_apic_base(vcpu, val);
-            break;
-        }
-        case IA32_BIOS_UPDT_TRIG: {
-            break;
-        }
-        case IA32_EBC_FREQUENCY_ID:
-        case IA32_EBC_HARD_POWERON:
-        case IA32_EBC_SOFT_POWERON: {
-            break;
-        }
-        // In case the host CPU does not support MSR bitmaps, emulate MSR writes
-        // to performance monitoring registers
-        case IA32_PMC0:
-        case IA32_PMC1:
-        case IA32_PMC2:
-        case IA32_PMC3: {
-            if (hax->apm_version) {
-                // According to IA SDM Vol. 3B 18.2.5, writes to IA_PMCx use
-                // only bits 31..0 of the input value
-                gstate->apm_pmc_msrs[msr - IA32_PMC0] = val & 0xffffffff;
-                hax_log(HAX_LOGI, "handle_msr_write: IA32_PMC%u value=0x%llx\n",
-                        msr - IA32_PMC0, val);
-            }
-            break;
-        }
-        case IA32_PERFEVTSEL0:
-        case IA32_PERFEVTSEL1:
-        case IA32_PERFEVTSEL2:
-        case IA32_PERFEVTSEL3: {
-            if (hax->apm_version) {
-                // According to IA SDM Vol. 3B Figure 18-1 (APM v1) and Figure
-                // 18-6 (APM v3), bits 63..32 of IA_PERFEVTSELx are reserved
-                gstate->apm_pes_msrs[msr - IA32_PERFEVTSEL0] = val & 0xffffffff;
-                hax_log(HAX_LOGI, "handle_msr_write: IA32_PERFEVTSEL%u "
-                        "value=0x%llx\n", msr - IA32_PERFEVTSEL0, val);
-            }
-            break;
+// In case the host CPU does not support MSR bitmaps, emulate MSR accesses to
+// performance monitoring registers
+static int msr_read_pmc(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                        uint32_t msr, uint64_t *val)
+{
+    *val = hax->apm_version ? vcpu->gstate.apm_pmc_msrs[msr - IA32_PMC0] &
+           hax->apm_general_mask : 0;
+    hax_log(HAX_LOGI, "handle_msr_read: IA32_PMC%u value=0x%llx\n",
+            msr - IA32_PMC0, *val);
+    return 0;
+}
+
+static int msr_write_pmc(struct vcpu_t *vcpu, const struct vcpu_msr_desc *desc,
+                         uint32_t msr, uint64_t val, bool by_host)
+{
+    if (hax->apm_version) {
+        // According to IA SDM Vol. 3B 18.2.5, writes to IA_PMCx use
+        // only bits 31..0 of the input value
+        vcpu->gstate.apm_pmc_msrs[msr - IA32_PMC0] = val & 0xffffffff;
+        hax_log(HAX_LOGI, "handle_msr_write: IA32_PMC%u value=0x%llx\n",
+                msr - IA32_PMC0, val);
+    }
+    return 0;
+}
+
+static int msr_read_perfevtsel(struct vcpu_t *vcpu,
+                               const struct vcpu_msr_desc *desc, uint32_t msr,
+                               uint64_t *val)
+{
+    *val = hax->apm_version
+           ? vcpu->gstate.apm_pes_msrs[msr - IA32_PERFEVTSEL0]
+           : 0;
+    hax_log(HAX_LOGI, "handle_msr_read: IA32_PERFEVTSEL%u "
+            "value=0x%llx\n", msr - IA32_PERFEVTSEL0, *val);
+    return 0;
+}
+
+static int msr_write_perfevtsel(struct vcpu_t *vcpu,
+                                const struct vcpu_msr_desc *desc, uint32_t msr,
+                                uint64_t val, bool by_host)
+{
+    if (hax->apm_version) {
+        // According to IA SDM Vol. 3B Figure 18-1 (APM v1) and Figure
+        // 18-6 (APM v3), bits 63..32 of IA_PERFEVTSELx are reserved
+        vcpu->gstate.apm_pes_msrs[msr - IA32_PERFEVTSEL0] = val & 0xffffffff;
+        hax_log(HAX_LOGI, "handle_msr_write: IA32_PERFEVTSEL%u "
+                "value=0x%llx\n", msr - IA32_PERFEVTSEL0, val);
+    }
+    return 0;
+}
+
+#define MSR_CONST(first, last, value, write) \
+    { first, last, msr_read_const, write, value, MSR_FAST_READ }
+
+/* Sorted by MSR address, see vcpu_msr_lookup() */
+static const struct vcpu_msr_desc msr_table[] = {
+    // P4 Maps P5_Type to Status
+    MSR_CONST(IA32_P5_MC_ADDR, IA32_P5_MC_TYPE, 0, NULL),
+    { IA32_TSC, IA32_TSC, msr_read_tsc, msr_write_tsc, 0, MSR_FAST },
+    MSR_CONST(IA32_PLATFORM_ID, IA32_PLATFORM_ID, 0x18000000000000ULL, NULL),
+    { IA32_APIC_BASE, IA32_APIC_BASE, msr_read_apic_base, msr_write_apic_base,
+      0, MSR_FAST_READ },
+    MSR_CONST(IA32_EBC_HARD_POWERON, IA32_EBC_FREQUENCY_ID, 0,
+              msr_write_ignore),
+    MSR_CONST(IA32_FEATURE_CONTROL, IA32_FEATURE_CONTROL, 0x5, NULL),
+    MSR_CONST(IA32_THERM_DIODE_OFFSET, IA32_THERM_DIODE_OFFSET, 0, NULL),
+    { IA32_BIOS_UPDT_TRIG, IA32_BIOS_UPDT_TRIG, NULL, msr_write_ignore, 0,
+      MSR_FAST_WRITE },
+    MSR_CONST(IA32_BIOS_SIGN_ID, IA32_BIOS_SIGN_ID, 0x67311111,
+              msr_write_ignore),
+    { IA32_PMC0, IA32_PMC3, msr_read_pmc, msr_write_pmc, 0, 0 },
+    MSR_CONST(IA32_FSB_FREQ, IA32_FSB_FREQ, 4, NULL),
+    MSR_CONST(IA32_TEMP_TARGET, IA32_TEMP_TARGET, 0x86791b00, NULL),
+    { IA32_MTRRCAP, IA32_MTRRCAP, msr_read_mtrr, msr_write_mtrr, 0,
+      MSR_FAST },
+    MSR_CONST(IA32_BBL_CR_CTL3, IA32_BBL_CR_CTL3, 0xbe702111, NULL),
+    { IA32_SYSENTER_CS, IA32_SYSENTER_EIP, msr_read_sysenter,
+      msr_write_sysenter, 0, MSR_FAST },
+    // 1 MC reporting reg
+    MSR_CONST(IA32_MCG_CAP, IA32_MCG_CAP, 1, NULL),
+    MSR_CONST(IA32_MCG_STATUS, IA32_MCG_STATUS, 0, msr_write_ignore),
+    MSR_CONST(IA32_MCG_CTL, IA32_MCG_CTL, 0x3, NULL),
+    { IA32_PERFEVTSEL0, IA32_PERFEVTSEL3, msr_read_perfevtsel,
+      msr_write_perfevtsel, 0, 0 },
+    MSR_CONST(IA32_MISC_ENABLE, IA32_MISC_ENABLE, 1u << 11 | 1u << 12,
+              msr_write_ignore),
+    // TODO: Will this still work when we support APM v2?
+    MSR_CONST(IA32_DEBUGCTL, IA32_DEBUGCTL, 0, msr_write_ignore),
+    { IA32_MTRR_PHYSBASE0, IA32_MTRR_PHYSMASK9, msr_read_mtrr,
+      msr_write_mtrr, 0, MSR_FAST },
+    { MTRRFIX64K_00000, MTRRFIX64K_00000, msr_read_mtrr, msr_write_mtrr, 0,
+      MSR_FAST },
+    { MTRRFIX16K_80000, MTRRFIX16K_A0000, msr_read_mtrr, msr_write_mtrr, 0,
+      MSR_FAST },
+    { MTRRFIX4K_C0000, MTRRFIX4K_F8000, msr_read_mtrr, msr_write_mtrr, 0,
+      MSR_FAST },
+    { IA32_CR_PAT, IA32_CR_PAT, msr_read_pat, msr_write_pat, 0, MSR_FAST },
+    MSR_CONST(IA32_MC0_CTL2, IA32_MC8_CTL2, 0, msr_write_ignore),
+    { IA32_MTRR_DEF_TYPE, IA32_MTRR_DEF_TYPE, msr_read_mtrr, msr_write_mtrr,
+      0, MSR_FAST },
+    MSR_CONST(0x300, IA32_PERF_CAPABILITIES - 1, 0, msr_write_ignore),
+    { IA32_PERF_CAPABILITIES, IA32_PERF_CAPABILITIES,
+      msr_read_perf_capabilities, msr_write_ignore, 0, 0 },
+    MSR_CONST(IA32_PERF_CAPABILITIES + 1, 0x3ff, 0, msr_write_ignore),
+    MSR_CONST(IA32_MC0_CTL, IA32_MC0_MISC, 0, msr_write_ignore),
+    { IA32_CPUID_FEATURE_MASK, IA32_CPUID_FEATURE_MASK,
+      msr_read_features_mask, msr_write_features_mask, 0, 0 },
+    { IA32_EFER, IA32_EFER, msr_read_efer, msr_write_efer, 0,
+      MSR_FAST_READ },
+    // IA32_STAR, IA32_LSTAR, IA32_CSTAR and IA32_SF_MASK
+    { IA32_STAR, IA32_SF_MASK, msr_read_gmsr, msr_write_gmsr, 0,
+      MSR_FAST | MSR_PASSTHROUGH },
+    { IA32_FS_BASE, IA32_FS_BASE, msr_read_fs_base, msr_write_fs_base, 0,
+      MSR_FAST | MSR_PASSTHROUGH },
+    { IA32_GS_BASE, IA32_GS_BASE, msr_read_gs_base, msr_write_gs_base, 0,
+      MSR_FAST | MSR_PASSTHROUGH },
+    { IA32_KERNEL_GS_BASE, IA32_KERNEL_GS_BASE, msr_read_gmsr,
+      msr_write_gmsr, 0, MSR_FAST | MSR_PASSTHROUGH },
+    { IA32_TSC_AUX, IA32_TSC_AUX, msr_read_tsc_aux, msr_write_tsc_aux, 0,
+      MSR_FAST | MSR_PASSTHROUGH }
+};
+
+/* Returns the descriptor of |msr|, or NULL if the vCPU does not have it */
+static const struct vcpu_msr_desc *vcpu_msr_lookup(uint32_t msr)
+{
+    int lo = 0, hi = ARRAY_ELEMENTS(msr_table) - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const struct vcpu_msr_desc *desc = &msr_table[mid];
+
+        if (msr < desc->first) {
+            hi = mid - 1;
+        } else if (msr > desc->last) {
+            lo = mid + 1;
+        } else {
+            return desc;
         }
-        default: {
-            r = misc_msr_write(vcpu, msr, val);
-            break;
+    }
+    return NULL;
+}
+
+/*
+ * Lets the guest access the MSRs flagged with MSR_PASSTHROUGH without causing
+ * VM exits. Their guest values are either switched by VM entries and exits, or
+ * by vcpu_load_guest_msrs()/vcpu_put_guest_msrs().
+ */
+void vcpu_msr_init_bitmap(void)
+{
+    uint i;
+
+    for (i = 0; i < ARRAY_ELEMENTS(msr_table); i++) {
+        const struct vcpu_msr_desc *desc = &msr_table[i];
+
+        // The bitmap must be kept in sync with the table
+        hax_assert(!i || desc->first > msr_table[i - 1].last);
+        if (desc->flags & MSR_PASSTHROUGH) {
+            set_msr_access(desc->first, desc->last - desc->first + 1, true,
+                           true);
         }
     }
-    return r;
+}
+
+/*
+ * Returns true if accesses to |msr| can be emulated on the fast path, i.e.
+ * without sleeping, taking locks or involving user space.
+ */
+static bool vcpu_msr_has_fast_path(uint32_t msr, bool write)
+{
+    const struct vcpu_msr_desc *desc = vcpu_msr_lookup(msr);
+
+    return desc && (desc->flags & (write ? MSR_FAST_WRITE : MSR_FAST_READ));
+}
+
+/*
+ * Returns 0 if handled, else returns 1
+ * According to the caller, return 1 will cause GP to guest
+ */
+static int handle_msr_read(struct vcpu_t *vcpu, uint32_t msr, uint64_t *val)
+{
+    const struct vcpu_msr_desc *desc = vcpu_msr_lookup(msr);
+
+    if (!desc || !desc->read)
+        return 1;
+    return desc->read(vcpu, desc, msr, val);
+}
+
+static int handle_msr_write(struct vcpu_t *vcpu, uint32_t msr, uint64_t val,
+                            bool by_host)
+{
+    const struct vcpu_msr_desc *desc = vcpu_msr_lookup(msr);
+
+    if (!desc || !desc->write)
+        return 1;
+    return desc->write(vcpu, desc, msr, val, by_host);
 }
 
 static int exit_invalid_guest_state(struct vcpu_t *vcpu,
@@ -3538,9 +4203,12 @@ static int exit_ept_misconfiguration(struct vcpu_t *vcpu,
     int ret;
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_GPA);
     gpa = vmx(vcpu, exit_gpa);
+    hax_mutex_lock(vcpu->vm->gpa_space.lock);
     ret = ept_handle_misconfiguration(&vcpu->vm->gpa_space, &vcpu->vm->ept_tree,
                                       gpa);
+    hax_mutex_unlock(vcpu->vm->gpa_space.lock);
     if (ret > 0) {
         // The misconfigured entries have been fixed
         return HAX_RESUME;
@@ -3561,6 +4229,8 @@ static int exit_ept_violation(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     uint64_t fault_gfn;
 
     htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_EXIT_QUALIFICATION |
+                          VMCS_CACHE_EXIT_GPA | VMCS_CACHE_EXIT_INSTR_LENGTH);
 
     if (qual->ept.gla1 == 0 && qual->ept.gla2 == 1) {
         vcpu_set_panic(vcpu);
@@ -3571,8 +4241,10 @@ static int exit_ept_violation(struct vcpu_t *vcpu, struct hax_tunnel *htun)
 
     gpa = vmx(vcpu, exit_gpa);
 
+    hax_mutex_lock(vcpu->vm->gpa_space.lock);
     ret = ept_handle_access_violation(&vcpu->vm->gpa_space, &vcpu->vm->ept_tree,
                                       *qual, gpa, &fault_gfn);
+    hax_mutex_unlock(vcpu->vm->gpa_space.lock);
     if (ret == -EFAULT) {
         // Extract bits 5..0 from Exit Qualification. They indicate the type of
         // the faulting access (HAX_PAGEFAULT_ACC_R/W/X) and the types of access
@@ -3637,6 +4309,125 @@ static int exit_xsetbv(struct vcpu_t *vcpu, struct hax_tunnel *htun)
     return HAX_RESUME;
 }
 
+// Minimum host TSC cycles between two scans for a vCPU to yield to
+#define VCPU_PLE_SCAN_CYCLES 1000000ULL
+
+/*
+ * Picks a sibling vCPU of the same VM to yield to when |vcpu| is spinning:
+ * one that is not in guest mode, and not halted either (i.e. most likely
+ * preempted by the host, possibly while holding the lock |vcpu| is waiting
+ * for). Candidates are tried round-robin, starting after the last vCPU picked.
+ * Scanning the vCPUs takes |vm_lock|, so only one vCPU of the VM does it at a
+ * time, at most once every VCPU_PLE_SCAN_CYCLES; the others just yield.
+ * Returns the sibling with a reference held, or NULL.
+ */
+static struct vcpu_t * vcpu_pick_yield_target(struct vcpu_t *vcpu)
+{
+    struct vm_t *vm = vcpu->vm;
+    struct vcpu_t *sibling, *target = NULL;
+    uint64_t next_scan = vm->ple_next_scan, now;
+    int pass;
+
+    now = ia32_rdtsc();
+    if (now < next_scan ||
+        !hax_cmpxchg64(next_scan, now + VCPU_PLE_SCAN_CYCLES,
+                       &vm->ple_next_scan))
+        return NULL;
+
+    hax_mutex_lock(vm->vm_lock);
+    for (pass = 0; pass < 2 && !target; pass++) {
+        hax_list_entry_for_each(sibling, &vm->vcpu_list, struct vcpu_t,
+                                vcpu_list) {
+            if (sibling == vcpu || sibling->in_guest || !sibling->tunnel ||
+                sibling->tunnel->_exit_status == HAX_EXIT_HLT)
+                continue;
+            if (pass == 0 && sibling->vcpu_id <= vm->ple_last_target)
+                continue;
+            if (hax_atomic_add(&sibling->ref_count, 1) <= 0) {
+                hax_atomic_dec(&sibling->ref_count);
+                continue;
+            }
+            target = sibling;
+            vm->ple_last_target = sibling->vcpu_id;
+            break;
+        }
+    }
+    hax_mutex_unlock(vm->vm_lock);
+    return target;
+}
+
+static int exit_pause(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    struct vcpu_t *target;
+
+    htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+    htun->ple_exits = ++vcpu->ple_exits;
+    advance_rip(vcpu);
+
+    target = vcpu_pick_yield_target(vcpu);
+    hax_vcpu_yield(vcpu, target ? target->vcpu_host : NULL);
+    if (target) {
+        hax_put_vcpu(target);
+    }
+    return HAX_RESUME;
+}
+
+/*
+ * Arms the VMX-preemption timer to expire at the timer deadline (in guest TSC)
+ * published by user space in the tunnel, or disarms it if there is none.
+ * Must be called with the VMCS loaded, right before VM entry.
+ */
+void vcpu_arm_preemption_timer(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    info_t *vmx_info = &current_cpu_data()->vmx_info;
+    uint32_t pin_ctls = vmx(vcpu, pin_ctls);
+    uint64_t deadline = htun->timer_deadline;
+
+    if (deadline && (vmx_info->pin_ctls_1 & VMX_TIMER_EXITING)) {
+        // The timer counts down at the TSC rate divided by 2^shift (cf. IA SDM
+        // Vol. 3C 25.5.1)
+        uint shift = vmx_info->_tsc_comparator_len & 0x1f;
+        uint64_t now = vcpu_guest_tsc(vcpu);
+        uint64_t ticks = 0;
+
+        if (deadline > now) {
+            // The timer counts host TSC ticks, not guest ones. A deadline too
+            // far away for the conversion needs several rounds anyway.
+            ticks = vcpu_guest_to_host_ticks(vcpu, deadline - now);
+            // Round up, so as not to expire before the deadline
+            ticks = (ticks + (1ULL << shift) - 1) >> shift;
+            if (ticks > 0xffffffffULL) {
+                ticks = 0xffffffffULL;
+            }
+        }
+        vmwrite(vcpu, VMX_PREEMPTION_TIMER, ticks);
+        pin_ctls |= VMX_TIMER_EXITING;
+    } else {
+        pin_ctls &= ~VMX_TIMER_EXITING;
+    }
+
+    if (pin_ctls != vmx(vcpu, pin_ctls)) {
+        vmwrite(vcpu, VMX_PIN_CONTROLS, vmx(vcpu, pin_ctls) = pin_ctls);
+    }
+}
+
+static int exit_preemption_timer(struct vcpu_t *vcpu, struct hax_tunnel *htun)
+{
+    uint64_t now = vcpu_guest_tsc(vcpu);
+
+    htun->_exit_reason = vmx(vcpu, exit_reason).basic_reason;
+
+    // A deadline too far away for the 32-bit timer needs several rounds
+    if (!htun->timer_deadline || now < htun->timer_deadline)
+        return HAX_RESUME;
+
+    // The deadline is one-shot. The timer interrupt is left to user space,
+    // which knows how the guest programmed its local APIC timer.
+    htun->timer_deadline = 0;
+    htun->_exit_status = HAX_EXIT_TIMER;
+    return HAX_EXIT;
+}
+
 static int exit_unsupported_instruction(struct vcpu_t *vcpu,
                                         struct hax_tunnel *htun)
 {
@@ -3685,41 +4476,56 @@ static int _copy_desc(segment_desc_t *old, segment_desc_t *new)
     return flags;
 }
 
-int vcpu_get_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
+// Copies the HAX_REGS_* |groups| of the cached vCPU state to |ustate|
+static void vcpu_copy_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate,
+                           uint32_t groups)
 {
     struct vcpu_state_t *state = vcpu->state;
     int i;
 
-    vcpu_vmread_all(vcpu);
+    if (groups & HAX_REGS_GPRS) {
+        for (i = 0; i < 16; i++) {
+            ustate->_regs[i] = state->_regs[i];
+        }
+    }
+    if (groups & HAX_REGS_RIP) {
+        ustate->_rip = state->_rip;
+        ustate->_rflags = state->_rflags;
+    }
 
-    for (i = 0; i < 16; i++) {
-        ustate->_regs[i] = state->_regs[i];
-    }
-    ustate->_rip = state->_rip;
-    ustate->_rflags = state->_rflags;
-
-    ustate->_cr0 = state->_cr0;
-    ustate->_cr2 = state->_cr2;
-    ustate->_cr3 = state->_cr3;
-    ustate->_cr4 = state->_cr4;
-
-    ustate->_dr0 = state->_dr0;
-    ustate->_dr1 = state->_dr1;
-    ustate->_dr2 = state->_dr2;
-    ustate->_dr3 = state->_dr3;
-    ustate->_dr6 = state->_dr6;
-    ustate->_dr7 = state->_dr7;
-    _copy_desc(&state->_cs, &ustate->_cs);
-    _copy_desc(&state->_ds, &ustate->_ds);
-    _copy_desc(&state->_es, &ustate->_es);
-    _copy_desc(&state->_ss, &ustate->_ss);
-    _copy_desc(&state->_fs, &ustate->_fs);
-    _copy_desc(&state->_gs, &ustate->_gs);
-    _copy_desc(&state->_ldt, &ustate->_ldt);
-    _copy_desc(&state->_tr, &ustate->_tr);
-    _copy_desc(&state->_gdt, &ustate->_gdt);
-    _copy_desc(&state->_idt, &ustate->_idt);
+    if (groups & HAX_REGS_CRS) {
+        ustate->_cr0 = state->_cr0;
+        ustate->_cr2 = state->_cr2;
+        ustate->_cr3 = state->_cr3;
+        ustate->_cr4 = state->_cr4;
+    }
+
+    if (groups & HAX_REGS_DRS) {
+        ustate->_dr0 = state->_dr0;
+        ustate->_dr1 = state->_dr1;
+        ustate->_dr2 = state->_dr2;
+        ustate->_dr3 = state->_dr3;
+        ustate->_dr6 = state->_dr6;
+        ustate->_dr7 = state->_dr7;
+    }
+    if (groups & HAX_REGS_SEGS) {
+        _copy_desc(&state->_cs, &ustate->_cs);
+        _copy_desc(&state->_ds, &ustate->_ds);
+        _copy_desc(&state->_es, &ustate->_es);
+        _copy_desc(&state->_ss, &ustate->_ss);
+        _copy_desc(&state->_fs, &ustate->_fs);
+        _copy_desc(&state->_gs, &ustate->_gs);
+        _copy_desc(&state->_ldt, &ustate->_ldt);
+        _copy_desc(&state->_tr, &ustate->_tr);
+        _copy_desc(&state->_gdt, &ustate->_gdt);
+        _copy_desc(&state->_idt, &ustate->_idt);
+    }
+}
 
+int vcpu_get_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
+{
+    vcpu_vmread_all(vcpu);
+    vcpu_copy_regs(vcpu, ustate, HAX_REGS_ALL);
     return 0;
 }
 
@@ -3734,7 +4540,9 @@ int vcpu_get_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
             VMWRITE_SEG(vcpu, seg, state->field);        \
         }
 
-int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
+// Loads the HAX_REGS_* |groups| of |ustate| into the vCPU
+static int vcpu_load_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate,
+                          uint32_t groups)
 {
     struct vcpu_state_t *state = vcpu->state;
     int i;
@@ -3743,12 +4551,17 @@ int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
     int rsp_dirty = 0;
     uint32_t vmcs_err = 0;
 
-    if (state->_rsp != ustate->_rsp) {
-        rsp_dirty = 1;
-    }
+    // Compare against up-to-date values only
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_ALL);
+
+    if (groups & HAX_REGS_GPRS) {
+        if (state->_rsp != ustate->_rsp) {
+            rsp_dirty = 1;
+        }
 
-    for (i = 0; i < 16; i++) {
-        state->_regs[i] = ustate->_regs[i];
+        for (i = 0; i < 16; i++) {
+            state->_regs[i] = ustate->_regs[i];
+        }
     }
 
     if ((vmcs_err = load_vmcs(vcpu, &flags))) {
@@ -3759,25 +4572,30 @@ int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
         return -EFAULT;
     }
 
-    if (state->_rip != ustate->_rip) {
-        state->_rip = ustate->_rip;
-        vcpu->rip_dirty = 1;
-    }
-    if (state->_rflags != ustate->_rflags) {
-        state->_rflags = ustate->_rflags;
-        vcpu->rflags_dirty = 1;
+    if (groups & HAX_REGS_RIP) {
+        if (state->_rip != ustate->_rip) {
+            state->_rip = ustate->_rip;
+            vcpu->rip_dirty = 1;
+        }
+        if (state->_rflags != ustate->_rflags) {
+            state->_rflags = ustate->_rflags;
+            vcpu->rflags_dirty = 1;
+        }
     }
     if (rsp_dirty) {
         state->_rsp = ustate->_rsp;
         vmwrite(vcpu, GUEST_RSP, state->_rsp);
     }
 
-    UPDATE_VCPU_STATE(_cr0, cr_dirty);
-    UPDATE_VCPU_STATE(_cr2, cr_dirty);
-    UPDATE_VCPU_STATE(_cr3, cr_dirty);
-    UPDATE_VCPU_STATE(_cr4, cr_dirty);
-    if (cr_dirty) {
-        vmwrite_cr(vcpu);
+    if (groups & HAX_REGS_CRS) {
+        UPDATE_VCPU_STATE(_cr0, cr_dirty);
+        UPDATE_VCPU_STATE(_cr2, cr_dirty);
+        UPDATE_VCPU_STATE(_cr3, cr_dirty);
+        UPDATE_VCPU_STATE(_cr4, cr_dirty);
+        if (cr_dirty) {
+            vmwrite_cr(vcpu);
+            vcpu_vpid_invalidate(vcpu);
+        }
     }
 
     /*
@@ -3809,7 +4627,9 @@ int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
      * on the same HW breakpoint without setting RFAGS.RF (See Intel SDM Vol.
      * 3B 17.3.1.1), which can't be done in user space.
      */
-    if (vcpu->debug_control & HAX_DEBUG_ENABLE) {
+    if (!(groups & HAX_REGS_DRS)) {
+        // Leave the DR state alone
+    } else if (vcpu->debug_control & HAX_DEBUG_ENABLE) {
         hax_log(HAX_LOGI, "%s: Ignore DR updates because hax debugging has "
                 "been enabled in %d.\n", __func__, vcpu->vcpu_id);
     } else {
@@ -3828,21 +4648,27 @@ int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
             vcpu->dr_dirty = 0;
     }
 
-    UPDATE_SEGMENT_STATE(CS, _cs);
-    UPDATE_SEGMENT_STATE(DS, _ds);
-    UPDATE_SEGMENT_STATE(ES, _es);
-    UPDATE_SEGMENT_STATE(FS, _fs);
-    UPDATE_SEGMENT_STATE(GS, _gs);
-    UPDATE_SEGMENT_STATE(SS, _ss);
-    UPDATE_SEGMENT_STATE(LDTR, _ldt);
-    UPDATE_SEGMENT_STATE(TR, _tr);
+    if (groups & HAX_REGS_SEGS) {
+        // Fix up the segment types once here rather than before every VM
+        // entry
+        ustate->_cs.ar = fix_cs_ar(ustate->_cs.ar);
+        ustate->_tr.ar = fix_tr_ar(ustate->_tr.ar);
+        UPDATE_SEGMENT_STATE(CS, _cs);
+        UPDATE_SEGMENT_STATE(DS, _ds);
+        UPDATE_SEGMENT_STATE(ES, _es);
+        UPDATE_SEGMENT_STATE(FS, _fs);
+        UPDATE_SEGMENT_STATE(GS, _gs);
+        UPDATE_SEGMENT_STATE(SS, _ss);
+        UPDATE_SEGMENT_STATE(LDTR, _ldt);
+        UPDATE_SEGMENT_STATE(TR, _tr);
 
-    if (_copy_desc(&ustate->_gdt, &state->_gdt)) {
-        VMWRITE_DESC(vcpu, GDTR, state->_gdt);
-    }
+        if (_copy_desc(&ustate->_gdt, &state->_gdt)) {
+            VMWRITE_DESC(vcpu, GDTR, state->_gdt);
+        }
 
-    if (_copy_desc(&ustate->_idt, &state->_idt)) {
-        VMWRITE_DESC(vcpu, IDTR, state->_idt);
+        if (_copy_desc(&ustate->_idt, &state->_idt)) {
+            VMWRITE_DESC(vcpu, IDTR, state->_idt);
+        }
     }
 
     if ((vmcs_err = put_vmcs(vcpu, &flags))) {
@@ -3855,6 +4681,64 @@ int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
     return 0;
 }
 
+int vcpu_set_regs(struct vcpu_t *vcpu, struct vcpu_state_t *ustate)
+{
+    int ret;
+
+    ret = vcpu_load_regs(vcpu, ustate, HAX_REGS_ALL);
+    if (ret)
+        return ret;
+
+    // Do not leave the old values in the register page
+    if (vcpu->regs_page) {
+        vcpu_vmread_all(vcpu);
+        vcpu_sync_regs_page(vcpu);
+    }
+    return 0;
+}
+
+/*
+ * Loads the register groups that user space has modified in the register page
+ * since the last return from vcpu_execute(). The page is copied first, so that
+ * user space cannot change it while it is being validated.
+ */
+static int vcpu_load_regs_page(struct vcpu_t *vcpu)
+{
+    struct hax_regs_page *page = vcpu->regs_page;
+    struct vcpu_state_t regs;
+    uint32_t dirty;
+
+    dirty = page->dirty & HAX_REGS_ALL;
+    if (!dirty)
+        return 0;
+
+    page->dirty = 0;
+    regs = page->regs;
+    return vcpu_load_regs(vcpu, &regs, dirty);
+}
+
+/*
+ * Updates the register page with the register groups that are known without
+ * reading the whole guest state from the VMCS, and reports them in
+ * |page->valid|. Only RSP is read if needed, to complete the GPRs.
+ */
+static void vcpu_sync_regs_page(struct vcpu_t *vcpu)
+{
+    struct hax_regs_page *page = vcpu->regs_page;
+    uint32_t valid = HAX_REGS_ALL;
+
+    if (vcpu->cur_state == GS_STALE) {
+        // RIP and RFLAGS are read after every VM exit
+        valid = HAX_REGS_GPRS | HAX_REGS_RIP;
+        vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_RSP);
+        if (vmx(vcpu, vmcs_cache_valid) & VMCS_CACHE_CRS) {
+            valid |= HAX_REGS_CRS;
+        }
+    }
+    vcpu_copy_regs(vcpu, &page->regs, valid);
+    page->valid = valid;
+}
+
 int vcpu_get_fpu(struct vcpu_t *vcpu, struct fx_layout *ufl)
 {
     struct fx_layout *fl = (struct fx_layout *)hax_page_va(
@@ -3973,6 +4857,204 @@ int vcpu_get_xcr(struct vcpu_t *vcpu, uint32_t index, uint64_t *value)
     return 0;
 }
 
+#define VCPU_EVENTS_BLOCKING (GUEST_INTRSTAT_STI_BLOCKING |                   \
+                              GUEST_INTRSTAT_SS_BLOCKING |                    \
+                              GUEST_INTRSTAT_SMI_BLOCKING |                   \
+                              GUEST_INTRSTAT_NMI_BLOCKING)
+
+static int vcpu_check_state(struct hax_vcpu_state *ustate)
+{
+    if (ustate->version != HAX_VCPU_STATE_VERSION ||
+        ustate->size != sizeof(struct hax_vcpu_state)) {
+        hax_log(HAX_LOGW, "%s: Unsupported version %u or size %u.\n",
+                __func__, ustate->version, ustate->size);
+        return -EINVAL;
+    }
+    if (ustate->flags & ~HAX_VCPU_STATE_ALL) {
+        hax_log(HAX_LOGW, "%s: Invalid flags 0x%x.\n", __func__,
+                ustate->flags);
+        return -EINVAL;
+    }
+    if (ustate->nr_msrs > HAX_MAX_VCPU_STATE_MSRS) {
+        hax_log(HAX_LOGW, "%s: Too many MSRs: %u.\n", __func__,
+                ustate->nr_msrs);
+        return -E2BIG;
+    }
+    return 0;
+}
+
+static void vcpu_get_events(struct vcpu_t *vcpu, struct hax_vcpu_events *events)
+{
+    int i;
+
+    // Called after vcpu_vmread_all(), so the cached value is up to date
+    events->interruptibility.pad = 0;
+    events->interruptibility.raw = vmx(vcpu, interruptibility_state).raw &
+                                   VCPU_EVENTS_BLOCKING;
+    for (i = 0; i < 8; i++) {
+        events->intr_pending[i] = vcpu->intr_pending[i];
+    }
+}
+
+static void vcpu_set_events(struct vcpu_t *vcpu, struct hax_vcpu_events *events)
+{
+    uint32_t pending;
+    int i;
+
+    // Make sure a later vcpu_vmread_all() does not discard the new value
+    vcpu_vmread_all(vcpu);
+    vmx(vcpu, interruptibility_state).raw = events->interruptibility.raw &
+                                            VCPU_EVENTS_BLOCKING;
+    vcpu->interruptibility_dirty = 1;
+
+    vcpu->nr_pending_intrs = 0;
+    for (i = 0; i < 8; i++) {
+        vcpu->intr_pending[i] = events->intr_pending[i];
+        for (pending = events->intr_pending[i]; pending;
+             pending &= pending - 1) {
+            vcpu->nr_pending_intrs++;
+        }
+    }
+}
+
+/*
+ * Retrieves the state groups selected by |ustate->flags| in one go, so that
+ * the VMCS is loaded only once. For HAX_VCPU_STATE_MSRS, the caller fills in
+ * the |entry| of each of the |nr_msrs| MSRs, and |done| reports how many of
+ * them were read before the first failure.
+ */
+int vcpu_get_state(struct vcpu_t *vcpu, struct hax_vcpu_state *ustate)
+{
+    uint32_t i;
+    int ret;
+
+    ret = vcpu_check_state(ustate);
+    if (ret)
+        return ret;
+
+    vcpu_vmread_all(vcpu);
+
+    if (ustate->flags & HAX_VCPU_STATE_REGS) {
+        vcpu_get_regs(vcpu, &ustate->regs);
+    }
+    if (ustate->flags & HAX_VCPU_STATE_FPU) {
+        vcpu_get_fpu(vcpu, &ustate->fpu);
+    }
+    if (ustate->flags & HAX_VCPU_STATE_XCR0) {
+        ustate->xcr0 = vcpu->xcr0;
+    }
+    if (ustate->flags & HAX_VCPU_STATE_EVENTS) {
+        vcpu_get_events(vcpu, &ustate->events);
+    }
+
+    ustate->done = 0;
+    if (!(ustate->flags & HAX_VCPU_STATE_MSRS))
+        return 0;
+
+    for (i = 0; i < ustate->nr_msrs; i++) {
+        if (vcpu_get_msr(vcpu, ustate->msrs[i].entry, &ustate->msrs[i].value))
+            break;
+    }
+    ustate->done = i;
+    return 0;
+}
+
+/*
+ * Restores the state groups selected by |ustate->flags|. Registers are set
+ * first, because the handling of some MSRs depends on them, and events last.
+ */
+int vcpu_set_state(struct vcpu_t *vcpu, struct hax_vcpu_state *ustate)
+{
+    uint32_t i;
+    int ret;
+
+    ret = vcpu_check_state(ustate);
+    if (ret)
+        return ret;
+
+    if (ustate->flags & HAX_VCPU_STATE_REGS) {
+        ret = vcpu_set_regs(vcpu, &ustate->regs);
+        if (ret)
+            return ret;
+    }
+    if (ustate->flags & HAX_VCPU_STATE_XCR0) {
+        ret = vcpu_set_xcr(vcpu, XCR_XFEATURE_ENABLED_MASK, ustate->xcr0);
+        if (ret)
+            return ret;
+    }
+    if (ustate->flags & HAX_VCPU_STATE_FPU) {
+        vcpu_put_fpu(vcpu, &ustate->fpu);
+    }
+
+    ustate->done = 0;
+    if (ustate->flags & HAX_VCPU_STATE_MSRS) {
+        for (i = 0; i < ustate->nr_msrs; i++) {
+            if (vcpu_set_msr(vcpu, ustate->msrs[i].entry,
+                             ustate->msrs[i].value))
+                break;
+        }
+        ustate->done = i;
+    }
+
+    if (ustate->flags & HAX_VCPU_STATE_EVENTS) {
+        vcpu_set_events(vcpu, &ustate->events);
+    }
+    return 0;
+}
+
+/*
+ * Passes on the host CPU that the thread running the vCPU should preferably
+ * run on to the host scheduler, which may still move the thread elsewhere.
+ */
+int vcpu_set_cpu_hint(struct vcpu_t *vcpu, struct hax_vcpu_cpu_hint *hint)
+{
+    if (hint->cpu != -1 &&
+        (hint->cpu < 0 || (uint32_t)hint->cpu >= cpu_online_map.cpu_num ||
+         !cpu_is_online(&cpu_online_map, (uint32_t)hint->cpu)))
+        return -EINVAL;
+
+    return hax_vcpu_set_cpu_hint(vcpu, vcpu->vcpu_host, hint->cpu);
+}
+
+/*
+ * Sets the TSC frequency seen by the guest, e.g. to that of the host a snapshot
+ * was taken on, and reports the TSC frequency of this host. The guest TSC
+ * value carries on from where it was, so user space restoring a snapshot
+ * should set the frequency before IA32_TSC.
+ */
+int vcpu_set_tsc_khz(struct vcpu_t *vcpu, struct hax_tsc_khz *info)
+{
+    uint32_t host_khz = hax->tsc_khz;
+    uint32_t guest_khz = info->guest_khz;
+    uint64_t ratio = VCPU_TSC_RATIO_ONE, inverse_ratio = VCPU_TSC_RATIO_ONE;
+    uint64_t guest_tsc;
+
+    info->host_khz = host_khz;
+    // 0 stands for the host frequency
+    if (guest_khz && guest_khz != host_khz) {
+        if (!host_khz || !(vmx(vcpu, scpu_ctls) & USE_TSC_SCALING))
+            return -ENOSYS;
+        // Both ratios must fit in the 16 integer bits of the multiplier
+        if (guest_khz / host_khz >= 0x10000 || host_khz / guest_khz >= 0x10000)
+            return -EINVAL;
+        ratio = tsc_ratio(guest_khz, host_khz);
+        inverse_ratio = tsc_ratio(host_khz, guest_khz);
+    }
+
+    guest_tsc = vcpu_guest_tsc(vcpu);
+    vcpu->tsc_ratio = ratio;
+    vcpu->tsc_inverse_ratio = inverse_ratio;
+    vcpu->tsc_offset = guest_tsc - vcpu_scale_tsc(vcpu, ia32_rdtsc());
+
+    if (vmx(vcpu, scpu_ctls) & USE_TSC_SCALING) {
+        vmwrite(vcpu, VMX_TSC_MULTIPLIER, vcpu->tsc_ratio);
+    }
+    if (vmx(vcpu, pcpu_ctls) & USE_TSC_OFFSETTING) {
+        vmwrite(vcpu, VMX_TSC_OFFSET, vcpu->tsc_offset);
+    }
+    return 0;
+}
+
 int vcpu_set_cpuid(struct vcpu_t *vcpu, hax_cpuid *cpuid_info)
 {
     int ret;
@@ -4054,6 +5136,7 @@ static void vcpu_state_dump(struct vcpu_t *vcpu)
     bool em64t_support = cpu_has_feature(X86_FEATURE_EM64T);
     struct fx_layout *gfx = (struct fx_layout *)hax_page_va(gstate->gfxpage);
 
+    vcpu_vmcs_cache_fetch(vcpu, VMCS_CACHE_ALL);
     hax_log(HAX_LOGW,
             "RIP: %08llx  RSP: %08llx  RFLAGS: %08llx\n"
             "RAX: %08llx  RBX: %08llx  RCX: %08llx  RDX: %08llx\n"
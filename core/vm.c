@@ -39,34 +39,78 @@
 #include "paging.h"
 #include "vcpu.h"
 
-static uint64_t vm_mid_bits = 0;
-
 #ifdef HAX_ARCH_X86_32
 static void gpfn_to_hva_recycle_total(struct vm_t *vm, uint64_t cr3_cur,
                                       int flag);
 #endif
 
-static int get_free_vm_mid(void)
+/*
+ * Makes |*table|, an array of |*size| pointers indexed by ID, large enough to
+ * hold |index|, doubling its size as needed but not beyond |max_size|. New
+ * entries are NULL. The caller must hold the lock that protects the table.
+ */
+int hax_table_reserve(void ***table, int *size, int index, int max_size)
 {
-    int i;
+    void **new_table;
+    int new_size;
 
-    for (i = 0; i < HAX_MAX_VMS; i++) {
-        if (!hax_test_and_set_bit(i, (uint64_t *)&vm_mid_bits))
-            return i;
-    }
+    if (index < *size)
+        return 0;
+    if (index < 0 || index >= max_size)
+        return -EINVAL;
 
-    return -1;
+    new_size = *size ? *size : 8;
+    while (new_size <= index) {
+        new_size *= 2;
+    }
+    new_size = min(new_size, max_size);
+
+    new_table = hax_vmalloc(new_size * sizeof(void *), HAX_MEM_NONPAGE);
+    if (!new_table)
+        return -ENOMEM;
+    memset(new_table, 0, new_size * sizeof(void *));
+    if (*table) {
+        memcpy(new_table, *table, *size * sizeof(void *));
+        hax_vfree(*table, *size * sizeof(void *));
+    }
+    *table = new_table;
+    *size = new_size;
+    return 0;
 }
 
-static void hax_put_vm_mid(int id)
+/*
+ * Assigns the lowest free VM ID to |vm|. Until it is published, the VM cannot
+ * be looked up by its ID, because its reference count is still 0 (see
+ * hax_get_vm()).
+ */
+static int hax_alloc_vm_id(struct vm_t *vm)
 {
-    if (hax_test_and_clear_bit(id, (uint64_t *)&vm_mid_bits))
-        hax_log(HAX_LOGW, "Clear a non-set vmid %x\n", id);
+    int id;
+
+    hax_mutex_lock(hax->hax_lock);
+    for (id = 0; id < hax->vm_table_size; id++) {
+        if (!hax->vm_table[id])
+            break;
+    }
+    if (hax_table_reserve((void ***)&hax->vm_table, &hax->vm_table_size, id,
+                          HAX_MAX_VMS)) {
+        id = -1;
+    } else {
+        hax->vm_table[id] = vm;
+    }
+    hax_mutex_unlock(hax->hax_lock);
+    return id;
 }
 
-static int valid_vm_mid(int vm_id)
+static void hax_free_vm_id(int id)
 {
-    return (vm_id >= 0) && (vm_id < HAX_MAX_VMS);
+    hax_mutex_lock(hax->hax_lock);
+    if (id < hax->vm_table_size && hax->vm_table[id]) {
+        hax->vm_table[id] = NULL;
+    } else {
+        hax_log(HAX_LOGW, "Clear a non-set vmid %x\n", id);
+    }
+    hax_mutex_unlock(hax->hax_lock);
 }
 
 int hax_vm_set_qemuversion(struct vm_t *vm, struct hax_qemu_version *ver)
@@ -76,6 +120,9 @@ int hax_vm_set_qemuversion(struct vm_t *vm, struct hax_qemu_version *ver)
         if (ver->cur_version >= 0x4) {
             vm->features |= VM_FEATURES_FASTMMIO_EXTRA;
         }
+        if (ver->cur_version >= 0x5) {
+            vm->features |= VM_FEATURES_IOBUF_SIZE;
+        }
     }
     return 0;
 }
@@ -97,23 +144,21 @@ struct vm_t * hax_create_vm(int *vm_id)
         return NULL;
     }
 
-    id = get_free_vm_mid();
-
-    if (!valid_vm_mid(id)) {
-        hax_log(HAX_LOGE, "Failed to allocate vm id\n");
-        return NULL;
-    }
-    *vm_id = id;
     hvm = hax_vmalloc(sizeof(struct vm_t), HAX_MEM_NONPAGE);
     if (!hvm) {
-        hax_put_vm_mid(id);
         hax_log(HAX_LOGE, "Failed to allocate vm\n");
         return NULL;
     }
     memset(hvm, 0, sizeof(struct vm_t));
 
+    id = hax_alloc_vm_id(hvm);
+    if (id < 0) {
+        hax_vfree(hvm, sizeof(struct vm_t));
+        hax_log(HAX_LOGE, "Failed to allocate vm id\n");
+        return NULL;
+    }
+    *vm_id = id;
     hvm->vm_id = id;
-    memset(hvm->vpid_seed, 0, sizeof(hvm->vpid_seed));
 
 #ifdef HAX_ARCH_X86_32
     hvm->hva_list = hax_vmalloc(((HVA_MAP_ARRAY_SIZE / 4096) *
@@ -147,6 +192,7 @@ struct vm_t * hax_create_vm(int *vm_id)
     hvm->gpa_space_listener.mapping_added = NULL;
     hvm->gpa_space_listener.mapping_removed = ept_handle_mapping_removed;
     hvm->gpa_space_listener.mapping_changed = ept_handle_mapping_changed;
+    hvm->gpa_space_listener.pages_unshared = ept_handle_pages_unshared;
     hvm->gpa_space_listener.opaque = (void *)&hvm->ept_tree;
     gpa_space_add_listener(&hvm->gpa_space, &hvm->gpa_space_listener);
 
@@ -156,9 +202,12 @@ struct vm_t * hax_create_vm(int *vm_id)
     hvm->vm_lock = hax_mutex_alloc_init();
     if (!hvm->vm_lock)
         goto fail1;
+    hvm->ws.lock = hax_mutex_alloc_init();
+    if (!hvm->ws.lock)
+        goto fail2;
     hax_init_list_head(&hvm->vcpu_list);
     if (hax_vm_create_host(hvm, id) < 0)
-        goto fail2;
+        goto fail3;
 
     /* Publish the VM */
     hax_mutex_lock(hax->hax_lock);
@@ -166,9 +215,14 @@ struct vm_t * hax_create_vm(int *vm_id)
     hvm->ref_count = 1;
     hax_mutex_unlock(hax->hax_lock);
     return hvm;
+fail3:
+    hax_mutex_free(hvm->ws.lock);
 fail2:
     hax_mutex_free(hvm->vm_lock);
 fail1:
+    if (hvm->gpa_space.lock) {
+        hax_mutex_free(hvm->gpa_space.lock);
+    }
 #ifdef HAX_ARCH_X86_32
     hax_vfree(hvm->hva_list_1,
               ((HVA_MAP_ARRAY_SIZE / 4096) * sizeof(struct hva_entry)));
@@ -178,11 +232,60 @@ fail0:
               ((HVA_MAP_ARRAY_SIZE / 4096) * sizeof(struct hva_entry)));
 fail:
 #endif
+    hax_free_vm_id(id);
     hax_vfree(hvm, sizeof(struct vm_t));
-    hax_put_vm_mid(id);
     return NULL;
 }
 
+int hax_clone_vm(int template_vm_id, uint64_t token, int *vm_id)
+{
+    struct vm_t *template, *hvm;
+    uint64_t clone_token;
+    int ret;
+
+    template = hax_get_vm(template_vm_id, 1);
+    if (!template) {
+        hax_log(HAX_LOGE, "%s: Template VM %d does not exist\n", __func__,
+                template_vm_id);
+        return -ENOENT;
+    }
+    if (!hax_test_bit(VM_STATE_FLAGS_FROZEN, &template->flags)) {
+        hax_log(HAX_LOGE, "%s: Template VM %d is not frozen\n", __func__,
+                template_vm_id);
+        hax_put_vm(template);
+        return -EINVAL;
+    }
+    // Only processes the owner of the template has handed the token to may
+    // clone it, and only until the owner closes it
+    hax_mutex_lock(template->vm_lock);
+    clone_token = template->clone_token;
+    hax_mutex_unlock(template->vm_lock);
+    if (!clone_token || token != clone_token) {
+        hax_log(HAX_LOGE, "%s: Template VM %d has been closed, or the token"
+                " is wrong\n", __func__, template_vm_id);
+        hax_put_vm(template);
+        return -EACCES;
+    }
+
+    hvm = hax_create_vm(vm_id);
+    if (!hvm) {
+        hax_put_vm(template);
+        return -ENOMEM;
+    }
+    ret = gpa_space_set_template(&hvm->gpa_space, &template->gpa_space);
+    if (ret) {
+        // Not opened yet, so this destroys the new VM
+        hax_put_vm(hvm);
+        hax_put_vm(template);
+        return ret;
+    }
+    // The reference to the template is dropped by hax_teardown_vm()
+    hvm->template_vm = template;
+    hax_log(HAX_LOGI, "%s: Created VM %d as a clone of VM %d\n", __func__,
+            *vm_id, template_vm_id);
+    return 0;
+}
+
 static void hax_vm_free_p2m_map(struct vm_t *vm)
 {
     int i;
@@ -194,10 +297,6 @@ static void hax_vm_free_p2m_map(struct vm_t *vm)
     }
 }
 
-/*
- * We don't need corresponding vm_core_close because once closed, the VM will be
- * destroyed.
- */
 int hax_vm_core_open(struct vm_t *vm)
 {
     if (!vm)
@@ -209,6 +308,18 @@ int hax_vm_core_open(struct vm_t *vm)
     return 0;
 }
 
+/*
+ * Called when the owner closes the VM, which is destroyed once its last
+ * reference is dropped. A frozen VM may outlive its owner as long as its
+ * clones use its RAM, but no new clone can be made of it.
+ */
+void hax_vm_core_close(struct vm_t *vm)
+{
+    hax_mutex_lock(vm->vm_lock);
+    vm->clone_token = 0;
+    hax_mutex_unlock(vm->vm_lock);
+}
+
 int hax_teardown_vm(struct vm_t *vm)
 {
     if (!hax_list_empty(&(vm->vcpu_list))) {
@@ -226,51 +337,104 @@ int hax_teardown_vm(struct vm_t *vm)
 #endif
 
     hax_vm_free_p2m_map(vm);
+    if (vm->vcpu_table) {
+        hax_vfree(vm->vcpu_table, vm->vcpu_table_size * sizeof(void *));
+    }
     hax_mutex_free(vm->vm_lock);
-    hax_put_vm_mid(vm->vm_id);
+    if (vm->ws.ages) {
+        hax_vfree(vm->ws.ages, vm->ws.end_gfn);
+    }
+    hax_mutex_free(vm->ws.lock);
+    hax_free_vm_id(vm->vm_id);
 
     gpa_space_remove_listener(&vm->gpa_space, &vm->gpa_space_listener);
     ept_tree_free(&vm->ept_tree);
     gpa_space_free(&vm->gpa_space);
+    if (vm->template_vm) {
+        hax_put_vm(vm->template_vm);
+    }
 
     hax_vfree(vm, sizeof(struct vm_t));
     hax_log(HAX_LOGE, "...........hax_teardown_vm\n");
     return 0;
 }
 
+/*
+ * Makes all the vCPUs of the given VM return from vcpu_execute(), and keeps
+ * them from running until hax_vm_resume_vcpus() is called. Each vCPU is
+ * paused, which kicks it out of guest mode, and its tmutex is taken, which
+ * waits for vcpu_execute() to return. Returns -EBUSY if the vCPUs have already
+ * been stopped by another caller.
+ */
+int hax_vm_stop_vcpus(struct vm_t *vm)
+{
+    int i;
+
+    if (hax_test_and_set_bit(VM_STATE_FLAGS_STOPPED, &vm->flags))
+        return -EBUSY;
+
+    for (i = 0; ; i++) {
+        struct vcpu_t *vcpu = NULL;
+        bool paused;
+
+        hax_mutex_lock(vm->vm_lock);
+        if (i >= vm->vcpu_table_size) {
+            hax_mutex_unlock(vm->vm_lock);
+            break;
+        }
+        vcpu = vm->vcpu_table[i];
+        // Destroy on way already
+        if (vcpu && hax_atomic_add(&vcpu->ref_count, 1) <= 0) {
+            hax_atomic_dec(&vcpu->ref_count);
+            vcpu = NULL;
+        }
+        hax_mutex_unlock(vm->vm_lock);
+        if (!vcpu)
+            continue;
+
+        // The tmutex must not be taken with vm_lock held
+        paused = vcpu->paused;
+        vcpu_pause(vcpu);
+        hax_mutex_lock(vcpu->tmutex);
+        hax_mutex_unlock(vcpu->tmutex);
+        // From now on, vcpu_execute() returns right away, as the flag is set
+        if (!paused) {
+            vcpu_unpause(vcpu);
+        }
+        hax_put_vcpu(vcpu);
+    }
+    return 0;
+}
+
+void hax_vm_resume_vcpus(struct vm_t *vm)
+{
+    hax_test_and_clear_bit(VM_STATE_FLAGS_STOPPED, &vm->flags);
+}
+
 struct vcpu_t * hax_get_vcpu(int vm_id, int vcpu_id, int refer)
 {
     struct vm_t *vm = NULL;
     struct vcpu_t *vcpu = NULL;
-    hax_list_head *list;
-    int found = 0;
 
     vm = hax_get_vm(vm_id, 1);
     if (!vm)
         return NULL;
 
     hax_mutex_lock(vm->vm_lock);
-    hax_list_for_each(list, (hax_list_head *)(&vm->vcpu_list)) {
-        vcpu = hax_list_entry(vcpu_list, struct vcpu_t, list);
-        if (vcpu->vcpu_id == vcpu_id) {
-            found = 1;
-
-            if (refer) {
-                signed int count;
-
-                count = hax_atomic_add(&vcpu->ref_count, 1);
-                // Destroy on way already, we need to return NULL now.
-                if (count <= 0) {
-                    hax_atomic_dec(&vcpu->ref_count);
-                    vcpu = NULL;
-                }
-            }
-            break;
+    if (vcpu_id >= 0 && vcpu_id < vm->vcpu_table_size) {
+        vcpu = vm->vcpu_table[vcpu_id];
+    }
+    if (vcpu && refer) {
+        signed int count;
+
+        count = hax_atomic_add(&vcpu->ref_count, 1);
+        // Destroy on way already, we need to return NULL now.
+        if (count <= 0) {
+            hax_atomic_dec(&vcpu->ref_count);
+            vcpu = NULL;
         }
     }
     hax_mutex_unlock(vm->vm_lock);
-    if (!found)
-        vcpu = NULL;
     hax_put_vm(vm);
     return vcpu;
 }
@@ -278,30 +442,26 @@ struct vcpu_t * hax_get_vcpu(int vm_id, int vcpu_id, int refer)
 struct vm_t * hax_get_vm(int vm_id, int ref)
 {
     struct vm_t *vm = NULL;
-    hax_list_head *list;
-    int found = 0;
 
     hax_mutex_lock(hax->hax_lock);
-    hax_list_for_each(list, (hax_list_head *)(&hax->hax_vmlist)) {
-        vm = hax_list_entry(hvm_list, struct vm_t, list);
-        if (vm->vm_id == vm_id) {
-            found = 1;
-            if (ref) {
-                signed int count;
-                count = hax_atomic_add(&vm->ref_count, 1);
-                // If ref count is 0, that means the vm is on way to destroy
-                if (count <= 0) {
-                    hax_atomic_dec(&vm->ref_count);
-                    vm = NULL;
-                }
-            }
-            break;
+    if (vm_id >= 0 && vm_id < hax->vm_table_size) {
+        vm = hax->vm_table[vm_id];
+    }
+    // If ref count is 0, the vm is either not published yet or on way to
+    // destroy
+    if (vm && (signed int)vm->ref_count <= 0) {
+        vm = NULL;
+    }
+    if (vm && ref) {
+        signed int count;
+        count = hax_atomic_add(&vm->ref_count, 1);
+        if (count <= 0) {
+            hax_atomic_dec(&vm->ref_count);
+            vm = NULL;
         }
     }
     hax_mutex_unlock(hax->hax_lock);
 
-    if (!found)
-        return NULL;
     return vm;
 }
 
@@ -66,12 +66,11 @@ static void _vmx_vmwrite_natural(struct vcpu_t *vcpu, const char *name,
 #endif
 }
 
-static void __vmx_vmwrite_common(struct vcpu_t *vcpu, const char *name,
-                                 component_index_t component,
-                                 uint64_t source_val)
+static inline void __vmx_vmwrite_common(struct vcpu_t *vcpu, const char *name,
+                                        component_index_t component,
+                                        uint64_t source_val, uint8_t width)
 {
-    uint8_t val = (component & 0x6000) >> 13;
-    switch (val) {
+    switch (width) {
         case ENCODE_16:
         case ENCODE_32: {
             source_val &= 0x00000000FFFFFFFF;
@@ -88,18 +87,47 @@ static void __vmx_vmwrite_common(struct vcpu_t *vcpu, const char *name,
         }
         default: {
             hax_log(HAX_LOGE, "Unsupported component %x, val %x\n",
-                    component, val);
+                    component, width);
             break;
         }
     }
 }
 
-void vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
-                 component_index_t component, uint64_t source_val)
+/*
+ * Returns true if |component| is a host-state field that already holds
+ * |source_val|, otherwise records that it is about to.
+ * Most of the host state written before every VM entry never changes as long
+ * as the vCPU stays on the same host CPU.
+ */
+static inline bool vmx_host_state_unchanged(struct vcpu_t *vcpu,
+                                            component_index_t component,
+                                            uint64_t source_val)
+{
+    uint slot;
+
+    if (!vcpu || !VMCS_FIELD_IS_HOST_STATE(component))
+        return false;
+
+    slot = VMCS_HOST_SHADOW_SLOT(component);
+    if ((vmx(vcpu, host_state_valid) & (1ULL << slot)) &&
+        vmx(vcpu, host_state_shadow)[slot] == source_val)
+        return true;
+
+    vmx(vcpu, host_state_shadow)[slot] = source_val;
+    vmx(vcpu, host_state_valid) |= 1ULL << slot;
+    return false;
+}
+
+static inline void __vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
+                                 component_index_t component,
+                                 uint64_t source_val, uint8_t width)
 {
     preempt_flag flags;
     uint8_t loaded = 0;
 
+    if (vmx_host_state_unchanged(vcpu, component, source_val))
+        return;
+
     if (!vcpu || is_vmcs_loaded(vcpu))
         loaded = 1;
 
@@ -112,7 +140,7 @@ void vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
         }
     }
 
-    __vmx_vmwrite_common(vcpu, name, component, source_val);
+    __vmx_vmwrite_common(vcpu, name, component, source_val, width);
 
     if (!loaded) {
         if (put_vmcs(vcpu, &flags)) {
@@ -124,6 +152,32 @@ void vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
     }
 }
 
+void vmx_vmwrite(struct vcpu_t *vcpu, const char *name,
+                 component_index_t component, uint64_t source_val)
+{
+    __vmx_vmwrite(vcpu, name, component, source_val,
+                  VMCS_FIELD_WIDTH(component));
+}
+
+// Also used for 16-bit components, which are written the same way
+void vmx_vmwrite_32(struct vcpu_t *vcpu, const char *name,
+                    component_index_t component, uint64_t source_val)
+{
+    __vmx_vmwrite(vcpu, name, component, source_val, ENCODE_32);
+}
+
+void vmx_vmwrite_64(struct vcpu_t *vcpu, const char *name,
+                    component_index_t component, uint64_t source_val)
+{
+    __vmx_vmwrite(vcpu, name, component, source_val, ENCODE_64);
+}
+
+void vmx_vmwrite_natural(struct vcpu_t *vcpu, const char *name,
+                         component_index_t component, uint64_t source_val)
+{
+    __vmx_vmwrite(vcpu, name, component, source_val, ENCODE_NATURAL);
+}
+
 
 static uint64_t vmx_vmread(struct vcpu_t *vcpu, component_index_t component)
 {
@@ -201,6 +255,9 @@ uint64_t vmread(struct vcpu_t *vcpu, component_index_t component)
     }
 
     val = __vmread_common(vcpu, component);
+    if (vcpu) {
+        vcpu->nr_vmreads++;
+    }
 
     if (!loaded) {
         if (put_vmcs(vcpu, &flags)) {
@@ -170,6 +170,11 @@ function asm_invept, 2
     vmx_check
     ret
 
+function asm_invvpid, 2
+    invvpid reg_arg1, [reg_arg2]
+    vmx_check
+    ret
+
 function asm_vmxon, 1
     vmxon [reg_arg1]
     vmx_check
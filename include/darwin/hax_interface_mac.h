@@ -41,6 +41,8 @@
 #define HAX_IOCTL_DESTROY_VM _IOW(0, 0x22, uint32_t)
 #define HAX_IOCTL_CAPABILITY _IOR(0, 0x23, struct hax_capabilityinfo)
 #define HAX_IOCTL_SET_MEMLIMIT _IOWR(0, 0x24, struct hax_set_memlimit)
+#define HAX_IOCTL_CLONE_VM _IOWR(0, 0x25, struct hax_clone_vm_info)
+#define HAX_IOCTL_SET_PIN_LIMIT _IOWR(0, 0x26, struct hax_pin_limit)
 
 // Only for backward compatibility with old Qemu.
 #define HAX_VM_IOCTL_VCPU_CREATE_ORIG _IOR(0, 0x80, int)
@@ -52,6 +54,14 @@
 #define HAX_VM_IOCTL_ADD_RAMBLOCK _IOW(0, 0x85, struct hax_ramblock_info)
 #define HAX_VM_IOCTL_SET_RAM2 _IOWR(0, 0x86, struct hax_set_ram_info2)
 #define HAX_VM_IOCTL_PROTECT_RAM _IOWR(0, 0x87, struct hax_protect_ram_info)
+#define HAX_VM_IOCTL_SNAPSHOT_SAVE _IOWR(0, 0x88, struct hax_snapshot_io)
+#define HAX_VM_IOCTL_SNAPSHOT_RESTORE _IOWR(0, 0x89, struct hax_snapshot_io)
+#define HAX_VM_IOCTL_FREEZE _IOWR(0, 0x8a, struct hax_freeze_info)
+#define HAX_VM_IOCTL_UNSHARE_RAM _IOW(0, 0x8b, struct hax_unshare_ram_info)
+#define HAX_VM_IOCTL_WS_SCAN _IOWR(0, 0x8c, struct hax_ws_scan)
+#define HAX_VM_IOCTL_WS_SAMPLER _IOW(0, 0x8d, struct hax_ws_sampler)
+#define HAX_VM_IOCTL_WS_HISTOGRAM _IOWR(0, 0x8e, struct hax_ws_histogram)
+#define HAX_VM_IOCTL_RECLAIM_RAM _IOWR(0, 0x8f, struct hax_reclaim_ram)
 
 #define HAX_VCPU_IOCTL_RUN _IO(0, 0xc0)
 #define HAX_VCPU_IOCTL_SET_MSRS _IOWR(0, 0xc1, struct hax_msr_data)
@@ -75,6 +85,13 @@
 // should pass the address of the pointer to `hax_cpuid`.
 #define HAX_VCPU_IOCTL_SET_CPUID _IOW(0, 0xca, struct hax_cpuid *)
 #define HAX_VCPU_IOCTL_GET_CPUID _IOW(0, 0xcb, struct hax_cpuid *)
+#define HAX_VCPU_IOCTL_GET_STATS _IOR(0, 0xcc, struct hax_vcpu_stats)
+#define HAX_VCPU_IOCTL_SETUP_TRACE _IOWR(0, 0xcd, struct hax_trace_info)
+#define HAX_VCPU_IOCTL_GET_STATE _IOW(0, 0xce, struct hax_vcpu_state *)
+#define HAX_VCPU_IOCTL_SET_STATE _IOW(0, 0xcf, struct hax_vcpu_state *)
+#define HAX_VCPU_IOCTL_SETUP_REGS_PAGE _IOR(0, 0xd0, struct hax_regs_page_info)
+#define HAX_VCPU_IOCTL_SET_CPU_HINT _IOW(0, 0xd1, struct hax_vcpu_cpu_hint)
+#define HAX_VCPU_IOCTL_SET_TSC_KHZ _IOWR(0, 0xd2, struct hax_tsc_khz)
 
 #define HAX_KERNEL64_CS 0x80
 #define HAX_KERNEL32_CS 0x08
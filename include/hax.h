@@ -39,7 +39,7 @@
 // declaration
 struct vcpu_t;
 
-#define HAX_CUR_VERSION    0x0004
+#define HAX_CUR_VERSION    0x0005
 #define HAX_COMPAT_VERSION 0x0001
 
 /* TBD */
@@ -183,10 +183,30 @@ void *hax_map_page(struct hax_page *page);
 
 void hax_unmap_page(struct hax_page *page);
 
-void hax_log(int level, const char *fmt, ...);
+struct hax_log_site;
+struct hax_log_ratelimit;
+
+// Use hax_log() instead
+void hax_log_write(int level, const char *fmt, ...);
+bool hax_log_site_update(struct hax_log_site *site, int level);
+bool hax_log_ratelimit_pass(struct hax_log_ratelimit *rl,
+                            struct hax_log_site *site);
+void hax_log_settings_changed(void);
 void hax_panic(const char *fmt, ...);
 
 uint32_t hax_cpu_id(void);
+/*
+ * Fills the given buffer with random bytes from the host OS's cryptographic
+ * random number generator. Must be called in a context that may sleep.
+ * Returns 0 on success, or -EIO if the generator failed.
+ */
+int hax_get_random_bytes(void *buf, uint32_t size);
+/*
+ * Returns the time elapsed since an arbitrary point (e.g. host boot) in
+ * nanoseconds, from a monotonic host clock whose resolution may be as coarse as
+ * the host timer tick.
+ */
+uint64_t hax_get_uptime_ns(void);
 
 #ifdef __cplusplus
 }
@@ -207,6 +227,81 @@ static inline unsigned char *hax_page_va(struct hax_page *page)
 #define HAX_LOGD        1
 #define HAX_LOG_DEFAULT 3
 
+/*
+ * Messages below HAX_LOG_LEVEL_MIN are compiled out, along with the evaluation
+ * of their arguments. Debug builds (HAX_DEBUG, or DBG with the WDK) keep all of
+ * them.
+ */
+#if defined(HAX_DEBUG) || (defined(DBG) && DBG)
+#define HAX_LOG_LEVEL_MIN HAX_LOGD
+#else
+#define HAX_LOG_LEVEL_MIN HAX_LOGI
+#endif
+
+/*
+ * Messages compiled in are printed if their level is at least hax_log_level,
+ * or if their call site matches hax_log_sites, a comma-separated list of
+ * "file" or "file:line" entries (e.g. "vcpu.c,ept2.c:120"). Both can be changed
+ * at any time, as long as hax_log_settings_changed() is called afterwards.
+ */
+extern int hax_log_level;
+extern char hax_log_sites[256];
+
+/*
+ * Each call site of hax_log() caches whether it is enabled, which is only
+ * re-evaluated (by hax_log_site_update()) after the log settings change, so
+ * a disabled message costs a load and a compare, and no call.
+ */
+struct hax_log_site {
+    const char *file;
+    uint32_t line;
+    // (hax_log_generation << 1) | enabled
+    uint32_t state;
+};
+
+extern uint32_t hax_log_generation;
+
+static inline bool hax_log_site_enabled(struct hax_log_site *site, int level)
+{
+    uint32_t state = site->state;
+
+    if ((state >> 1) == hax_log_generation)
+        return state & 1;
+    return hax_log_site_update(site, level);
+}
+
+#define hax_log(level, ...)                                                   \
+    do {                                                                      \
+        static struct hax_log_site __site = { __FILE__, __LINE__, 0 };        \
+        if ((level) >= HAX_LOG_LEVEL_MIN &&                                   \
+            hax_log_site_enabled(&__site, level))                             \
+            hax_log_write(level, __VA_ARGS__);                                \
+    } while (0)
+
+/*
+ * Same as hax_log(), but prints at most HAX_LOG_RATELIMIT_BURST messages per
+ * 2^HAX_LOG_RATELIMIT_ORDER TSC cycles (about a second), for messages that the
+ * guest could otherwise trigger in a loop.
+ */
+#define HAX_LOG_RATELIMIT_BURST 10
+#define HAX_LOG_RATELIMIT_ORDER 32
+
+struct hax_log_ratelimit {
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+};
+
+#define hax_log_ratelimited(level, ...)                                       \
+    do {                                                                      \
+        static struct hax_log_site __site = { __FILE__, __LINE__, 0 };        \
+        static struct hax_log_ratelimit __rl;                                 \
+        if ((level) >= HAX_LOG_LEVEL_MIN &&                                   \
+            hax_log_site_enabled(&__site, level) &&                           \
+            hax_log_ratelimit_pass(&__rl, &__site))                           \
+            hax_log_write(level, __VA_ARGS__);                                \
+    } while (0)
+
 #ifdef HAX_PLATFORM_DARWIN
 #include "darwin/hax_mac.h"
 #endif
@@ -154,6 +154,14 @@ struct hax_tunnel {
         } debug;
     };
     uint64_t apic_base;
+    /* Since HAX_CAP_HALT_POLL, owned by HAXM, QEMU should not touch them */
+    uint64_t halt_poll_success;
+    uint64_t halt_poll_fail;
+    /* Since HAX_CAP_PLE, owned by HAXM, QEMU should not touch it */
+    uint64_t ple_exits;
+    /* Since HAX_CAP_TIMER_DEADLINE, set by QEMU, cleared by HAXM on expiry */
+    uint64_t timer_deadline;
+    uint64_t pad1;
 } PACKED;
 
 struct hax_fastmmio {
@@ -180,6 +188,14 @@ struct hax_module_version {
 #define HAX_CAP_STATUS_WORKING     (1 << 0)
 #define HAX_CAP_MEMQUOTA           (1 << 1)
 #define HAX_CAP_WORKSTATUS_MASK    0x01
+// The remaining wstatus bits are only valid when working
+#define HAX_CAP_REGS_PAGE          (1 << 2)
+#define HAX_CAP_CPU_HINT           (1 << 3)
+#define HAX_CAP_TSC_SCALING        (1 << 4)
+#define HAX_CAP_SNAPSHOT           (1 << 5)
+#define HAX_CAP_VM_CLONE           (1 << 6)
+#define HAX_CAP_WORKING_SET        (1 << 7)
+#define HAX_CAP_RAM_RECLAIM        (1 << 8)
 
 #define HAX_CAP_FAILREASON_VT      (1 << 0)
 #define HAX_CAP_FAILREASON_NX      (1 << 1)
@@ -194,11 +210,18 @@ struct hax_module_version {
 #define HAX_CAP_DEBUG              (1 << 7)
 #define HAX_CAP_IMPLICIT_RAMBLOCK  (1 << 8)
 #define HAX_CAP_CPUID              (1 << 9)
+#define HAX_CAP_IOBUF_SIZE         (1 << 10)
+#define HAX_CAP_HALT_POLL          (1 << 11)
+#define HAX_CAP_PLE                (1 << 12)
+#define HAX_CAP_TIMER_DEADLINE     (1 << 13)
+#define HAX_CAP_VCPU_STATS         (1 << 14)
+#define HAX_CAP_VCPU_STATE         (1 << 15)
 
 struct hax_capabilityinfo {
     /*
      * bit 0: 1 - working, 0 - not working, possibly because NT/NX disabled
      * bit 1: 1 - memory limitation working, 0 - no memory limitation
+     * bit 2 and above: capabilities that do not fit in winfo
      */
     uint16_t wstatus;
     /*
@@ -220,9 +243,17 @@ struct hax_tunnel_info {
     uint64_t va;
     uint64_t io_va;
     uint16_t size;
-    uint16_t pad[3];
+    // Input: requested size of the I/O buffer in bytes (0 for the default),
+    // only read if HAX_CAP_IOBUF_SIZE is set and user space has declared API
+    // v5 or later through HAX_VM_IOCTL_NOTIFY_QEMU_VERSION.
+    // Output: actual size.
+    uint16_t io_size;
+    uint16_t pad[2];
 } PACKED;
 
+// Upper bound for hax_tunnel_info::io_size
+#define HAX_IOBUF_MAX_SIZE (4 * HAX_PAGE_SIZE)
+
 struct hax_set_memlimit {
     uint8_t enable_memlimit;
     uint8_t pad[7];
@@ -321,4 +352,350 @@ typedef struct hax_cpuid {
     hax_cpuid_entry entries[0];
 } hax_cpuid;
 
+// Large enough for every basic VM exit reason defined by the Intel SDM
+#define HAX_STATS_NR_EXIT_REASONS  72
+// Large enough for every HAX_EXIT_* exit status
+#define HAX_STATS_NR_EXIT_STATUSES 16
+// Bucket i counts the samples in [2^i, 2^(i+1)) TSC cycles, bucket 0 also
+// counts 0, and the last bucket counts everything above
+#define HAX_STATS_NR_HIST_BUCKETS  32
+#define HAX_STATS_NR_TOP           8
+
+struct hax_exit_reason_stats {
+    uint64_t count;
+    // Exits handled without leaving the VMCS or disabling interrupts
+    uint64_t fast;
+    // Exits handled without returning to user space
+    uint64_t resumes;
+    // TSC cycles from VM exit to the next VM entry, for those exits
+    uint64_t resume_cycles;
+    // TSC cycles spent in the exit handler, for the exits not counted in fast
+    uint64_t handler_cycles;
+} PACKED;
+
+struct hax_stats_talker {
+    // I/O port number, guest physical page frame number for MMIO, or MSR
+    // address (with bit 32 set for writes)
+    uint64_t key;
+    uint64_t count;
+} PACKED;
+
+struct hax_vcpu_stats {
+    // Indexed by basic VM exit reason
+    struct hax_exit_reason_stats exits[HAX_STATS_NR_EXIT_REASONS];
+    // Returns to user space, indexed by HAX_EXIT_* exit status
+    uint64_t user_exits[HAX_STATS_NR_EXIT_STATUSES];
+    // Cycles spent in the exit handler, for the exits not handled fast
+    uint64_t handler_hist[HAX_STATS_NR_HIST_BUCKETS];
+    // Cycles from VM entry to the following VM exit
+    uint64_t guest_hist[HAX_STATS_NR_HIST_BUCKETS];
+    // Most frequent I/O ports and MMIO pages passed on to user space, in
+    // descending order of count, padded with zero counts
+    struct hax_stats_talker io_ports[HAX_STATS_NR_TOP];
+    struct hax_stats_talker mmio_pages[HAX_STATS_NR_TOP];
+    // Most frequent intercepted RDMSR/WRMSR instructions
+    struct hax_stats_talker msrs[HAX_STATS_NR_TOP];
+    // VPIDs taken by the vCPU, and flushes of all VPIDs on the host CPU that
+    // it triggered by running out of VPIDs there
+    uint64_t vpid_allocs;
+    uint64_t vpid_flushes;
+    // Loads of the VMCS on a host CPU it was not kept current on, and VM
+    // entries on another host CPU than the previous one
+    uint64_t vmcs_loads;
+    uint64_t migrations;
+} PACKED;
+
+// Upper bound for hax_trace_info::size
+#define HAX_TRACE_MAX_SIZE (16 << 20)
+
+struct hax_trace_info {
+    // Output: user space address of the trace ring (struct hax_trace_ring)
+    uint64_t va;
+    // Input: requested size of the trace ring in bytes (0 to disable tracing).
+    // Output: actual size.
+    uint32_t size;
+    uint32_t pad;
+} PACKED;
+
+#define HAX_TRACE_VM_ENTRY   1
+#define HAX_TRACE_VM_EXIT    2
+#define HAX_TRACE_INJECT     3
+#define HAX_TRACE_USER_EXIT  4
+#define HAX_TRACE_USER_ENTRY 5
+
+struct hax_trace_event {
+    uint64_t tsc;
+    // HAX_TRACE_*
+    uint16_t type;
+    uint16_t pad;
+    // HAX_TRACE_VM_EXIT: basic exit reason; HAX_TRACE_INJECT: VM-entry
+    // interruption information; HAX_TRACE_USER_EXIT: HAX_EXIT_* exit status
+    uint32_t info;
+    // HAX_TRACE_VM_EXIT: exit qualification
+    uint64_t qualification;
+    // HAX_TRACE_VM_EXIT: guest physical address for EPT violations and
+    // misconfigurations, port number for I/O instructions
+    uint64_t address;
+} PACKED;
+
+// Written by HAXM only. Events are never dropped: the oldest ones are
+// overwritten instead once the ring is full.
+struct hax_trace_ring {
+    uint32_t vcpu_id;
+    // Capacity of events[], a power of 2
+    uint32_t nr_events;
+    // Number of events recorded so far. Event n is stored at
+    // events[n % nr_events], and head is advanced after the event is written.
+    uint64_t head;
+    uint64_t pad[6];
+    struct hax_trace_event events[0];
+} PACKED;
+
+#define HAX_VCPU_STATE_VERSION  1
+#define HAX_MAX_VCPU_STATE_MSRS 0x100
+
+// hax_vcpu_state::flags, each selects a group of fields
+#define HAX_VCPU_STATE_REGS     (1 << 0)
+#define HAX_VCPU_STATE_FPU      (1 << 1)
+#define HAX_VCPU_STATE_XCR0     (1 << 2)
+#define HAX_VCPU_STATE_EVENTS   (1 << 3)
+#define HAX_VCPU_STATE_MSRS     (1 << 4)
+#define HAX_VCPU_STATE_ALL      0x1f
+
+struct hax_vcpu_events {
+    // Blocking by STI, MOV SS, SMI and NMI, as in the VMCS guest
+    // interruptibility state
+    interruptibility_state_t interruptibility;
+    // Pending external interrupts not yet injected, one bit per vector
+    uint32_t intr_pending[8];
+} PACKED;
+
+// Not PACKED, because fpu must stay 16-byte aligned. All fields are naturally
+// aligned, so there is no padding either.
+struct hax_vcpu_state {
+    // Input: HAX_VCPU_STATE_VERSION
+    uint32_t version;
+    // Input: sizeof(struct hax_vcpu_state), excluding msrs[]
+    uint32_t size;
+    // Input: HAX_VCPU_STATE_* groups to retrieve or restore
+    uint32_t flags;
+    // Input: number of entries in msrs[]
+    uint32_t nr_msrs;
+    // Output: number of entries in msrs[] successfully processed
+    uint32_t done;
+    uint32_t pad[3];
+    struct fx_layout fpu;
+    struct vcpu_state_t regs;
+    uint64_t xcr0;
+    struct hax_vcpu_events events;
+    struct vmx_msr msrs[0];
+};
+
+// Groups of vcpu_state_t fields, for hax_regs_page::dirty
+#define HAX_REGS_GPRS (1 << 0)  // _regs[], including _rsp
+#define HAX_REGS_RIP  (1 << 1)  // _rip and _rflags
+#define HAX_REGS_CRS  (1 << 2)  // _cr0, _cr2, _cr3 and _cr4
+#define HAX_REGS_DRS  (1 << 3)  // _dr0 to _dr7
+#define HAX_REGS_SEGS (1 << 4)  // Segment registers, LDTR, TR, GDTR and IDTR
+#define HAX_REGS_ALL  0x1f
+
+// Shared with user space (see HAX_VCPU_IOCTL_SETUP_REGS_PAGE)
+struct hax_regs_page {
+    // Set by user space: the groups of regs it has modified, to be loaded
+    // into the vCPU by the next HAX_VCPU_IOCTL_RUN, which clears this field
+    uint32_t dirty;
+    // Set by HAXM: the groups of |regs| that are up to date
+    uint32_t valid;
+    uint32_t pad[14];
+    // Updated by HAXM before each return from HAX_VCPU_IOCTL_RUN, and by
+    // HAX_VCPU_SET_REGS, with the same contents as HAX_VCPU_GET_REGS would
+    // return for the groups in |valid|
+    struct vcpu_state_t regs;
+} PACKED;
+
+struct hax_regs_page_info {
+    // Output: user space address of the register page (struct hax_regs_page)
+    uint64_t va;
+    // Output: size of the mapping
+    uint32_t size;
+    uint32_t pad;
+} PACKED;
+
+struct hax_vcpu_cpu_hint {
+    // Host CPU on which the calling thread should preferably run, from 0 to
+    // the number of online host CPUs minus 1, or -1 for no preference
+    int32_t cpu;
+    uint32_t pad;
+} PACKED;
+
+struct hax_tsc_khz {
+    // Input: TSC frequency of the guest in kHz, or 0 for that of the host
+    uint32_t guest_khz;
+    // Output: TSC frequency of the host in kHz, or 0 if unknown
+    uint32_t host_khz;
+} PACKED;
+
+// Snapshot stream (see HAX_VM_IOCTL_SNAPSHOT_SAVE), a sequence of records, each
+// made of a struct hax_snapshot_record and |size| bytes of data. The first
+// record is HAX_SNAPSHOT_REC_HEADER, and the last one HAX_SNAPSHOT_REC_END.
+#define HAX_SNAPSHOT_MAGIC      0x53584148  // "HAXS"
+#define HAX_SNAPSHOT_VERSION    1
+
+// hax_snapshot_record::type
+#define HAX_SNAPSHOT_REC_HEADER 1  // Data: struct hax_snapshot_header
+#define HAX_SNAPSHOT_REC_VCPU   2  // Data: struct hax_vcpu_state and msrs[]
+#define HAX_SNAPSHOT_REC_RAM    3  // Data: struct hax_snapshot_ram and pages
+#define HAX_SNAPSHOT_REC_END    4  // No data
+
+// Number of guest pages a HAX_SNAPSHOT_REC_RAM record covers at most
+#define HAX_SNAPSHOT_RAM_PAGES  64
+
+// hax_snapshot_io::flags
+// Also save RAM chunks that the guest has never accessed, pinning them
+#define HAX_SNAPSHOT_SAVE_ALL_RAM (1 << 0)
+
+// Size limits of the buffer passed to HAX_VM_IOCTL_SNAPSHOT_{SAVE,RESTORE}.
+// The minimum is the size of the largest record, rounded up to pages.
+#define HAX_SNAPSHOT_BUFFER_MIN ((HAX_SNAPSHOT_RAM_PAGES + 1) * 4096)
+#define HAX_SNAPSHOT_BUFFER_MAX (16 << 20)
+
+// hax_snapshot_io::cursor once the whole stream has been saved or restored
+#define HAX_SNAPSHOT_CURSOR_DONE (~0ULL)
+
+// The size of each record, including its data, is a multiple of 16 bytes
+struct hax_snapshot_record {
+    uint32_t type;
+    // Size of the data following this structure, in bytes
+    uint32_t size;
+    // HAX_SNAPSHOT_REC_VCPU: vCPU ID; HAX_SNAPSHOT_REC_RAM: GFN of the first
+    // page covered; others: 0
+    uint64_t id;
+} PACKED;
+
+struct hax_snapshot_header {
+    // HAX_SNAPSHOT_MAGIC
+    uint32_t magic;
+    // HAX_SNAPSHOT_VERSION
+    uint32_t version;
+    // Number of HAX_SNAPSHOT_REC_VCPU records
+    uint32_t nr_vcpus;
+    // hax_snapshot_io::flags used for saving
+    uint32_t flags;
+    uint32_t page_size;
+    uint32_t pad[3];
+} PACKED;
+
+// Guest pages not saved are zero-filled. Saved pages follow this structure in
+// GFN order.
+struct hax_snapshot_ram {
+    // Number of guest pages covered, at most HAX_SNAPSHOT_RAM_PAGES
+    uint32_t npages;
+    uint32_t pad;
+    // Bit n is set if page n is saved, i.e. not zero-filled
+    uint64_t bitmap;
+} PACKED;
+
+struct hax_snapshot_io {
+    // Input: user space address of the buffer, page-aligned
+    uint64_t va;
+    // Input: size of the buffer, a multiple of the page size between
+    // HAX_SNAPSHOT_BUFFER_MIN and HAX_SNAPSHOT_BUFFER_MAX
+    uint32_t size;
+    // Output: number of bytes written to (save) or consumed from (restore)
+    // the buffer
+    uint32_t bytes;
+    // Input/output: position in the stream, 0 at the start, to be passed back
+    // unchanged, and HAX_SNAPSHOT_CURSOR_DONE at the end
+    uint64_t cursor;
+    // Input: HAX_SNAPSHOT_* flags
+    uint32_t flags;
+    uint32_t pad;
+} PACKED;
+
+struct hax_freeze_info {
+    // Output: secret to be passed to HAX_IOCTL_CLONE_VM to clone the VM
+    uint64_t token;
+} PACKED;
+
+struct hax_clone_vm_info {
+    // Input: ID of the template VM, which must be frozen (see
+    // HAX_VM_IOCTL_FREEZE)
+    uint32_t template_vm_id;
+    // Output: ID of the new VM
+    uint32_t vm_id;
+    // Input: the token returned by HAX_VM_IOCTL_FREEZE for the template VM
+    uint64_t token;
+} PACKED;
+
+struct hax_unshare_ram_info {
+    uint64_t pa_start;
+    uint64_t size;
+} PACKED;
+
+// Working set estimation works on 2MB-aligned regions of guest physical memory
+#define HAX_WS_REGION_SIZE      (1U << 21)
+#define HAX_WS_SCAN_MAX_REGIONS 256
+
+// Leave the accessed flags set, so that the next scan also counts the pages
+// counted by this scan
+#define HAX_WS_SCAN_KEEP (1 << 0)
+
+struct hax_ws_scan {
+    // Input: start of the first region to scan, 2MB-aligned
+    uint64_t pa_start;
+    // Input: number of regions to scan, between 1 and HAX_WS_SCAN_MAX_REGIONS
+    uint32_t nr_regions;
+    // Input: HAX_WS_SCAN_* flags
+    uint32_t flags;
+    // Output: total number of pages accessed
+    uint64_t nr_accessed;
+    // Output: number of 4KB pages of each region accessed by the guest since
+    // the previous scan (or the previous sample, see HAX_VM_IOCTL_WS_SAMPLER)
+    uint16_t counts[HAX_WS_SCAN_MAX_REGIONS];
+} PACKED;
+
+struct hax_ws_sampler {
+    // Input: milliseconds between two samples, or 0 to stop sampling
+    uint32_t interval_ms;
+    uint32_t pad;
+} PACKED;
+
+#define HAX_WS_HISTOGRAM_BUCKETS 8
+
+struct hax_ws_histogram {
+    // Input: a GPA; the histogram returned is that of the first RAM mapping
+    // that ends above it
+    // Output: start of that RAM mapping
+    uint64_t pa_start;
+    // Output: size of that RAM mapping
+    uint64_t size;
+    // Output: number of samples taken so far
+    uint64_t nr_samples;
+    // Output: counts[0] is the number of pages accessed in the last sample
+    // interval, and counts[n] (n > 0) the number of pages not accessed in the
+    // last 2^(n-1) to 2^n - 1 intervals (or more, for the last bucket)
+    uint64_t counts[HAX_WS_HISTOGRAM_BUCKETS];
+} PACKED;
+
+struct hax_pin_limit {
+    // Input: pinned guest RAM of all VMs, in bytes, above which reclaim passes
+    // unpin cold RAM regardless of the budget of each VM, or 0 for no limit
+    uint64_t high_water;
+    // Output: guest RAM currently pinned by all VMs, in bytes
+    uint64_t pinned;
+} PACKED;
+
+struct hax_reclaim_ram {
+    // Input: pinned guest RAM budget of this VM in bytes, or 0 for none
+    uint64_t budget;
+    // Input: number of passes in a row a 2MB chunk must have gone unaccessed
+    // before it can be unpinned, at least 1
+    uint32_t min_idle;
+    uint32_t pad;
+    // Output: guest RAM of this VM still pinned after this pass, in bytes
+    uint64_t pinned;
+    // Output: guest RAM unpinned by this pass, in bytes
+    uint64_t reclaimed;
+} PACKED;
+
 #endif  // HAX_INTERFACE_H_
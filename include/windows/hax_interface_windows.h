@@ -123,6 +123,10 @@ extern PDRIVER_OBJECT HaxDriverObject;
         CTL_CODE(HAX_DEVICE_TYPE, 0x910, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define HAX_IOCTL_SET_MEMLIMIT \
         CTL_CODE(HAX_DEVICE_TYPE, 0x911, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_IOCTL_CLONE_VM \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x922, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_IOCTL_SET_PIN_LIMIT \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x928, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 #define HAX_VM_IOCTL_VCPU_CREATE \
         CTL_CODE(HAX_DEVICE_TYPE, 0x902, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -138,6 +142,22 @@ extern PDRIVER_OBJECT HaxDriverObject;
         CTL_CODE(HAX_DEVICE_TYPE, 0x914, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define HAX_VM_IOCTL_PROTECT_RAM \
         CTL_CODE(HAX_DEVICE_TYPE, 0x915, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_SNAPSHOT_SAVE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x920, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_SNAPSHOT_RESTORE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x921, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_FREEZE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x923, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_UNSHARE_RAM \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x924, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_WS_SCAN \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x925, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_WS_SAMPLER \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x926, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_WS_HISTOGRAM \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x927, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VM_IOCTL_RECLAIM_RAM \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x929, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 #define HAX_VCPU_IOCTL_RUN \
         CTL_CODE(HAX_DEVICE_TYPE, 0x906, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -172,6 +192,20 @@ extern PDRIVER_OBJECT HaxDriverObject;
         CTL_CODE(HAX_DEVICE_TYPE, 0x917, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define HAX_VCPU_IOCTL_GET_CPUID \
         CTL_CODE(HAX_DEVICE_TYPE, 0x918, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_GET_STATS \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x919, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_SETUP_TRACE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91a, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_GET_STATE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91b, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_SET_STATE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91c, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_SETUP_REGS_PAGE \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91d, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_SET_CPU_HINT \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91e, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define HAX_VCPU_IOCTL_SET_TSC_KHZ \
+        CTL_CODE(HAX_DEVICE_TYPE, 0x91f, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 /*
  * This is for MAC compatible mode, so should not be used
@@ -107,7 +107,9 @@ static int hax_vcpu_major = 0;
             unload_user_data(dest, false);                                    \
             ret = -EFAULT;                                                    \
             break;                                                            \
-        }
+        }                                                                     \
+        /* User space may have changed the header in the meantime */          \
+        (dest)->body_len = header.body_len;
 
 #define unload_user_data(dest, overwrite)                                     \
         if ((overwrite) && copyout((dest), uaddr, size)) {                    \
@@ -191,10 +193,12 @@ static int hax_vcpu_ioctl(dev_t dev, ulong cmd, caddr_t data, int flag,
         case HAX_VCPU_IOCTL_SETUP_TUNNEL: {
             struct hax_tunnel_info info, *uinfo;
             uinfo = (struct hax_tunnel_info *)data;
+            info.io_size = uinfo->io_size;
             ret = hax_vcpu_setup_hax_tunnel(cvcpu, &info);
             uinfo->va = info.va;
             uinfo->io_va = info.io_va;
             uinfo->size = info.size;
+            uinfo->io_size = info.io_size;
             break;
         }
         case HAX_VCPU_IOCTL_SET_MSRS: {
@@ -297,6 +301,53 @@ static int hax_vcpu_ioctl(dev_t dev, ulong cmd, caddr_t data, int flag,
             unload_user_data(cpuid, true);
             break;
         }
+        case HAX_VCPU_IOCTL_GET_STATE: {
+            struct hax_vcpu_state *state;
+            load_user_data(state, data, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                           struct hax_vcpu_state, struct vmx_msr);
+            ret = vcpu_get_state(cvcpu, state);
+            unload_user_data(state, true);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SET_STATE: {
+            struct hax_vcpu_state *state;
+            load_user_data(state, data, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                           struct hax_vcpu_state, struct vmx_msr);
+            ret = vcpu_set_state(cvcpu, state);
+            // Report the number of MSRs written
+            unload_user_data(state, true);
+            break;
+        }
+        case HAX_VCPU_IOCTL_GET_STATS: {
+            struct hax_vcpu_stats *stats;
+            stats = (struct hax_vcpu_stats *)data;
+            ret = vcpu_get_stats(cvcpu, stats);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SETUP_TRACE: {
+            struct hax_trace_info *info;
+            info = (struct hax_trace_info *)data;
+            ret = hax_vcpu_setup_trace(cvcpu, info);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SETUP_REGS_PAGE: {
+            struct hax_regs_page_info *info;
+            info = (struct hax_regs_page_info *)data;
+            ret = hax_vcpu_setup_regs_page(cvcpu, info);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SET_CPU_HINT: {
+            struct hax_vcpu_cpu_hint *hint;
+            hint = (struct hax_vcpu_cpu_hint *)data;
+            ret = vcpu_set_cpu_hint(cvcpu, hint);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SET_TSC_KHZ: {
+            struct hax_tsc_khz *info;
+            info = (struct hax_tsc_khz *)data;
+            ret = vcpu_set_tsc_khz(cvcpu, info);
+            break;
+        }
         default: {
             handle_unknown_ioctl(dev, cmd, p);
             ret = -ENOSYS;
@@ -393,6 +444,7 @@ static int hax_vm_close(dev_t dev, int flags, __unused int devtype,
     cvm = hax_get_vm(minor(dev), 1);
     hax_log(HAX_LOGI, "Close VM\n");
     if (cvm) {
+        hax_vm_core_close(cvm);
         /* put the ref get just now */
         hax_put_vm(cvm);
         hax_put_vm(cvm);
@@ -490,6 +542,54 @@ static int hax_vm_ioctl(dev_t dev, ulong cmd, caddr_t data, int flag,
             ret = hax_vm_protect_ram(cvm, info);
             break;
         }
+        case HAX_VM_IOCTL_SNAPSHOT_SAVE: {
+            struct hax_snapshot_io *io;
+            io = (struct hax_snapshot_io *)data;
+            ret = hax_vm_snapshot_save(cvm, io);
+            break;
+        }
+        case HAX_VM_IOCTL_SNAPSHOT_RESTORE: {
+            struct hax_snapshot_io *io;
+            io = (struct hax_snapshot_io *)data;
+            ret = hax_vm_snapshot_restore(cvm, io);
+            break;
+        }
+        case HAX_VM_IOCTL_FREEZE: {
+            struct hax_freeze_info *info;
+            info = (struct hax_freeze_info *)data;
+            ret = hax_vm_freeze(cvm, info);
+            break;
+        }
+        case HAX_VM_IOCTL_UNSHARE_RAM: {
+            struct hax_unshare_ram_info *info;
+            info = (struct hax_unshare_ram_info *)data;
+            ret = hax_vm_unshare_ram(cvm, info);
+            break;
+        }
+        case HAX_VM_IOCTL_WS_SCAN: {
+            struct hax_ws_scan *info;
+            info = (struct hax_ws_scan *)data;
+            ret = hax_vm_ws_scan(cvm, info);
+            break;
+        }
+        case HAX_VM_IOCTL_WS_SAMPLER: {
+            struct hax_ws_sampler *info;
+            info = (struct hax_ws_sampler *)data;
+            ret = hax_vm_ws_set_sampler(cvm, info);
+            break;
+        }
+        case HAX_VM_IOCTL_WS_HISTOGRAM: {
+            struct hax_ws_histogram *info;
+            info = (struct hax_ws_histogram *)data;
+            ret = hax_vm_ws_get_histogram(cvm, info);
+            break;
+        }
+        case HAX_VM_IOCTL_RECLAIM_RAM: {
+            struct hax_reclaim_ram *info;
+            info = (struct hax_reclaim_ram *)data;
+            ret = hax_vm_reclaim_ram(cvm, info);
+            break;
+        }
         case HAX_VM_IOCTL_NOTIFY_QEMU_VERSION: {
             int pid;
             char task_name[TASK_NAME_LEN];
@@ -608,6 +708,27 @@ static int hax_ioctl(dev_t dev, u_long cmd, caddr_t data, int flag,
             *((uint32_t *)data) = vm_id;
             break;
         }
+        case HAX_IOCTL_CLONE_VM: {
+            struct hax_clone_vm_info *info;
+            int vm_id;
+
+            info = (struct hax_clone_vm_info *)data;
+            ret = hax_clone_vm(info->template_vm_id, info->token, &vm_id);
+            if (ret) {
+                hax_log(HAX_LOGE, "Failed to clone HAX VM %u\n",
+                        info->template_vm_id);
+                break;
+            }
+            info->vm_id = vm_id;
+            break;
+        }
+        case HAX_IOCTL_SET_PIN_LIMIT: {
+            struct hax_pin_limit *info;
+
+            info = (struct hax_pin_limit *)data;
+            ret = hax_set_pin_limit(info);
+            break;
+        }
 
         default: {
             handle_unknown_ioctl(dev, cmd, p);
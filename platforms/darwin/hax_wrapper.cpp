@@ -32,9 +32,11 @@
 
 #include <mach/mach_types.h>
 #include <IOKit/IOLib.h>
+#include <kern/clock.h>
 #include <libkern/libkern.h>
 #include <stdarg.h>
 #include <sys/proc.h>
+#include <sys/random.h>
 
 #include "hax.h"
 
@@ -59,14 +61,12 @@ static const char* kLogPrefix[] = {
     "haxm_panic: "
 };
 
-extern "C" void hax_log(int level, const char *fmt, ...)
+extern "C" void hax_log_write(int level, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    if (level >= HAX_LOG_DEFAULT) {
-        printf("%s", kLogPrefix[level]);
-        vprintf(fmt, args);
-    }
+    printf("%s", kLogPrefix[level]);
+    vprintf(fmt, args);
     va_end(args);
 }
 
@@ -74,7 +74,7 @@ extern "C" void hax_panic(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    hax_log(HAX_LOGPANIC, fmt, args);
+    hax_log_write(HAX_LOGPANIC, fmt, args);
     (panic)(fmt, args);
     va_end(args);
 }
@@ -85,6 +85,21 @@ extern "C" uint32_t hax_cpu_id(void)
     return (uint32_t)cpu_number();
 }
 
+extern "C" int hax_get_random_bytes(void *buf, uint32_t size)
+{
+    read_random(buf, size);
+    return 0;
+}
+
+extern "C" uint64_t hax_get_uptime_ns(void)
+{
+    uint64_t abstime, ns;
+
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
 /* This is provided in unsupported kext */
 extern unsigned int real_ncpus;
 int cpu_info_init(void)
@@ -226,3 +241,28 @@ extern "C" int proc_event_pending(struct vcpu_t *vcpu)
     return (proc_issignal(proc_id, QEMU_SIGNAL_SIGMASK) ||
             vcpu_event_pending(vcpu));
 }
+
+extern "C" int hax_vcpu_set_cpu_hint(struct vcpu_t *cvcpu, void *vcpu_host,
+                                     int cpu_id)
+{
+    // No soft affinity in the KPI
+    return -ENOSYS;
+}
+
+extern "C" void hax_vcpu_yield(struct vcpu_t *cvcpu, void *target_host)
+{
+    // No directed yield in the KPI, just give up the CPU
+    IOSleep(0);
+}
+
+extern "C" int hax_vcpu_preempt_notify_begin(struct vcpu_t *cvcpu,
+                                             void *vcpu_host)
+{
+    // No preemption notifiers
+    return -ENOSYS;
+}
+
+extern "C" void hax_vcpu_preempt_notify_end(struct vcpu_t *cvcpu,
+                                            void *vcpu_host)
+{
+}
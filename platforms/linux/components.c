@@ -29,18 +29,31 @@
  */
 
 #include <linux/cred.h>
+#include <linux/debugfs.h>
 #include <linux/dm-ioctl.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/namei.h>
+#include <linux/pid.h>
+#include <linux/preempt.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/task.h>
+#endif
 
 #include "interface.h"
 
 #define HAX_VM_DEVFS_FMT    "hax_vm/vm%02d"
 #define HAX_VCPU_DEVFS_FMT  "hax_vm%02d/vcpu%02d"
 
+#define HAX_DEBUGFS_DIR       "haxm"
+#define HAX_VM_DEBUGFS_FMT    "vm%02d"
+#define HAX_VCPU_DEBUGFS_FMT  "vcpu%02d"
+
 #define load_user_data(dest, src, body_len, body_max, arg_t, body_t)          \
         arg_t __user *from = (arg_t __user *)(*(arg_t **)(src));              \
         size_t size;                                                          \
@@ -69,7 +82,9 @@
             unload_user_data(dest, false);                                           \
             ret = -EFAULT;                                                    \
             break;                                                            \
-        }
+        }                                                                     \
+        /* User space may have changed the header in the meantime */          \
+        (dest)->body_len = header.body_len;
 
 #define unload_user_data(dest, overwrite)                                     \
         if ((overwrite) && copy_to_user(from, (dest), size)) {                \
@@ -84,6 +99,7 @@ typedef struct hax_vm_linux_t {
     int id;
     struct miscdevice dev;
     char *devname;
+    struct dentry *debugfs;
 } hax_vm_linux_t;
 
 typedef struct hax_vcpu_linux_t {
@@ -92,6 +108,13 @@ typedef struct hax_vcpu_linux_t {
     int id;
     struct miscdevice dev;
     char *devname;
+    struct dentry *debugfs;
+    // The thread that runs this vCPU (see hax_vcpu_yield())
+    struct pid *pid;
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    // See hax_vcpu_preempt_notify_begin()
+    struct preempt_notifier preempt_notifier;
+#endif
 } hax_vcpu_linux_t;
 
 static int hax_vm_open(struct inode *inodep, struct file *filep);
@@ -120,6 +143,96 @@ static struct file_operations hax_vcpu_fops = {
     .compat_ioctl   = hax_vcpu_ioctl,
 };
 
+/* Debugfs */
+
+static struct dentry *hax_debugfs;
+
+void hax_debugfs_init(void)
+{
+    hax_debugfs = debugfs_create_dir(HAX_DEBUGFS_DIR, NULL);
+}
+
+void hax_debugfs_exit(void)
+{
+    debugfs_remove_recursive(hax_debugfs);
+    hax_debugfs = NULL;
+}
+
+static void hax_vcpu_stats_show_hist(struct seq_file *m, const char *name,
+                                     uint64_t *hist)
+{
+    int i;
+
+    seq_printf(m, "\n%s (TSC cycles)\n", name);
+    for (i = 0; i < HAX_STATS_NR_HIST_BUCKETS; i++) {
+        if (hist[i])
+            seq_printf(m, "  >= 2^%-2d %20llu\n", i, hist[i]);
+    }
+}
+
+static void hax_vcpu_stats_show_top(struct seq_file *m, const char *name,
+                                    struct hax_stats_talker *top)
+{
+    int i;
+
+    seq_printf(m, "\n%s\n", name);
+    for (i = 0; i < HAX_STATS_NR_TOP && top[i].count; i++) {
+        seq_printf(m, "  %#10llx %20llu\n", top[i].key, top[i].count);
+    }
+}
+
+static int hax_vcpu_stats_show(struct seq_file *m, void *v)
+{
+    hax_vcpu_linux_t *vcpu = m->private;
+    struct hax_vcpu_stats *stats;
+    int i;
+
+    stats = hax_vmalloc(sizeof(*stats), HAX_MEM_NONPAGE);
+    if (!stats)
+        return -ENOMEM;
+    vcpu_get_stats(vcpu->cvcpu, stats);
+
+    seq_printf(m, "%6s %20s %20s %20s %20s %20s\n", "reason", "exits",
+               "fast", "resumes", "resume_cycles", "handler_cycles");
+    for (i = 0; i < HAX_STATS_NR_EXIT_REASONS; i++) {
+        struct hax_exit_reason_stats *es = &stats->exits[i];
+
+        if (!es->count)
+            continue;
+        seq_printf(m, "%6d %20llu %20llu %20llu %20llu %20llu\n", i,
+                   es->count, es->fast, es->resumes, es->resume_cycles,
+                   es->handler_cycles);
+    }
+
+    seq_printf(m, "\n%6s %20s\n", "status", "user_exits");
+    for (i = 0; i < HAX_STATS_NR_EXIT_STATUSES; i++) {
+        if (stats->user_exits[i])
+            seq_printf(m, "%6d %20llu\n", i, stats->user_exits[i]);
+    }
+
+    hax_vcpu_stats_show_hist(m, "Exit handler", stats->handler_hist);
+    hax_vcpu_stats_show_hist(m, "Guest run", stats->guest_hist);
+    hax_vcpu_stats_show_top(m, "I/O ports", stats->io_ports);
+    hax_vcpu_stats_show_top(m, "MMIO pages", stats->mmio_pages);
+    hax_vcpu_stats_show_top(m, "MSRs", stats->msrs);
+
+    hax_vfree(stats, sizeof(*stats));
+    return 0;
+}
+
+static int hax_vcpu_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hax_vcpu_stats_show, inode->i_private);
+}
+
+static const struct file_operations hax_vcpu_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hax_vcpu_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 /* Component management */
 
 static void hax_component_perm(const char *devname, struct miscdevice *misc)
@@ -162,6 +275,10 @@ static hax_vcpu_linux_t* hax_vcpu_create_linux(struct vcpu_t *cvcpu,
     vcpu->cvcpu = cvcpu;
     vcpu->id = vcpu_id;
     vcpu->vm = vm;
+#if defined(CONFIG_PREEMPT_NOTIFIERS) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+    preempt_notifier_inc();
+#endif
     set_vcpu_host(cvcpu, vcpu);
     return vcpu;
 }
@@ -177,6 +294,11 @@ static void hax_vcpu_destroy_linux(hax_vcpu_linux_t *vcpu)
     hax_vcpu_destroy_hax_tunnel(cvcpu);
     set_vcpu_host(cvcpu, NULL);
     vcpu->cvcpu = NULL;
+    put_pid(vcpu->pid);
+#if defined(CONFIG_PREEMPT_NOTIFIERS) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+    preempt_notifier_dec();
+#endif
     kfree(vcpu);
 }
 
@@ -186,6 +308,7 @@ int hax_vcpu_create_host(struct vcpu_t *cvcpu, void *vm_host, int vm_id,
     int err;
     hax_vcpu_linux_t *vcpu;
     hax_vm_linux_t *vm;
+    char name[16];
 
     vm = (hax_vm_linux_t *)vm_host;
     vcpu = hax_vcpu_create_linux(cvcpu, vm, vcpu_id);
@@ -207,7 +330,90 @@ int hax_vcpu_create_host(struct vcpu_t *cvcpu, void *vm_host, int vm_id,
     hax_component_perm(vcpu->devname, &vcpu->dev);
     hax_log(HAX_LOGI, "Created HAXM-VCPU device with minor=%d\n",
             vcpu->dev.minor);
+
+    // Debugfs is optional, so failures are ignored
+    snprintf(name, sizeof(name), HAX_VCPU_DEBUGFS_FMT, vcpu_id);
+    vcpu->debugfs = debugfs_create_file(name, 0444, vm->debugfs, vcpu,
+                                        &hax_vcpu_stats_fops);
+    return 0;
+}
+
+int hax_vcpu_set_cpu_hint(struct vcpu_t *cvcpu, void *vcpu_host, int cpu_id)
+{
+    // No soft affinity; user space can pin the thread with sched_setaffinity()
+    return -ENOSYS;
+}
+
+void hax_vcpu_yield(struct vcpu_t *cvcpu, void *target_host)
+{
+    hax_vcpu_linux_t *target = (hax_vcpu_linux_t *)target_host;
+    struct task_struct *task = NULL;
+
+    if (target && target->pid) {
+        rcu_read_lock();
+        task = pid_task(target->pid, PIDTYPE_PID);
+        if (task) {
+            get_task_struct(task);
+        }
+        rcu_read_unlock();
+    }
+    if (task) {
+        int ret = yield_to(task, 1);
+
+        put_task_struct(task);
+        if (ret > 0)
+            return;
+    }
+    yield();
+}
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+static void hax_vcpu_sched_in(struct preempt_notifier *pn, int cpu)
+{
+}
+
+static void hax_vcpu_sched_out(struct preempt_notifier *pn,
+                               struct task_struct *next)
+{
+    hax_vcpu_linux_t *vcpu = container_of(pn, hax_vcpu_linux_t,
+                                          preempt_notifier);
+
+    vcpu_sched_out(vcpu->cvcpu);
+}
+
+static struct preempt_ops hax_vcpu_preempt_ops = {
+    .sched_in  = hax_vcpu_sched_in,
+    .sched_out = hax_vcpu_sched_out,
+};
+#endif
+
+int hax_vcpu_preempt_notify_begin(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    hax_vcpu_linux_t *vcpu = (hax_vcpu_linux_t *)vcpu_host;
+
+    if (!vcpu)
+        return -ENODEV;
+
+    preempt_notifier_init(&vcpu->preempt_notifier, &hax_vcpu_preempt_ops);
+    preempt_disable();
+    preempt_notifier_register(&vcpu->preempt_notifier);
+    preempt_enable();
     return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+void hax_vcpu_preempt_notify_end(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    hax_vcpu_linux_t *vcpu = (hax_vcpu_linux_t *)vcpu_host;
+
+    preempt_disable();
+    preempt_notifier_unregister(&vcpu->preempt_notifier);
+    preempt_enable();
+#endif
 }
 
 int hax_vcpu_destroy_host(struct vcpu_t *cvcpu, void *vcpu_host)
@@ -215,6 +421,7 @@ int hax_vcpu_destroy_host(struct vcpu_t *cvcpu, void *vcpu_host)
     hax_vcpu_linux_t *vcpu;
 
     vcpu = (hax_vcpu_linux_t *)vcpu_host;
+    debugfs_remove(vcpu->debugfs);
     misc_deregister(&vcpu->dev);
     kfree(vcpu->devname);
 
@@ -258,6 +465,7 @@ int hax_vm_create_host(struct vm_t *cvm, int vm_id)
 {
     int err;
     hax_vm_linux_t *vm;
+    char name[16];
 
     vm = hax_vm_create_linux(cvm, vm_id);
     if (!vm)
@@ -277,6 +485,9 @@ int hax_vm_create_host(struct vm_t *cvm, int vm_id)
     }
     hax_component_perm(vm->devname, &vm->dev);
     hax_log(HAX_LOGI, "Created HAXM-VM device with minor=%d\n", vm->dev.minor);
+
+    snprintf(name, sizeof(name), HAX_VM_DEBUGFS_FMT, vm_id);
+    vm->debugfs = debugfs_create_dir(name, hax_debugfs);
     return 0;
 }
 
@@ -286,6 +497,7 @@ int hax_vm_destroy_host(struct vm_t *cvm, void *vm_host)
     hax_vm_linux_t *vm;
 
     vm = (hax_vm_linux_t *)vm_host;
+    debugfs_remove_recursive(vm->debugfs);
     misc_deregister(&vm->dev);
     kfree(vm->devname);
 
@@ -364,10 +576,22 @@ static long hax_vcpu_ioctl(struct file *filp, unsigned int cmd,
 
     switch (cmd) {
     case HAX_VCPU_IOCTL_RUN:
+        // Record the vCPU thread once, for directed yield by its siblings
+        if (!vcpu->pid) {
+            struct pid *pid = get_task_pid(current, PIDTYPE_PID);
+
+            if (cmpxchg(&vcpu->pid, NULL, pid) != NULL) {
+                put_pid(pid);
+            }
+        }
         ret = vcpu_execute(cvcpu);
         break;
     case HAX_VCPU_IOCTL_SETUP_TUNNEL: {
         struct hax_tunnel_info info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
         ret = hax_vcpu_setup_hax_tunnel(cvcpu, &info);
         if (copy_to_user(argp, &info, sizeof(info))) {
             ret = -EFAULT;
@@ -498,6 +722,82 @@ static long hax_vcpu_ioctl(struct file *filp, unsigned int cmd,
         unload_user_data(cpuid, true);
         break;
     }
+    case HAX_VCPU_IOCTL_GET_STATE: {
+        struct hax_vcpu_state *state;
+        load_user_data(state, argp, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                       struct hax_vcpu_state, struct vmx_msr);
+        ret = vcpu_get_state(cvcpu, state);
+        unload_user_data(state, true);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_STATE: {
+        struct hax_vcpu_state *state;
+        load_user_data(state, argp, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                       struct hax_vcpu_state, struct vmx_msr);
+        ret = vcpu_set_state(cvcpu, state);
+        // Report the number of MSRs written
+        unload_user_data(state, true);
+        break;
+    }
+    case HAX_VCPU_IOCTL_GET_STATS: {
+        // Too large for the kernel stack
+        struct hax_vcpu_stats *stats;
+        stats = hax_vmalloc(sizeof(*stats), HAX_MEM_NONPAGE);
+        if (!stats) {
+            ret = -ENOMEM;
+            break;
+        }
+        ret = vcpu_get_stats(cvcpu, stats);
+        if (copy_to_user(argp, stats, sizeof(*stats))) {
+            ret = -EFAULT;
+        }
+        hax_vfree(stats, sizeof(*stats));
+        break;
+    }
+    case HAX_VCPU_IOCTL_SETUP_TRACE: {
+        struct hax_trace_info info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vcpu_setup_trace(cvcpu, &info);
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VCPU_IOCTL_SETUP_REGS_PAGE: {
+        struct hax_regs_page_info info;
+        ret = hax_vcpu_setup_regs_page(cvcpu, &info);
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_CPU_HINT: {
+        struct hax_vcpu_cpu_hint hint;
+        if (copy_from_user(&hint, argp, sizeof(hint))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = vcpu_set_cpu_hint(cvcpu, &hint);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_TSC_KHZ: {
+        struct hax_tsc_khz info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = vcpu_set_tsc_khz(cvcpu, &info);
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
     default:
         // TODO: Print information about the process that sent the ioctl.
         hax_log(HAX_LOGE, "Unknown VCPU IOCTL 0x%lx\n", cmd);
@@ -541,6 +841,7 @@ static int hax_vm_release(struct inode *inodep, struct file *filep)
 
     hax_log(HAX_LOGI, "Close VM\n");
     if (cvm) {
+        hax_vm_core_close(cvm);
         /* put the ref get just now */
         hax_put_vm(cvm);
         hax_put_vm(cvm);
@@ -651,6 +952,96 @@ static long hax_vm_ioctl(struct file *filp, unsigned int cmd,
         ret = hax_vm_protect_ram(cvm, &info);
         break;
     }
+    case HAX_VM_IOCTL_SNAPSHOT_SAVE:
+    case HAX_VM_IOCTL_SNAPSHOT_RESTORE: {
+        struct hax_snapshot_io io;
+        if (copy_from_user(&io, argp, sizeof(io))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = cmd == HAX_VM_IOCTL_SNAPSHOT_SAVE
+              ? hax_vm_snapshot_save(cvm, &io)
+              : hax_vm_snapshot_restore(cvm, &io);
+        if (copy_to_user(argp, &io, sizeof(io))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VM_IOCTL_FREEZE: {
+        struct hax_freeze_info info;
+        ret = hax_vm_freeze(cvm, &info);
+        if (ret)
+            break;
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VM_IOCTL_UNSHARE_RAM: {
+        struct hax_unshare_ram_info info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vm_unshare_ram(cvm, &info);
+        break;
+    }
+    case HAX_VM_IOCTL_WS_SCAN: {
+        struct hax_ws_scan info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vm_ws_scan(cvm, &info);
+        if (ret)
+            break;
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VM_IOCTL_WS_SAMPLER: {
+        struct hax_ws_sampler info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vm_ws_set_sampler(cvm, &info);
+        break;
+    }
+    case HAX_VM_IOCTL_WS_HISTOGRAM: {
+        struct hax_ws_histogram info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vm_ws_get_histogram(cvm, &info);
+        if (ret)
+            break;
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
+    case HAX_VM_IOCTL_RECLAIM_RAM: {
+        struct hax_reclaim_ram info;
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_vm_reclaim_ram(cvm, &info);
+        if (ret)
+            break;
+        if (copy_to_user(argp, &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        break;
+    }
     case HAX_VM_IOCTL_NOTIFY_QEMU_VERSION: {
         struct hax_qemu_version info;
         if (copy_from_user(&info, argp, sizeof(info))) {
@@ -37,6 +37,7 @@
 
 #include "hax_release_ver.h"
 
+#include "config.h"
 #include "interface.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
@@ -44,8 +45,79 @@ MODULE_AUTHOR("Kryptos Logic");
 MODULE_DESCRIPTION("Hypervisor that provides x86 virtualization on Intel VT-x compatible CPUs.");
 MODULE_VERSION(HAXM_RELEASE_VERSION_STR);
 
+module_param_named(persistent_vmcs, config.persistent_vmcs, int, 0444);
+MODULE_PARM_DESC(persistent_vmcs,
+                 "Keep the VMCS loaded between VM exits (default: 0)");
+module_param_named(lazy_host_msrs, config.lazy_host_msrs, int, 0644);
+MODULE_PARM_DESC(lazy_host_msrs,
+                 "Restore host SYSCALL MSRs only before returning to user "
+                 "space (default: 1)");
+
+module_param_named(ple_gap, config.ple_gap, int, 0444);
+MODULE_PARM_DESC(ple_gap,
+                 "PAUSE-loop exiting gap in TSC cycles, 0 to disable PAUSE-loop "
+                 "exiting (default: 128)");
+module_param_named(ple_window, config.ple_window, int, 0444);
+MODULE_PARM_DESC(ple_window,
+                 "PAUSE-loop exiting window in TSC cycles (default: 4096)");
+
+static int log_level_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_int(val, kp);
+
+    if (!ret) {
+        hax_log_settings_changed();
+    }
+    return ret;
+}
+
+static const struct kernel_param_ops log_level_ops = {
+    .set = log_level_set,
+    .get = param_get_int,
+};
+
+module_param_cb(log_level, &log_level_ops, &hax_log_level, 0644);
+MODULE_PARM_DESC(log_level,
+                 "Minimum level of the messages to print, from 1 (debug) to 4 "
+                 "(error) (default: 3)");
+
+static struct kparam_string log_sites_string = {
+    .maxlen = sizeof(hax_log_sites),
+    .string = hax_log_sites,
+};
+
+static int log_sites_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_copystring(val, kp);
+    size_t len;
+
+    if (ret)
+        return ret;
+    // Strip the newline added by "echo ... > /sys/module/..."
+    len = strlen(hax_log_sites);
+    if (len && hax_log_sites[len - 1] == '\n') {
+        hax_log_sites[len - 1] = '\0';
+    }
+    hax_log_settings_changed();
+    return 0;
+}
+
+static const struct kernel_param_ops log_sites_ops = {
+    .set = log_sites_set,
+    .get = param_get_string,
+};
+
+module_param_cb(log_sites, &log_sites_ops, &log_sites_string, 0644);
+MODULE_PARM_DESC(log_sites,
+                 "Comma-separated list of file or file:line call sites whose "
+                 "messages are always printed (default: none)");
+
 #define HAX_DEVICE_NAME "HAX"
 
+/* See components.c */
+void hax_debugfs_init(void);
+void hax_debugfs_exit(void);
+
 static long hax_dev_ioctl(struct file *filp, unsigned int cmd,
                           unsigned long arg);
 
@@ -105,6 +177,37 @@ static long hax_dev_ioctl(struct file *filp, unsigned int cmd,
             return -EFAULT;
         break;
     }
+    case HAX_IOCTL_CLONE_VM: {
+        struct hax_clone_vm_info info;
+        int vm_id;
+
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_clone_vm(info.template_vm_id, info.token, &vm_id);
+        if (ret) {
+            hax_log(HAX_LOGE, "Failed to clone HAX VM %u\n",
+                    info.template_vm_id);
+            break;
+        }
+        info.vm_id = vm_id;
+        if (copy_to_user(argp, &info, sizeof(info)))
+            return -EFAULT;
+        break;
+    }
+    case HAX_IOCTL_SET_PIN_LIMIT: {
+        struct hax_pin_limit info;
+
+        if (copy_from_user(&info, argp, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = hax_set_pin_limit(&info);
+        if (copy_to_user(argp, &info, sizeof(info)))
+            return -EFAULT;
+        break;
+    }
     default:
         break;
     }
@@ -136,11 +239,13 @@ static int __init hax_driver_init(void)
     }
 
     hax_log(HAX_LOGI, "Created HAXM device with minor=%d\n", hax_dev.minor);
+    hax_debugfs_init();
     return 0;
 }
 
 static void __exit hax_driver_exit(void)
 {
+    hax_debugfs_exit();
     if (hax_module_exit() < 0) {
         hax_log(HAX_LOGE, "Failed to finalize HAXM module\n");
     }
@@ -68,11 +68,19 @@ int hax_pin_user_pages(uint64_t start_uva, uint64_t size, hax_memdesc_user *memd
 
 int hax_unpin_user_pages(hax_memdesc_user *memdesc)
 {
+    int i;
+
     if (!memdesc)
         return -EINVAL;
     if (!memdesc->pages)
         return -EINVAL;
-    
+
+    // The guest writes to the pages through the EPT, behind the back of the
+    // host MM, which must not drop them as clean once they are no longer
+    // pinned (e.g. after a reclaim pass, or for a file-backed mapping)
+    for (i = 0; i < memdesc->nr_pages; i++) {
+        set_page_dirty_lock(memdesc->pages[i]);
+    }
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(4,15,0)
     release_pages(memdesc->pages, memdesc->nr_pages, 1);
 #else
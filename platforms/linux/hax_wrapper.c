@@ -30,7 +30,9 @@
 
 #include <asm/cmpxchg.h>
 #include <linux/atomic.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
+#include <linux/random.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/spinlock_types.h>
@@ -56,14 +58,11 @@ static const char* kLogPrefix[] = {
     "haxm_panic: "
 };
 
-void hax_log(int level, const char *fmt,  ...)
+void hax_log_write(int level, const char *fmt,  ...)
 {
     struct va_format vaf;
     va_list args;
 
-    if (level < HAX_LOG_DEFAULT)
-        return;
-
     vaf.fmt = fmt;
     vaf.va = &args;
     va_start(args, fmt);
@@ -75,7 +74,7 @@ void hax_panic(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    hax_log(HAX_LOGPANIC, fmt, args);
+    hax_log_write(HAX_LOGPANIC, fmt, args);
     va_end(args);
 }
 
@@ -84,6 +83,17 @@ uint32_t hax_cpu_id(void)
     return (uint32_t)smp_processor_id();
 }
 
+int hax_get_random_bytes(void *buf, uint32_t size)
+{
+    get_random_bytes(buf, size);
+    return 0;
+}
+
+uint64_t hax_get_uptime_ns(void)
+{
+    return (uint64_t)ktime_to_ns(ktime_get());
+}
+
 int cpu_info_init(void)
 {
     uint32_t size_group, size_pos, cpu_id, group, bit;
@@ -115,6 +115,27 @@ int hax_ioctl(dev_t self __unused, u_long cmd, void *data, int flag,
         *((uint32_t *)data) = vm_id;
         break;
     }
+    case HAX_IOCTL_CLONE_VM: {
+        struct hax_clone_vm_info *info;
+        int vm_id;
+
+        info = (struct hax_clone_vm_info *)data;
+        ret = hax_clone_vm(info->template_vm_id, info->token, &vm_id);
+        if (ret) {
+            hax_log(HAX_LOGE, "Failed to clone HAX VM %u\n",
+                    info->template_vm_id);
+            break;
+        }
+        info->vm_id = vm_id;
+        break;
+    }
+    case HAX_IOCTL_SET_PIN_LIMIT: {
+        struct hax_pin_limit *info;
+
+        info = (struct hax_pin_limit *)data;
+        ret = hax_set_pin_limit(info);
+        break;
+    }
     default:
         hax_log(HAX_LOGE, "Unknown ioctl %#lx, pid=%d ('%s')\n", cmd,
                 l->l_proc->p_pid, l->l_proc->p_comm);
@@ -86,7 +86,9 @@ struct cdevsw hax_vcpu_cdevsw = {
             unload_user_data(dest);                                           \
             ret = -EFAULT;                                                    \
             break;                                                            \
-        }
+        }                                                                     \
+        /* User space may have changed the header in the meantime */          \
+        (dest)->body_len = header.body_len;
 
 #define unload_user_data(dest)       \
         if ((dest) != NULL)          \
@@ -285,6 +287,59 @@ int hax_vcpu_ioctl(dev_t self, u_long cmd, void *data, int flag,
         unload_user_data(cpuid);
         break;
     }
+    case HAX_VCPU_IOCTL_GET_STATE: {
+        struct hax_vcpu_state *state;
+        load_user_data(state, data, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                       struct hax_vcpu_state, struct vmx_msr);
+        ret = vcpu_get_state(cvcpu, state);
+        if (copyout(state, uaddr, size)) {
+            ret = -EFAULT;
+        }
+        unload_user_data(state);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_STATE: {
+        struct hax_vcpu_state *state;
+        load_user_data(state, data, nr_msrs, HAX_MAX_VCPU_STATE_MSRS,
+                       struct hax_vcpu_state, struct vmx_msr);
+        ret = vcpu_set_state(cvcpu, state);
+        // Report the number of MSRs written
+        if (copyout(state, uaddr, size)) {
+            ret = -EFAULT;
+        }
+        unload_user_data(state);
+        break;
+    }
+    case HAX_VCPU_IOCTL_GET_STATS: {
+        struct hax_vcpu_stats *stats;
+        stats = (struct hax_vcpu_stats *)data;
+        ret = vcpu_get_stats(cvcpu, stats);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SETUP_TRACE: {
+        struct hax_trace_info *info;
+        info = (struct hax_trace_info *)data;
+        ret = hax_vcpu_setup_trace(cvcpu, info);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SETUP_REGS_PAGE: {
+        struct hax_regs_page_info *info;
+        info = (struct hax_regs_page_info *)data;
+        ret = hax_vcpu_setup_regs_page(cvcpu, info);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_CPU_HINT: {
+        struct hax_vcpu_cpu_hint *hint;
+        hint = (struct hax_vcpu_cpu_hint *)data;
+        ret = vcpu_set_cpu_hint(cvcpu, hint);
+        break;
+    }
+    case HAX_VCPU_IOCTL_SET_TSC_KHZ: {
+        struct hax_tsc_khz *info;
+        info = (struct hax_tsc_khz *)data;
+        ret = vcpu_set_tsc_khz(cvcpu, info);
+        break;
+    }
     default:
         // TODO: Print information about the process that sent the ioctl.
         hax_log(HAX_LOGE, "Unknown VCPU IOCTL %#lx, pid=%d ('%s')\n", cmd,
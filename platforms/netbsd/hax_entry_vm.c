@@ -112,6 +112,7 @@ int hax_vm_close(dev_t self __unused, int flag __unused, int mode __unused,
 
     hax_log(HAX_LOGI, "Close VM%02d\n", vm->id);
     if (cvm) {
+        hax_vm_core_close(cvm);
         /* put the ref get just now */
         hax_put_vm(cvm);
         hax_put_vm(cvm);
@@ -207,6 +208,54 @@ int hax_vm_ioctl(dev_t self __unused, u_long cmd, void *data, int flag,
         ret = hax_vm_protect_ram(cvm, info);
         break;
     }
+    case HAX_VM_IOCTL_SNAPSHOT_SAVE: {
+        struct hax_snapshot_io *io;
+        io = (struct hax_snapshot_io *)data;
+        ret = hax_vm_snapshot_save(cvm, io);
+        break;
+    }
+    case HAX_VM_IOCTL_SNAPSHOT_RESTORE: {
+        struct hax_snapshot_io *io;
+        io = (struct hax_snapshot_io *)data;
+        ret = hax_vm_snapshot_restore(cvm, io);
+        break;
+    }
+    case HAX_VM_IOCTL_FREEZE: {
+        struct hax_freeze_info *info;
+        info = (struct hax_freeze_info *)data;
+        ret = hax_vm_freeze(cvm, info);
+        break;
+    }
+    case HAX_VM_IOCTL_UNSHARE_RAM: {
+        struct hax_unshare_ram_info *info;
+        info = (struct hax_unshare_ram_info *)data;
+        ret = hax_vm_unshare_ram(cvm, info);
+        break;
+    }
+    case HAX_VM_IOCTL_WS_SCAN: {
+        struct hax_ws_scan *info;
+        info = (struct hax_ws_scan *)data;
+        ret = hax_vm_ws_scan(cvm, info);
+        break;
+    }
+    case HAX_VM_IOCTL_WS_SAMPLER: {
+        struct hax_ws_sampler *info;
+        info = (struct hax_ws_sampler *)data;
+        ret = hax_vm_ws_set_sampler(cvm, info);
+        break;
+    }
+    case HAX_VM_IOCTL_WS_HISTOGRAM: {
+        struct hax_ws_histogram *info;
+        info = (struct hax_ws_histogram *)data;
+        ret = hax_vm_ws_get_histogram(cvm, info);
+        break;
+    }
+    case HAX_VM_IOCTL_RECLAIM_RAM: {
+        struct hax_reclaim_ram *info;
+        info = (struct hax_reclaim_ram *)data;
+        ret = hax_vm_reclaim_ram(cvm, info);
+        break;
+    }
     case HAX_VM_IOCTL_NOTIFY_QEMU_VERSION: {
         struct hax_qemu_version *info;
         info = (struct hax_qemu_version *)data;
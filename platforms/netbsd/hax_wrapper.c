@@ -31,9 +31,12 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/atomic.h>
+#include <sys/cprng.h>
 #include <sys/kmem.h>
 #include <sys/mutex.h>
+#include <sys/sched.h>
 #include <sys/systm.h>
+#include <sys/time.h>
 #include <sys/xcall.h>
 #include <sys/cpu.h>
 #include <machine/cpu.h>
@@ -51,14 +54,12 @@ static const char* kLogPrefix[] = {
     "haxm_panic: "
 };
 
-void hax_log(int level, const char *fmt,  ...)
+void hax_log_write(int level, const char *fmt,  ...)
 {
     va_list args;
     va_start(args, fmt);
-    if (level >= HAX_LOG_DEFAULT) {
-        printf("%s", kLogPrefix[level]);
-        vprintf(fmt, args);
-    }
+    printf("%s", kLogPrefix[level]);
+    vprintf(fmt, args);
     va_end(args);
 }
 
@@ -66,7 +67,7 @@ void hax_panic(const char *fmt,  ...)
 {
     va_list args;
     va_start(args, fmt);
-    hax_log(HAX_LOGPANIC, fmt, args);
+    hax_log_write(HAX_LOGPANIC, fmt, args);
     panic(fmt, args);
     va_end(args);
 }
@@ -76,6 +77,21 @@ uint32_t hax_cpu_id(void)
     return (uint32_t)cpu_number();
 }
 
+int hax_get_random_bytes(void *buf, uint32_t size)
+{
+    if (cprng_strong(kern_cprng, buf, size, 0) != size)
+        return -EIO;
+    return 0;
+}
+
+uint64_t hax_get_uptime_ns(void)
+{
+    struct timespec ts;
+
+    getnanouptime(&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int cpu_info_init(void)
 {
     struct cpu_info *ci = NULL;
@@ -183,6 +199,28 @@ int proc_event_pending(struct vcpu_t *vcpu)
     return vcpu_event_pending(vcpu);
 }
 
+int hax_vcpu_set_cpu_hint(struct vcpu_t *cvcpu, void *vcpu_host, int cpu_id)
+{
+    // No soft affinity
+    return -ENOSYS;
+}
+
+void hax_vcpu_yield(struct vcpu_t *cvcpu, void *target_host)
+{
+    // No directed yield, just give up the CPU
+    yield();
+}
+
+int hax_vcpu_preempt_notify_begin(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+    // No preemption notifiers
+    return -ENOSYS;
+}
+
+void hax_vcpu_preempt_notify_end(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+}
+
 void hax_disable_preemption(preempt_flag *eflags)
 {
     kpreempt_disable();
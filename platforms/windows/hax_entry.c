@@ -215,8 +215,10 @@ NTSTATUS HaxClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             vm = &devext->vmdev_ext;
             cvm = vm->cvm;
             hax_log(HAX_LOGI, "Close VM %x\n", vm->vm_id);
-            if (cvm)
+            if (cvm) {
+                hax_vm_core_close(cvm);
                 hax_put_vm(cvm);
+            }
             break;
         case HAX_DEVEXT_TYPE_VCPU:
             vcpu = &devext->vcpudev_ext;
@@ -302,10 +304,14 @@ NTSTATUS HaxVcpuControl(PDEVICE_OBJECT DeviceObject,
                 goto done;
             }
             uinfo = (struct hax_tunnel_info *)outBuf;
+            // Older clients do not pass an input buffer
+            info.io_size = inBufLength >= sizeof(struct hax_tunnel_info) ?
+                           ((struct hax_tunnel_info *)inBuf)->io_size : 0;
             ret = hax_vcpu_setup_hax_tunnel(cvcpu, &info);
             uinfo->va = info.va;
             uinfo->io_va = info.io_va;
             uinfo->size = info.size;
+            uinfo->io_size = info.io_size;
             infret = sizeof(struct hax_tunnel_info);
             break;
         }
@@ -476,6 +482,114 @@ NTSTATUS HaxVcpuControl(PDEVICE_OBJECT DeviceObject,
             infret = sizeof(hax_cpuid) + cpuid->total * sizeof(hax_cpuid_entry);
             break;
         }
+        case HAX_VCPU_IOCTL_GET_STATE:
+        case HAX_VCPU_IOCTL_SET_STATE: {
+            struct hax_vcpu_state *state = (struct hax_vcpu_state *)inBuf;
+            uint32_t nr_msrs, size;
+            if (inBufLength < sizeof(struct hax_vcpu_state)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            // Validate and use a single read of the header
+            nr_msrs = state->nr_msrs;
+            if (nr_msrs > HAX_MAX_VCPU_STATE_MSRS) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            size = sizeof(struct hax_vcpu_state) +
+                   nr_msrs * sizeof(struct vmx_msr);
+            if (inBufLength < size || outBufLength < size) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            state->nr_msrs = nr_msrs;
+            // METHOD_BUFFERED: inBuf and outBuf share the system buffer
+            if (irpSp->Parameters.DeviceIoControl.IoControlCode ==
+                HAX_VCPU_IOCTL_GET_STATE) {
+                err = vcpu_get_state(cvcpu, state);
+            } else {
+                err = vcpu_set_state(cvcpu, state);
+            }
+            if (err) {
+                ret = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            infret = size;
+            break;
+        }
+        case HAX_VCPU_IOCTL_GET_STATS: {
+            if (outBufLength < sizeof(struct hax_vcpu_stats)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            // vcpu_get_stats() cannot fail
+            vcpu_get_stats(cvcpu, (struct hax_vcpu_stats *)outBuf);
+            infret = sizeof(struct hax_vcpu_stats);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SETUP_TRACE: {
+            struct hax_trace_info info;
+            if (inBufLength < sizeof(struct hax_trace_info) ||
+                outBufLength < sizeof(struct hax_trace_info)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = *(struct hax_trace_info *)inBuf;
+            if (hax_vcpu_setup_trace(cvcpu, &info)) {
+                ret = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            *(struct hax_trace_info *)outBuf = info;
+            infret = sizeof(struct hax_trace_info);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SETUP_REGS_PAGE: {
+            struct hax_regs_page_info info;
+            if (outBufLength < sizeof(struct hax_regs_page_info)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            if (hax_vcpu_setup_regs_page(cvcpu, &info)) {
+                ret = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            *(struct hax_regs_page_info *)outBuf = info;
+            infret = sizeof(struct hax_regs_page_info);
+            break;
+        }
+        case HAX_VCPU_IOCTL_SET_CPU_HINT: {
+            if (inBufLength < sizeof(struct hax_vcpu_cpu_hint)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            switch (vcpu_set_cpu_hint(cvcpu,
+                                      (struct hax_vcpu_cpu_hint *)inBuf)) {
+                case 0:
+                    break;
+                case -EINVAL:
+                    ret = STATUS_INVALID_PARAMETER;
+                    break;
+                default:
+                    ret = STATUS_UNSUCCESSFUL;
+                    break;
+            }
+            break;
+        }
+        case HAX_VCPU_IOCTL_SET_TSC_KHZ: {
+            struct hax_tsc_khz info;
+            if (inBufLength < sizeof(struct hax_tsc_khz) ||
+                outBufLength < sizeof(struct hax_tsc_khz)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = *(struct hax_tsc_khz *)inBuf;
+            if (vcpu_set_tsc_khz(cvcpu, &info)) {
+                ret = STATUS_UNSUCCESSFUL;
+            }
+            *(struct hax_tsc_khz *)outBuf = info;
+            infret = sizeof(struct hax_tsc_khz);
+            break;
+        }
         default:
             hax_log(HAX_LOGE, "Unknow vcpu ioctl %lx\n",
                     irpSp->Parameters.DeviceIoControl.IoControlCode);
@@ -645,6 +759,124 @@ NTSTATUS HaxVmControl(PDEVICE_OBJECT DeviceObject, struct hax_vm_windows *ext,
             }
             break;
         }
+        case HAX_VM_IOCTL_SNAPSHOT_SAVE:
+        case HAX_VM_IOCTL_SNAPSHOT_RESTORE: {
+            struct hax_snapshot_io io;
+            int res;
+            if (inBufLength < sizeof(struct hax_snapshot_io) ||
+                outBufLength < sizeof(struct hax_snapshot_io)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            io = *(struct hax_snapshot_io *)inBuf;
+            res = irpSp->Parameters.DeviceIoControl.IoControlCode ==
+                  HAX_VM_IOCTL_SNAPSHOT_SAVE ? hax_vm_snapshot_save(cvm, &io)
+                  : hax_vm_snapshot_restore(cvm, &io);
+            if (res) {
+                ret = res == -EINVAL ? STATUS_INVALID_PARAMETER
+                      : STATUS_UNSUCCESSFUL;
+            }
+            *(struct hax_snapshot_io *)outBuf = io;
+            infret = sizeof(struct hax_snapshot_io);
+            break;
+        }
+        case HAX_VM_IOCTL_FREEZE: {
+            struct hax_freeze_info *info;
+            int res;
+            if (outBufLength < sizeof(struct hax_freeze_info)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_freeze_info *)outBuf;
+            res = hax_vm_freeze(cvm, info);
+            if (res) {
+                ret = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            infret = sizeof(struct hax_freeze_info);
+            break;
+        }
+        case HAX_VM_IOCTL_UNSHARE_RAM: {
+            struct hax_unshare_ram_info *info;
+            int res;
+            if (inBufLength < sizeof(struct hax_unshare_ram_info)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_unshare_ram_info *)inBuf;
+            res = hax_vm_unshare_ram(cvm, info);
+            if (res) {
+                ret = res == -EINVAL ? STATUS_INVALID_PARAMETER
+                      : STATUS_UNSUCCESSFUL;
+            }
+            break;
+        }
+        case HAX_VM_IOCTL_WS_SCAN: {
+            struct hax_ws_scan *info;
+            int res;
+            if (inBufLength < sizeof(struct hax_ws_scan) ||
+                outBufLength < sizeof(struct hax_ws_scan)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_ws_scan *)inBuf;
+            res = hax_vm_ws_scan(cvm, info);
+            if (res) {
+                ret = res == -EINVAL ? STATUS_INVALID_PARAMETER
+                      : STATUS_UNSUCCESSFUL;
+                break;
+            }
+            infret = sizeof(struct hax_ws_scan);
+            break;
+        }
+        case HAX_VM_IOCTL_WS_SAMPLER: {
+            struct hax_ws_sampler *info;
+            if (inBufLength < sizeof(struct hax_ws_sampler)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_ws_sampler *)inBuf;
+            if (hax_vm_ws_set_sampler(cvm, info)) {
+                ret = STATUS_UNSUCCESSFUL;
+            }
+            break;
+        }
+        case HAX_VM_IOCTL_WS_HISTOGRAM: {
+            struct hax_ws_histogram *info;
+            int res;
+            if (inBufLength < sizeof(struct hax_ws_histogram) ||
+                outBufLength < sizeof(struct hax_ws_histogram)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_ws_histogram *)inBuf;
+            res = hax_vm_ws_get_histogram(cvm, info);
+            if (res) {
+                ret = res == -ENOENT ? STATUS_INVALID_PARAMETER
+                      : STATUS_UNSUCCESSFUL;
+                break;
+            }
+            infret = sizeof(struct hax_ws_histogram);
+            break;
+        }
+        case HAX_VM_IOCTL_RECLAIM_RAM: {
+            struct hax_reclaim_ram *info;
+            int res;
+            if (inBufLength < sizeof(struct hax_reclaim_ram) ||
+                outBufLength < sizeof(struct hax_reclaim_ram)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_reclaim_ram *)inBuf;
+            res = hax_vm_reclaim_ram(cvm, info);
+            if (res) {
+                ret = res == -EINVAL ? STATUS_INVALID_PARAMETER
+                      : STATUS_UNSUCCESSFUL;
+                break;
+            }
+            infret = sizeof(struct hax_reclaim_ram);
+            break;
+        }
         case HAX_VM_IOCTL_NOTIFY_QEMU_VERSION: {
             struct hax_qemu_version *info;
 
@@ -746,6 +978,45 @@ NTSTATUS HaxDeviceControl(PDEVICE_OBJECT DeviceObject,
             infret = sizeof(uint32_t);
             ret = STATUS_SUCCESS;
             break;
+        case HAX_IOCTL_CLONE_VM: {
+            struct hax_clone_vm_info *info;
+            int res;
+
+            if (inBufLength < sizeof(struct hax_clone_vm_info) ||
+                outBufLength < sizeof(struct hax_clone_vm_info)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_clone_vm_info *)inBuf;
+            res = hax_clone_vm(info->template_vm_id, info->token, &vm_id);
+            if (res) {
+                hax_log(HAX_LOGE, "Failed to clone HAX VM %u\n",
+                        info->template_vm_id);
+                ret = res == -EACCES ? STATUS_ACCESS_DENIED
+                      : res == -EINVAL || res == -ENOENT
+                      ? STATUS_INVALID_PARAMETER : STATUS_UNSUCCESSFUL;
+                break;
+            }
+            // |inBuf| and |outBuf| are the same system buffer
+            info->vm_id = vm_id;
+            infret = sizeof(struct hax_clone_vm_info);
+            ret = STATUS_SUCCESS;
+            break;
+        }
+        case HAX_IOCTL_SET_PIN_LIMIT: {
+            struct hax_pin_limit *info;
+
+            if (inBufLength < sizeof(struct hax_pin_limit) ||
+                outBufLength < sizeof(struct hax_pin_limit)) {
+                ret = STATUS_INVALID_PARAMETER;
+                goto done;
+            }
+            info = (struct hax_pin_limit *)inBuf;
+            hax_set_pin_limit(info);
+            infret = sizeof(struct hax_pin_limit);
+            ret = STATUS_SUCCESS;
+            break;
+        }
         default:
             ret = STATUS_INVALID_DEVICE_REQUEST;
             hax_log(HAX_LOGE, "Invalid hax ioctl %x\n",
@@ -31,6 +31,7 @@
 #include "ia32.h"
 
 #include "hax_win.h"
+#include <bcrypt.h>
 
 uint32_t hax_cpu_id(void)
 {
@@ -38,6 +39,27 @@ uint32_t hax_cpu_id(void)
     return (uint32_t)KeGetCurrentProcessorNumberEx(&ProcNumber);
 }
 
+int hax_get_random_bytes(void *buf, uint32_t size)
+{
+    NTSTATUS status;
+
+    status = BCryptGenRandom(NULL, buf, size,
+                             BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (!NT_SUCCESS(status)) {
+        hax_log(HAX_LOGE, "%s: BCryptGenRandom() failed: 0x%x\n", __func__,
+                status);
+        return -EIO;
+    }
+    return 0;
+}
+
+uint64_t hax_get_uptime_ns(void)
+{
+    // The interrupt time counts in 100ns units, and is updated at every clock
+    // tick
+    return KeQueryInterruptTime() * 100;
+}
+
 int cpu_info_init(void)
 {
     uint32_t size_group, size_pos, count, group, bit;
@@ -255,6 +277,33 @@ int proc_event_pending(struct vcpu_t *vcpu)
     return vcpu_event_pending(vcpu);
 }
 
+int hax_vcpu_set_cpu_hint(struct vcpu_t *cvcpu, void *vcpu_host, int cpu_id)
+{
+    // The kernel only has an undocumented API for the ideal processor, while
+    // user space can call SetThreadIdealProcessorEx() on the vCPU thread
+    return -ENOSYS;
+}
+
+void hax_vcpu_yield(struct vcpu_t *cvcpu, void *target_host)
+{
+    LARGE_INTEGER interval;
+
+    // No directed yield, just give up the rest of the time slice to any ready
+    // thread
+    interval.QuadPart = 0;
+    KeDelayExecutionThread(KernelMode, FALSE, &interval);
+}
+
+int hax_vcpu_preempt_notify_begin(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+    // No preemption notifiers
+    return -ENOSYS;
+}
+
+void hax_vcpu_preempt_notify_end(struct vcpu_t *cvcpu, void *vcpu_host)
+{
+}
+
 void hax_disable_preemption(preempt_flag *flags)
 {
     KIRQL cur;
@@ -301,15 +350,12 @@ static const char* kLogPrefix[] = {
     "haxm_panic: "
 };
 
-void hax_log(int level, const char *fmt,  ...)
+void hax_log_write(int level, const char *fmt,  ...)
 {
     va_list arglist;
     va_start(arglist, fmt);
-
-    if (level >= HAX_LOG_DEFAULT)
-        vDbgPrintExWithPrefix(kLogPrefix[level], DPFLTR_IHVDRIVER_ID,
-                              kLogLevel[level], fmt, arglist);
-
+    vDbgPrintExWithPrefix(kLogPrefix[level], DPFLTR_IHVDRIVER_ID,
+                          kLogLevel[level], fmt, arglist);
     va_end(arglist);
 }
 
@@ -317,6 +363,6 @@ void hax_panic(const char *fmt, ...)
 {
     va_list arglist;
     va_start(arglist, fmt);
-    hax_log(HAX_LOGPANIC, fmt, arglist);
+    hax_log_write(HAX_LOGPANIC, fmt, arglist);
     va_end(arglist);
 }
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2020 Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "cpuid_index.h"
+
+/* Same layout as kCpuidManager[] in core/cpuid.c */
+struct test_leaf_t {
+    uint32_t leaf;
+    uint32_t subleaf;
+};
+
+static const test_leaf_t kGuestLeaves[] = {
+    {0x00000000, 0}, {0x00000001, 0}, {0x00000002, 0}, {0x00000007, 0},
+    {0x00000007, 1}, {0x0000000a, 0}, {0x0000000d, 0}, {0x0000000d, 1},
+    {0x00000015, 0}, {0x00000016, 0}, {0x40000000, 0}, {0x80000000, 0},
+    {0x80000001, 0}, {0x80000002, 0}, {0x80000003, 0}, {0x80000004, 0},
+    {0x80000006, 0}, {0x80000008, 0}
+};
+
+/* Leaves looked up by the tests, whether or not they are indexed */
+static const uint32_t kProbeLeaves[] = {
+    0x00000000, 0x00000001, 0x00000003, 0x00000007, 0x0000000d, 0x00000016,
+    0x0000001f, 0x00000020, 0x40000000, 0x40000001, 0x4fffffff, 0x80000000,
+    0x80000005, 0x80000008, 0x8000001f, 0x80000020, 0xc0000000, 0xffffffff
+};
+
+/* The linear scan that cpuid_execute() used to do */
+static cpuid_index_slot_t linear_find(const std::vector<test_leaf_t>& leaves,
+                                      uint32_t leaf) {
+    cpuid_index_slot_t slot = {0, 0};
+
+    for (size_t i = 0; i < leaves.size(); i++) {
+        if (leaves[i].leaf != leaf) {
+            if (slot.count)
+                break;
+            continue;
+        }
+        if (!slot.count) {
+            slot.first = (uint8_t)i;
+        }
+        slot.count++;
+    }
+    return slot;
+}
+
+/* Test class */
+class CpuidIndexTest : public testing::Test {
+protected:
+    cpuid_index_t index;
+    std::vector<test_leaf_t> leaves;
+
+    virtual void SetUp() {
+        memset(&index, 0, sizeof(index));
+        leaves.assign(std::begin(kGuestLeaves), std::end(kGuestLeaves));
+        for (size_t i = 0; i < leaves.size(); i++) {
+            ASSERT_TRUE(cpuid_index_add(&index, leaves[i].leaf, (uint8_t)i));
+        }
+    }
+
+    void check_leaf(uint32_t leaf) {
+        cpuid_index_slot_t expected = linear_find(leaves, leaf);
+        cpuid_index_slot_t actual = cpuid_index_find(&index, leaf);
+
+        EXPECT_EQ(expected.count, actual.count) << std::hex << leaf;
+        if (expected.count) {
+            EXPECT_EQ(expected.first, actual.first) << std::hex << leaf;
+        }
+    }
+};
+
+TEST_F(CpuidIndexTest, guest_leaves) {
+    for (const test_leaf_t& l : kGuestLeaves) {
+        check_leaf(l.leaf);
+    }
+    for (uint32_t leaf : kProbeLeaves) {
+        check_leaf(leaf);
+    }
+}
+
+TEST_F(CpuidIndexTest, subleaves) {
+    cpuid_index_slot_t slot = cpuid_index_find(&index, 0x0000000d);
+
+    ASSERT_EQ(2, slot.count);
+    EXPECT_EQ(0x0000000du, leaves[slot.first].leaf);
+    EXPECT_EQ(0u, leaves[slot.first].subleaf);
+    EXPECT_EQ(1u, leaves[slot.first + 1].subleaf);
+}
+
+TEST_F(CpuidIndexTest, hash_collisions) {
+    // 4000_0000h is already indexed, so all but one of these fit
+    const uint32_t extra[] = {
+        0x40000001, 0x40000002, 0x40010000, 0x50000000, 0x60000000,
+        0xc0000000, 0xc0000001
+    };
+    for (uint32_t leaf : extra) {
+        ASSERT_TRUE(cpuid_index_add(&index, leaf, (uint8_t)leaves.size()));
+        leaves.push_back({leaf, 0});
+    }
+    EXPECT_FALSE(cpuid_index_add(&index, 0xd0000000, (uint8_t)leaves.size()));
+
+    for (const test_leaf_t& l : leaves) {
+        check_leaf(l.leaf);
+    }
+    for (uint32_t leaf : kProbeLeaves) {
+        check_leaf(leaf);
+    }
+}
+
+TEST_F(CpuidIndexTest, non_consecutive_subleaves) {
+    EXPECT_FALSE(cpuid_index_add(&index, 0x00000001, (uint8_t)leaves.size()));
+    EXPECT_FALSE(cpuid_index_add(&index, 0x40000000, (uint8_t)leaves.size()));
+    check_leaf(0x00000001);
+    check_leaf(0x40000000);
+}
+
+/*
+ * Compares the lookup times of the linear scan and the index. Run with
+ * --gtest_also_run_disabled_tests.
+ */
+TEST_F(CpuidIndexTest, DISABLED_benchmark) {
+    const int kRounds = 1000000;
+    volatile uint32_t sink = 0;
+    std::chrono::steady_clock::time_point start;
+    double linear_ns, index_ns;
+    size_t nr_lookups = kRounds * (sizeof(kProbeLeaves) / sizeof(uint32_t));
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRounds; i++) {
+        for (uint32_t leaf : kProbeLeaves) {
+            sink += linear_find(leaves, leaf).count;
+        }
+    }
+    linear_ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRounds; i++) {
+        for (uint32_t leaf : kProbeLeaves) {
+            sink += cpuid_index_find(&index, leaf).count;
+        }
+    }
+    index_ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+
+    printf("linear scan: %.2f ns/lookup, index: %.2f ns/lookup\n",
+           linear_ns / nr_lookups, index_ns / nr_lookups);
+    EXPECT_LT(index_ns, linear_ns);
+}